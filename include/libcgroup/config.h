@@ -55,6 +55,30 @@ int cgroup_unload_cgroups(void);
  */
 int cgroup_config_unload_config(const char *pathname, int flags);
 
+/**
+ * Apply changes of a configuration file to the already loaded groups.
+ *
+ * Unlike cgroup_config_unload_config() followed by
+ * cgroup_config_load_config(), the groups are not destroyed and no tasks are
+ * moved. The groups defined in the file are compared with their current
+ * state and only the missing groups are created and only the values which
+ * differ are written. Hierarchies are mounted only if their controllers are
+ * not mounted yet. Nothing is unmounted or destroyed when an error occurs.
+ *
+ * When @c old_pathname is given, the groups defined in it but not in
+ * @c pathname are removed, subgroups first. Only empty groups are removed,
+ * as with #CGFLAG_DELETE_EMPTY_ONLY.
+ *
+ * All groups are processed even if some of them fail, the first error is
+ * returned.
+ *
+ * @param pathname Name of the configuration file to apply.
+ * @param old_pathname Name of the previously loaded configuration file or
+ *	NULL if no groups should be removed.
+ */
+int cgroup_config_reload_config(const char *pathname,
+		const char *old_pathname);
+
 /**
  * Sets default permissions of groups created by subsequent
  * cgroup_config_load_config() calls. If a config file contains a 'default {}'
@@ -73,6 +97,40 @@ int cgroup_config_unload_config(const char *pathname, int flags);
  */
 int cgroup_config_set_default(struct cgroup *new_default);
 
+/**
+ * Sets the number of threads cgroup_config_load_config() uses to create the
+ * groups. Groups are split into subtrees whose top groups have no ancestor
+ * defined in the configuration; each subtree is created by one thread,
+ * parents before their children. Default is 1, i.e. all groups are created
+ * sequentially in the order they appear in the configuration.
+ *
+ * When several groups fail, the error of the first failing group in
+ * alphabetical order is returned.
+ *
+ * @param jobs Number of threads, 0 is the same as 1.
+ */
+void cgroup_config_set_jobs(unsigned int jobs);
+
+/**
+ * Sets the directory where cgroup_config_load_config() and the other
+ * functions parsing configuration files keep compiled configurations.
+ * A configuration file is loaded from its compiled configuration instead
+ * of being parsed when the checksums of the file, /etc/passwd, /etc/group
+ * and /etc/nsswitch.conf recorded in it still match. Otherwise the file is
+ * parsed and its compiled configuration is written. The compiled
+ * configurations are used only when /etc/nsswitch.conf looks up passwd and
+ * group in files alone, the user and group ids resolved by other services
+ * could change unnoticed.
+ *
+ * The compiled configurations are used only if they are owned by root or
+ * the current user and not writable by the group or others. Failure to
+ * write one is only a warning.
+ *
+ * @param dir The directory, NULL (the default) disables the compiled
+ * configurations.
+ */
+int cgroup_config_set_cache_dir(const char *dir);
+
 /**
  * Initializes the templates cache and load it from file pathname.
  */
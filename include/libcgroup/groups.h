@@ -33,6 +33,48 @@ enum cgroup_delete_flag {
 	 * CGFLAG_DELETE_RECURSIVE.
 	 */
 	CGFLAG_DELETE_EMPTY_ONLY	= 4,
+
+	/**
+	 * Remove the subgroups in several threads, each thread removes
+	 * different subtrees. Used with CGFLAG_DELETE_RECURSIVE.
+	 */
+	CGFLAG_DELETE_PARALLEL	= 8,
+
+	/**
+	 * Do not move the tasks, the caller knows that the groups are empty.
+	 * Removal of a group with tasks fails with #ECGNONEMPTY.
+	 */
+	CGFLAG_DELETE_NO_MIGRATION	= 16,
+};
+
+/**
+ * Flags for cgroup_modify_cgroup_ext().
+ */
+enum cgroup_modify_flag {
+	/**
+	 * Write also the values which were not added or set since they were
+	 * read by cgroup_get_cgroup() or copied by cgroup_copy_cgroup().
+	 * Errors when writing such values are ignored.
+	 */
+	CGFLAG_MODIFY_ALL	= 1,
+
+	/**
+	 * Read the current value first and skip the write if it is the same.
+	 * Multi-line values are always written.
+	 */
+	CGFLAG_MODIFY_SKIP_EQUAL	= 2,
+};
+
+/**
+ * Counters of cgroup_modify_cgroup_ext().
+ */
+struct cgroup_modify_stats {
+	/** Number of values written to kernel. */
+	unsigned long written;
+	/** Number of values skipped because they were not changed. */
+	unsigned long skipped_clean;
+	/** Number of values skipped because kernel has the same value. */
+	unsigned long skipped_equal;
 };
 
 /**
@@ -235,13 +277,26 @@ int cgroup_create_cgroup_from_parent(struct cgroup *cgroup,
 
 /**
  * Physically modify a control group in kernel. All parameters added by
- * cgroup_add_value_ or cgroup_set_value_ are written.
+ * cgroup_add_value_ or cgroup_set_value_ are written, the ones which were
+ * only read by cgroup_get_cgroup() or copied by cgroup_copy_cgroup() are
+ * skipped.
  * Currently it's not possible to change and owner of a group.
  *
  * @param cgroup
  */
 int cgroup_modify_cgroup(struct cgroup *cgroup);
 
+/**
+ * Physically modify a control group in kernel, see cgroup_modify_cgroup().
+ *
+ * @param cgroup
+ * @param flags Combination of CGFLAG_MODIFY_* flags.
+ * @param stats If not NULL, the numbers of written and skipped values are
+ *	added to it. The counters are not reset by this function.
+ */
+int cgroup_modify_cgroup_ext(struct cgroup *cgroup, int flags,
+		struct cgroup_modify_stats *stats);
+
 /**
  * Physically remove a control group from kernel. The group is removed from
  * all hierarchies,  which cover controllers added by cgroup_add_controller()
@@ -265,7 +320,9 @@ int cgroup_delete_cgroup(struct cgroup *cgroup, int ignore_migration);
  * during the task movement are ignored.
  * #CGFLAG_DELETE_RECURSIVE flag specifies that all subgroups should be removed
  * too. If root group is being removed with this flag specified, all subgroups
- * are removed but the root group itself is left undeleted.
+ * are removed but the root group itself is left undeleted. The recursive
+ * removal moves whole processes through cgroup.procs files, subgroups are
+ * always removed before their parents.
  * @see cgroup_delete_flag.
  *
  * @param cgroup
@@ -274,6 +331,20 @@ int cgroup_delete_cgroup(struct cgroup *cgroup, int ignore_migration);
  */
 int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags);
 
+/**
+ * Wait until a control group is empty in all its hierarchies, e.g. after
+ * its tasks were moved away and before it is removed. In the cgroup v2
+ * unified hierarchy the group is empty when neither it nor its subgroups
+ * have any processes, which is watched by inotify on its cgroup.events
+ * file. In the other hierarchies its tasks file is polled.
+ *
+ * @param cgroup
+ * @param timeout Maximum time to wait in milliseconds, -1 waits forever.
+ * @return 0 when the group is empty, ECGNONEMPTY when it is still not empty
+ *	after the timeout.
+ */
+int cgroup_wait_empty(struct cgroup *cgroup, int timeout);
+
 
 /**
  * @}
@@ -304,6 +375,26 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags);
  */
 int cgroup_get_cgroup(struct cgroup *cgroup);
 
+/**
+ * Read configuration of a control group from kernel like cgroup_get_cgroup(),
+ * but read only the selected controllers and parameters. Hierarchies with
+ * no selected controller are not touched at all.
+ *
+ * @code
+ * const char *names[] = { "memory.usage_in_bytes", "cpu*", NULL };
+ * cgroup_get_cgroup_filtered(group, names);
+ * @endcode
+ *
+ * @param cgroup The cgroup to load. Only it's name is used, everything else
+ * 	is replaced.
+ * @param names NULL terminated list of controller names (all parameters of
+ *	the controller are read) and parameter names. Both can contain
+ *	fnmatch(3) wildcards. Parameter names without wildcards are read
+ *	directly, without listing the group directory. NULL reads everything.
+ */
+int cgroup_get_cgroup_filtered(struct cgroup *cgroup,
+		const char * const *names);
+
 /**
  * Copy all controllers, their parameters and values. Group name, permissions
  * and ownerships are not coppied. All existing controllers
@@ -564,6 +655,34 @@ char *cgroup_get_value_name(struct cgroup_controller *controller, int index);
  */
 int cgroup_get_procs(char *name, char *controller, pid_t **pids, int *size);
 
+/**
+ * Flags of cgroup_get_procs_buf().
+ */
+enum cgroup_procs_flag {
+	/** Sort the returned pids. */
+	CGROUP_PROCS_SORT = 0x1,
+	/** Read thread ids from @c tasks instead of @c cgroup.procs. */
+	CGROUP_PROCS_TASKS = 0x2,
+};
+
+/**
+ * Get the list of processes in a cgroup into a caller supplied buffer,
+ * without any memory allocation.
+ * @param name The name of the cgroup
+ * @param controller The name of the controller
+ * @param flags Bit flags from #cgroup_procs_flag.
+ * @param pids The buffer for the pids. With @c NULL (and @c *size @c 0)
+ * the pids are only counted.
+ * @param size The size of the buffer on input, the number of pids in the
+ * group on output.
+ * @return #ECGOTHER with cgroup_get_last_errno() returning @c ERANGE when
+ * the buffer is too small, @c *size then holds the size needed. The buffer
+ * holds the first pids then, unsorted. A group can grow in the meantime,
+ * so leave some spare room when retrying.
+ */
+int cgroup_get_procs_buf(const char *name, const char *controller,
+		int flags, pid_t *pids, int *size);
+
 /**
  * Change permission of files and directories of given group
  * @param cgroup The cgroup which permissions should be changed
@@ -95,6 +95,15 @@ enum cgroup_walk_type {
 	 * @endcode
 	 */
 	CGROUP_WALK_TYPE_POST_DIR = 0x2,
+	/**
+	 * Return only directories and do not stat() anything. Control files
+	 * are skipped by the kernel provided directory entry types, which
+	 * makes walks of large trees much cheaper. Must be set by
+	 * cgroup_walk_tree_set_flags() before the first
+	 * cgroup_walk_tree_next() call, together with one of the
+	 * directions above.
+	 */
+	CGROUP_WALK_TYPE_DIRS_ONLY = 0x4,
 };
 
 /**
@@ -175,6 +184,46 @@ int cgroup_walk_tree_end(void **handle);
  */
 int cgroup_walk_tree_set_flags(void **handle, int flags);
 
+/**
+ * Callback of cgroup_walk_tree_parallel(), called for each group.
+ * @param info Description of the group, valid only during the call.
+ * @param userdata Pointer given to cgroup_walk_tree_parallel().
+ * @return @c 0 to continue the walk, any other value stops it.
+ */
+typedef int (*cgroup_walk_tree_callback)(const struct cgroup_file_info *info,
+		void *userdata);
+
+/**
+ * Walk all groups below given path using several threads. The tree is split
+ * into the subtrees rooted at @c split_depth levels below @c base_path,
+ * which are distributed among the threads; idle threads steal subtrees
+ * from the busy ones. Groups above the split depth are reported by the
+ * calling thread.
+ *
+ * Only directories are reported, like with #CGROUP_WALK_TYPE_DIRS_ONLY.
+ * With #CGROUP_WALK_TYPE_PRE_DIR each group is reported before its
+ * descendants, with #CGROUP_WALK_TYPE_POST_DIR after them. There is no
+ * other ordering, the callback is called concurrently from several threads
+ * and must be thread safe.
+ *
+ * @param controller Name of the controller, for which we want to walk
+ * the directory tree.
+ * @param base_path Begin walking from this path.
+ * @param split_depth Depth of the subtrees handed to the threads,
+ * at least @c 1.
+ * @param flags Either #CGROUP_WALK_TYPE_PRE_DIR or
+ * #CGROUP_WALK_TYPE_POST_DIR.
+ * @param threads Maximal number of threads, @c 0 for the number of online
+ * CPUs.
+ * @param callback Function to call for each group.
+ * @param userdata Passed to the callback.
+ * @return @c 0 on success, the non-zero value returned by the callback or
+ * an error code.
+ */
+int cgroup_walk_tree_parallel(const char *controller, const char *base_path,
+		int split_depth, int flags, unsigned int threads,
+		cgroup_walk_tree_callback callback, void *userdata);
+
 /**
  * Read the value of the given variable for the specified
  * controller and control group.
@@ -260,6 +309,115 @@ int cgroup_read_stats_next(void **handle, struct cgroup_stat *stat);
  */
 int cgroup_read_stats_end(void **handle);
 
+/**
+ * Flags of cgroup_stats_open().
+ */
+enum cgroup_stats_flag {
+	/**
+	 * Keep the stats file open between cgroup_stats_read() calls instead
+	 * of opening it for each of them.
+	 */
+	CGROUP_STATS_KEEP_OPEN = 0x1,
+};
+
+/**
+ * One numeric item in stats file.
+ */
+struct cgroup_stat_value {
+	const char *name;
+	u_int64_t value;
+};
+
+/**
+ * Prepare bulk reading of a stats file, e.g. for periodic polling. Unlike
+ * cgroup_read_stats_begin(), all items are returned at once by
+ * cgroup_stats_read(), with their values already converted to numbers.
+ * @param controller Name of the controller for which stats are requested.
+ * @param path Path to control group, relative to hierarchy root.
+ * @param name Name of the stats file, @c NULL for
+ * <tt><i>controller</i>.stat</tt>.
+ * @param flags Bit flags from #cgroup_stats_flag.
+ * @param handle Handle to be used by cgroup_stats_read().
+ */
+int cgroup_stats_open(const char *controller, const char *path,
+		const char *name, int flags, void **handle);
+
+/**
+ * Read all items of the stats file. Lines without a numeric value are
+ * skipped.
+ * @param handle Handle returned by cgroup_stats_open().
+ * @param values Returned array of the items. It is owned by the handle and
+ * valid until the next cgroup_stats_read() or cgroup_stats_close() call.
+ * @param count Returned number of the items.
+ */
+int cgroup_stats_read(void *handle, const struct cgroup_stat_value **values,
+		int *count);
+
+/**
+ * Release the handle.
+ */
+int cgroup_stats_close(void **handle);
+
+/**
+ * @}
+ *
+ * @name Poll values of groups
+ * Periodic readers of many values can register the files once with
+ * cgroup_poll_add(). The files stay open and cgroup_poll_refresh() re-reads
+ * all of them, using one pread() syscall per file.
+ */
+
+/**
+ * Value of one file registered by cgroup_poll_add().
+ */
+struct cgroup_poll_value {
+	/**
+	 * Content of the file without the trailing newline, truncated to
+	 * CG_VALUE_MAX - 1 characters.
+	 */
+	char value[CG_VALUE_MAX];
+	/**
+	 * @c 0 if the value was read, an error code otherwise, e.g. when
+	 * the group has been removed.
+	 */
+	int error;
+};
+
+/**
+ * Create an empty poll handle.
+ * @param handle Returned handle.
+ */
+int cgroup_poll_create(void **handle);
+
+/**
+ * Open a file of a group and register it into the poll handle.
+ * @param handle Handle returned by cgroup_poll_create().
+ * @param path Path to control group, relative to hierarchy root.
+ * @param controller Name of the controller.
+ * @param name Name of the file, e.g. @c memory.usage_in_bytes.
+ * @param index Returned index of the file in the values array of
+ * cgroup_poll_refresh(), files get consecutive indexes starting at @c 0.
+ */
+int cgroup_poll_add(void *handle, const char *path, const char *controller,
+		const char *name, int *index);
+
+/**
+ * Read all registered files.
+ * @param handle Handle returned by cgroup_poll_create().
+ * @param values Caller-owned array, the value of each file is stored at its
+ * index.
+ * @param count Size of the array, files with higher indexes are not read.
+ * @return @c 0 if all files were read, otherwise the error of the first one
+ * which failed. The other files are read anyway.
+ */
+int cgroup_poll_refresh(void *handle, struct cgroup_poll_value *values,
+		int count);
+
+/**
+ * Close all files and release the handle.
+ */
+int cgroup_poll_destroy(void **handle);
+
 /**
  * @}
  *
@@ -20,6 +20,25 @@ enum cgflags {
 	CGFLAG_USECACHE = 0x01,
 	/** Use cached templates, do not read templates from disk. */
 	CGFLAG_USE_TEMPLATE_CACHE = 0x02,
+	/**
+	 * Do not move a task, which is already in the destination group in
+	 * all the controllers, according to /proc/<pid>/cgroup.
+	 */
+	CGFLAG_SKIP_CURRENT = 0x04,
+	/**
+	 * Match the rules and substitute the destinations only, create no
+	 * template group and move no task.
+	 */
+	CGFLAG_DRY_RUN = 0x08,
+};
+
+/** Flags for cgroup_attach_tasks(). */
+enum cgroup_attach_flags {
+	/**
+	 * Move whole thread groups, i.e. write the pids to cgroup.procs
+	 * instead of tasks.
+	 */
+	CGFLAG_ATTACH_PROCS = 0x01,
 };
 
 /** Flags for cgroup_register_unchanged_process(). */
@@ -55,6 +74,35 @@ int cgroup_attach_task(struct cgroup *cgroup);
  */
 int cgroup_attach_task_pid(struct cgroup *cgroup, pid_t tid);
 
+/**
+ * Move many tasks to given control group at once. The tasks file of each
+ * controller is opened only once for all the tasks. Tasks, which do not
+ * exist anymore, do not make the call fail.
+ * @param cgroup Destination control group, NULL means the root groups of
+ * 	all hierarchies.
+ * @param pids The tasks to move.
+ * @param count Number of tasks in pids.
+ * @param flags Combination of CGFLAG_ATTACH_* flags.
+ * @param errors Array of @c count error codes, or NULL. The first error of
+ * 	each task is stored there, 0 if it was moved and ECGOTHER with
+ * 	cgroup_get_last_errno() ESRCH if it does not exist, unless another
+ * 	task failed with ECGOTHER.
+ * @return 0 on success or the first error.
+ */
+int cgroup_attach_tasks(struct cgroup *cgroup, const pid_t *pids,
+		size_t count, int flags, int *errors);
+
+/**
+ * Keep the tasks files used by cgroup_attach_task_pid() open, so moving a
+ * task to a recently used control group is a single write() per hierarchy.
+ * The files are closed when the group is deleted by libcgroup or when
+ * cgroup_init() is called again, and also reopened once when the group
+ * was removed by someone else.
+ * @param size Maximum number of open tasks files. Zero, the default,
+ * 	disables the cache and closes all cached files.
+ */
+int cgroup_set_tasks_fd_cache_size(unsigned int size);
+
 /**
  * Changes the cgroup of a task based on the path provided.  In this case,
  * the user must already know into which cgroup the task should be placed and
@@ -69,6 +117,24 @@ int cgroup_attach_task_pid(struct cgroup *cgroup, pid_t tid);
 int cgroup_change_cgroup_path(const char *path, pid_t pid,
 		const char * const controllers[]);
 
+/**
+ * Same as cgroup_change_cgroup_path(), with flags.
+ *
+ * @param path Name of the destination group.
+ * @param pid The task to move.
+ * @param controllers List of controllers.
+ * @param flags Bit flags, only CGFLAG_SKIP_CURRENT is used.
+ */
+int cgroup_change_cgroup_path_flags(const char *path, pid_t pid,
+		const char * const controllers[], int flags);
+
+/**
+ * Get the number of moves skipped because the task already was in the
+ * destination group, see CGFLAG_SKIP_CURRENT and
+ * cgroup_change_all_cgroups_parallel().
+ */
+unsigned long cgroup_get_skipped_moves(void);
+
 /**
  * Get the current control group path where the given task is.
  * @param pid The task to find.
@@ -80,6 +146,55 @@ int cgroup_change_cgroup_path(const char *path, pid_t pid,
 int cgroup_get_current_controller_path(pid_t pid, const char *controller,
 					char **current_path);
 
+/**
+ * Number of paths per task returned by cgroup_get_current_controller_paths()
+ * for all mounted controllers.
+ */
+#define CG_CURRENT_PATHS_MAX 100
+
+/**
+ * Get the current control group paths of the given task in several
+ * controllers, reading /proc/<pid>/cgroup only once.
+ * @param pid The task to find.
+ * @param controllers NULL terminated list of controllers, or NULL for all
+ * 	mounted controllers, in the order of cgroup_get_controller_begin().
+ * @param paths Array with one item per controller, CG_CURRENT_PATHS_MAX
+ * 	items if @c controllers is NULL. Filled with the paths like
+ * 	cgroup_get_current_controller_path() does, NULL for controllers,
+ * 	where the task was not found, and for the unused items. The caller
+ * 	must free the paths.
+ * @return 0 on success, ECGROUPNOTEXIST if the task does not exist.
+ */
+int cgroup_get_current_controller_paths(pid_t pid,
+		const char * const controllers[], char *paths[]);
+
+/**
+ * Same as cgroup_get_current_controller_paths() for many tasks at once.
+ * Tasks, which do not exist, do not make the call fail.
+ * @param pids The tasks to find.
+ * @param count Number of tasks in pids.
+ * @param controllers NULL terminated list of controllers, or NULL for all
+ * 	mounted controllers.
+ * @param paths Array of @c count rows, one per task, each with one item per
+ * 	controller (CG_CURRENT_PATHS_MAX if @c controllers is NULL).
+ * @param errors Array of @c count error codes, or NULL. ECGROUPNOTEXIST is
+ * 	stored for tasks, which do not exist, 0 for the others.
+ * @return 0 on success, > 0 on error, no paths are returned then.
+ */
+int cgroup_get_current_controller_paths_pids(const pid_t *pids, int count,
+		const char * const controllers[], char *paths[], int *errors);
+
+/**
+ * Read the identity and the current groups of tasks from another directory
+ * than /proc, e.g. from a fake tree with <pid>/status, exe, cmdline, cwd
+ * and cgroup entries for replaying process events. The tasks are still
+ * moved in the real hierarchies. Must be called before any thread
+ * classifies a task.
+ * @param path The directory, NULL for /proc.
+ * @return 0 on success, ECGINVAL if the path is too long.
+ */
+int cgroup_set_proc_root(const char *path);
+
 /**
  * @}
  *
@@ -97,8 +212,9 @@ int cgroup_get_current_controller_path(pid_t pid, const char *controller,
 int cgroup_init_rules_cache(void);
 
 /**
- * Reloads the rules list from /etc/cgrules.conf. This function
- * is probably NOT thread safe (calls cgroup_parse_rules_config()).
+ * Reloads the rules list from /etc/cgrules.conf. The new rules replace the
+ * old ones at once, callers matching the old rules concurrently are not
+ * blocked. If the new rules cannot be loaded, the old ones are kept.
  */
 int cgroup_reload_cached_rules(void);
 
@@ -110,6 +226,44 @@ int cgroup_reload_cached_rules(void);
  */
 void cgroup_print_rules_config(FILE *fp);
 
+/**
+ * Print the number of processes each cached rule moved, one rule per line:
+ * the rule number in the list, the user and the process name of the rule,
+ * its destination and the number. The numbers start from zero whenever the
+ * rules are reloaded.
+ * @param fp Destination file, where the numbers will be printed.
+ */
+void cgroup_print_rules_stats(FILE *fp);
+
+/**
+ * Write the cached rules to a compiled rules image. Callers which do not
+ * cache the rules, like cgroup_change_cgroup_flags() without
+ * CGFLAG_USECACHE, use the image instead of parsing /etc/cgrules.conf and
+ * /etc/cgrules.d as long as none of the rules files, /etc/passwd or
+ * /etc/group changed since the rules were loaded. The image replaces the
+ * previous one atomically.
+ * The image records the resolved user and group ids, so it is written only
+ * when /etc/nsswitch.conf looks up passwd and group in files alone. With
+ * other services, like LDAP, the previous image is removed instead.
+ * @param path Path of the image, NULL for the default one.
+ */
+int cgroup_write_rules_image(const char *path);
+
+/**
+ * Members of groups used in '@group' rules are resolved when the rules
+ * are cached, so matching a rule does not need any user or group lookup.
+ * This function resolves them again, without reloading the rules.
+ */
+int cgroup_refresh_rules_group_cache(void);
+
+/**
+ * Set how long the resolved members of groups used in '@group' rules are
+ * valid. When they expire, they are resolved again on next rule matching.
+ * @param ttl Time to live in seconds. Zero, the default, means the members
+ * 	are valid until the rules are reloaded or refreshed.
+ */
+void cgroup_set_rules_group_cache_ttl(unsigned int ttl);
+
 /**
  * @}
  * @name Rule based task assignment
@@ -131,6 +285,19 @@ void cgroup_print_rules_config(FILE *fp);
  */
 int cgroup_change_all_cgroups(void);
 
+/**
+ * Same as cgroup_change_all_cgroups(), but the running processes are
+ * classified by several threads and the processes moved to one group are
+ * written to its cgroup.procs files at once. Processes, which are already
+ * in the destination group of their rule according to /proc/<pid>/cgroup,
+ * are not moved. The cached rules are used.
+ *
+ * @param threads Maximal number of threads, @c 0 for the number of online
+ * 	CPUs.
+ * @return 0 on success, < 0 on error
+ */
+int cgroup_change_all_cgroups_parallel(unsigned int threads);
+
 /**
  * Changes the cgroup of a program based on the rules in the config file.
  * If a rule exists for the given UID, GID or PROCESS NAME, then the given
@@ -141,6 +308,9 @@ int cgroup_change_all_cgroups(void);
  * 	CGFLAG_USECACHE: Use cached rules instead of parsing the config file
  *      CGFLAG_USE_TEMPLATE_CACHE: Use cached templates instead of
  * parsing the config file
+ *      CGFLAG_SKIP_CURRENT: Do not move the task to groups it already
+ * is in
+ *      CGFLAG_DRY_RUN: Only find the destination groups of the task
  *
  * This function may NOT be thread safe.
  * @param uid The UID to match.
@@ -39,7 +39,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 #include <fts.h>
@@ -49,6 +53,8 @@
 #include <assert.h>
 #include <linux/un.h>
 #include <grp.h>
+#include <poll.h>
+#include <time.h>
 
 /*
  * The errno which happend the last time (have to be thread specific)
@@ -66,15 +72,102 @@ static __thread char errtext[MAXLEN];
 /* Check if cgroup_init has been called or not. */
 static int cgroup_initialized;
 
-/* List of configuration rules */
-static struct cgroup_rule_list rl;
+/*
+ * Snapshot of the cached configuration rules. It is never modified once
+ * published, see cg_rule_list_get() and cg_rule_list_put().
+ */
+static struct cgroup_rule_list *rl;
 
 /* Temporary list of configuration rules (for non-cache apps) */
 static struct cgroup_rule_list trl;
 
-/* Lock for the list of rules (rl) */
+/*
+ * Lock for publishing the rl snapshot and members of its '@group' rules.
+ * It is held only to take a reference or to swap the pointers.
+ */
 static pthread_rwlock_t rl_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+/*
+ * Serializes parsing of the rules and resolving of '@group' rule members.
+ * The temporary list (trl) is shared and getgrnam() or getpwnam() are not
+ * reentrant.
+ */
+static pthread_mutex_t rl_parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* How long are resolved '@group' members valid, in seconds (0 = forever) */
+static unsigned int rl_group_ttl;
+
+/*
+ * An open tasks file, referenced by its cache entry and by the threads
+ * writing to it, closed with the last reference.
+ */
+struct cg_tasks_file {
+	int fd;
+	int refcount;
+};
+
+/* An open tasks file of a cgroup, used by cgroup_attach_task_pid() */
+struct cg_tasks_fd {
+	/* Full path to the tasks file, NULL if the entry is unused */
+	char *path;
+	struct cg_tasks_file *file;
+	/* When was the entry last used, for replacing the oldest entry */
+	unsigned long stamp;
+};
+
+/* Cache of open tasks files, see cgroup_set_tasks_fd_cache_size() */
+static struct cg_tasks_fd *cg_tasks_fds;
+static unsigned int cg_tasks_fds_size;
+static unsigned long cg_tasks_fds_stamp;
+static pthread_mutex_t cg_tasks_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Watch of the mount table: the mount file stays open and poll() on it tells
+ * when the mount table changed since the last check. Each watch has its own
+ * descriptor, as the change events are consumed by poll().
+ */
+struct cg_mounts_watch {
+	int fd;
+	/* the process which opened fd, the description is shared on fork() */
+	pid_t pid;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Result of the last scan of /proc/mounts for a cgroup mount, -1 if
+ * not known.
+ */
+static struct cg_mounts_watch cg_mounted_fs_watch = {
+	.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static int cg_mounted_fs = -1;
+
+/*
+ * cg_mount_table is up to date with /proc/self/mountinfo, so cgroup_init()
+ * has nothing to do.
+ */
+static struct cg_mounts_watch cg_mount_table_watch = {
+	.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static int cg_mount_table_valid;
+
+/*
+ * Directory descriptors of the hierarchy roots, one per distinct mount point
+ * in cg_mount_table, so that paths inside the hierarchies are resolved from
+ * there instead of from /. Protected by cg_mount_table_lock; descriptors are
+ * closed by cgroup_init() only when their mount point disappears. The
+ * device and inode tell whether the descriptor number was closed and
+ * reused by the application meanwhile.
+ */
+struct cg_mount_dirfd {
+	int fd;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+};
+static struct cg_mount_dirfd cg_mount_dirfds[CG_CONTROLLER_MAX];
+static int cg_mount_dirfds_count;
+
 /* Namespace */
 __thread char *cg_namespace_table[CG_CONTROLLER_MAX];
 
@@ -104,6 +197,8 @@ const char const *cgroup_strerror_codes[] = {
 	"Cgroup parsing failed",
 	"Cgroup, rules file does not exist",
 	"Cgroup mounting failed",
+	/* 50022 is not used */
+	"Cgroup unknown error",
 	"End of File or iterator",
 	"Failed to parse config file",
 	"Have multiple paths for the same namespace",
@@ -114,7 +209,10 @@ const char const *cgroup_strerror_codes[] = {
 	"Failed to remove a non-empty group",
 };
 
-static const char const *cgroup_ignored_tasks_files[] = { "tasks", NULL };
+static const char * const cgroup_ignored_tasks_files[] = { "tasks", NULL };
+static const char * const cgroup_ignored_unified_files[] = {
+	"cgroup.procs", NULL
+};
 
 static int cg_chown(const char *filename, uid_t owner, gid_t group)
 {
@@ -124,29 +222,78 @@ static int cg_chown(const char *filename, uid_t owner, gid_t group)
 		group = getgid();
 	return chown(filename, owner, group);
 }
-static int cg_chown_file(FTS *fts, FTSENT *ent, uid_t owner, gid_t group)
+
+/* Owner and permissions set by cg_set_owner_perms() */
+struct cg_owner_perms {
+	/* whether the owner should be changed */
+	int chown;
+	uid_t owner;
+	gid_t group;
+	mode_t dir_mode;
+	int dirm_change;
+	mode_t file_mode;
+	int filem_change;
+	/* use the owner permissions as an umask of group and others */
+	int owner_is_umask;
+	/* files whose permissions are kept, terminated with NULL */
+	const char * const *ignore_list;
+};
+
+/*
+ * Use owner permissions as an umask for group and others permissions because
+ * we trust kernel to initialize owner permissions to something useful.
+ * Keep SUID and SGID bits.
+ */
+static mode_t cg_owner_umask(mode_t mode)
+{
+	mode_t mask = S_IRWXU & mode;
+
+	return mask | (mask >> 3) | (mask >> 6) | S_ISUID | S_ISGID | S_ISVTX;
+}
+
+/*
+ * Change the owner and the permissions of one file relative to dirfd,
+ * described by st. Only the values which differ are changed.
+ */
+static int cg_owner_perms_at(int dirfd, const char *name, const char *path,
+		const struct stat *st, const struct cg_owner_perms *op)
 {
+	mode_t mode, mask = -1U;
+	int change, i;
 	int ret = 0;
-	const char *filename = fts->fts_path;
-	cgroup_dbg("chown: seeing file %s\n", filename);
-	switch (ent->fts_info) {
-	case FTS_ERR:
-		errno = ent->fts_errno;
-		break;
-	case FTS_D:
-	case FTS_DC:
-	case FTS_NSOK:
-	case FTS_NS:
-	case FTS_DNR:
-	case FTS_DP:
-	case FTS_F:
-	case FTS_DEFAULT:
-		ret = cg_chown(filename, owner, group);
-		break;
+
+	if (op->chown && (st->st_uid != op->owner ||
+				st->st_gid != op->group)) {
+		if (fchownat(dirfd, name, op->owner, op->group,
+					AT_SYMLINK_NOFOLLOW)) {
+			cgroup_warn("Warning: cannot change owner of file %s: %s\n",
+					path, strerror(errno));
+			last_errno = errno;
+			ret = ECGOTHER;
+		}
 	}
-	if (ret < 0) {
-		cgroup_warn("Warning: cannot change owner of file %s: %s\n",
-				filename, strerror(errno));
+
+	if (S_ISDIR(st->st_mode)) {
+		change = op->dirm_change;
+		mode = op->dir_mode;
+	} else {
+		change = op->filem_change;
+		mode = op->file_mode;
+	}
+	if (!change)
+		return ret;
+
+	for (i = 0; op->ignore_list && op->ignore_list[i]; i++)
+		if (!strcmp(op->ignore_list[i], name))
+			return ret;
+
+	if (op->owner_is_umask)
+		mask = cg_owner_umask(st->st_mode);
+	mode &= mask;
+
+	if ((st->st_mode & 07777) != mode && fchmodat(dirfd, name, mode, 0)) {
+		cgroup_warn("Warning: cannot change permissions of file %s: %s\n",
+				path, strerror(errno));
 		last_errno = errno;
 		ret = ECGOTHER;
 	}
@@ -154,35 +301,70 @@ static int cg_chown_file(FTS *fts, FTSENT *ent, uid_t owner, gid_t group)
 }
 
 /*
- * TODO: Need to decide a better place to put this function.
+ * Change the owner and the permissions of a file relative to dirfd and,
+ * when it is a directory, of all files below it. The directories are read
+ * once and the files are changed relative to them, without building and
+ * resolving their full paths.
  */
-static int cg_chown_recursive(char **path, uid_t owner, gid_t group)
+static int cg_set_owner_perms_at(int dirfd, const char *name,
+		const char *path, const struct cg_owner_perms *op)
 {
-	int ret = 0;
-	FTS *fts;
+	char child_path[FILENAME_MAX];
+	struct dirent *ent;
+	struct stat st;
+	const char *sep;
+	DIR *dir;
+	int fd, ret, error;
 
-	cgroup_dbg("chown: path is %s\n", *path);
-	fts = fts_open(path, FTS_PHYSICAL | FTS_NOCHDIR |
-				FTS_NOSTAT, NULL);
-	if (fts == NULL) {
-		cgroup_warn("Warning: cannot open directory %s: %s\n",
-				path, strerror(errno));
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+		cgroup_warn("Warning: cannot stat %s: %s\n", path,
+				strerror(errno));
 		last_errno = errno;
 		return ECGOTHER;
 	}
-	while (1) {
-		FTSENT *ent;
-		ent = fts_read(fts);
-		if (!ent) {
-			cgroup_warn("Warning: fts_read failed\n");
-			break;
-		}
-		ret = cg_chown_file(fts, ent, owner, group);
+
+	ret = cg_owner_perms_at(dirfd, name, path, &st, op);
+	if (!S_ISDIR(st.st_mode))
+		return ret;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		cgroup_warn("Warning: cannot open directory %s: %s\n", path,
+				strerror(errno));
+		last_errno = errno;
+		if (fd >= 0)
+			close(fd);
+		return ECGOTHER;
+	}
+
+	sep = path[0] && path[strlen(path) - 1] == '/' ? "" : "/";
+	while ((ent = readdir(dir)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		snprintf(child_path, sizeof(child_path), "%s%s%s", path, sep,
+				ent->d_name);
+		error = cg_set_owner_perms_at(fd, ent->d_name, child_path, op);
+		if (error)
+			ret = error;
 	}
-	fts_close(fts);
+	closedir(dir);
 	return ret;
 }
 
+/*
+ * Change the owner and the permissions of a group directory and all its
+ * files and subgroups.
+ */
+static int cg_set_owner_perms(const char *path,
+		const struct cg_owner_perms *op)
+{
+	cgroup_dbg("chown/chmod: path is %s\n", path);
+	return cg_set_owner_perms_at(AT_FDCWD, path, path, op);
+}
+
 int cg_chmod_path(const char *path, mode_t mode, int owner_is_umask)
 {
 	struct stat buf;
@@ -218,109 +400,21 @@ fail:
 	return ECGOTHER;
 }
 
-int cg_chmod_file(FTS *fts, FTSENT *ent, mode_t dir_mode,
-	int dirm_change, mode_t file_mode, int filem_change,
-	int owner_is_umask)
-{
-	int ret = 0;
-	const char *filename = fts->fts_path;
-
-	cgroup_dbg("chmod: seeing file %s\n", filename);
-
-	switch (ent->fts_info) {
-	case FTS_ERR:
-		errno = ent->fts_errno;
-		break;
-	case FTS_D:
-	case FTS_DC:
-	case FTS_DNR:
-	case FTS_DP:
-		if (dirm_change)
-			ret = cg_chmod_path(filename, dir_mode, owner_is_umask);
-		break;
-	case FTS_F:
-	case FTS_NSOK:
-	case FTS_NS:
-	case FTS_DEFAULT:
-		if (filem_change)
-			ret = cg_chmod_path(filename, file_mode,
-					owner_is_umask);
-		break;
-	}
-	return ret;
-}
-
-
-/**
- * Changes permissions of all directories and control files (i.e. all
- * files except files named in ignore_list. The list must be terminated with
- * NULL.
- */
-static int cg_chmod_recursive_controller(char *path, mode_t dir_mode,
-		int dirm_change, mode_t file_mode, int filem_change,
-		int owner_is_umask, const char const **ignore_list)
-{
-	int ret = 0;
-	int final_ret =0;
-	FTS *fts;
-	char *fts_path[2];
-	int i, ignored;
-
-	fts_path[0] = path;
-	fts_path[1] = NULL;
-	cgroup_dbg("chmod: path is %s\n", path);
-
-	fts = fts_open(fts_path, FTS_PHYSICAL | FTS_NOCHDIR |
-			FTS_NOSTAT, NULL);
-	if (fts == NULL) {
-		cgroup_warn("Warning: cannot open directory %s: %s\n",
-				fts_path, strerror(errno));
-		last_errno = errno;
-		return ECGOTHER;
-	}
-	while (1) {
-		FTSENT *ent;
-		ent = fts_read(fts);
-		if (!ent) {
-			if (errno != 0) {
-				cgroup_dbg("fts_read failed\n");
-				last_errno = errno;
-				final_ret = ECGOTHER;
-			}
-			break;
-		}
-		ignored = 0;
-		if (ignore_list != NULL)
-			for (i = 0; ignore_list[i] != NULL; i++)
-				if (!strcmp(ignore_list[i], ent->fts_name)) {
-					ignored = 1;
-					break;
-				}
-		if (ignored)
-			continue;
-
-		ret = cg_chmod_file(fts, ent, dir_mode, dirm_change,
-				file_mode, filem_change,
-				owner_is_umask);
-		if (ret) {
-			cgroup_warn("Warning: cannot change file mode %s: %s\n",
-					fts_path, strerror(errno));
-			last_errno = errno;
-			final_ret = ECGOTHER;
-		}
-	}
-	fts_close(fts);
-	return final_ret;
-}
-
 int cg_chmod_recursive(struct cgroup *cgroup, mode_t dir_mode,
 		int dirm_change, mode_t file_mode, int filem_change)
 {
+	struct cg_owner_perms op;
 	int i;
 	char *path;
 	int final_ret = 0;
 	int ret;
 
+	memset(&op, 0, sizeof(op));
+	op.dir_mode = dir_mode;
+	op.dirm_change = dirm_change;
+	op.file_mode = file_mode;
+	op.filem_change = filem_change;
+
 	path = malloc(FILENAME_MAX);
 	if (!path) {
 		last_errno = errno;
@@ -332,8 +426,7 @@ int cg_chmod_recursive(struct cgroup *cgroup, mode_t dir_mode,
 			final_ret = ECGFAIL;
 			break;
 		}
-		ret = cg_chmod_recursive_controller(path, dir_mode, dirm_change,
-				file_mode, filem_change, 0, NULL);
+		ret = cg_set_owner_perms(path, &op);
 		if (ret)
 			final_ret = ret;
 	}
@@ -384,6 +477,50 @@ static int cgroup_test_subsys_mounted(const char *name)
 	return 0;
 }
 
+/*
+ * Is the controller in the cgroup v2 unified hierarchy?
+ * Call with cg_mount_table_lock held.
+ */
+static int cg_controller_unified_locked(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CG_CONTROLLER_MAX &&
+			cg_mount_table[i].name[0] != '\0'; i++) {
+		if (!strcmp(cg_mount_table[i].name, name))
+			return cg_mount_table[i].unified;
+	}
+	return 0;
+}
+
+static int cg_controller_unified(const char *name)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	ret = cg_controller_unified_locked(name);
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+	return ret;
+}
+
+/*
+ * Name of the file tasks are moved with into a group of the controller. The
+ * unified hierarchy has no tasks file, whole processes are moved by
+ * cgroup.procs there.
+ */
+static const char *cg_tasks_file(const char *controller)
+{
+	return cg_controller_unified(controller) ? "cgroup.procs" : "tasks";
+}
+
+/*
+ * Name of the file listing the threads of a group of the controller.
+ */
+static const char *cg_threads_file(const char *controller)
+{
+	return cg_controller_unified(controller) ? "cgroup.threads" : "tasks";
+}
+
 /**
  * Free a single cgroup_rule struct.
  *	@param r The rule to free from memory
@@ -411,9 +548,31 @@ static void cgroup_free_rule(struct cgroup_rule *r)
 	free(r);
 }
 
+static void cg_rule_members_put(struct cgroup_rule_members *members)
+{
+	if (!members || __sync_sub_and_fetch(&members->refcount, 1))
+		return;
+
+	free(members->hash);
+	free(members->members);
+	free(members);
+}
+
+static void cgroup_free_rule_index(struct cgroup_rule_index *idx)
+{
+	if (!idx)
+		return;
+
+	free(idx->uid_hash);
+	free(idx->gid_hash);
+	free(idx->proc_hash);
+	cg_rule_members_put(idx->members);
+	free(idx);
+}
+
 /**
- * Free a list of cgroup_rule structs.  If rl is the main list of rules,
- * the lock must be taken for writing before calling this function!
+ * Free a list of cgroup_rule structs. The cached list of rules must be
+ * released by cg_rule_list_put() instead.
  *	@param rl Pointer to the list of rules to free from memory
  */
 static void cgroup_free_rule_list(struct cgroup_rule_list *cg_rl)
@@ -421,6 +580,9 @@ static void cgroup_free_rule_list(struct cgroup_rule_list *cg_rl)
 	/* Temporary pointer */
 	struct cgroup_rule *tmp = NULL;
 
+	cgroup_free_rule_index(cg_rl->index);
+	cg_rl->index = NULL;
+
 	/* Make sure we're not freeing NULL memory! */
 	if (!(cg_rl->head)) {
 		cgroup_warn("Warning: attempted to free NULL list\n");
@@ -436,72 +598,400 @@ static void cgroup_free_rule_list(struct cgroup_rule_list *cg_rl)
 	/* Don't leave wild pointers around! */
 	cg_rl->head = NULL;
 	cg_rl->tail = NULL;
+	cg_rl->len = 0;
 }
 
-static char *cg_skip_unused_charactors_in_rule(char *rule)
+/**
+ * Free the list of files the cached rules were parsed from.
+ *	@param lst The list of rules
+ */
+static void cg_rules_sources_free(struct cgroup_rule_list *lst)
 {
-	char *itr;
+	int i;
 
-	/* We ignore anything after a # sign as comments. */
-	itr = strchr(rule, '#');
-	if (itr)
-		*itr = '\0';
+	for (i = 0; i < lst->nsources; i++)
+		free(lst->sources[i].path);
+	free(lst->sources);
+	lst->sources = NULL;
+	lst->nsources = -1;
+}
 
-	/* We also need to remove the newline character. */
-	itr = strchr(rule, '\n');
-	if (itr)
-		*itr = '\0';
+/**
+ * Remember the state of a file the cached rules depend on, before it is
+ * read. If the list cannot grow, the files are marked as not known.
+ *	@param lst The list of rules
+ *	@param path The file
+ */
+static void cg_rules_source_add(struct cgroup_rule_list *lst,
+		const char *path)
+{
+	struct cg_rules_source *sources, *src;
 
-	/* Now, skip any leading tabs and spaces. */
-	itr = rule;
-	while (itr && isblank(*itr))
-		itr++;
+	if (lst->nsources < 0)
+		return;
 
-	/* If there's nothing left, we can ignore this line. */
-	if (!strlen(itr))
-		return NULL;
+	sources = realloc(lst->sources,
+			(lst->nsources + 1) * sizeof(*sources));
+	if (!sources) {
+		cg_rules_sources_free(lst);
+		return;
+	}
+	lst->sources = sources;
 
-	return itr;
+	src = &sources[lst->nsources];
+	src->path = strdup(path);
+	if (!src->path) {
+		cg_rules_sources_free(lst);
+		return;
+	}
+	src->missing = stat(path, &src->st) != 0;
+	lst->nsources++;
 }
 
 /**
- * Parse the configuration file that maps UID/GIDs to cgroups.  If ever the
- * configuration file is modified, applications should call this function to
- * load the new configuration rules.  The function caller is responsible for
- * calling free() on each rule in the list.
- *
- * The cache parameter alters the behavior of this function.  If true, this
- * function will read the entire configuration file and store the results in
- * rl (global rules list).  If false, this function will only parse until it
- * finds a rule matching the given UID or GID.  It will store this rule in trl,
- * as well as any children rules (rules that begin with a %) that it has.
- *
- * This function is NOT thread safe!
- *	@param filename configuration file to parse
- *	@param cache True to cache rules, else false
- *	@param muid If cache is false, the UID to match against
- *	@param mgid If cache is false, the GID to match against
- *	@return 0 on success, -1 if no cache and match found, > 0 on error.
- * TODO: Make this function thread safe!
- *
+ * Take a reference to the current snapshot of the cached rules. The rules
+ * in the snapshot do not change and stay valid until cg_rule_list_put().
+ *	@return The snapshot, or NULL if the rules are not cached
  */
-static int cgroup_parse_rules_file(char *filename, bool cache, uid_t muid,
-					  gid_t mgid, const char *mprocname)
+static struct cgroup_rule_list *cg_rule_list_get(void)
 {
-	/* File descriptor for the configuration file */
-	FILE *fp = NULL;
+	struct cgroup_rule_list *list;
 
-	/* Buffer to store the line we're working on */
-	char buff[CGROUP_RULE_MAXLINE] = { '\0' };
+	pthread_rwlock_rdlock(&rl_lock);
+	list = rl;
+	if (list)
+		__sync_fetch_and_add(&list->refcount, 1);
+	pthread_rwlock_unlock(&rl_lock);
 
-	/* Iterator for the line we're working on */
-	char *itr = NULL;
+	return list;
+}
 
-	/* Pointer to process name in a line of the configuration file */
-	char *procname = NULL;
+/**
+ * Release a reference to a snapshot of the cached rules, the last one
+ * frees it.
+ *	@param list The snapshot from cg_rule_list_get()
+ */
+static void cg_rule_list_put(struct cgroup_rule_list *list)
+{
+	if (!list || __sync_sub_and_fetch(&list->refcount, 1))
+		return;
 
-	/* Pointer to the list that we're using */
-	struct cgroup_rule_list *lst = NULL;
+	if (list->head)
+		cgroup_free_rule_list(list);
+	else
+		cgroup_free_rule_index(list->index);
+	cg_rules_sources_free(list);
+	free(list);
+}
+
+/**
+ * Replace the current snapshot of the cached rules. Readers holding
+ * a reference to the old one still use it, until they release it.
+ *	@param list The new snapshot, with the reference owned by rl
+ */
+static void cg_rule_list_publish(struct cgroup_rule_list *list)
+{
+	struct cgroup_rule_list *old;
+
+	pthread_rwlock_wrlock(&rl_lock);
+	old = rl;
+	rl = list;
+	pthread_rwlock_unlock(&rl_lock);
+
+	cg_rule_list_put(old);
+}
+
+static unsigned int cg_hash_id(unsigned int id, unsigned int size)
+{
+	return (id * 2654435761U) & (size - 1);
+}
+
+unsigned int cg_hash_string(const char *str, unsigned int size)
+{
+	unsigned int hash = 5381;
+
+	while (*str)
+		hash = hash * 33 + (unsigned char)*str++;
+
+	return hash & (size - 1);
+}
+
+/*
+ * Append the rule at the end of the bucket, so that the bucket stays
+ * sorted by the rule ordinal.
+ */
+static void cg_rule_index_append(struct cgroup_rule **bucket,
+		struct cgroup_rule *rule)
+{
+	while (*bucket)
+		bucket = &(*bucket)->hash_next;
+	*bucket = rule;
+}
+
+/**
+ * Resolve members of the groups of all '@group' rules in the index and hash
+ * them by UID. The caller must hold rl_parse_lock.
+ *	@param idx The rule index
+ *	@return The resolved members with one reference, NULL on error
+ */
+static struct cgroup_rule_members *cg_rule_index_resolve_groups(
+		struct cgroup_rule_index *idx)
+{
+	struct cgroup_rule_members *res;
+	struct cgroup_rule_member *tmp;
+	struct cgroup_rule_member **bucket;
+	struct cgroup_rule *itr;
+	struct passwd *pwd;
+	struct group *grp;
+	int size = 0;
+	int i;
+
+	res = calloc(1, sizeof(struct cgroup_rule_members));
+	if (!res)
+		goto oom;
+	res->refcount = 1;
+	res->size = idx->size;
+	res->hash = calloc(idx->size, sizeof(struct cgroup_rule_member *));
+	if (!res->hash)
+		goto oom;
+
+	for (itr = idx->groups; itr; itr = itr->group_next) {
+		grp = getgrnam(&(itr->username[1]));
+		if (!grp)
+			continue;
+
+		for (i = 0; grp->gr_mem[i]; i++) {
+			pwd = getpwnam(grp->gr_mem[i]);
+			if (!pwd)
+				continue;
+
+			if (res->len == size) {
+				size = size ? size * 2 : 16;
+				tmp = realloc(res->members,
+					size * sizeof(struct cgroup_rule_member));
+				if (!tmp)
+					goto oom;
+				res->members = tmp;
+			}
+			res->members[res->len].uid = pwd->pw_uid;
+			res->members[res->len].rule = itr;
+			res->members[res->len].next = NULL;
+			res->len++;
+		}
+	}
+
+	/*
+	 * Hash the members only now, the array could have been moved by
+	 * realloc(). Members were added in the rule order and so the
+	 * buckets stay sorted by the rule ordinal.
+	 */
+	for (i = 0; i < res->len; i++) {
+		bucket = &res->hash[cg_hash_id(res->members[i].uid,
+				res->size)];
+		while (*bucket)
+			bucket = &(*bucket)->next;
+		*bucket = &res->members[i];
+	}
+
+	res->resolved = time(NULL);
+	cgroup_dbg("Resolved %d members of '@group' rules\n", res->len);
+
+	return res;
+
+oom:
+	cgroup_err("Error: out of memory? Error was: %s\n", strerror(errno));
+	last_errno = errno;
+	if (res) {
+		free(res->hash);
+		free(res->members);
+		free(res);
+	}
+	return NULL;
+}
+
+/**
+ * Resolve members of '@group' rules of a snapshot again and replace the old
+ * ones. Readers holding a reference to the old members still use them.
+ * The caller must hold rl_parse_lock.
+ *	@param list The snapshot of the cached rules, must have an index
+ *	@return 0 on success, > 0 on error
+ */
+static int cg_rule_list_refresh_groups(struct cgroup_rule_list *list)
+{
+	struct cgroup_rule_members *members, *old;
+
+	members = cg_rule_index_resolve_groups(list->index);
+	if (!members)
+		return ECGOTHER;
+
+	pthread_rwlock_wrlock(&rl_lock);
+	old = list->index->members;
+	list->index->members = members;
+	pthread_rwlock_unlock(&rl_lock);
+
+	cg_rule_members_put(old);
+
+	return 0;
+}
+
+/**
+ * Take a reference to members of '@group' rules of a snapshot.
+ *	@param list The snapshot of the cached rules, must have an index
+ *	@return The members, release them by cg_rule_members_put()
+ */
+static struct cgroup_rule_members *cg_rule_members_get(
+		struct cgroup_rule_list *list)
+{
+	struct cgroup_rule_members *members;
+
+	pthread_rwlock_rdlock(&rl_lock);
+	members = list->index->members;
+	__sync_fetch_and_add(&members->refcount, 1);
+	pthread_rwlock_unlock(&rl_lock);
+
+	return members;
+}
+
+/**
+ * Build the lookup index for a list of rules. The list must not be modified
+ * while the index exists. The caller must hold rl_parse_lock.
+ *	@param cg_rl The list of rules to index
+ *	@return 0 on success, > 0 on error
+ */
+static int cgroup_build_rule_index(struct cgroup_rule_list *cg_rl)
+{
+	struct cgroup_rule_index *idx;
+	struct cgroup_rule **last_group;
+	struct cgroup_rule *itr;
+	unsigned int size = 16;
+	int ordinal = 0;
+
+	cg_rl->len = 0;
+	for (itr = cg_rl->head; itr; itr = itr->next)
+		cg_rl->len++;
+
+	while (size < 2 * (unsigned int)cg_rl->len)
+		size <<= 1;
+
+	idx = calloc(1, sizeof(struct cgroup_rule_index));
+	if (!idx)
+		goto oom;
+	idx->size = size;
+	idx->uid_hash = calloc(size, sizeof(struct cgroup_rule *));
+	idx->gid_hash = calloc(size, sizeof(struct cgroup_rule *));
+	idx->proc_hash = calloc(size, sizeof(struct cgroup_rule *));
+	if (!idx->uid_hash || !idx->gid_hash || !idx->proc_hash)
+		goto oom;
+
+	last_group = &idx->groups;
+	for (itr = cg_rl->head; itr; itr = itr->next) {
+		itr->ordinal = ordinal++;
+		itr->hash_next = NULL;
+		itr->group_next = NULL;
+
+		/* Continuation rules are never matched directly. */
+		if (itr->username[0] == '%')
+			continue;
+
+		if ((itr->uid == CGRULE_WILD) && (itr->gid == CGRULE_WILD)) {
+			if (!idx->first_wild)
+				idx->first_wild = itr;
+			if (itr->procname)
+				cg_rule_index_append(&idx->proc_hash[
+					cg_hash_string(itr->procname, size)],
+					itr);
+			else if (!idx->wild)
+				idx->wild = itr;
+		} else if (itr->username[0] == '@') {
+			cg_rule_index_append(&idx->gid_hash[
+				cg_hash_id(itr->gid, size)], itr);
+			*last_group = itr;
+			last_group = &itr->group_next;
+		} else {
+			cg_rule_index_append(&idx->uid_hash[
+				cg_hash_id(itr->uid, size)], itr);
+		}
+	}
+
+	idx->members = cg_rule_index_resolve_groups(idx);
+	if (!idx->members) {
+		cgroup_free_rule_index(idx);
+		return ECGOTHER;
+	}
+
+	cg_rl->index = idx;
+	cgroup_dbg("Indexed %d rules in %u buckets\n", cg_rl->len, size);
+	return 0;
+
+oom:
+	cgroup_err("Error: out of memory? Error was: %s\n", strerror(errno));
+	last_errno = errno;
+	cgroup_free_rule_index(idx);
+	return ECGOTHER;
+}
+
+static char *cg_skip_unused_charactors_in_rule(char *rule)
+{
+	char *itr;
+
+	/* We ignore anything after a # sign as comments. */
+	itr = strchr(rule, '#');
+	if (itr)
+		*itr = '\0';
+
+	/* We also need to remove the newline character. */
+	itr = strchr(rule, '\n');
+	if (itr)
+		*itr = '\0';
+
+	/* Now, skip any leading tabs and spaces. */
+	itr = rule;
+	while (itr && isblank(*itr))
+		itr++;
+
+	/* If there's nothing left, we can ignore this line. */
+	if (!strlen(itr))
+		return NULL;
+
+	return itr;
+}
+
+/**
+ * Parse the configuration file that maps UID/GIDs to cgroups.  If ever the
+ * configuration file is modified, applications should call this function to
+ * load the new configuration rules.  The function caller is responsible for
+ * calling free() on each rule in the list.
+ *
+ * The cache parameter alters the behavior of this function.  If true, this
+ * function will read the entire configuration file and store the results in
+ * rl (global rules list).  If false, this function will only parse until it
+ * finds a rule matching the given UID or GID.  It will store this rule in trl,
+ * as well as any children rules (rules that begin with a %) that it has.
+ *
+ * This function is NOT thread safe!
+ *	@param filename configuration file to parse
+ *	@param cache True to cache rules, else false
+ *	@param muid If cache is false, the UID to match against
+ *	@param mgid If cache is false, the GID to match against
+ *	@return 0 on success, -1 if no cache and match found, > 0 on error.
+ * TODO: Make this function thread safe!
+ *
+ */
+static int cgroup_parse_rules_file(char *filename,
+		struct cgroup_rule_list *lst, bool cache, uid_t muid,
+		gid_t mgid, const char *mprocname)
+{
+	/* File descriptor for the configuration file */
+	FILE *fp = NULL;
+
+	/* Buffer to store the line we're working on */
+	char buff[CGROUP_RULE_MAXLINE] = { '\0' };
+
+	/* Iterator for the line we're working on */
+	char *itr = NULL;
+
+	/* Pointer to process name in a line of the configuration file */
+	char *procname = NULL;
 
 	/* Rule to add to the list */
 	struct cgroup_rule *newrule = NULL;
@@ -540,12 +1030,6 @@ static int cgroup_parse_rules_file(char *filename, bool cache, uid_t muid,
 	/* Loop variable. */
 	int i = 0;
 
-	/* Determine which list we're using. */
-	if (cache)
-		lst = &rl;
-	else
-		lst = &trl;
-
 	/* Open the configuration file. */
 	fp = fopen(filename, "re");
 	if (!fp) {
@@ -808,102 +1292,459 @@ finish:
 	return ret;
 }
 
-/**
- * Parse CGRULES_CONF_FILE and all files in CGRULES_CONF_FILE_DIR.
- * If CGRULES_CONF_FILE_DIR does not exists or can not be read,
- * parse only CGRULES_CONF_FILE. This way we keep the back compatibility.
- *
- * Original description of this function moved to cgroup_parse_rules_file.
- * Also cloned and all occurences of file changed to files.
- *
- * Parse the configuration files that maps UID/GIDs to cgroups.  If ever the
- * configuration files are modified, applications should call this function to
- * load the new configuration rules.  The function caller is responsible for
- * calling free() on each rule in the list.
- *
- * The cache parameter alters the behavior of this function.  If true, this
- * function will read the entire content of all configuration files and store
- * the results in rl (global rules list).  If false, this function will only
- * parse until it finds a file and a rule matching the given UID or GID.
- * The remaining files are skipped. It will store this rule in trl,
- * as well as any children rules (rules that begin with a %) that it has.
- *
- * Files can be read in an random order so the first match must not be
- * dependent on it. Thus construct the rules the way not to break
- * this assumption.
- *
- * This function is NOT thread safe!
- *	@param cache True to cache rules, else false
- *	@param muid If cache is false, the UID to match against
- *	@param mgid If cache is false, the GID to match against
- *	@return 0 on success, -1 if no cache and match found, > 0 on error.
- * TODO: Make this function thread safe!
+/*
+ * The compiled rules image: a header, the files the rules depend on, the
+ * rules in the list order and the strings. Strings are referenced by their
+ * offset in the image, 0 means no string.
  */
-static int cgroup_parse_rules(bool cache, uid_t muid,
-					  gid_t mgid, const char *mprocname)
-{
-	int ret;
-
-	/* Pointer to the list that we're using */
-	struct cgroup_rule_list *lst = NULL;
-
-	/* Directory variables */
-	DIR *d;
-	struct dirent *item;
-	const char *dirname = CGRULES_CONF_DIR;
-	char *tmp;
-	int sret;
+#define CG_RULES_IMAGE_MAGIC	0x43475249
+#define CG_RULES_IMAGE_VERSION	1
+
+struct cg_rules_image_header {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t size;
+	u_int32_t nsources;
+	u_int32_t nrules;
+};
 
-	/* Determine which list we're using. */
-	if (cache)
-		lst = &rl;
-	else
-		lst = &trl;
+struct cg_rules_image_source {
+	u_int64_t dev;
+	u_int64_t ino;
+	u_int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	u_int32_t path;
+	u_int32_t missing;
+};
 
-	/* If our list already exists, clean it. */
-	if (lst->head)
-		cgroup_free_rule_list(lst);
+struct cg_rules_image_rule {
+	u_int32_t uid;
+	u_int32_t gid;
+	u_int32_t username;
+	u_int32_t procname;
+	u_int32_t destination;
+	u_int32_t controllers[MAX_MNT_ELEMENTS];
+};
 
-	pthread_rwlock_wrlock(&rl_lock);
+/*
+ * The files always checked, the rules resolve user and group names. The ids
+ * are cached only when they are resolved from these files alone, see
+ * cg_nss_files_only().
+ */
+static const char * const cg_rules_image_db[] = {
+	"/etc/passwd",
+	"/etc/group",
+	CG_NSSWITCH_CONF,
+};
 
-	/* Parse CGRULES_CONF_FILE configuration file (back compatibility). */
-	ret = cgroup_parse_rules_file(CGRULES_CONF_FILE,
-		cache, muid, mgid, mprocname);
+/**
+ * Check that users and groups are looked up only in /etc/passwd and
+ * /etc/group. Ids resolved by other NSS services, like LDAP, can change
+ * without any of the image sources changing.
+ *	@return 1 if the passwd and group databases use only files
+ */
+int cg_nss_files_only(void)
+{
+	char line[FILENAME_MAX];
+	char *db, *service, *saveptr;
+	int ret = 1;
+	FILE *fp;
 
-	/*
-	 * if match (ret = -1), stop parsing other files, just return
-	 * or ret > 0 => error
-	 */
-	if (ret != 0) {
-		pthread_rwlock_unlock(&rl_lock);
-		return ret;
+	fp = fopen(CG_NSSWITCH_CONF, "re");
+	if (!fp)
+		return 0;
+	while (ret && fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "#\n")] = '\0';
+		db = strtok_r(line, ": \t", &saveptr);
+		if (!db || (strcmp(db, "passwd") && strcmp(db, "group")))
+			continue;
+		/* actions like [NOTFOUND=return] do not add a service */
+		while ((service = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+			if (strcmp(service, "files") && service[0] != '[') {
+				ret = 0;
+				break;
+			}
+		}
 	}
+	fclose(fp);
+	return ret;
+}
 
-	/* Continue parsing */
-	d = opendir(dirname);
-	if (!d) {
-		cgroup_warn("Warning: Failed to open directory %s: %s\n",
-				dirname, strerror(errno));
+/**
+ * Get a string from the rules image.
+ *	@return The string, NULL if off is 0 or not a valid string
+ */
+static const char *cg_rules_image_str(const char *img, size_t size,
+		u_int32_t off)
+{
+	if (!off || off >= size || !memchr(img + off, '\0', size - off))
+		return NULL;
+	return img + off;
+}
 
-		/*
-		 * Cannot read directory. However, CGRULES_CONF_FILE is
-		 * succesfully parsed. Thus return as a success
-		 * for back compatibility.
-		 */
-		pthread_rwlock_unlock(&rl_lock);
+/**
+ * Check that a file did not change since the image was written.
+ */
+static int cg_rules_image_source_valid(const char *img, size_t size,
+		const struct cg_rules_image_source *src)
+{
+	const char *path;
+	struct stat st;
 
+	path = cg_rules_image_str(img, size, src->path);
+	if (!path)
 		return 0;
-	}
 
-	/* read all files from CGRULES_CONF_FILE_DIR */
-	do {
-		item = readdir(d);
-		if (item && (item->d_type == DT_REG
-				|| item->d_type == DT_LNK)) {
+	if (stat(path, &st))
+		return src->missing && errno == ENOENT;
 
-			sret = asprintf(&tmp, "%s/%s", dirname, item->d_name);
-			if (sret < 0) {
-				cgroup_err("Out of memory\n");
+	return !src->missing && st.st_dev == src->dev &&
+		st.st_ino == src->ino && st.st_size == src->size &&
+		st.st_mtim.tv_sec == src->mtime_sec &&
+		st.st_mtim.tv_nsec == src->mtime_nsec &&
+		st.st_ctim.tv_sec == src->ctime_sec &&
+		st.st_ctim.tv_nsec == src->ctime_nsec;
+}
+
+/**
+ * Check that the rules image is complete and up to date.
+ *	@return 1 if the image can be used, 0 otherwise
+ */
+static int cg_rules_image_valid(const char *img, size_t size)
+{
+	const struct cg_rules_image_header *hdr = (const void *)img;
+	const struct cg_rules_image_source *sources;
+	const struct cg_rules_image_rule *rules;
+	u_int32_t i;
+	int j;
+
+	if (size < sizeof(*hdr) || hdr->magic != CG_RULES_IMAGE_MAGIC ||
+			hdr->version != CG_RULES_IMAGE_VERSION ||
+			hdr->size != size)
+		return 0;
+	if (hdr->nsources > size / sizeof(*sources) ||
+			hdr->nrules > size / sizeof(*rules) ||
+			sizeof(*hdr) + hdr->nsources * sizeof(*sources) +
+			hdr->nrules * sizeof(*rules) > size)
+		return 0;
+
+	sources = (const void *)(img + sizeof(*hdr));
+	rules = (const void *)(sources + hdr->nsources);
+
+	for (i = 0; i < hdr->nrules; i++) {
+		if (!cg_rules_image_str(img, size, rules[i].username) ||
+			!cg_rules_image_str(img, size, rules[i].destination) ||
+			!cg_rules_image_str(img, size, rules[i].controllers[0]))
+			return 0;
+		if (rules[i].procname &&
+			!cg_rules_image_str(img, size, rules[i].procname))
+			return 0;
+		for (j = 1; j < MAX_MNT_ELEMENTS; j++)
+			if (rules[i].controllers[j] && !cg_rules_image_str(img,
+					size, rules[i].controllers[j]))
+				return 0;
+	}
+
+	for (i = 0; i < hdr->nsources; i++) {
+		if (!cg_rules_image_source_valid(img, size, &sources[i])) {
+			cgroup_dbg("Rules image is out of date\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Append a rule from the rules image to a list of rules.
+ *	@return 0 on success, > 0 on error
+ */
+static int cg_rules_image_add_rule(struct cgroup_rule_list *lst,
+		const char *img, size_t size,
+		const struct cg_rules_image_rule *rec, uid_t uid, gid_t gid)
+{
+	struct cgroup_rule *newrule;
+	const char *str;
+	int i;
+
+	newrule = calloc(1, sizeof(struct cgroup_rule));
+	if (!newrule)
+		goto oom;
+
+	newrule->uid = uid;
+	newrule->gid = gid;
+	strncpy(newrule->username, cg_rules_image_str(img, size,
+		rec->username), sizeof(newrule->username) - 1);
+	strncpy(newrule->destination, cg_rules_image_str(img, size,
+		rec->destination), sizeof(newrule->destination) - 1);
+	if (rec->procname) {
+		newrule->procname = strdup(cg_rules_image_str(img, size,
+					rec->procname));
+		if (!newrule->procname)
+			goto oom;
+	}
+	for (i = 0; i < MAX_MNT_ELEMENTS; i++) {
+		str = cg_rules_image_str(img, size, rec->controllers[i]);
+		if (!str)
+			break;
+		newrule->controllers[i] = strdup(str);
+		if (!newrule->controllers[i])
+			goto oom;
+	}
+
+	if (lst->head == NULL)
+		lst->head = newrule;
+	else
+		lst->tail->next = newrule;
+	lst->tail = newrule;
+	return 0;
+
+oom:
+	cgroup_err("Error: out of memory? Error was: %s\n", strerror(errno));
+	last_errno = errno;
+	if (newrule)
+		cgroup_free_rule(newrule);
+	return ECGOTHER;
+}
+
+/**
+ * Find the rule matching the given UID, GID and process name in the rules
+ * image, like cgroup_parse_rules_file() does without caching. The rule and
+ * its children are stored in lst.
+ *	@param lst The list for the matching rule
+ *	@param used Set to false if the image is missing, out of date or
+ *	corrupted, the rules must be parsed then
+ *	@return 0 on success, -1 if a match was found, > 0 on error
+ */
+static int cg_rules_image_match(struct cgroup_rule_list *lst, uid_t muid,
+		gid_t mgid, const char *mprocname, bool *used)
+{
+	const struct cg_rules_image_header *hdr;
+	const struct cg_rules_image_rule *rec;
+	const char *user, *procname;
+	struct passwd *pwd;
+	struct group *grp;
+	uid_t uid = CGRULE_INVALID;
+	gid_t gid = CGRULE_INVALID;
+	bool matched = false;
+	bool group = false;
+	char *mproc_base;
+	struct stat st;
+	char *img;
+	u_int32_t n;
+	int ret = 0;
+	int fd, i;
+
+	*used = false;
+
+	fd = open(CGRULES_IMAGE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	/* Only trust an image nobody but root could have written. */
+	if (fstat(fd, &st) || st.st_uid != 0 || (st.st_mode & 022) ||
+			st.st_size < sizeof(*hdr) || st.st_size > UINT_MAX) {
+		close(fd);
+		return 0;
+	}
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img == MAP_FAILED)
+		return 0;
+
+	if (!cg_rules_image_valid(img, st.st_size))
+		goto unmap;
+	*used = true;
+	cgroup_dbg("Using rules image %s\n", CGRULES_IMAGE_FILE);
+
+	hdr = (const void *)img;
+	rec = (const void *)(img + sizeof(*hdr) +
+		hdr->nsources * sizeof(struct cg_rules_image_source));
+	for (n = 0; n < hdr->nrules; n++, rec++) {
+		user = cg_rules_image_str(img, st.st_size, rec->username);
+
+		/* The rule and all its children are in the list. */
+		if (matched && user[0] != '%')
+			break;
+
+		if (user[0] == '@') {
+			uid = CGRULE_INVALID;
+			gid = rec->gid;
+			group = true;
+		} else if (user[0] == '*') {
+			uid = CGRULE_WILD;
+			gid = CGRULE_WILD;
+			group = false;
+		} else if (user[0] != '%') {
+			uid = rec->uid;
+			gid = CGRULE_INVALID;
+			group = false;
+		}
+
+		if (group && !matched && muid != CGRULE_INVALID) {
+			grp = getgrgid(gid);
+			pwd = grp ? getpwuid(muid) : NULL;
+			for (i = 0; pwd && grp->gr_mem[i]; i++) {
+				if (!strcmp(pwd->pw_name, grp->gr_mem[i]))
+					matched = true;
+			}
+		}
+
+		if (uid == muid || gid == mgid || uid == CGRULE_WILD)
+			matched = true;
+		if (!matched)
+			continue;
+
+		if (rec->procname) {
+			procname = cg_rules_image_str(img, st.st_size,
+					rec->procname);
+			if (!mprocname) {
+				uid = CGRULE_INVALID;
+				gid = CGRULE_INVALID;
+				matched = false;
+				continue;
+			}
+			mproc_base = cgroup_basename(mprocname);
+			if (strcmp(mprocname, procname) &&
+				strcmp(mproc_base, procname)) {
+				uid = CGRULE_INVALID;
+				gid = CGRULE_INVALID;
+				matched = false;
+				free(mproc_base);
+				continue;
+			}
+			free(mproc_base);
+		}
+
+		ret = cg_rules_image_add_rule(lst, img, st.st_size, rec,
+				uid, gid);
+		if (ret)
+			goto unmap;
+	}
+	ret = matched ? -1 : 0;
+
+unmap:
+	munmap(img, st.st_size);
+	return ret;
+}
+
+/**
+ * Parse CGRULES_CONF_FILE and all files in CGRULES_CONF_FILE_DIR.
+ * If CGRULES_CONF_FILE_DIR does not exists or can not be read,
+ * parse only CGRULES_CONF_FILE. This way we keep the back compatibility.
+ *
+ * Original description of this function moved to cgroup_parse_rules_file.
+ * Also cloned and all occurences of file changed to files.
+ *
+ * Parse the configuration files that maps UID/GIDs to cgroups.  If ever the
+ * configuration files are modified, applications should call this function to
+ * load the new configuration rules.  The function caller is responsible for
+ * calling free() on each rule in the list.
+ *
+ * The cache parameter alters the behavior of this function.  If true, this
+ * function will read the entire content of all configuration files and store
+ * the results in rl (global rules list).  If false, this function will only
+ * parse until it finds a file and a rule matching the given UID or GID.
+ * The remaining files are skipped. It will store this rule in trl,
+ * as well as any children rules (rules that begin with a %) that it has.
+ *
+ * Files can be read in an random order so the first match must not be
+ * dependent on it. Thus construct the rules the way not to break
+ * this assumption.
+ *
+ * This function is NOT thread safe!
+ *	@param cache True to cache rules, else false
+ *	@param muid If cache is false, the UID to match against
+ *	@param mgid If cache is false, the GID to match against
+ *	@return 0 on success, -1 if no cache and match found, > 0 on error.
+ * TODO: Make this function thread safe!
+ */
+static int cgroup_parse_rules(bool cache, uid_t muid,
+					  gid_t mgid, const char *mprocname)
+{
+	int ret;
+	unsigned int i;
+	bool used;
+
+	/* Pointer to the list that we're using */
+	struct cgroup_rule_list *lst = NULL;
+
+	/* Directory variables */
+	DIR *d;
+	struct dirent *item;
+	const char *dirname = CGRULES_CONF_DIR;
+	char *tmp;
+	int sret;
+
+	/*
+	 * Cached rules are parsed into a new snapshot, readers keep using
+	 * the current one until the new one is published.
+	 */
+	if (cache) {
+		lst = calloc(1, sizeof(struct cgroup_rule_list));
+		if (!lst) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		lst->refcount = 1;
+		pthread_mutex_lock(&rl_parse_lock);
+		for (i = 0; i < sizeof(cg_rules_image_db) /
+				sizeof(cg_rules_image_db[0]); i++)
+			cg_rules_source_add(lst, cg_rules_image_db[i]);
+		cg_rules_source_add(lst, CGRULES_CONF_FILE);
+		cg_rules_source_add(lst, dirname);
+	} else {
+		pthread_mutex_lock(&rl_parse_lock);
+		lst = &trl;
+
+		/* If our list already exists, clean it. */
+		if (lst->head)
+			cgroup_free_rule_list(lst);
+
+		/* The compiled rules spare parsing, if they are current. */
+		ret = cg_rules_image_match(lst, muid, mgid, mprocname, &used);
+		if (used)
+			goto finish;
+		if (lst->head)
+			cgroup_free_rule_list(lst);
+	}
+
+	/* Parse CGRULES_CONF_FILE configuration file (back compatibility). */
+	ret = cgroup_parse_rules_file(CGRULES_CONF_FILE, lst,
+		cache, muid, mgid, mprocname);
+
+	/*
+	 * if match (ret = -1), stop parsing other files, just return
+	 * or ret > 0 => error
+	 */
+	if (ret != 0)
+		goto finish;
+
+	/* Continue parsing */
+	d = opendir(dirname);
+	if (!d) {
+		cgroup_warn("Warning: Failed to open directory %s: %s\n",
+				dirname, strerror(errno));
+
+		/*
+		 * Cannot read directory. However, CGRULES_CONF_FILE is
+		 * succesfully parsed. Thus return as a success
+		 * for back compatibility.
+		 */
+		ret = 0;
+		goto finish;
+	}
+
+	/* read all files from CGRULES_CONF_FILE_DIR */
+	do {
+		item = readdir(d);
+		if (item && (item->d_type == DT_REG
+				|| item->d_type == DT_LNK)) {
+
+			sret = asprintf(&tmp, "%s/%s", dirname, item->d_name);
+			if (sret < 0) {
+				cgroup_err("Out of memory\n");
 
 				/*
 				 * Cannot read directory. However, CGRULES_CONF_FILE is
@@ -915,7 +1756,9 @@ static int cgroup_parse_rules(bool cache, uid_t muid,
 			}
 
 			cgroup_dbg("Parsing cgrules file: %s\n", tmp);
-			ret = cgroup_parse_rules_file(tmp,
+			if (cache)
+				cg_rules_source_add(lst, tmp);
+			ret = cgroup_parse_rules_file(tmp, lst,
 				cache, muid, mgid, mprocname);
 
 			free(tmp);
@@ -939,7 +1782,21 @@ static int cgroup_parse_rules(bool cache, uid_t muid,
 unlock_list:
 	closedir(d);
 
-	pthread_rwlock_unlock(&rl_lock);
+finish:
+	if (!cache) {
+		pthread_mutex_unlock(&rl_parse_lock);
+		return ret;
+	}
+
+	if (ret == 0)
+		ret = cgroup_build_rule_index(lst);
+	pthread_mutex_unlock(&rl_parse_lock);
+
+	/* On error, the previous snapshot stays in use. */
+	if (ret == 0)
+		cg_rule_list_publish(lst);
+	else
+		cg_rule_list_put(lst);
 
 	return ret;
 }
@@ -969,6 +1826,545 @@ int cg_add_duplicate_mount(struct cg_mount_table_s *item, const char *path)
 	return 0;
 }
 
+static void cg_tasks_file_put(struct cg_tasks_file *file)
+{
+	if (__sync_sub_and_fetch(&file->refcount, 1))
+		return;
+	close(file->fd);
+	free(file);
+}
+
+/*
+ * Call with cg_tasks_fds_lock taken. The file is closed once the threads
+ * writing to it are done.
+ */
+static void cg_tasks_fd_close_locked(struct cg_tasks_fd *entry)
+{
+	cg_tasks_file_put(entry->file);
+	free(entry->path);
+	entry->path = NULL;
+	entry->file = NULL;
+}
+
+/**
+ * Close all cached tasks files under a directory.
+ * @param dir: Path to the directory, NULL to close all the cached files
+ */
+static void cg_tasks_fd_invalidate(const char *dir)
+{
+	unsigned int i;
+	size_t len = dir ? strlen(dir) : 0;
+
+	pthread_mutex_lock(&cg_tasks_fds_lock);
+	for (i = 0; i < cg_tasks_fds_size; i++) {
+		if (cg_tasks_fds[i].path &&
+				!strncmp(cg_tasks_fds[i].path, dir ? dir : "",
+					len))
+			cg_tasks_fd_close_locked(&cg_tasks_fds[i]);
+	}
+	pthread_mutex_unlock(&cg_tasks_fds_lock);
+}
+
+/*
+ * Tell whether a cached root descriptor still refers to the root it was
+ * opened for. The application may have closed it, e.g. a daemon closing
+ * all its files, and got the same number for another file.
+ */
+static int cg_mount_dirfd_valid(const struct cg_mount_dirfd *dirfd)
+{
+	struct stat st;
+
+	return !fstat(dirfd->fd, &st) && st.st_dev == dirfd->dev &&
+		st.st_ino == dirfd->ino;
+}
+
+/*
+ * Open directory descriptors of all hierarchies in cg_mount_table, reusing
+ * the ones of mount points which did not change.
+ * Call with cg_mount_table_lock taken for writing.
+ */
+static void cg_mount_dirfds_update_locked(void)
+{
+	struct cg_mount_dirfd old[CG_CONTROLLER_MAX];
+	int old_count = cg_mount_dirfds_count;
+	const char *path;
+	struct stat st;
+	char *dup;
+	int i, j, fd;
+
+	memcpy(old, cg_mount_dirfds, sizeof(old));
+	cg_mount_dirfds_count = 0;
+
+	for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0';
+			i++) {
+		path = cg_mount_table[i].mount.path;
+
+		/* co-mounted controllers share the descriptor */
+		for (j = 0; j < cg_mount_dirfds_count; j++)
+			if (!strcmp(cg_mount_dirfds[j].path, path))
+				break;
+		if (j < cg_mount_dirfds_count)
+			continue;
+
+		for (j = 0; j < old_count; j++)
+			if (old[j].path && !strcmp(old[j].path, path))
+				break;
+		if (j < old_count && cg_mount_dirfd_valid(&old[j])) {
+			cg_mount_dirfds[cg_mount_dirfds_count++] = old[j];
+			old[j].path = NULL;
+			continue;
+		}
+
+		fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			cgroup_dbg("cannot open %s: %s\n", path,
+					strerror(errno));
+			continue;
+		}
+		dup = fstat(fd, &st) ? NULL : strdup(path);
+		if (!dup) {
+			close(fd);
+			continue;
+		}
+		cg_mount_dirfds[cg_mount_dirfds_count].fd = fd;
+		cg_mount_dirfds[cg_mount_dirfds_count].path = dup;
+		cg_mount_dirfds[cg_mount_dirfds_count].dev = st.st_dev;
+		cg_mount_dirfds[cg_mount_dirfds_count].ino = st.st_ino;
+		cg_mount_dirfds_count++;
+	}
+
+	for (j = 0; j < old_count; j++) {
+		if (!old[j].path)
+			continue;
+		close(old[j].fd);
+		free(old[j].path);
+	}
+}
+
+/*
+ * Unmount a hierarchy. The cached descriptors of its root and of its tasks
+ * files keep it busy, so they are closed first.
+ */
+int cg_umount(const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	pthread_rwlock_wrlock(&cg_mount_table_lock);
+	for (i = 0; i < cg_mount_dirfds_count; i++) {
+		if (strncmp(cg_mount_dirfds[i].path, path, len) ||
+				cg_mount_dirfds[i].path[len] != '\0')
+			continue;
+		close(cg_mount_dirfds[i].fd);
+		free(cg_mount_dirfds[i].path);
+		cg_mount_dirfds[i] = cg_mount_dirfds[--cg_mount_dirfds_count];
+		break;
+	}
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	cg_tasks_fd_invalidate(path);
+	return umount(path);
+}
+
+/*
+ * Split a path inside a mounted hierarchy into the directory descriptor of
+ * the hierarchy root and the path relative to it. Other paths are returned
+ * unchanged together with AT_FDCWD, and so are the paths of hierarchies
+ * whose descriptor does not refer to their root anymore. The descriptor
+ * stays valid until cg_path_at_end(), cg_mount_table_lock is held for
+ * reading meanwhile.
+ */
+static int cg_path_at(const char *path, const char **relpath)
+{
+	int fd = AT_FDCWD;
+	size_t len;
+	int i;
+
+	*relpath = path;
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; i < cg_mount_dirfds_count; i++) {
+		len = strlen(cg_mount_dirfds[i].path);
+		if (strncmp(path, cg_mount_dirfds[i].path, len) ||
+				(path[len] != '/' && path[len] != '\0'))
+			continue;
+		if (!cg_mount_dirfd_valid(&cg_mount_dirfds[i])) {
+			cgroup_dbg("descriptor of %s was reused\n",
+					cg_mount_dirfds[i].path);
+			break;
+		}
+
+		path += len;
+		while (*path == '/')
+			path++;
+		*relpath = *path ? path : ".";
+		fd = cg_mount_dirfds[i].fd;
+		break;
+	}
+
+	return fd;
+}
+
+static void cg_path_at_end(void)
+{
+	int saved_errno = errno;
+
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+	errno = saved_errno;
+}
+
+/*
+ * open(), mkdir() and rmdir() of paths inside the hierarchies, resolved
+ * relative to the hierarchy roots. If the root descriptor was closed or
+ * reused under our feet between the check in cg_path_at() and the call,
+ * the absolute path is used.
+ */
+#define CG_DIRFD_LOST(dirfd, ret) \
+	((ret) < 0 && (errno == EBADF || errno == ENOTDIR) && \
+	 (dirfd) != AT_FDCWD)
+
+static int cg_open(const char *path, int flags)
+{
+	const char *relpath;
+	int dirfd, fd;
+
+	dirfd = cg_path_at(path, &relpath);
+	fd = openat(dirfd, relpath, flags);
+	cg_path_at_end();
+	if (CG_DIRFD_LOST(dirfd, fd))
+		fd = open(path, flags);
+	return fd;
+}
+
+static int cg_mkdir(const char *path, mode_t mode)
+{
+	const char *relpath;
+	int dirfd, ret;
+
+	dirfd = cg_path_at(path, &relpath);
+	ret = mkdirat(dirfd, relpath, mode);
+	cg_path_at_end();
+	if (CG_DIRFD_LOST(dirfd, ret))
+		ret = mkdir(path, mode);
+	return ret;
+}
+
+static int cg_rmdir(const char *path)
+{
+	const char *relpath;
+	int dirfd, ret;
+
+	dirfd = cg_path_at(path, &relpath);
+	ret = unlinkat(dirfd, relpath, AT_REMOVEDIR);
+	cg_path_at_end();
+	if (CG_DIRFD_LOST(dirfd, ret))
+		ret = rmdir(path);
+	return ret;
+}
+
+static int cg_stat(const char *path, struct stat *st)
+{
+	const char *relpath;
+	int dirfd, ret;
+
+	dirfd = cg_path_at(path, &relpath);
+	ret = fstatat(dirfd, relpath, st, 0);
+	cg_path_at_end();
+	if (CG_DIRFD_LOST(dirfd, ret))
+		ret = stat(path, st);
+	return ret;
+}
+
+static FILE *cg_fopen(const char *path)
+{
+	FILE *fp;
+	int fd;
+
+	fd = cg_open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	fp = fdopen(fd, "re");
+	if (!fp)
+		close(fd);
+	return fp;
+}
+
+static DIR *cg_opendir(const char *path)
+{
+	DIR *dir;
+	int fd;
+
+	fd = cg_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	dir = fdopendir(fd);
+	if (!dir)
+		close(fd);
+	return dir;
+}
+
+/*
+ * Check whether the mount table changed since the last call, or whether this
+ * is the first call. Call with watch->lock taken.
+ */
+static int cg_mounts_changed_locked(struct cg_mounts_watch *watch)
+{
+	struct pollfd pfd;
+	pid_t pid = getpid();
+
+	if (watch->fd >= 0 && watch->pid != pid) {
+		close(watch->fd);
+		watch->fd = -1;
+	}
+
+	if (watch->fd < 0) {
+		watch->fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		watch->pid = pid;
+		return 1;
+	}
+
+	pfd.fd = watch->fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 0)
+		return 0;
+
+	/* somebody closed our descriptor, reopen it next time */
+	if (pfd.revents & POLLNVAL)
+		watch->fd = -1;
+	return (pfd.revents & (POLLERR | POLLPRI | POLLNVAL)) != 0;
+}
+
+/*
+ * Read whole file at once. Returns malloc'ed NUL terminated content or NULL
+ * with last_errno set.
+ */
+static char *cg_read_file(int fd)
+{
+	size_t size = 16384, len = 0;
+	char *buf, *tmp;
+	ssize_t ret;
+
+	buf = malloc(size);
+	if (!buf)
+		goto err;
+
+	for (;;) {
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+		if (len + 1 < size)
+			continue;
+
+		size *= 2;
+		tmp = realloc(buf, size);
+		if (!tmp)
+			goto err;
+		buf = tmp;
+	}
+	buf[len] = '\0';
+	return buf;
+err:
+	last_errno = errno;
+	free(buf);
+	return NULL;
+}
+
+static char *cg_read_proc_file_alloc(const char *path)
+{
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		cgroup_err("Error: cannot open %s: %s\n", path,
+				strerror(errno));
+		last_errno = errno;
+		return NULL;
+	}
+	buf = cg_read_file(fd);
+	close(fd);
+	return buf;
+}
+
+/*
+ * Find mount option opt in comma separated list opts, like hasmntopt().
+ * Returns pointer to the option in opts or NULL.
+ */
+static const char *cg_find_mntopt(const char *opts, const char *opt)
+{
+	size_t len = strlen(opt);
+	const char *p = opts;
+
+	while (*p) {
+		if (!strncmp(p, opt, len) &&
+				(p[len] == '\0' || p[len] == ',' ||
+				 p[len] == '='))
+			return p;
+		p = strchr(p, ',');
+		if (!p)
+			break;
+		p++;
+	}
+	return NULL;
+}
+
+/* Decode the octal escapes of a mountinfo field in place. */
+static void cg_unescape_mount_path(char *path)
+{
+	char *in = path, *out = path;
+
+	while (*in) {
+		if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+				in[2] >= '0' && in[2] <= '7' &&
+				in[3] >= '0' && in[3] <= '7') {
+			*out++ = ((in[1] - '0') << 6) | ((in[2] - '0') << 3) |
+				(in[3] - '0');
+			in += 4;
+		} else {
+			*out++ = *in++;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Add hierarchy name mounted at path to cg_mount_table, or add the path to
+ * the mount points of an already known hierarchy.
+ * Call with cg_mount_table_lock taken for writing.
+ */
+static int cg_mount_table_add_locked(const char *name, size_t name_len,
+		const char *path, const char *opts, int unified, int *found_mnt)
+{
+	int j;
+
+	if (name_len >= FILENAME_MAX)
+		name_len = FILENAME_MAX - 1;
+
+	/* do not have duplicates in mount table */
+	for (j = 0; j < *found_mnt; j++) {
+		if (strncmp(name, cg_mount_table[j].name, name_len) == 0 &&
+				cg_mount_table[j].name[name_len] == '\0') {
+			cgroup_dbg("controller %.*s is already mounted on %s\n",
+					(int)name_len, name,
+					cg_mount_table[j].mount.path);
+			return cg_add_duplicate_mount(&cg_mount_table[j], path);
+		}
+	}
+
+	if (*found_mnt >= CG_CONTROLLER_MAX - 2)
+		return 0;
+
+	memcpy(cg_mount_table[*found_mnt].name, name, name_len);
+	cg_mount_table[*found_mnt].name[name_len] = '\0';
+	strncpy(cg_mount_table[*found_mnt].mount.path, path, FILENAME_MAX);
+	cg_mount_table[*found_mnt].mount.path[FILENAME_MAX-1] = '\0';
+	cg_mount_table[*found_mnt].mount.next = NULL;
+	cg_mount_table[*found_mnt].unified = unified;
+	cgroup_dbg("Found cgroup option %s, count %d\n", opts, *found_mnt);
+	(*found_mnt)++;
+	return 0;
+}
+
+/*
+ * Add all hierarchies of one cgroup mount to cg_mount_table.
+ * controllers is the NULL terminated list of controllers from /proc/cgroups.
+ * Call with cg_mount_table_lock taken for writing.
+ */
+static int cg_mount_table_add_mount_locked(char **controllers,
+		const char *path, const char *opts, int *found_mnt)
+{
+	const char *mntopt;
+	size_t len;
+	int ret;
+	int i;
+
+	for (i = 0; controllers[i] != NULL; i++) {
+		if (!cg_find_mntopt(opts, controllers[i]))
+			continue;
+
+		cgroup_dbg("found %s in %s\n", controllers[i], opts);
+		ret = cg_mount_table_add_locked(controllers[i],
+				strlen(controllers[i]), path, opts, 0,
+				found_mnt);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * Doesn't match the controller.
+	 * Check if it is a named hierarchy.
+	 */
+	mntopt = cg_find_mntopt(opts, "name");
+	if (!mntopt)
+		return 0;
+	len = strcspn(mntopt, ",");
+
+#ifdef OPAQUE_HIERARCHY
+	/*
+	 * Ignore the opaque hierarchy.
+	 */
+	if (strlen(OPAQUE_HIERARCHY) == len &&
+			!strncmp(mntopt, OPAQUE_HIERARCHY, len))
+		return 0;
+#endif
+
+	return cg_mount_table_add_locked(mntopt, len, path, opts, 0, found_mnt);
+}
+
+/*
+ * Add the controllers of the cgroup v2 unified hierarchy mounted at path to
+ * cg_mount_table, as listed in its cgroup.controllers. All of them share
+ * the mount, so everything is done once for all of them, like for
+ * co-mounted v1 controllers. Controllers used by v1 hierarchies are not
+ * listed there, so on hybrid systems only the controllers really in the
+ * unified hierarchy are added.
+ * Call with cg_mount_table_lock taken for writing.
+ */
+static int cg_mount_table_add_unified_locked(const char *path,
+		int *found_mnt)
+{
+	char file[FILENAME_MAX];
+	char *controllers, *name, *next;
+	size_t len;
+	int ret = 0;
+	int fd;
+
+	snprintf(file, sizeof(file), "%s/cgroup.controllers", path);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		cgroup_warn("Warning: cannot open %s: %s\n", file,
+				strerror(errno));
+		return 0;
+	}
+	controllers = cg_read_file(fd);
+	close(fd);
+	if (!controllers)
+		return ECGOTHER;
+
+	for (name = controllers; *name; name = next) {
+		len = strcspn(name, " \n");
+		next = name + len + (name[len] != '\0');
+		if (!len)
+			continue;
+		ret = cg_mount_table_add_locked(name, len, path, "cgroup2", 1,
+				found_mnt);
+		if (ret)
+			break;
+	}
+	free(controllers);
+	return ret;
+}
+
 /**
  * cgroup_init(), initializes the MOUNT_POINT.
  *
@@ -976,29 +2372,34 @@ int cg_add_duplicate_mount(struct cg_mount_table_s *item, const char *path)
  * so it can blow up. If does for you, please let us know with your
  * test case and we can really make it thread safe.
  *
+ * The mount table is read from /proc/self/mountinfo in a single read. The
+ * file is kept open and when no mount changed since the last successful
+ * call, cgroup_init() returns immediately.
  */
 int cgroup_init(void)
 {
-	FILE *proc_mount = NULL;
-	struct mntent *ent = NULL;
-	struct mntent *temp_ent = NULL;
+	char *controllers[CG_CONTROLLER_MAX];
+	char *proc_cgroups = NULL;
+	char *mountinfo = NULL;
+	char *line, *next, *field[6], *fstype, *superopts;
 	int found_mnt = 0;
+	int changed;
 	int ret = 0;
-	static char *controllers[CG_CONTROLLER_MAX];
-	FILE *proc_cgroup = NULL;
-	char subsys_name[FILENAME_MAX];
-	int hierarchy, num_cgroups, enabled;
-	int i = 0;
-	int j;
-	int duplicate = 0;
-	char *mntopt = NULL;
-	int err;
-	char *buf = NULL;
-	char mntent_buffer[4 * FILENAME_MAX];
-	char *strtok_buffer = NULL;
+	int i, j;
 
 	cgroup_set_default_logger(-1);
 
+	pthread_mutex_lock(&cg_mount_table_watch.lock);
+	changed = cg_mounts_changed_locked(&cg_mount_table_watch);
+	if (!changed && cg_mount_table_valid && cg_mount_table_watch.fd >= 0) {
+		pthread_mutex_unlock(&cg_mount_table_watch.lock);
+		return 0;
+	}
+	cg_mount_table_valid = 0;
+
+	/* The mount points may change, do not keep the old tasks files. */
+	cg_tasks_fd_invalidate(NULL);
+
 	pthread_rwlock_wrlock(&cg_mount_table_lock);
 
 	/* free global variables filled by previous cgroup_init() */
@@ -1012,171 +2413,84 @@ int cgroup_init(void)
 	}
 	memset(&cg_mount_table, 0, sizeof(cg_mount_table));
 
-	proc_cgroup = fopen("/proc/cgroups", "re");
-
-	if (!proc_cgroup) {
-		cgroup_err("Error: cannot open /proc/cgroups: %s\n",
-				strerror(errno));
-		last_errno = errno;
-		ret = ECGOTHER;
-		goto unlock_exit;
-	}
-
 	/*
-	 * The first line of the file has stuff we are not interested in.
-	 * So just read it and discard the information.
-	 *
-	 * XX: fix the size for fgets
+	 * The first line of /proc/cgroups has stuff we are not interested in,
+	 * the others start with controller names.
 	 */
-	buf = malloc(FILENAME_MAX);
-	if (!buf) {
-		last_errno = errno;
-		ret = ECGOTHER;
-		goto unlock_exit;
-	}
-	if (!fgets(buf, FILENAME_MAX, proc_cgroup)) {
-		free(buf);
-		cgroup_err("Error: cannot read /proc/cgroups: %s\n",
-				strerror(errno));
-		last_errno = errno;
+	proc_cgroups = cg_read_proc_file_alloc("/proc/cgroups");
+	if (!proc_cgroups) {
 		ret = ECGOTHER;
 		goto unlock_exit;
 	}
-	free(buf);
-
 	i = 0;
-	while (!feof(proc_cgroup)) {
-		err = fscanf(proc_cgroup, "%s %d %d %d", subsys_name,
-				&hierarchy, &num_cgroups, &enabled);
-		if (err < 0)
-			break;
-		controllers[i] = strdup(subsys_name);
-		i++;
+	line = strchr(proc_cgroups, '\n');
+	while (line && i < CG_CONTROLLER_MAX - 1) {
+		line++;
+		next = strchr(line, '\n');
+		line[strcspn(line, " \t\n")] = '\0';
+		if (*line)
+			controllers[i++] = line;
+		line = next;
 	}
 	controllers[i] = NULL;
 
-	proc_mount = fopen("/proc/mounts", "re");
-	if (proc_mount == NULL) {
-		cgroup_err("Error: cannot open /proc/mounts: %s\n",
-				strerror(errno));
-		last_errno = errno;
-		ret = ECGOTHER;
-		goto unlock_exit;
+	if (cg_mount_table_watch.fd >= 0 &&
+			lseek(cg_mount_table_watch.fd, 0, SEEK_SET) == 0) {
+		mountinfo = cg_read_file(cg_mount_table_watch.fd);
+	} else {
+		mountinfo = cg_read_proc_file_alloc("/proc/self/mountinfo");
 	}
-
-	temp_ent = (struct mntent *) malloc(sizeof(struct mntent));
-
-	if (!temp_ent) {
-		last_errno = errno;
+	if (!mountinfo) {
+		cgroup_err("Error: cannot read /proc/self/mountinfo: %s\n",
+				strerror(last_errno));
 		ret = ECGOTHER;
 		goto unlock_exit;
 	}
 
-	while ((ent = getmntent_r(proc_mount, temp_ent,
-					mntent_buffer,
-					sizeof(mntent_buffer))) != NULL) {
-		if (strcmp(ent->mnt_type, "cgroup"))
+	/*
+	 * mountinfo line: id parent major:minor root mount_point options
+	 * [optional fields] - fstype source super_options
+	 */
+	for (line = mountinfo; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		for (j = 0; j < 6; j++) {
+			field[j] = strsep(&line, " ");
+			if (!field[j])
+				break;
+		}
+		if (j < 6 || !line)
 			continue;
 
-		for (i = 0; controllers[i] != NULL; i++) {
-			mntopt = hasmntopt(ent, controllers[i]);
-
-			if (!mntopt)
-				continue;
-
-			cgroup_dbg("found %s in %s\n", controllers[i], ent->mnt_opts);
-
-			/* do not have duplicates in mount table */
-			duplicate = 0;
-			for  (j = 0; j < found_mnt; j++) {
-				if (strncmp(controllers[i],
-							cg_mount_table[j].name,
-							FILENAME_MAX) == 0) {
-					duplicate = 1;
-					break;
-				}
-			}
-			if (duplicate) {
-				cgroup_dbg("controller %s is already mounted on %s\n",
-					mntopt, cg_mount_table[j].mount.path);
-				ret = cg_add_duplicate_mount(&cg_mount_table[j],
-						ent->mnt_dir);
-				if (ret)
-					goto unlock_exit;
-				/* continue with next controller */
-				continue;
-			}
-
-			strncpy(cg_mount_table[found_mnt].name,
-				controllers[i], FILENAME_MAX);
-			cg_mount_table[found_mnt].name[FILENAME_MAX-1] = '\0';
-			strncpy(cg_mount_table[found_mnt].mount.path,
-				ent->mnt_dir, FILENAME_MAX);
-			cg_mount_table[found_mnt].mount.path[FILENAME_MAX-1] =
-				'\0';
-			cg_mount_table[found_mnt].mount.next = NULL;
-			cgroup_dbg("Found cgroup option %s, count %d\n",
-				ent->mnt_opts, found_mnt);
-			found_mnt++;
+		while ((fstype = strsep(&line, " ")) && strcmp(fstype, "-"))
+			;
+		fstype = strsep(&line, " ");
+		if (!fstype)
+			continue;
+		if (!strcmp(fstype, "cgroup2")) {
+			cg_unescape_mount_path(field[4]);
+			ret = cg_mount_table_add_unified_locked(field[4],
+					&found_mnt);
+			if (ret)
+				goto unlock_exit;
+			continue;
 		}
+		if (strcmp(fstype, "cgroup"))
+			continue;
+		/* source */
+		if (!strsep(&line, " ") || !line)
+			continue;
+		superopts = strsep(&line, " ");
 
-		/*
-		 * Doesn't match the controller.
-		 * Check if it is a named hierarchy.
-		 */
-		mntopt = hasmntopt(ent, "name");
-
-		if (mntopt) {
-			mntopt = strtok_r(mntopt, ",", &strtok_buffer);
-			if (!mntopt)
-				continue;
-			/*
-			 * Check if it is a duplicate
-			 */
-			duplicate = 0;
-
-#ifdef OPAQUE_HIERARCHY
-			/*
-			 * Ignore the opaque hierarchy.
-			 */
-			if (strcmp(mntopt, OPAQUE_HIERARCHY) == 0)
-					continue;
-#endif
-
-			for (j = 0; j < found_mnt; j++) {
-				if (strncmp(mntopt, cg_mount_table[j].name,
-							FILENAME_MAX) == 0) {
-					duplicate = 1;
-					break;
-				}
-			}
-
-			if (duplicate) {
-				cgroup_dbg("controller %s is already mounted on %s\n",
-					mntopt, cg_mount_table[j].mount.path);
-				ret = cg_add_duplicate_mount(&cg_mount_table[j],
-						ent->mnt_dir);
-				if (ret)
-					goto unlock_exit;
-				continue;
-			}
-
-			strncpy(cg_mount_table[found_mnt].name,
-				mntopt, FILENAME_MAX);
-			cg_mount_table[found_mnt].name[FILENAME_MAX-1] = '\0';
-			strncpy(cg_mount_table[found_mnt].mount.path,
-				ent->mnt_dir, FILENAME_MAX);
-			cg_mount_table[found_mnt].mount.path[FILENAME_MAX-1] =
-				'\0';
-			cg_mount_table[found_mnt].mount.next = NULL;
-			cgroup_dbg("Found cgroup option %s, count %d\n",
-				ent->mnt_opts, found_mnt);
-			found_mnt++;
-		}
+		cg_unescape_mount_path(field[4]);
+		ret = cg_mount_table_add_mount_locked(controllers, field[4],
+				superopts, &found_mnt);
+		if (ret)
+			goto unlock_exit;
 	}
 
-	free(temp_ent);
-
 	if (!found_mnt) {
 		cg_mount_table[0].name[0] = '\0';
 		ret = ECGROUPNOTMOUNTED;
@@ -1187,25 +2501,21 @@ int cgroup_init(void)
 	cg_mount_table[found_mnt].name[0] = '\0';
 
 	cgroup_initialized = 1;
+	cg_mount_table_valid = 1;
 
 unlock_exit:
-	if (proc_cgroup)
-		fclose(proc_cgroup);
-
-	if (proc_mount)
-		fclose(proc_mount);
+	cg_mount_dirfds_update_locked();
 
-	for (i = 0; controllers[i]; i++) {
-		free(controllers[i]);
-		controllers[i] = NULL;
-	}
+	free(mountinfo);
+	free(proc_cgroups);
 
 	pthread_rwlock_unlock(&cg_mount_table_lock);
+	pthread_mutex_unlock(&cg_mount_table_watch.lock);
 
 	return ret;
 }
 
-static int cg_test_mounted_fs(void)
+static int cg_scan_mounted_fs(void)
 {
 	FILE *proc_mount = NULL;
 	struct mntent *ent = NULL;
@@ -1232,7 +2542,8 @@ static int cg_test_mounted_fs(void)
 		goto done;
 	}
 
-	while (strcmp(ent->mnt_type, "cgroup") != 0) {
+	while (strcmp(ent->mnt_type, "cgroup") != 0 &&
+			strcmp(ent->mnt_type, "cgroup2") != 0) {
 		ent = getmntent_r(proc_mount, temp_ent, mntent_buff,
 						sizeof(mntent_buff));
 		if (ent == NULL) {
@@ -1246,6 +2557,26 @@ done:
 	return ret;
 }
 
+/*
+ * Check that some cgroup hierarchy is mounted. The answer is cached until
+ * the mount table changes.
+ */
+static int cg_test_mounted_fs(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&cg_mounted_fs_watch.lock);
+	if (cg_mounts_changed_locked(&cg_mounted_fs_watch) ||
+			cg_mounted_fs_watch.fd < 0)
+		cg_mounted_fs = -1;
+
+	if (cg_mounted_fs < 0)
+		cg_mounted_fs = cg_scan_mounted_fs();
+	ret = cg_mounted_fs;
+	pthread_mutex_unlock(&cg_mounted_fs_watch.lock);
+	return ret;
+}
+
 static inline pid_t cg_gettid(void)
 {
 	return syscall(__NR_gettid);
@@ -1309,13 +2640,212 @@ char *cg_build_path(const char *name, char *path, const char *type)
 	return path;
 }
 
+int cgroup_set_tasks_fd_cache_size(unsigned int size)
+{
+	struct cg_tasks_fd *fds = NULL;
+	unsigned int i;
+
+	if (size) {
+		fds = calloc(size, sizeof(struct cg_tasks_fd));
+		if (!fds) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+	}
+
+	pthread_mutex_lock(&cg_tasks_fds_lock);
+	for (i = 0; i < cg_tasks_fds_size; i++) {
+		if (cg_tasks_fds[i].path)
+			cg_tasks_fd_close_locked(&cg_tasks_fds[i]);
+	}
+	free(cg_tasks_fds);
+	cg_tasks_fds = fds;
+	cg_tasks_fds_size = size;
+	pthread_mutex_unlock(&cg_tasks_fds_lock);
+
+	return 0;
+}
+
+/**
+ * Find an open tasks file in the cache, or open it and add it to the cache,
+ * replacing the least recently used entry.
+ * Call with cg_tasks_fds_lock taken and the cache enabled.
+ * @param path: Full path to the tasks file
+ * @return The cache entry or NULL if the file cannot be opened, errno is set
+ */
+static struct cg_tasks_fd *cg_tasks_fd_get_locked(const char *path)
+{
+	struct cg_tasks_fd *entry = &cg_tasks_fds[0];
+	struct cg_tasks_file *file;
+	unsigned int i;
+	char *dup;
+	int fd;
+
+	for (i = 0; i < cg_tasks_fds_size; i++) {
+		if (cg_tasks_fds[i].path &&
+				!strcmp(cg_tasks_fds[i].path, path)) {
+			cg_tasks_fds[i].stamp = ++cg_tasks_fds_stamp;
+			return &cg_tasks_fds[i];
+		}
+		if (!cg_tasks_fds[i].path ||
+				(entry->path &&
+				 cg_tasks_fds[i].stamp < entry->stamp))
+			entry = &cg_tasks_fds[i];
+	}
+
+	fd = cg_open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	dup = strdup(path);
+	file = malloc(sizeof(*file));
+	if (!dup || !file) {
+		free(dup);
+		free(file);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->fd = fd;
+	file->refcount = 1;
+
+	if (entry->path)
+		cg_tasks_fd_close_locked(entry);
+	entry->path = dup;
+	entry->file = file;
+	entry->stamp = ++cg_tasks_fds_stamp;
+	return entry;
+}
+
+/**
+ * Write a tid to a tasks file. The file is kept open in the cache, if the
+ * cache is enabled. A cached file of a removed cgroup is reopened once.
+ * The write is done outside of cg_tasks_fds_lock with a reference to the
+ * cached file, so threads moving tasks do not wait for each other and a
+ * file evicted meanwhile is closed only after the write.
+ * @param path: Full path to the tasks file
+ * @param buf: The formatted tid
+ * @param len: Length of buf
+ * @return 0 on success, -1 if the file cannot be opened, -2 if the write
+ *	fails; errno is set in both cases.
+ */
+static int cg_write_tasks_file(const char *path, const char *buf, size_t len)
+{
+	struct cg_tasks_fd *entry;
+	struct cg_tasks_file *file;
+	int retry = 1;
+	ssize_t ret;
+	int saved_errno;
+	int fd;
+
+	pthread_mutex_lock(&cg_tasks_fds_lock);
+	if (!cg_tasks_fds_size) {
+		pthread_mutex_unlock(&cg_tasks_fds_lock);
+
+		fd = cg_open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		ret = write(fd, buf, len);
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return ret < 0 ? -2 : 0;
+	}
+
+	for (;;) {
+		entry = cg_tasks_fd_get_locked(path);
+		file = entry ? entry->file : NULL;
+		saved_errno = errno;
+		if (file)
+			__sync_fetch_and_add(&file->refcount, 1);
+		pthread_mutex_unlock(&cg_tasks_fds_lock);
+		if (!file) {
+			errno = saved_errno;
+			return -1;
+		}
+
+		ret = write(file->fd, buf, len);
+		saved_errno = errno;
+		cg_tasks_file_put(file);
+		errno = saved_errno;
+		if (ret >= 0)
+			return 0;
+		if ((errno != ENOENT && errno != ENODEV) || !retry--)
+			return -2;
+
+		/* The cgroup was removed, maybe created again. */
+		cg_tasks_fd_invalidate(path);
+		pthread_mutex_lock(&cg_tasks_fds_lock);
+		if (!cg_tasks_fds_size) {
+			pthread_mutex_unlock(&cg_tasks_fds_lock);
+			errno = saved_errno;
+			return -2;
+		}
+	}
+}
+
+/*
+ * Return index of the first controller in cg_mount_table, which is mounted
+ * in the same hierarchy and namespace as the controller on index i.
+ */
+static int cg_hierarchy_of_locked(int i)
+{
+	const char *ns_i = cg_namespace_table[i];
+	const char *ns_j;
+	int j;
+
+	for (j = 0; j < i; j++) {
+		if (strcmp(cg_mount_table[j].mount.path,
+					cg_mount_table[i].mount.path))
+			continue;
+		ns_j = cg_namespace_table[j];
+		if (ns_i == ns_j || (ns_i && ns_j && !strcmp(ns_i, ns_j)))
+			return j;
+	}
+	return i;
+}
+
+/*
+ * Co-mounted controllers of a group share one directory. Set first[i] to 1
+ * for the controllers of the group which are the first one of their
+ * hierarchy, so filesystem operations are done once per hierarchy. Not
+ * mounted controllers are always first.
+ */
+static void cg_first_in_hierarchy(struct cgroup *cgroup, int *first)
+{
+	int hierarchy[CG_CONTROLLER_MAX];
+	int i, j;
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; i < cgroup->index; i++) {
+		hierarchy[i] = -1 - i;
+		for (j = 0; j < CG_CONTROLLER_MAX &&
+				cg_mount_table[j].name[0] != '\0'; j++) {
+			if (!strcmp(cg_mount_table[j].name,
+						cgroup->controller[i]->name)) {
+				hierarchy[i] = cg_hierarchy_of_locked(j);
+				break;
+			}
+		}
+
+		first[i] = 1;
+		for (j = 0; j < i && first[i]; j++)
+			if (hierarchy[j] == hierarchy[i])
+				first[i] = 0;
+	}
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+}
+
 static int __cgroup_attach_task_pid(char *path, pid_t tid)
 {
-	int ret = 0;
-	FILE *tasks = NULL;
+	char buf[32];
+	int saved_errno;
+	int len;
+	int ret;
 
-	tasks = fopen(path, "we");
-	if (!tasks) {
+	len = snprintf(buf, sizeof(buf), "%d", tid);
+	ret = cg_write_tasks_file(path, buf, len);
+	if (ret == -1) {
 		switch (errno) {
 		case EPERM:
 			return ECGROUPNOTOWNER;
@@ -1325,25 +2855,15 @@ static int __cgroup_attach_task_pid(char *path, pid_t tid)
 			return ECGROUPNOTALLOWED;
 		}
 	}
-	ret = fprintf(tasks, "%d", tid);
-	if (ret < 0) {
-		last_errno = errno;
-		ret = ECGOTHER;
-		goto err;
-	}
-	ret = fflush(tasks);
 	if (ret) {
+		saved_errno = errno;
 		last_errno = errno;
-		ret = ECGOTHER;
-		goto err;
+		cgroup_warn("Warning: cannot write tid %d to %s:%s\n",
+				tid, path, strerror(errno));
+		errno = saved_errno;
+		return ECGOTHER;
 	}
-	fclose(tasks);
 	return 0;
-err:
-	cgroup_warn("Warning: cannot write tid %d to %s:%s\n",
-			tid, path, strerror(errno));
-	fclose(tasks);
-	return ret;
 }
 
 /** cgroup_attach_task_pid is used to assign tasks to a cgroup.
@@ -1354,65 +2874,245 @@ err:
  *  returns ECGROUPNOTOWNER if the caller does not have access to the cgroup.
  *  returns ECGROUPNOTALLOWED for other causes of failure.
  */
+static int cg_attach_task_pid(struct cgroup *cgroup, pid_t tid)
+{
+	char path[FILENAME_MAX];
+	int first[CG_CONTROLLER_MAX];
+	int i, ret = 0;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("Warning: libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+	if (!cgroup) {
+		pthread_rwlock_rdlock(&cg_mount_table_lock);
+		for (i = 0; i < CG_CONTROLLER_MAX &&
+				cg_mount_table[i].name[0] != '\0'; i++) {
+			if (cg_hierarchy_of_locked(i) != i)
+				continue;
+			if (!cg_build_path_locked(NULL, path,
+						cg_mount_table[i].name))
+				continue;
+			strncat(path, cg_mount_table[i].unified ?
+					"/cgroup.procs" : "/tasks",
+					sizeof(path) - strlen(path) - 1);
+			ret = __cgroup_attach_task_pid(path, tid);
+			if (ret) {
+				pthread_rwlock_unlock(&cg_mount_table_lock);
+				return ret;
+			}
+		}
+		pthread_rwlock_unlock(&cg_mount_table_lock);
+	} else {
+		for (i = 0; i < cgroup->index; i++) {
+			if (!cgroup_test_subsys_mounted(cgroup->controller[i]->name)) {
+				cgroup_warn("Warning: subsystem %s is not mounted\n",
+						cgroup->controller[i]->name);
+				return ECGROUPSUBSYSNOTMOUNTED;
+			}
+		}
+
+		cg_first_in_hierarchy(cgroup, first);
+		for (i = 0; i < cgroup->index; i++) {
+			if (!first[i])
+				continue;
+			if (!cg_build_path(cgroup->name, path,
+					cgroup->controller[i]->name))
+				continue;
+			strncat(path, "/", sizeof(path) - strlen(path) - 1);
+			strncat(path, cg_tasks_file(cgroup->controller[i]->name),
+					sizeof(path) - strlen(path) - 1);
+			ret = __cgroup_attach_task_pid(path, tid);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 int cgroup_attach_task_pid(struct cgroup *cgroup, pid_t tid)
 {
+	int ret;
+
+	CG_TRACE2(attach_begin, tid, cgroup ? cgroup->name : NULL);
+	ret = cg_attach_task_pid(cgroup, tid);
+	CG_TRACE2(attach_end, tid, ret);
+	return ret;
+}
+
+/** cgroup_attach_task is used to attach the current thread to a cgroup.
+ *  struct cgroup *cgroup: The cgroup to assign the current thread to.
+ *
+ *  See cg_attach_task_pid for return values.
+ */
+int cgroup_attach_task(struct cgroup *cgroup)
+{
+	pid_t tid = cg_gettid();
+	int error;
+
+	error = cgroup_attach_task_pid(cgroup, tid);
+
+	return error;
+}
+
+/**
+ * Write tids to an open tasks or cgroup.procs file, one write() per tid.
+ * Tasks, which do not exist anymore, are skipped.
+ * @param fd: The open file
+ * @param path: Path to the file, for error messages
+ * @param pids: The tids to write
+ * @param count: Number of tids
+ * @param errors: Array of count error codes, the first error of each tid is
+ *	stored there, or NULL
+ * @return 0 on success, ECGOTHER if any tid could not be written.
+ */
+static int cg_write_tids(int fd, const char *path, const pid_t *pids,
+		size_t count, int *errors)
+{
+	char buf[32];
+	int ret = 0;
+	size_t i;
+	int len;
+
+	for (i = 0; i < count; i++) {
+		len = snprintf(buf, sizeof(buf), "%d", pids[i]);
+		if (write(fd, buf, len) >= 0)
+			continue;
+
+		/* the task exited, as with a single task */
+		if (errno == ESRCH) {
+			if (errors && !errors[i])
+				errors[i] = ECGOTHER;
+			if (!ret)
+				last_errno = ESRCH;
+			continue;
+		}
+
+		if (errors && !errors[i])
+			errors[i] = ECGOTHER;
+		if (!ret) {
+			last_errno = errno;
+			cgroup_warn("Warning: cannot write tid %d to %s:%s\n",
+					pids[i], path, strerror(errno));
+			ret = ECGOTHER;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Open a tasks or cgroup.procs file for writing.
+ * @return The file descriptor or negative error code.
+ */
+static int cg_open_tasks_file(const char *path)
+{
+	int fd;
+
+	fd = cg_open(path, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+
+	cgroup_warn("Warning: cannot open %s: %s\n", path, strerror(errno));
+	switch (errno) {
+	case EPERM:
+		return -ECGROUPNOTOWNER;
+	case ENOENT:
+		return -ECGROUPNOTEXIST;
+	default:
+		return -ECGROUPNOTALLOWED;
+	}
+}
+
+int cgroup_attach_tasks(struct cgroup *cgroup, const pid_t *pids,
+		size_t count, int flags, int *errors)
+{
+	const char *file = (flags & CGFLAG_ATTACH_PROCS) ? "cgroup.procs" :
+		"tasks";
 	char path[FILENAME_MAX];
-	int i, ret = 0;
+	char done[CG_CONTROLLER_MAX];
+	int i, m, fd, ret;
+	size_t j;
+	int first_error = 0, first_errno = 0;
 
 	if (!cgroup_initialized) {
 		cgroup_warn("Warning: libcgroup is not initialized\n");
 		return ECGROUPNOTINITIALIZED;
 	}
-	if (!cgroup) {
-		pthread_rwlock_rdlock(&cg_mount_table_lock);
-		for (i = 0; i < CG_CONTROLLER_MAX &&
-				cg_mount_table[i].name[0] != '\0'; i++) {
-			if (!cg_build_path_locked(NULL, path,
-						cg_mount_table[i].name))
-				continue;
-			strncat(path, "/tasks", sizeof(path) - strlen(path));
-			ret = __cgroup_attach_task_pid(path, tid);
-			if (ret) {
-				pthread_rwlock_unlock(&cg_mount_table_lock);
-				return ret;
-			}
-		}
-		pthread_rwlock_unlock(&cg_mount_table_lock);
-	} else {
+	if (!pids && count)
+		return ECGINVAL;
+
+	if (errors)
+		memset(errors, 0, count * sizeof(int));
+
+	if (cgroup) {
 		for (i = 0; i < cgroup->index; i++) {
-			if (!cgroup_test_subsys_mounted(cgroup->controller[i]->name)) {
+			if (!cgroup_test_subsys_mounted(
+						cgroup->controller[i]->name)) {
 				cgroup_warn("Warning: subsystem %s is not mounted\n",
 						cgroup->controller[i]->name);
+				for (j = 0; errors && j < count; j++)
+					errors[j] = ECGROUPSUBSYSNOTMOUNTED;
 				return ECGROUPSUBSYSNOTMOUNTED;
 			}
 		}
+	}
 
-		for (i = 0; i < cgroup->index; i++) {
-			if (!cg_build_path(cgroup->name, path,
-					cgroup->controller[i]->name))
+	/*
+	 * Open the file once per hierarchy and write all the tids. Try the
+	 * other hierarchies after an error, so errors has all the failed
+	 * tids, but return the first error. The unified hierarchy moves
+	 * whole processes always.
+	 */
+	CG_TRACE2(attach_tasks_begin, cgroup ? cgroup->name : NULL, count);
+	memset(done, 0, sizeof(done));
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; cgroup ? i < cgroup->index : (i < CG_CONTROLLER_MAX &&
+				cg_mount_table[i].name[0] != '\0'); i++) {
+		for (m = cgroup ? 0 : i; cgroup && m < CG_CONTROLLER_MAX &&
+				cg_mount_table[m].name[0] != '\0'; m++)
+			if (!strcmp(cg_mount_table[m].name,
+						cgroup->controller[i]->name))
+				break;
+		if (m < CG_CONTROLLER_MAX && cg_mount_table[m].name[0]) {
+			if (done[cg_hierarchy_of_locked(m)])
 				continue;
-			strncat(path, "/tasks", sizeof(path) - strlen(path));
-			ret = __cgroup_attach_task_pid(path, tid);
-			if (ret)
-				return ret;
+			done[cg_hierarchy_of_locked(m)] = 1;
 		}
-	}
-	return 0;
-}
 
-/** cgroup_attach_task is used to attach the current thread to a cgroup.
- *  struct cgroup *cgroup: The cgroup to assign the current thread to.
- *
- *  See cg_attach_task_pid for return values.
- */
-int cgroup_attach_task(struct cgroup *cgroup)
-{
-	pid_t tid = cg_gettid();
-	int error;
+		if (!cg_build_path_locked(cgroup ? cgroup->name : NULL, path,
+					cgroup ? cgroup->controller[i]->name :
+					cg_mount_table[i].name))
+			continue;
+		strncat(path, m < CG_CONTROLLER_MAX &&
+				cg_mount_table[m].unified ? "cgroup.procs" :
+				file, sizeof(path) - strlen(path) - 1);
+
+		fd = cg_open_tasks_file(path);
+		if (fd < 0) {
+			/* No tid got into this hierarchy. */
+			for (j = 0; errors && j < count; j++) {
+				if (!errors[j])
+					errors[j] = -fd;
+			}
+			if (!first_error)
+				first_error = -fd;
+			continue;
+		}
 
-	error = cgroup_attach_task_pid(cgroup, tid);
+		ret = cg_write_tids(fd, path, pids, count, errors);
+		close(fd);
+		if (ret && !first_error) {
+			first_error = ret;
+			first_errno = last_errno;
+		}
+	}
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+	CG_TRACE3(attach_tasks_end, cgroup ? cgroup->name : NULL, count,
+			first_error);
 
-	return error;
+	if (first_error == ECGOTHER)
+		last_errno = first_errno;
+	return first_error;
 }
 
 /**
@@ -1427,6 +3127,11 @@ int cg_mkdir_p(const char *path)
 	int ret = 0, stat_ret;
 	struct stat st;
 
+	/* Usually only the last component is missing. */
+	if (!cg_mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) ||
+			errno == EEXIST)
+		return 0;
+
 	real_path = strdup(path);
 	if (!real_path) {
 		last_errno = errno;
@@ -1442,7 +3147,7 @@ int cg_mkdir_p(const char *path)
 			i++;
 		pos = real_path[i];
 		real_path[i] = '\0';		/* Temporarily overwrite "/" */
-		ret = mkdir(real_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+		ret = cg_mkdir(real_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 		real_path[i] = pos;
 		if (ret) {
 			switch (errno) {
@@ -1455,7 +3160,7 @@ int cg_mkdir_p(const char *path)
 			default:
 				/* Check if path exists */
 				real_path[i] = '\0';
-				stat_ret = stat(real_path, &st);
+				stat_ret = cg_stat(real_path, &st);
 				real_path[i] = pos;
 				if (stat_ret == 0) {
 					ret = 0;	/* Path exists */
@@ -1493,7 +3198,7 @@ static int cg_create_control_group(const char *path)
  * This function takes in the complete path and sets the value in val in that
  * file.
  */
-static int cg_set_control_value(char *path, const char *val)
+static int cg_write_control_value(char *path, const char *val)
 {
 	int ctl_file;
 	char *str_val;
@@ -1504,7 +3209,7 @@ static int cg_set_control_value(char *path, const char *val)
 	if (!cg_test_mounted_fs())
 		return ECGROUPNOTMOUNTED;
 
-	ctl_file = open(path, O_RDWR | O_CLOEXEC);
+	ctl_file = cg_open(path, O_RDWR | O_CLOEXEC);
 
 	if (ctl_file == -1) {
 		if (errno == EPERM) {
@@ -1593,6 +3298,44 @@ static int cg_set_control_value(char *path, const char *val)
 	return 0;
 }
 
+static int cg_set_control_value(char *path, const char *val)
+{
+	int ret;
+
+	CG_TRACE2(control_write_begin, path, val);
+	ret = cg_write_control_value(path, val);
+	CG_TRACE2(control_write_end, path, ret);
+	return ret;
+}
+
+/*
+ * Check whether the control file at path already contains given single-line
+ * value.
+ */
+static int cg_control_value_equals(const char *path, const char *val)
+{
+	char buf[CG_VALUE_MAX];
+	ssize_t len;
+	int fd;
+
+	if (strchr(val, '\n'))
+		return 0;
+
+	fd = cg_open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return 0;
+
+	if (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return !strcmp(buf, val);
+}
+
 /** cgroup_modify_cgroup modifies the cgroup control files.
  * struct cgroup *cgroup: The name will be the cgroup to be modified.
  * The values will be the values to be modified, those not mentioned
@@ -1605,8 +3348,15 @@ static int cg_set_control_value(char *path, const char *val)
  */
 
 int cgroup_modify_cgroup(struct cgroup *cgroup)
+{
+	return cgroup_modify_cgroup_ext(cgroup, 0, NULL);
+}
+
+int cgroup_modify_cgroup_ext(struct cgroup *cgroup, int flags,
+		struct cgroup_modify_stats *stats)
 {
 	char *path, base[FILENAME_MAX];
+	struct control_value *cv;
 	int i;
 	int error = 0;
 	int ret;
@@ -1631,26 +3381,44 @@ int cgroup_modify_cgroup(struct cgroup *cgroup)
 			cgroup->controller[i]->name))
 			continue;
 		for (j = 0; j < cgroup->controller[i]->index; j++) {
-			ret = asprintf(&path, "%s%s", base,
-				cgroup->controller[i]->values[j]->name);
+			cv = cgroup->controller[i]->values[j];
+			if (!cv->dirty && !(flags & CGFLAG_MODIFY_ALL)) {
+				if (stats)
+					stats->skipped_clean++;
+				continue;
+			}
+
+			ret = asprintf(&path, "%s%s", base, cv->name);
 			if (ret < 0) {
 				last_errno = errno;
 				error = ECGOTHER;
 				goto err;
 			}
-			error = cg_set_control_value(path,
-				cgroup->controller[i]->values[j]->value);
+			if ((flags & CGFLAG_MODIFY_SKIP_EQUAL) &&
+					cg_control_value_equals(path,
+						cv->value)) {
+				cgroup_dbg("%s is already set to \"%s\"\n",
+						path, cv->value);
+				free(path);
+				cv->dirty = false;
+				if (stats)
+					stats->skipped_equal++;
+				continue;
+			}
+			error = cg_set_control_value(path, cv->value);
 			free(path);
 			path = NULL;
 			/* don't consider error in files directly written by
 			 * the user as fatal */
-			if (error && !cgroup->controller[i]->values[j]->dirty) {
+			if (error && !cv->dirty) {
 				error = 0;
 				continue;
 			}
 			if (error)
 				goto err;
-			cgroup->controller[i]->values[j]->dirty = false;
+			cv->dirty = false;
+			if (stats)
+				stats->written++;
 		}
 	}
 err:
@@ -1672,24 +3440,16 @@ static int cgroup_copy_controller_values(struct cgroup_controller *dst,
 	if (!dst || !src)
 		return ECGFAIL;
 
-	strncpy(dst->name, src->name, FILENAME_MAX);
-	for (i = 0; i < src->index; i++, dst->index++) {
-		struct control_value *src_val = src->values[i];
-		struct control_value *dst_val;
-
-		dst->values[i] = calloc(1, sizeof(struct control_value));
-		if (!dst->values[i]) {
-			last_errno = errno;
-			ret = ECGOTHER;
-			goto err;
-		}
+	for (i = 0; i < src->index; i++) {
+		ret = cgroup_add_value_string(dst, src->values[i]->name,
+				src->values[i]->value);
+		if (ret)
+			return ret;
 
-		dst_val = dst->values[i];
-		strncpy(dst_val->value, src_val->value, CG_VALUE_MAX);
-		strncpy(dst_val->name, src_val->name, FILENAME_MAX);
+		/* Values waiting to be written stay so in the copy. */
+		dst->values[i]->dirty = src->values[i]->dirty;
 	}
-err:
-	return ret;
+	return 0;
 }
 
 /**
@@ -1714,18 +3474,17 @@ int cgroup_copy_cgroup(struct cgroup *dst, struct cgroup *src)
 
 	cgroup_free_controllers(dst);
 
-	for (i = 0; i < src->index; i++, dst->index++) {
+	for (i = 0; i < src->index; i++) {
 		struct cgroup_controller *src_ctlr = src->controller[i];
 		struct cgroup_controller *dst_ctlr;
 
-		dst->controller[i] = calloc(1, sizeof(struct cgroup_controller));
-		if (!dst->controller[i]) {
+		dst_ctlr = cgroup_add_controller(dst, src_ctlr->name);
+		if (!dst_ctlr) {
 			last_errno = errno;
 			ret = ECGOTHER;
 			goto err;
 		}
 
-		dst_ctlr = dst->controller[i];
 		ret = cgroup_copy_controller_values(dst_ctlr, src_ctlr);
 		if (ret)
 			goto err;
@@ -1734,6 +3493,207 @@ err:
 	return ret;
 }
 
+/*
+ * Check whether a space separated list, like cgroup.subtree_control,
+ * contains the word.
+ */
+static int cg_list_contains(const char *list, const char *word)
+{
+	size_t len = strlen(word);
+	const char *p;
+
+	for (p = list; (p = strstr(p, word)) != NULL; p += len) {
+		if ((p == list || p[-1] == ' ') &&
+				(p[len] == '\0' || p[len] == ' '))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Enable the unified hierarchy controllers of a group in
+ * cgroup.subtree_control of all its ancestors, so their control files
+ * appear in the group. The controllers missing in an ancestor are enabled
+ * there by a single write, ancestors which have all of them enabled are
+ * only read.
+ *	@param path Path of the group directory in the unified hierarchy
+ */
+static int cg_enable_subtree_control(struct cgroup *cgroup, const char *path)
+{
+	char file[FILENAME_MAX];
+	char enabled[CG_VALUE_MAX];
+	char change[CG_VALUE_MAX];
+	int wanted[CG_CONTROLLER_MAX];
+	size_t dir_len = 0, len;
+	const char *p;
+	ssize_t ret;
+	int error = 0;
+	int i, j, fd;
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; i < cgroup->index; i++) {
+		wanted[i] = 0;
+		for (j = 0; j < CG_CONTROLLER_MAX &&
+				cg_mount_table[j].name[0] != '\0'; j++) {
+			if (strcmp(cg_mount_table[j].name,
+					cgroup->controller[i]->name))
+				continue;
+			if (cg_mount_table[j].unified) {
+				wanted[i] = 1;
+				dir_len = strlen(cg_mount_table[j].mount.path);
+			}
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	/* the mount point, then each directory up to the parent */
+	while (dir_len) {
+		p = path + dir_len;
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+
+		snprintf(file, sizeof(file), "%.*s/cgroup.subtree_control",
+				(int)dir_len, path);
+		fd = cg_open(file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			last_errno = errno;
+			error = ECGOTHER;
+			break;
+		}
+		ret = read(fd, enabled, sizeof(enabled) - 1);
+		close(fd);
+		if (ret < 0) {
+			last_errno = errno;
+			error = ECGOTHER;
+			break;
+		}
+		enabled[ret] = '\0';
+		if (ret > 0 && enabled[ret - 1] == '\n')
+			enabled[ret - 1] = '\0';
+
+		len = 0;
+		change[0] = '\0';
+		for (i = 0; i < cgroup->index; i++) {
+			if (!wanted[i] || cg_list_contains(enabled,
+					cgroup->controller[i]->name))
+				continue;
+			len += snprintf(change + len, sizeof(change) - len,
+					"%s+%s", len ? " " : "",
+					cgroup->controller[i]->name);
+			if (len >= sizeof(change)) {
+				error = ECGOTHER;
+				break;
+			}
+		}
+		if (error)
+			break;
+		if (len) {
+			cgroup_dbg("enabling %s in %s\n", change, file);
+			error = cg_set_control_value(file, change);
+			if (error)
+				break;
+		}
+
+		dir_len = strchrnul(p, '/') - path;
+	}
+
+	if (error)
+		cgroup_warn("Warning: cannot enable the controllers of %s in "
+			"%s: %s\n", cgroup->name, file,
+			cgroup_strerror(error));
+	return error;
+}
+
+/*
+ * Tell whether the owner or the mode of a file differ from the configured
+ * ones, as set by cgroup_create_cgroup(). NO_UID_GID and NO_PERMS are not
+ * compared.
+ */
+static int cg_file_owner_perms_differ(const struct stat *st, uid_t uid,
+		gid_t gid, mode_t mode)
+{
+	if (uid != NO_UID_GID && st->st_uid != uid)
+		return 1;
+	if (gid != NO_UID_GID && st->st_gid != gid)
+		return 1;
+	return mode != NO_PERMS &&
+		(st->st_mode & 07777) != (mode & cg_owner_umask(st->st_mode));
+}
+
+/*
+ * Compare the directory of the group opened as fd and its files with the
+ * configured control and tasks owners and modes. Closes fd.
+ */
+static int cg_dir_owner_perms_differ(struct cgroup *cgroup, int fd,
+		const char *tasks)
+{
+	struct dirent *ent;
+	struct stat st;
+	int differ = 0;
+	DIR *dir;
+
+	if (fstat(fd, &st) || cg_file_owner_perms_differ(&st,
+				cgroup->control_uid, cgroup->control_gid,
+				cgroup->control_dperm)) {
+		close(fd);
+		return 1;
+	}
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return 1;
+	}
+	while (!differ && (ent = readdir(dir)) != NULL) {
+		if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			differ = 1;
+			break;
+		}
+		if (S_ISDIR(st.st_mode))
+			continue;
+		if (!strcmp(ent->d_name, tasks))
+			differ = cg_file_owner_perms_differ(&st,
+					cgroup->tasks_uid, cgroup->tasks_gid,
+					cgroup->task_fperm);
+		else
+			differ = cg_file_owner_perms_differ(&st,
+					cgroup->control_uid,
+					cgroup->control_gid,
+					cgroup->control_fperm);
+	}
+	closedir(dir);
+	return differ;
+}
+
+/*
+ * Tell whether the owners or the permissions of the existing directories of
+ * the group and their files differ from the configured ones, i.e. whether
+ * cgroup_create_cgroup() would change them.
+ */
+int cg_owner_perms_differ(struct cgroup *cgroup)
+{
+	char path[FILENAME_MAX];
+	int fd;
+	int i;
+
+	for (i = 0; i < cgroup->index; i++) {
+		const char *controller = cgroup->controller[i]->name;
+
+		if (!cg_build_path(cgroup->name, path, controller))
+			continue;
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return 1;
+		if (cg_dir_owner_perms_differ(cgroup, fd,
+					cg_tasks_file(controller)))
+			return 1;
+	}
+	return 0;
+}
+
 /** cgroup_create_cgroup creates a new control group.
  * struct cgroup *cgroup: The control group to be created
  *
@@ -1744,9 +3704,10 @@ err:
  */
 int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 {
-	char *fts_path[2];
+	struct cg_owner_perms op;
 	char *base = NULL;
 	char *path = NULL;
+	int first[CG_CONTROLLER_MAX];
 	int i, j, k;
 	int error = 0;
 	int retval = 0;
@@ -1763,27 +3724,53 @@ int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 			return ECGROUPSUBSYSNOTMOUNTED;
 	}
 
-	fts_path[0] = (char *)malloc(FILENAME_MAX);
-	if (!fts_path[0]) {
+	path = malloc(FILENAME_MAX);
+	if (!path) {
 		last_errno = errno;
 		return ECGOTHER;
 	}
-	fts_path[1] = NULL;
-	path = fts_path[0];
+
+	/* owner and permissions of the group directory and control files */
+	memset(&op, 0, sizeof(op));
+	op.chown = 1;
+	op.owner = cgroup->control_uid == NO_UID_GID ? getuid() :
+		cgroup->control_uid;
+	op.group = cgroup->control_gid == NO_UID_GID ? getgid() :
+		cgroup->control_gid;
+	op.dir_mode = cgroup->control_dperm;
+	op.dirm_change = cgroup->control_dperm != NO_PERMS;
+	op.file_mode = cgroup->control_fperm;
+	op.filem_change = cgroup->control_fperm != NO_PERMS;
+	op.owner_is_umask = 1;
 
 	/*
 	 * XX: One important test to be done is to check, if you have multiple
 	 * subsystems mounted at one point, all of them *have* be on the cgroup
 	 * data structure. If not, we fail.
+	 *
+	 * Co-mounted controllers share the directory, it is created and its
+	 * ownership set only with the first of them.
 	 */
+	cg_first_in_hierarchy(cgroup, first);
 	for (k = 0; k < cgroup->index; k++) {
 		if (!cg_build_path(cgroup->name, path,
 				cgroup->controller[k]->name))
 			continue;
 
-		error = cg_create_control_group(path);
-		if (error)
-			goto err;
+		if (first[k]) {
+			error = cg_create_control_group(path);
+			if (error)
+				goto err;
+			/*
+			 * The controllers of the unified hierarchy are
+			 * enabled all at once, the group keeps being usable
+			 * without their control files if it fails.
+			 */
+			if (cg_controller_unified(cgroup->controller[k]->name)
+					&& cg_enable_subtree_control(cgroup,
+						path))
+				retval = ECGCANTSETVALUE;
+		}
 
 		base = strdup(path);
 
@@ -1793,17 +3780,13 @@ int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 			goto err;
 		}
 
-		if (!ignore_ownership) {
-			cgroup_dbg("Changing ownership of %s\n", fts_path[0]);
-			error = cg_chown_recursive(fts_path,
-				cgroup->control_uid, cgroup->control_gid);
-			if (!error)
-				error = cg_chmod_recursive_controller(fts_path[0],
-						cgroup->control_dperm,
-						cgroup->control_dperm != NO_PERMS,
-						cgroup->control_fperm,
-						cgroup->control_fperm != NO_PERMS,
-						1, cgroup_ignored_tasks_files);
+		if (!ignore_ownership && first[k]) {
+			cgroup_dbg("Changing ownership of %s\n", path);
+			op.ignore_list = cg_controller_unified(
+					cgroup->controller[k]->name) ?
+				cgroup_ignored_unified_files :
+				cgroup_ignored_tasks_files;
+			error = cg_set_owner_perms(path, &op);
 		}
 
 		if (error)
@@ -1840,8 +3823,9 @@ int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 			}
 		}
 
-		if (!ignore_ownership) {
-			ret = snprintf(path, FILENAME_MAX, "%s/tasks", base);
+		if (!ignore_ownership && first[k]) {
+			ret = snprintf(path, FILENAME_MAX, "%s/%s", base,
+					cg_tasks_file(cgroup->controller[k]->name));
 			if (ret < 0 || ret >= FILENAME_MAX) {
 				last_errno = errno;
 				error = ECGOTHER;
@@ -1938,7 +3922,7 @@ static int cgroup_get_parent_name(struct cgroup *cgroup, char **parent)
  *	Caller is responsible to free the returned string!
  * @return 0 on success, >0 on error.
  */
-static int cgroup_find_parent(struct cgroup *cgroup, char *controller,
+static int cgroup_find_parent(struct cgroup *cgroup, const char *controller,
 		char **parent)
 {
 	char child_path[FILENAME_MAX];
@@ -2031,112 +4015,293 @@ int cgroup_create_cgroup_from_parent(struct cgroup *cgroup,
 		ret = ECGFAIL;
 		goto err_parent;
 	}
-
-	cgroup_dbg("got parent group for %s\n", parent_cgroup->name);
-	ret = cgroup_copy_cgroup(cgroup, parent_cgroup);
-	if (ret) {
-		goto err_parent;
+
+	cgroup_dbg("got parent group for %s\n", parent_cgroup->name);
+	ret = cgroup_copy_cgroup(cgroup, parent_cgroup);
+	if (ret) {
+		goto err_parent;
+	}
+
+	cgroup_dbg("copied parent group %s to %s\n", parent_cgroup->name,
+							cgroup->name);
+	ret = cgroup_create_cgroup(cgroup, ignore_ownership);
+
+err_parent:
+	cgroup_free(&parent_cgroup);
+err_nomem:
+	free(parent);
+	return ret;
+}
+
+/* Number of tids moved at once by cg_move_task_files() */
+#define CG_MOVE_TASKS_BATCH	256
+
+/**
+ * Move all processes from one task file to another.
+ * @param input_fd Pre-opened file to read tasks from.
+ * @param output_fd Pre-opened file to write tasks to.
+ * @param output_path Path to the output file, for error messages.
+ * @return 0 on succes, >0 on error.
+ */
+static int cg_move_task_files(int input_fd, int output_fd,
+		const char *output_path)
+{
+	pid_t tids[CG_MOVE_TASKS_BATCH];
+	char buf[4096];
+	size_t count = 0;
+	pid_t tid = 0;
+	int digits = 0;
+	ssize_t len, i;
+	int ret = 0;
+
+	do {
+		len = read(input_fd, buf, sizeof(buf));
+		if (len < 0) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		/* Numbers may span the reads, len == 0 ends the last one. */
+		for (i = 0; i < len || (!len && digits); i++) {
+			if (len && isdigit(buf[i])) {
+				tid = tid * 10 + buf[i] - '0';
+				digits++;
+				continue;
+			}
+			if (digits)
+				tids[count++] = tid;
+			tid = 0;
+			digits = 0;
+
+			if (count == CG_MOVE_TASKS_BATCH) {
+				ret = cg_write_tids(output_fd, output_path,
+						tids, count, NULL);
+				if (ret)
+					return ret;
+				count = 0;
+			}
+		}
+	} while (len > 0);
+
+	return cg_write_tids(output_fd, output_path, tids, count, NULL);
+}
+
+/* Interval of polling the tasks files by cg_wait_empty_path(), in ms */
+#define CG_WAIT_EMPTY_POLL	10
+/* Time cg_delete_cgroup_controller() waits for exiting tasks, in ms */
+#define CG_DELETE_WAIT_EMPTY	1000
+
+/*
+ * Deadline after timeout milliseconds from now, none if it is negative.
+ */
+static void cg_wait_deadline(struct timespec *deadline, int timeout)
+{
+	if (timeout < 0) {
+		deadline->tv_sec = -1;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
 	}
+}
 
-	cgroup_dbg("copied parent group %s to %s\n", parent_cgroup->name,
-							cgroup->name);
-	ret = cgroup_create_cgroup(cgroup, ignore_ownership);
+/*
+ * Milliseconds left until the deadline, -1 if there is none.
+ */
+static int cg_wait_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long left;
+
+	if (deadline->tv_sec < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return left > 0 ? left : 0;
+}
 
-err_parent:
-	cgroup_free(&parent_cgroup);
-err_nomem:
-	free(parent);
-	return ret;
+/*
+ * Check whether a group is empty: the "populated" key of cgroup.events in
+ * the unified hierarchy, otherwise the tasks file.
+ *	@return 1 if it is empty, 0 if not, -1 on error
+ */
+static int cg_group_empty(int dirfd, int unified)
+{
+	char buf[CG_VALUE_MAX];
+	char *populated;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dirfd, unified ? "cgroup.events" : "tasks",
+			O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	do {
+		len = read(fd, buf, sizeof(buf) - 1);
+	} while (len < 0 && errno == EINTR);
+	close(fd);
+	if (len < 0)
+		return -1;
+	if (!unified)
+		return len == 0;
+
+	buf[len] = '\0';
+	populated = strstr(buf, "populated ");
+	if (!populated)
+		return -1;
+	return populated[strlen("populated ")] == '0';
 }
 
-/**
- * Move all processes from one task file to another.
- * @param input_tasks Pre-opened file to read tasks from.
- * @param output_tasks Pre-opened file to write tasks to.
- * @return 0 on succes, >0 on error.
+/*
+ * Wait until the group at path is empty. The cgroup.events file of the
+ * unified hierarchy is modified when the group gets empty, so it is waited
+ * for by inotify; the tasks files are polled.
+ *	@param deadline See cg_wait_deadline()
+ *	@return 0 when it is empty, ECGNONEMPTY after the timeout, ECGOTHER
+ *	on error
  */
-static int cg_move_task_files(FILE *input_tasks, FILE *output_tasks)
+static int cg_wait_empty_path(const char *path, int unified,
+		const struct timespec *deadline)
 {
-	int tids;
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct pollfd pfd = { -1, POLLIN, 0 };
+	int dirfd, empty, left;
 	int ret = 0;
 
-	while (!feof(input_tasks)) {
-		ret = fscanf(input_tasks, "%d", &tids);
-		if (ret == EOF || ret == 0) {
-			ret = 0;
-			break;
-		}
-		if (ret < 0)
-			break;
+	dirfd = cg_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		last_errno = errno;
+		return errno == ENOENT ? 0 : ECGOTHER;
+	}
 
-		ret = fprintf(output_tasks, "%d", tids);
-		if (ret < 0) {
-			if (errno == ESRCH)
-				ret = 0;
-			else
-				break;
+	/* watch before the first check, so no change is missed */
+	if (unified) {
+		pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (pfd.fd >= 0) {
+			char file[FILENAME_MAX];
+
+			snprintf(file, sizeof(file), "%s/cgroup.events", path);
+			if (inotify_add_watch(pfd.fd, file, IN_MODIFY) < 0) {
+				close(pfd.fd);
+				pfd.fd = -1;
+			}
 		}
+		if (pfd.fd < 0)
+			cgroup_dbg("cannot watch %s/cgroup.events: %s, "
+				"polling it\n", path, strerror(errno));
+	}
 
-		/*
-		 * Flush the file, we need only one process per write() call.
-		 */
-		ret = fflush(output_tasks);
-		if (ret < 0) {
-			if (errno == ESRCH)
-				ret = 0;
-			else
-				break;
+	while ((empty = cg_group_empty(dirfd, unified)) == 0) {
+		left = cg_wait_left(deadline);
+		if (!left) {
+			ret = ECGNONEMPTY;
+			break;
+		}
+		if (pfd.fd < 0) {
+			if (left < 0 || left > CG_WAIT_EMPTY_POLL)
+				left = CG_WAIT_EMPTY_POLL;
+			poll(NULL, 0, left);
+			continue;
+		}
+		if (poll(&pfd, 1, left) > 0)
+			while (read(pfd.fd, events, sizeof(events)) > 0)
+				;
+	}
+	if (empty < 0) {
+		/* the group was removed meanwhile */
+		if (errno == ENOENT)
+			ret = 0;
+		else {
+			last_errno = errno;
+			ret = ECGOTHER;
 		}
 	}
 
-	if (ret < 0) {
-		last_errno = errno;
-		return ECGOTHER;
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+	close(dirfd);
+	return ret;
+}
+
+int cgroup_wait_empty(struct cgroup *cgroup, int timeout)
+{
+	struct timespec deadline;
+	char path[FILENAME_MAX];
+	int first[CG_CONTROLLER_MAX];
+	int i, ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!cgroup)
+		return ECGROUPNOTALLOWED;
+
+	cg_wait_deadline(&deadline, timeout);
+
+	/* once per hierarchy, the timeout is shared by all of them */
+	cg_first_in_hierarchy(cgroup, first);
+	for (i = 0; !ret && i < cgroup->index; i++) {
+		if (!first[i])
+			continue;
+		if (!cg_build_path(cgroup->name, path,
+				cgroup->controller[i]->name))
+			return ECGROUPSUBSYSNOTMOUNTED;
+		ret = cg_wait_empty_path(path,
+				cg_controller_unified(cgroup->controller[i]->name),
+				&deadline);
 	}
-	return 0;
+	return ret;
 }
 
 /**
  * Remove one cgroup from specific controller. The function  moves all
  * processes from it to given target group.
  *
- * The function succeeds if the group to remove is already removed - when
- * cgroup_delete_cgroup is called with group with two controllers mounted
- * to the same hierarchy, this function is called once for each of these
- * controllers. And during the second call the group is already removed...
+ * The function succeeds if the group to remove is already removed, e.g. by
+ * someone else in the meantime.
  *
  * @param cgroup_name Name of the group to remove.
  * @param controller  Name of the controller.
  * @param target_tasks Opened tasks file of the target group, where all
  *	processes should be moved.
+ * @param target_path Path to the target tasks file.
  * @param flags Flag indicating whether the errors from task
  *	migration should be ignored (CGROUP_DELETE_IGNORE_MIGRATION) or not (0).
  * @returns 0 on success, >0 on error.
  */
-static int cg_delete_cgroup_controller(char *cgroup_name, char *controller,
-		FILE *target_tasks, int flags)
+static int cg_delete_cgroup_controller(char *cgroup_name, const char *controller,
+		int target_tasks, const char *target_path, int flags)
 {
-	FILE *delete_tasks;
+	int delete_tasks;
 	char path[FILENAME_MAX];
 	int ret = 0;
 
 	cgroup_dbg("Removing group %s:%s\n", controller, cgroup_name);
 
-	if (!(flags & CGFLAG_DELETE_EMPTY_ONLY)) {
+	if (!(flags & (CGFLAG_DELETE_EMPTY_ONLY | CGFLAG_DELETE_NO_MIGRATION))) {
 		/*
-		 * Open tasks file of the group to delete.
+		 * Open tasks file of the group to delete, recursive delete
+		 * moves whole processes.
 		 */
 		if (!cg_build_path(cgroup_name, path, controller))
 			return ECGROUPSUBSYSNOTMOUNTED;
-		strncat(path, "tasks", sizeof(path) - strlen(path));
-
-		delete_tasks = fopen(path, "re");
-		if (delete_tasks) {
-			ret = cg_move_task_files(delete_tasks, target_tasks);
+		strncat(path, (flags & CGFLAG_DELETE_RECURSIVE) ?
+				"cgroup.procs" : cg_tasks_file(controller),
+				sizeof(path) - strlen(path));
+
+		delete_tasks = cg_open(path, O_RDONLY | O_CLOEXEC);
+		if (delete_tasks >= 0) {
+			ret = cg_move_task_files(delete_tasks, target_tasks,
+					target_path);
 			if (ret != 0)
 				cgroup_warn("Warning: removing tasks from %s failed: %s\n",
 						path, cgroup_strerror(ret));
-			fclose(delete_tasks);
+			close(delete_tasks);
 		} else {
 			/*
 			 * Can't open the tasks file. If the file does not
@@ -2161,11 +4326,29 @@ static int cg_delete_cgroup_controller(char *cgroup_name, char *controller,
 	if (!cg_build_path(cgroup_name, path, controller))
 		return ECGROUPSUBSYSNOTMOUNTED;
 
-	ret = rmdir(path);
-	if (ret == 0 || errno == ENOENT)
+	ret = cg_rmdir(path);
+	if (ret && errno == EBUSY && cg_controller_unified(controller) &&
+			!(flags & (CGFLAG_DELETE_EMPTY_ONLY |
+				CGFLAG_DELETE_NO_MIGRATION))) {
+		/*
+		 * The moved processes, which were exiting, leave the
+		 * unified hierarchy group only a while later.
+		 */
+		struct timespec deadline;
+
+		cg_wait_deadline(&deadline, CG_DELETE_WAIT_EMPTY);
+		if (!cg_wait_empty_path(path, 1, &deadline))
+			ret = cg_rmdir(path);
+		else
+			errno = EBUSY;
+	}
+	if (ret == 0 || errno == ENOENT) {
+		cg_tasks_fd_invalidate(path);
 		return 0;
+	}
 
-	if ((flags & CGFLAG_DELETE_EMPTY_ONLY) && (errno == EBUSY))
+	if ((flags & (CGFLAG_DELETE_EMPTY_ONLY | CGFLAG_DELETE_NO_MIGRATION))
+			&& (errno == EBUSY))
 		return ECGNONEMPTY;
 
 	cgroup_warn("Warning: cannot remove directory %s: %s\n",
@@ -2174,6 +4357,73 @@ static int cg_delete_cgroup_controller(char *cgroup_name, char *controller,
 	return ECGOTHER;
 }
 
+/* Subtrees removed by cg_delete_cgroup_controller_parallel() */
+struct cg_delete_job {
+	char *cgroup_name;
+	const char *controller;
+	int target_tasks;
+	const char *target_path;
+	int flags;
+	/* length of the full path of the removed group */
+	size_t root_len;
+};
+
+static int cg_delete_subgroup(const struct cgroup_file_info *info,
+		void *userdata)
+{
+	struct cg_delete_job *job = userdata;
+	const char *name = info->full_path + job->root_len;
+	char child_name[FILENAME_MAX];
+
+	/* the removed group itself is handled by the caller */
+	if (!info->depth)
+		return 0;
+
+	while (*name == '/')
+		name++;
+	snprintf(child_name, sizeof(child_name), "%s/%s", job->cgroup_name,
+			name);
+
+	return cg_delete_cgroup_controller(child_name, job->controller,
+			job->target_tasks, job->target_path, job->flags);
+}
+
+/**
+ * Remove the subgroups of one control group in several threads, the
+ * subtrees of its direct children are distributed among the threads by
+ * cgroup_walk_tree_parallel(). The walk is post-order, so each subgroup is
+ * removed after its children.
+ */
+static int cg_delete_cgroup_controller_parallel(char *cgroup_name,
+		const char *controller, int target_tasks, const char *target_path,
+		int flags)
+{
+	struct cg_delete_job job;
+	char path[FILENAME_MAX];
+	int ret;
+
+	cgroup_dbg("Removing subgroups of %s:%s in parallel\n", controller,
+			cgroup_name);
+
+	if (!cg_build_path(cgroup_name, path, controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+
+	job.cgroup_name = cgroup_name;
+	job.controller = controller;
+	job.target_tasks = target_tasks;
+	job.target_path = target_path;
+	job.flags = flags;
+	job.root_len = strlen(path);
+
+	ret = cgroup_walk_tree_parallel(controller, cgroup_name, 1,
+			CGROUP_WALK_TYPE_POST_DIR, 0, cg_delete_subgroup, &job);
+
+	/* the group was removed meanwhile */
+	if (ret == ECGOTHER && last_errno == ENOENT)
+		ret = 0;
+	return ret;
+}
+
 /**
  * Recursively delete one control group. Moves all tasks from the group and
  * its subgroups to given task file.
@@ -2181,13 +4431,14 @@ static int cg_delete_cgroup_controller(char *cgroup_name, char *controller,
  * @param cgroup_name The group to delete.
  * @param controller The controller, where to delete.
  * @param target_tasks Opened file, where all tasks should be moved.
+ * @param target_path Path to the target tasks file.
  * @param flags Combination of CGFLAG_DELETE_* flags. The function assumes
  *	that CGFLAG_DELETE_RECURSIVE is set.
  * @param delete_root Whether the group itself should be removed(1) or not(0).
  */
 static int cg_delete_cgroup_controller_recursive(char *cgroup_name,
-		char *controller, FILE *target_tasks, int flags,
-		int delete_root)
+		const char *controller, int target_tasks, const char *target_path,
+		int flags, int delete_root)
 {
 	int ret;
 	void *handle;
@@ -2197,12 +4448,23 @@ static int cg_delete_cgroup_controller_recursive(char *cgroup_name,
 
 	cgroup_dbg("Recursively removing %s:%s\n", controller, cgroup_name);
 
+	if (flags & CGFLAG_DELETE_PARALLEL) {
+		ret = cg_delete_cgroup_controller_parallel(cgroup_name,
+				controller, target_tasks, target_path, flags);
+		if (ret == 0 && delete_root)
+			ret = cg_delete_cgroup_controller(cgroup_name,
+					controller, target_tasks,
+					target_path, flags);
+		return ret;
+	}
+
 	ret = cgroup_walk_tree_begin(controller, cgroup_name, 0, &handle,
 			&info, &level);
 
 	if (ret == 0)
 		ret = cgroup_walk_tree_set_flags(&handle,
-				CGROUP_WALK_TYPE_POST_DIR);
+				CGROUP_WALK_TYPE_POST_DIR |
+				CGROUP_WALK_TYPE_DIRS_ONLY);
 
 	if (ret != 0) {
 		cgroup_walk_tree_end(&handle);
@@ -2224,7 +4486,7 @@ static int cg_delete_cgroup_controller_recursive(char *cgroup_name,
 
 			ret = cg_delete_cgroup_controller(child_name,
 					controller, target_tasks,
-					flags);
+					target_path, flags);
 			if (ret != 0)
 				break;
 		}
@@ -2239,7 +4501,7 @@ static int cg_delete_cgroup_controller_recursive(char *cgroup_name,
 		if (delete_root)
 			ret = cg_delete_cgroup_controller(cgroup_name,
 					controller, target_tasks,
-					flags);
+					target_path, flags);
 	}
 
 	cgroup_walk_tree_end(&handle);
@@ -2259,9 +4521,10 @@ int cgroup_delete_cgroup(struct cgroup *cgroup, int ignore_migration)
 
 int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 {
-	FILE *parent_tasks = NULL;
+	int parent_tasks = -1;
 	char parent_path[FILENAME_MAX];
 	int first_error = 0, first_errno = 0;
+	int first[CG_CONTROLLER_MAX];
 	int i, ret;
 	char *parent_name = NULL;
 	int delete_group = 1;
@@ -2282,9 +4545,12 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 	}
 
 	/*
-	 * Remove the group from all controllers.
+	 * Remove the group from all hierarchies.
 	 */
+	cg_first_in_hierarchy(cgroup, first);
 	for (i = 0; i < cgroup->index; i++) {
+		if (!first[i])
+			continue;
 		ret = 0;
 
 		/* find parent, it can be different for each controller */
@@ -2326,7 +4592,7 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 			}
 		}
 
-		if (parent_name) {
+		if (parent_name && !(flags & CGFLAG_DELETE_NO_MIGRATION)) {
 			/* tasks need to be moved, pre-open target tasks file */
 			if (!cg_build_path(parent_name, parent_path,
 					cgroup->controller[i]->name)) {
@@ -2335,11 +4601,15 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 				free(parent_name);
 				continue;
 			}
-			strncat(parent_path, "/tasks", sizeof(parent_path)
-					- strlen(parent_path));
-
-			parent_tasks = fopen(parent_path, "we");
-			if (!parent_tasks) {
+			strncat(parent_path, "/", sizeof(parent_path) -
+					strlen(parent_path));
+			strncat(parent_path, (flags & CGFLAG_DELETE_RECURSIVE) ?
+					"cgroup.procs" :
+					cg_tasks_file(cgroup->controller[i]->name),
+					sizeof(parent_path) - strlen(parent_path));
+
+			parent_tasks = cg_open(parent_path, O_WRONLY | O_CLOEXEC);
+			if (parent_tasks < 0) {
 				if (first_error == 0) {
 					cgroup_warn("Warning: cannot open tasks file %s: %s\n",
 							parent_path,
@@ -2355,17 +4625,17 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 			ret = cg_delete_cgroup_controller_recursive(
 					cgroup->name,
 					cgroup->controller[i]->name,
-					parent_tasks, flags,
+					parent_tasks, parent_path, flags,
 					delete_group);
 		} else {
 			ret = cg_delete_cgroup_controller(cgroup->name,
 					cgroup->controller[i]->name,
-					parent_tasks, flags);
+					parent_tasks, parent_path, flags);
 		}
 
-		if (parent_tasks) {
-			fclose(parent_tasks);
-			parent_tasks = NULL;
+		if (parent_tasks >= 0) {
+			close(parent_tasks);
+			parent_tasks = -1;
 		}
 		free(parent_name);
 		parent_name = NULL;
@@ -2374,13 +4644,14 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 		 * error code, but continue with next controller and try remove
 		 * the group from all of them.
 		 */
-		if (ret != 0 && first_error == 0) {
+		if (ret != 0 && (first_error == 0 ||
+					first_error == ECGNONEMPTY)) {
 			/*
 			 * ECGNONEMPTY is more or less not an error, but an
 			 * indication that something was not removed.
 			 * Therefore it should be replaced by any other error.
 			 */
-			if (ret != ECGNONEMPTY || first_error == ECGNONEMPTY) {
+			if (ret != ECGNONEMPTY || first_error == 0) {
 				first_errno = last_errno;
 				first_error = ret;
 			}
@@ -2398,150 +4669,246 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 }
 
 /*
- * This function should really have more checks, but this version
- * will assume that the callers have taken care of everything.
- * Including the locking.
+ * Read one control file relative to the group directory dirfd into buf of
+ * CG_VALUE_MAX bytes, without the trailing newline. A file which cannot be
+ * read gives an empty value.
+ * Returns -1 if the file cannot be opened.
  */
-static int cg_rd_ctrl_file(const char *subsys, const char *cgroup,
-					const char *file, char **value)
+static int cg_read_value_at(int dirfd, const char *name, char *buf)
 {
-	char path[FILENAME_MAX];
-	FILE *ctrl_file = NULL;
-	int ret;
+	ssize_t ret;
+	int fd;
 
-	if (!cg_build_path_locked(cgroup, path, subsys))
-		return ECGFAIL;
-
-	strncat(path, file, sizeof(path) - strlen(path));
-	ctrl_file = fopen(path, "re");
-	if (!ctrl_file)
-		return ECGROUPVALUENOTEXIST;
-
-	*value = calloc(CG_VALUE_MAX, 1);
-	if (!*value) {
-		fclose(ctrl_file);
-		last_errno = errno;
-		return ECGOTHER;
-	}
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
 
 	/*
-	 * using %as crashes when we try to read from files like
-	 * memory.stat
+	 * Only the beginning of files like memory.stat fits, as with the
+	 * other values.
 	 */
-	ret = fread(*value, 1, CG_VALUE_MAX-1, ctrl_file);
-	if (ret < 0) {
-		free(*value);
-		*value = NULL;
-	} else {
-		/* remove trailing \n */
-		if (ret > 0 && (*value)[ret-1] == '\n')
-			(*value)[ret-1] = '\0';
-	}
-
-	fclose(ctrl_file);
+	do {
+		ret = read(fd, buf, CG_VALUE_MAX - 1);
+	} while (ret < 0 && errno == EINTR);
+	close(fd);
 
+	if (ret < 0)
+		ret = 0;
+	if (ret > 0 && buf[ret - 1] == '\n')
+		ret--;
+	buf[ret] = '\0';
 	return 0;
 }
 
+/* What cg_fill_controller_locked() reads from one hierarchy. */
+enum cg_fill_mode {
+	CG_FILL_NONE,		/* nothing */
+	CG_FILL_ALL,		/* all parameters */
+	CG_FILL_MATCH,		/* parameters matching some of the names */
+	CG_FILL_LITERAL,	/* exactly the named parameters */
+};
+
 /*
- * Call this function with required locks taken.
- */
-static int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgroup,
-			struct cgroup_controller *cgc, int cg_index)
-{
-	char *ctrl_name = NULL;
-	char *ctrl_file = NULL;
-	char *ctrl_value = NULL;
-	char *d_name = NULL;
-	char *tmp_path = NULL;
-	int tmp_len = 0;
-	char path[FILENAME_MAX+1];
-	char *buffer = NULL;
-	int error = 0;
-	struct stat stat_buffer;
+ * Check whether name selects some parameters of controller: either it is a
+ * pattern of the controller name itself, or its part before the first dot
+ * matches the controller.
+ */
+static int cg_name_selects(const char *name, const char *controller,
+		int *whole)
+{
+	char part[FILENAME_MAX];
+	const char *dot = strchr(name, '.');
+	size_t len;
 
-	d_name = strdup(ctrl_dir->d_name);
+	*whole = !dot;
+	if (!dot)
+		return !fnmatch(name, controller, 0);
 
-	if (!strcmp(d_name, ".") || !strcmp(d_name, "..")) {
-		error = ECGINVAL;
-		goto fill_error;
-	}
+	len = dot - name;
+	if (len >= sizeof(part))
+		return 0;
+	memcpy(part, name, len);
+	part[len] = '\0';
+	return !fnmatch(part, controller, 0);
+}
 
+static enum cg_fill_mode cg_fill_mode(const char *controller,
+		const char * const *names)
+{
+	enum cg_fill_mode mode = CG_FILL_NONE;
+	int whole;
+	int i;
 
-	/*
-	 * This part really needs to be optimized out. Probably use
-	 * some sort of a flag, but this is fine for now.
-	 */
+	if (!names)
+		return CG_FILL_ALL;
 
-	cg_build_path_locked(cgroup->name, path, cg_mount_table[cg_index].name);
-	strncat(path, d_name, sizeof(path) - strlen(path));
+	for (i = 0; names[i]; i++) {
+		if (!cg_name_selects(names[i], controller, &whole))
+			continue;
+		if (whole)
+			return CG_FILL_ALL;
+		if (strpbrk(names[i], "*?[\\"))
+			mode = CG_FILL_MATCH;
+		else if (mode == CG_FILL_NONE)
+			mode = CG_FILL_LITERAL;
+	}
+	return mode;
+}
 
-	error = stat(path, &stat_buffer);
+/*
+ * Take the owner of control files from one of them, they all have the same
+ * owner: the one of the users who manage the cgroup shares.
+ */
+static void cg_fill_control_owner(struct cgroup *cgroup, int dirfd,
+		const char *name, int *owner_found)
+{
+	struct stat stat_buffer;
 
-	if (error) {
-		error = ECGFAIL;
-		goto fill_error;
-	}
+	if (*owner_found || fstatat(dirfd, name, &stat_buffer, 0))
+		return;
+	cgroup->control_uid = stat_buffer.st_uid;
+	cgroup->control_gid = stat_buffer.st_gid;
+	*owner_found = 1;
+}
 
-	/*
-	 * We have already stored the tasks_uid & tasks_gid.
-	 * This check is to avoid the overwriting of the values
-	 * stored in control_uid & cotrol_gid. tasks file will
-	 * have the uid and gid of the user who is capable of
-	 * putting a task to this cgroup. control_uid and control_gid
-	 * is meant for the users who are capable of managing the
-	 * cgroup shares.
-	 *
-	 * The strstr() function will return the pointer to the
-	 * beginning of the sub string "/tasks".
-	 */
-	tmp_len = strlen(path) - strlen("/tasks");
+/*
+ * Read ownership and control files of the group in hierarchy
+ * cg_mount_table[index] in a single pass over its directory, or only the
+ * files selected by names (see cgroup_get_cgroup_filtered()); names NULL
+ * selects all of them. Named parameters without wildcards are opened
+ * directly without reading the directory.
+ * Returns ECGROUPNOTEXIST if the group does not exist in that hierarchy or
+ * the hierarchy is not selected.
+ * Call with cg_mount_table_lock taken.
+ */
+static int cg_fill_controller_locked(struct cgroup *cgroup, int index,
+		const char * const *names)
+{
+	const char *controller = cg_mount_table[index].name;
+	const char *tasks = cg_mount_table[index].unified ? "cgroup.procs" :
+		"tasks";
+	size_t controller_len = strlen(controller);
+	struct cgroup_controller *cgc;
+	char value[CG_VALUE_MAX];
+	char path[FILENAME_MAX];
+	struct stat stat_buffer;
+	enum cg_fill_mode mode;
+	struct dirent *ent;
+	int owner_found = 0;
+	DIR *dir;
+	int whole;
+	int error;
+	int fd;
+	int i, j;
 
-	/*
-	 * tmp_path would be pointing to the last six characters
-	 */
-	tmp_path = (char *)path + tmp_len;
+	mode = cg_fill_mode(controller, names);
+	if (mode == CG_FILL_NONE)
+		return ECGROUPNOTEXIST;
+
+	if (!cg_build_path_locked(cgroup->name, path, controller))
+		return ECGROUPNOTEXIST;
+
+	fd = cg_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return ECGROUPNOTEXIST;
+		last_errno = errno;
+		return ECGOTHER;
+	}
 
 	/*
-	 * Checking to see, if this is actually a 'tasks' file
-	 * We need to compare the last 6 bytes
+	 * Get the uid and gid information
 	 */
-	if (strcmp(tmp_path, "/tasks")){
-		cgroup->control_uid = stat_buffer.st_uid;
-		cgroup->control_gid = stat_buffer.st_gid;
+	if (fstatat(fd, tasks, &stat_buffer, 0)) {
+		last_errno = errno;
+		close(fd);
+		return ECGOTHER;
 	}
+	cgroup->tasks_uid = stat_buffer.st_uid;
+	cgroup->tasks_gid = stat_buffer.st_gid;
 
-	ctrl_name = strtok_r(d_name, ".", &buffer);
-
-	if (!ctrl_name) {
-		error = ECGFAIL;
-		goto fill_error;
+	cgc = cgroup_add_controller(cgroup, controller);
+	if (!cgc) {
+		close(fd);
+		return ECGINVAL;
 	}
 
-	ctrl_file = strtok_r(NULL, ".", &buffer);
+	if (mode == CG_FILL_LITERAL) {
+		error = 0;
+		for (i = 0; names[i]; i++) {
+			if (!cg_name_selects(names[i], controller, &whole) ||
+					strchr(names[i], '/'))
+				continue;
+			if (cg_read_value_at(fd, names[i], value))
+				continue;
+			cg_fill_control_owner(cgroup, fd, names[i],
+					&owner_found);
+			error = cgroup_add_value_string(cgc, names[i], value);
+			if (error == ECGVALUEEXISTS)
+				error = 0;
+			if (error) {
+				error = ECGFAIL;
+				break;
+			}
+		}
+		close(fd);
+		if (error)
+			return error;
+		goto out;
+	}
 
-	if (!ctrl_file) {
-		error = ECGINVAL;
-		goto fill_error;
+	dir = fdopendir(fd);
+	if (!dir) {
+		last_errno = errno;
+		close(fd);
+		return ECGOTHER;
 	}
 
-	if (strcmp(ctrl_name, cg_mount_table[cg_index].name) == 0) {
-		error = cg_rd_ctrl_file(cg_mount_table[cg_index].name,
-				cgroup->name, ctrl_dir->d_name, &ctrl_value);
-		if (error || !ctrl_value)
-			goto fill_error;
+	while ((ent = readdir(dir)) != NULL) {
+		/*
+		 * Skip over non regular files
+		 */
+		if (ent->d_type != DT_REG)
+			continue;
+
+		/*
+		 * The tasks file has the uid and gid of the user who is
+		 * capable of putting a task to this cgroup.
+		 */
+		if (strcmp(ent->d_name, tasks))
+			cg_fill_control_owner(cgroup, fd, ent->d_name,
+					&owner_found);
+
+		/* only <controller>.<parameter> files */
+		if (strncmp(ent->d_name, controller, controller_len) ||
+				ent->d_name[controller_len] != '.' ||
+				ent->d_name[controller_len + 1] == '\0')
+			continue;
+
+		if (mode == CG_FILL_MATCH) {
+			for (i = 0; names[i]; i++)
+				if (strchr(names[i], '.') &&
+					!fnmatch(names[i], ent->d_name, 0))
+					break;
+			if (!names[i])
+				continue;
+		}
+
+		if (cg_read_value_at(fd, ent->d_name, value))
+			continue;
 
-		if (cgroup_add_value_string(cgc, ctrl_dir->d_name,
-				ctrl_value)) {
-			error = ECGFAIL;
-			goto fill_error;
+		if (cgroup_add_value_string(cgc, ent->d_name, value)) {
+			closedir(dir);
+			return ECGFAIL;
 		}
 	}
-fill_error:
-	if (ctrl_value)
-		free(ctrl_value);
-	free(d_name);
-	return error;
+	closedir(dir);
+
+out:
+	for (j = 0; j < cgc->index; j++)
+		cgc->values[j]->dirty = false;
+
+	return 0;
 }
 
 /*
@@ -2552,105 +4919,33 @@ fill_error:
  */
 int cgroup_get_cgroup(struct cgroup *cgroup)
 {
-	int i, j;
-	char path[FILENAME_MAX];
-	DIR *dir = NULL;
-	struct dirent *ctrl_dir = NULL;
-	char *control_path = NULL;
-	int error;
-	int ret;
-
-	if (!cgroup_initialized) {
-		/* ECGROUPNOTINITIALIZED */
-		return ECGROUPNOTINITIALIZED;
-	}
-
-	if (!cgroup) {
-		/* ECGROUPNOTALLOWED */
-		return ECGROUPNOTALLOWED;
-	}
-
-	pthread_rwlock_rdlock(&cg_mount_table_lock);
-	for (i = 0; i < CG_CONTROLLER_MAX &&
-			cg_mount_table[i].name[0] != '\0'; i++) {
-		struct cgroup_controller *cgc;
-		struct stat stat_buffer;
-		int path_len;
-
-		if (!cg_build_path_locked(NULL, path,
-					cg_mount_table[i].name))
-			continue;
-
-		path_len = strlen(path);
-		strncat(path, cgroup->name, FILENAME_MAX - path_len - 1);
-
-		if (access(path, F_OK))
-			continue;
-
-		if (!cg_build_path_locked(cgroup->name, path,
-					cg_mount_table[i].name)) {
-			/*
-			 * This fails when the cgroup does not exist
-			 * for that controller.
-			 */
-			continue;
-		}
-
-		/*
-		 * Get the uid and gid information
-		 */
-
-		ret = asprintf(&control_path, "%s/tasks", path);
-
-		if (ret < 0) {
-			last_errno = errno;
-			error = ECGOTHER;
-			goto unlock_error;
-		}
-
-		if (stat(control_path, &stat_buffer)) {
-			last_errno = errno;
-			free(control_path);
-			error = ECGOTHER;
-			goto unlock_error;
-		}
+	return cgroup_get_cgroup_filtered(cgroup, NULL);
+}
 
-		cgroup->tasks_uid = stat_buffer.st_uid;
-		cgroup->tasks_gid = stat_buffer.st_gid;
+int cgroup_get_cgroup_filtered(struct cgroup *cgroup,
+		const char * const *names)
+{
+	int error = 0;
+	int i;
 
-		free(control_path);
+	if (!cgroup_initialized) {
+		/* ECGROUPNOTINITIALIZED */
+		return ECGROUPNOTINITIALIZED;
+	}
 
-		cgc = cgroup_add_controller(cgroup,
-				cg_mount_table[i].name);
-		if (!cgc) {
-			error = ECGINVAL;
-			goto unlock_error;
-		}
+	if (!cgroup) {
+		/* ECGROUPNOTALLOWED */
+		return ECGROUPNOTALLOWED;
+	}
 
-		dir = opendir(path);
-		if (!dir) {
-			last_errno = errno;
-			error = ECGOTHER;
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; i < CG_CONTROLLER_MAX &&
+			cg_mount_table[i].name[0] != '\0'; i++) {
+		error = cg_fill_controller_locked(cgroup, i, names);
+		if (error == ECGROUPNOTEXIST)
+			continue;
+		if (error)
 			goto unlock_error;
-		}
-
-		while ((ctrl_dir = readdir(dir)) != NULL) {
-			/*
-			 * Skip over non regular files
-			 */
-			if (ctrl_dir->d_type != DT_REG)
-				continue;
-
-			error = cgroup_fill_cgc(ctrl_dir, cgroup, cgc, i);
-			for (j = 0; j < cgc->index; j++)
-				cgc->values[j]->dirty = false;
-
-			if (error == ECGFAIL) {
-				closedir(dir);
-				goto unlock_error;
-			}
-		}
-		closedir(dir);
 	}
 
 	/* Check if the group really exists or not */
@@ -2802,50 +5097,154 @@ static struct cgroup_rule *cgroup_find_matching_rule_uid_gid(uid_t uid,
 	return NULL;
 }
 
+static bool cg_rule_procname_match(struct cgroup_rule *rule,
+		const char *procname, const char *base)
+{
+	/* If procname is NULL, any rule matching UID or GID is fine. */
+	if (!procname)
+		return true;
+	/* If no process name in a rule, that means wildcard */
+	if (!rule->procname)
+		return true;
+	if (!strcmp(rule->procname, procname))
+		return true;
+	/* Check a rule of basename. */
+	return base && !strcmp(rule->procname, base);
+}
+
+/*
+ * Each bucket is sorted by the rule ordinal, so looking further than the
+ * best candidate found so far is pointless.
+ */
+#define cg_rule_before(rule, best) (!(best) || \
+		(rule)->ordinal < (best)->ordinal)
+
+static struct cgroup_rule *cg_rule_index_lookup_proc(
+		struct cgroup_rule_index *idx, const char *name,
+		struct cgroup_rule *best)
+{
+	struct cgroup_rule *itr;
+
+	itr = idx->proc_hash[cg_hash_string(name, idx->size)];
+	for (; itr && cg_rule_before(itr, best); itr = itr->hash_next) {
+		if (!strcmp(itr->procname, name))
+			return itr;
+	}
+
+	return best;
+}
+
+/*
+ * Find the first matching rule using the rule index. The result is the same
+ * as of the linear walk done by cgroup_find_matching_rule_uid_gid(), as long
+ * as neither uid nor gid is one of the CGRULE_* special values.
+ */
+static struct cgroup_rule *cgroup_find_matching_rule_indexed(
+		struct cgroup_rule_index *idx,
+		struct cgroup_rule_members *members, uid_t uid, gid_t gid,
+		const char *procname, const char *base)
+{
+	struct cgroup_rule_member *member;
+	struct cgroup_rule *best;
+	struct cgroup_rule *itr;
+
+	/* The wildcard rule always matches. */
+	best = procname ? idx->wild : idx->first_wild;
+
+	itr = idx->uid_hash[cg_hash_id(uid, idx->size)];
+	for (; itr && cg_rule_before(itr, best); itr = itr->hash_next) {
+		if (itr->uid == uid &&
+				cg_rule_procname_match(itr, procname, base)) {
+			best = itr;
+			break;
+		}
+	}
+
+	itr = idx->gid_hash[cg_hash_id(gid, idx->size)];
+	for (; itr && cg_rule_before(itr, best); itr = itr->hash_next) {
+		if (itr->gid == gid &&
+				cg_rule_procname_match(itr, procname, base)) {
+			best = itr;
+			break;
+		}
+	}
+
+	if (procname) {
+		best = cg_rule_index_lookup_proc(idx, procname, best);
+		if (base && strcmp(base, procname))
+			best = cg_rule_index_lookup_proc(idx, base, best);
+	}
+
+	/* The UID might be a member of group of an '@group' rule. */
+	member = members->hash[cg_hash_id(uid, members->size)];
+	for (; member && cg_rule_before(member->rule, best);
+			member = member->next) {
+		if (member->uid == uid &&
+			cg_rule_procname_match(member->rule, procname, base)) {
+			best = member->rule;
+			break;
+		}
+	}
+
+	return best;
+}
+
 /**
- * Finds the first rule in the cached list that matches the given UID, GID
- * or PROCESS NAME, and returns a pointer to that rule.
- * This function uses rl_lock.
+ * Finds the first rule in a snapshot of the cached rules that matches the
+ * given UID, GID or PROCESS NAME, and returns a pointer to that rule.
+ * The rule index is used when available, otherwise the list of rules is
+ * walked. No lock is held while matching, the snapshot does not change.
  *
- * This function may NOT be thread safe.
+ *	@param list The snapshot, the caller holds a reference to it
  *	@param uid The UID to match
  *	@param gid The GID to match
  *	@param procname The PROCESS NAME to match
  *	@return Pointer to the first matching rule, or NULL if no match
- * TODO: Determine thread-safeness and fix if not safe.
  */
-static struct cgroup_rule *cgroup_find_matching_rule(uid_t uid,
-				gid_t gid, const char *procname)
+static struct cgroup_rule *cgroup_find_matching_rule(
+		struct cgroup_rule_list *list, uid_t uid,
+		gid_t gid, const char *procname)
 {
 	/* Return value */
-	struct cgroup_rule *ret = rl.head;
+	struct cgroup_rule *ret = NULL;
+	struct cgroup_rule_members *members;
 	char *base = NULL;
 
-	pthread_rwlock_wrlock(&rl_lock);
+	if (procname)
+		base = cgroup_basename(procname);
+
+	if (list->index && uid != CGRULE_INVALID && uid != CGRULE_WILD &&
+			gid != CGRULE_INVALID && gid != CGRULE_WILD) {
+		members = cg_rule_members_get(list);
+
+		/*
+		 * Resolved group members are too old, resolve them again.
+		 * Only one caller does it, the others use the old ones.
+		 */
+		if (rl_group_ttl &&
+			time(NULL) - members->resolved >= rl_group_ttl &&
+			!pthread_mutex_trylock(&rl_parse_lock)) {
+			cg_rule_list_refresh_groups(list);
+			pthread_mutex_unlock(&rl_parse_lock);
+		}
+
+		ret = cgroup_find_matching_rule_indexed(list->index, members,
+				uid, gid, procname, base);
+		cg_rule_members_put(members);
+		goto out;
+	}
+
+	ret = list->head;
 	while (ret) {
 		ret = cgroup_find_matching_rule_uid_gid(uid, gid, ret);
 		if (!ret)
 			break;
-		if (!procname)
-			/* If procname is NULL, return a rule matching
-			 * UID or GID */
-			break;
-		if (!ret->procname)
-			/* If no process name in a rule, that means wildcard */
-			break;
-		if (!strcmp(ret->procname, procname))
-			break;
-
-		base = cgroup_basename(procname);
-		if (!strcmp(ret->procname, base))
-			/* Check a rule of basename. */
+		if (cg_rule_procname_match(ret, procname, base))
 			break;
 		ret = ret->next;
-		free(base);
-		base = NULL;
 	}
-	pthread_rwlock_unlock(&rl_lock);
 
+out:
 	if (base)
 		free(base);
 
@@ -2870,7 +5269,7 @@ int cgroup_exist_in_subsystem(char *controller_name, char *prefix)
 		goto end;
 	}
 
-	dir = opendir(path);
+	dir = cg_opendir(path);
 	if (dir == NULL) {
 		/* cgroup in wanted subsystem does not exist */
 		ret = 1;
@@ -2936,6 +5335,123 @@ end:
 
 
 
+/*
+ * Cache of the groups created by cgroup_create_template_group(), so the path
+ * is checked and created only for the first process classified into it. The
+ * key is the list of controllers of the rule and the group name. Entries are
+ * dropped when the templates are reloaded, or when the group turns out to
+ * be removed.
+ */
+#define CG_TEMPLATE_GROUPS_SIZE		256
+#define CG_TEMPLATE_GROUPS_MAX		4096
+
+struct cg_template_group {
+	struct cg_template_group *next;
+	char key[];
+};
+
+static struct cg_template_group *cg_template_groups[CG_TEMPLATE_GROUPS_SIZE];
+static int cg_template_groups_count;
+static pthread_mutex_t cg_template_groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cg_template_groups_flush_locked(void)
+{
+	struct cg_template_group *group;
+	int i;
+
+	for (i = 0; i < CG_TEMPLATE_GROUPS_SIZE; i++) {
+		while ((group = cg_template_groups[i])) {
+			cg_template_groups[i] = group->next;
+			free(group);
+		}
+	}
+	cg_template_groups_count = 0;
+}
+
+void cg_template_groups_flush(void)
+{
+	pthread_mutex_lock(&cg_template_groups_lock);
+	cg_template_groups_flush_locked();
+	pthread_mutex_unlock(&cg_template_groups_lock);
+}
+
+static void cg_template_group_key(char *key, size_t size, const char *name,
+		const struct cgroup_rule *rule)
+{
+	size_t len = 0;
+	int i;
+
+	key[0] = '\0';
+	for (i = 0; i < MAX_MNT_ELEMENTS && rule->controllers[i]; i++)
+		len += snprintf(key + len, len < size ? size - len : 0,
+				"%s,", rule->controllers[i]);
+	if (len < size)
+		snprintf(key + len, size - len, ":%s", name);
+}
+
+static struct cg_template_group **cg_template_group_find_locked(
+		const char *key)
+{
+	struct cg_template_group **group;
+
+	group = &cg_template_groups[cg_hash_string(key,
+			CG_TEMPLATE_GROUPS_SIZE)];
+	while (*group && strcmp((*group)->key, key))
+		group = &(*group)->next;
+	return group;
+}
+
+static int cg_template_group_cached(const char *key)
+{
+	int found;
+
+	pthread_mutex_lock(&cg_template_groups_lock);
+	found = *cg_template_group_find_locked(key) != NULL;
+	pthread_mutex_unlock(&cg_template_groups_lock);
+	return found;
+}
+
+static void cg_template_group_add(const char *key)
+{
+	struct cg_template_group **slot, *group;
+	size_t len = strlen(key);
+
+	group = malloc(sizeof(*group) + len + 1);
+	if (!group)
+		return;
+	memcpy(group->key, key, len + 1);
+
+	pthread_mutex_lock(&cg_template_groups_lock);
+	/* e.g. per-process templates, don't grow without limits */
+	if (cg_template_groups_count >= CG_TEMPLATE_GROUPS_MAX)
+		cg_template_groups_flush_locked();
+
+	slot = cg_template_group_find_locked(key);
+	if (!*slot) {
+		group->next = NULL;
+		*slot = group;
+		cg_template_groups_count++;
+		group = NULL;
+	}
+	pthread_mutex_unlock(&cg_template_groups_lock);
+	free(group);
+}
+
+static void cg_template_group_forget(const char *key)
+{
+	struct cg_template_group **slot, *group;
+
+	pthread_mutex_lock(&cg_template_groups_lock);
+	slot = cg_template_group_find_locked(key);
+	group = *slot;
+	if (group) {
+		*slot = group->next;
+		cg_template_groups_count--;
+	}
+	pthread_mutex_unlock(&cg_template_groups_lock);
+	free(group);
+}
+
 /* create control group based given template
  * if the group already don't exist
  * dest is template name with substitute variables
@@ -3043,19 +5559,261 @@ end:
 	return ret;
 }
 
+/* Number of moves skipped because of CGFLAG_SKIP_CURRENT */
+static unsigned long cg_moves_skipped;
+
+/*
+ * Where the identity and the groups of processes are read from. It is
+ * shorter than FILENAME_MAX, so "<root>/<pid>/<file>" paths always fit.
+ */
+#define CG_PROC_ROOT_MAX	(FILENAME_MAX - 32)
+static char cg_proc_root[CG_PROC_ROOT_MAX] = "/proc";
+
+int cgroup_set_proc_root(const char *path)
+{
+	if (!path)
+		path = "/proc";
+	if (strlen(path) >= sizeof(cg_proc_root))
+		return ECGINVAL;
+	strcpy(cg_proc_root, path);
+	return 0;
+}
+
+/**
+ * Read /proc/<pid>/cgroup.
+ *	@return Malloc'ed contents, NULL if the process does not exist or on
+ *	error
+ */
+static char *cg_read_proc_cgroups(pid_t pid)
+{
+	char path[FILENAME_MAX];
+	char *cgroups;
+	int fd;
+
+	/* the process may be gone, that is not an error */
+	snprintf(path, sizeof(path), "%s/%d/cgroup", cg_proc_root, pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	cgroups = cg_read_file(fd);
+	close(fd);
+	return cgroups;
+}
+
+/**
+ * Find the path of a hierarchy with given controller in the contents of
+ * /proc/<pid>/cgroup. The unified hierarchy is the "0::<path>" line, with
+ * no controllers listed.
+ *	@param unified Whether the controller is in the unified hierarchy
+ *	@return Start of the path without the leading '/' and its length in
+ *	@c len, NULL if the controller is not there
+ */
+static const char *cg_proc_cgroup_path(const char *cgroups,
+		const char *controller, int unified, size_t *len)
+{
+	size_t clen = strlen(controller);
+	const char *line, *ctrl, *end;
+
+	for (line = cgroups; *line; line = end + (*end == '\n')) {
+		end = strchrnul(line, '\n');
+		if (unified) {
+			if (strncmp(line, "0::", 3))
+				continue;
+			ctrl = line + 3;
+			if (*ctrl == '/')
+				ctrl++;
+			*len = end - ctrl;
+			return ctrl;
+		}
+		ctrl = memchr(line, ':', end - line);
+		if (!ctrl)
+			continue;
+		ctrl++;
+		while (ctrl < end && *ctrl != ':') {
+			if (!strncmp(ctrl, controller, clen) &&
+					(ctrl[clen] == ',' || ctrl[clen] == ':'))
+				break;
+			ctrl = memchr(ctrl, ',', end - ctrl);
+			if (!ctrl)
+				ctrl = end;
+			else
+				ctrl++;
+		}
+		if (ctrl >= end || *ctrl == ':')
+			continue;
+		ctrl = memchr(ctrl, ':', end - ctrl);
+		if (!ctrl)
+			continue;
+		ctrl++;
+		if (*ctrl == '/')
+			ctrl++;
+		*len = end - ctrl;
+		return ctrl;
+	}
+	return NULL;
+}
+
+/**
+ * Check whether a process is already in the destination of a rule in all
+ * its hierarchies.
+ *	@param cgroups Contents of /proc/<pid>/cgroup
+ */
+static int cg_proc_in_destination(const char *cgroups, const char *dest,
+		char * const controllers[])
+{
+	const char *path;
+	size_t len, dlen;
+	int i, in = 1;
+
+	while (*dest == '/')
+		dest++;
+	dlen = strlen(dest);
+	while (dlen && dest[dlen - 1] == '/')
+		dlen--;
+
+	if (controllers[0] && !strcmp(controllers[0], "*")) {
+		pthread_rwlock_rdlock(&cg_mount_table_lock);
+		for (i = 0; in && i < CG_CONTROLLER_MAX &&
+				cg_mount_table[i].name[0] != '\0'; i++) {
+			path = cg_proc_cgroup_path(cgroups,
+					cg_mount_table[i].name,
+					cg_mount_table[i].unified, &len);
+			in = path && len == dlen && !strncmp(path, dest, len);
+		}
+		pthread_rwlock_unlock(&cg_mount_table_lock);
+		return in;
+	}
+
+	for (i = 0; in && i < MAX_MNT_ELEMENTS && controllers[i]; i++) {
+		path = cg_proc_cgroup_path(cgroups, controllers[i],
+				cg_controller_unified(controllers[i]), &len);
+		in = path && len == dlen && !strncmp(path, dest, len);
+	}
+	return in;
+}
+
+/**
+ * Substitute the %U, %u, %G, %g, %P and %p variables of the destination of
+ * a rule.
+ *	@param rule The rule
+ *	@param uid The UID of the process
+ *	@param gid The GID of the process
+ *	@param procname The PROCESS NAME of the process, or NULL
+ *	@param pid The PID of the process
+ *	@param newdest Buffer of FILENAME_MAX bytes for the destination
+ */
+static void cg_rule_destination(const struct cgroup_rule *rule, uid_t uid,
+		gid_t gid, const char *procname, pid_t pid, char *newdest)
+{
+	const struct cgroup_rule *tmp = rule;
+	struct passwd pwd, *user_info;
+	struct group grp, *group_info;
+	char buf[4096];
+	int written;
+	int available;
+	int i, j;
+
+	for(j = i = 0; i < strlen(tmp->destination) &&
+		(j < FILENAME_MAX - 2); ++i, ++j) {
+		if(tmp->destination[i] == '%') {
+			/* How many bytes did we write / error check */
+			written = 0;
+			/* How many bytes can we write */
+			available = FILENAME_MAX - j - 2;
+			/* Substitution */
+			switch(tmp->destination[++i]) {
+			case 'U':
+				written = snprintf(newdest+j, available,
+					"%d", uid);
+				break;
+			case 'u':
+				if (!getpwuid_r(uid, &pwd, buf, sizeof(buf),
+						&user_info) && user_info) {
+					written = snprintf(newdest + j,
+						available, "%s",
+						user_info -> pw_name);
+				} else {
+					written = snprintf(newdest + j,
+						available, "%d", uid);
+				}
+				break;
+			case 'G':
+				written = snprintf(newdest + j,
+					available, "%d", gid);
+				break;
+			case 'g':
+				if (!getgrgid_r(gid, &grp, buf, sizeof(buf),
+						&group_info) && group_info) {
+					written = snprintf(newdest + j,
+						available, "%s",
+						group_info -> gr_name);
+				} else {
+					written = snprintf(newdest + j,
+						available, "%d", gid);
+				}
+				break;
+			case 'P':
+				written = snprintf(newdest + j,
+					available, "%d", pid);
+				break;
+			case 'p':
+				if(procname) {
+					written = snprintf(newdest + j,
+						available, "%s",
+						procname);
+				} else {
+					written = snprintf(newdest + j,
+						available, "%d", pid);
+				}
+				break;
+			}
+			written = min(written, available);
+			/*
+			 * written<1 only when either error occurred
+			 * during snprintf or if no substitution was
+			 * made at all. In both cases, we want to just
+			 * copy input string.
+			 */
+			if(written<1) {
+				newdest[j] = '%';
+				if(available>1)
+					newdest[++j] =
+						tmp->destination[i];
+			} else {
+				/*
+				 * In next iteration, we will write
+				 * just after the substitution, but j
+				 * will get incremented in the
+				 * meantime.
+				 */
+				j += written - 1;
+			}
+		} else {
+			if(tmp->destination[i] == '\\')
+				++i;
+			newdest[j] = tmp->destination[i];
+		}
+	}
+
+	newdest[j] = 0;
+}
+
 int cgroup_change_cgroup_flags(uid_t uid, gid_t gid,
 		const char *procname, pid_t pid, int flags)
 {
 	/* Temporary pointer to a rule */
 	struct cgroup_rule *tmp = NULL;
 
+	/* The first line of the matching rule */
+	struct cgroup_rule *matched;
+
+	/* Snapshot of the cached rules */
+	struct cgroup_rule_list *list = NULL;
+
 	/* Temporary variables for destination substitution */
 	char newdest[FILENAME_MAX];
-	int i, j;
-	int written;
-	int available;
-	struct passwd *user_info;
-	struct group *group_info;
+	char key[2 * FILENAME_MAX];
+	int cached;
 
 	/* Return codes */
 	int ret = 0;
@@ -3085,123 +5843,74 @@ int cgroup_change_cgroup_flags(uid_t uid, gid_t gid,
 		/* We did not find a matching rule, so we're done. */
 		if (ret == 0) {
 			cgroup_dbg("No rule found to match PID: %d, UID: %d, "
-				"GID: %d\n", pid, uid, gid);
-			goto finished;
-		}
-
-		/* Otherwise, we did match a rule and it's in trl. */
-		tmp = trl.head;
-	} else {
-		/* Find the first matching rule in the cached list. */
-		tmp = cgroup_find_matching_rule(uid, gid, procname);
-		if (!tmp) {
-			cgroup_dbg("No rule found to match PID: %d, UID: %d, "
-				"GID: %d\n", pid, uid, gid);
-			ret = 0;
-			goto finished;
-		}
-	}
-	cgroup_dbg("Found matching rule %s for PID: %d, UID: %d, GID: %d\n",
-			tmp->username, pid, uid, gid);
-
-	/* If we are here, then we found a matching rule, so execute it. */
-	do {
-		cgroup_dbg("Executing rule %s for PID %d... ", tmp->username,
-								pid);
-		/* Destination substitutions */
-		for(j = i = 0; i < strlen(tmp->destination) &&
-			(j < FILENAME_MAX - 2); ++i, ++j) {
-			if(tmp->destination[i] == '%') {
-				/* How many bytes did we write / error check */
-				written = 0;
-				/* How many bytes can we write */
-				available = FILENAME_MAX - j - 2;
-				/* Substitution */
-				switch(tmp->destination[++i]) {
-				case 'U':
-					written = snprintf(newdest+j, available,
-						"%d", uid);
-					break;
-				case 'u':
-					user_info = getpwuid(uid);
-					if(user_info) {
-						written = snprintf(newdest + j,
-							available, "%s",
-							user_info -> pw_name);
-					} else {
-						written = snprintf(newdest + j,
-							available, "%d", uid);
-					}
-					break;
-				case 'G':
-					written = snprintf(newdest + j,
-						available, "%d", gid);
-					break;
-				case 'g':
-					group_info = getgrgid(gid);
-					if(group_info) {
-						written = snprintf(newdest + j,
-							available, "%s",
-							group_info -> gr_name);
-					} else {
-						written = snprintf(newdest + j,
-							available, "%d", gid);
-					}
-					break;
-				case 'P':
-					written = snprintf(newdest + j,
-						available, "%d", pid);
-					break;
-				case 'p':
-					if(procname) {
-						written = snprintf(newdest + j,
-							available, "%s",
-							procname);
-					} else {
-						written = snprintf(newdest + j,
-							available, "%d", pid);
-					}
-					break;
-				}
-				written = min(written, available);
-				/*
-				 * written<1 only when either error occurred
-				 * during snprintf or if no substitution was
-				 * made at all. In both cases, we want to just
-				 * copy input string.
-				 */
-				if(written<1) {
-					newdest[j] = '%';
-					if(available>1)
-						newdest[++j] =
-							tmp->destination[i];
-				} else {
-					/*
-					 * In next iteration, we will write
-					 * just after the substitution, but j
-					 * will get incremented in the
-					 * meantime.
-					 */
-					j += written - 1;
-				}
-			} else {
-				if(tmp->destination[i] == '\\')
-					++i;
-				newdest[j] = tmp->destination[i];
-			}
+				"GID: %d\n", pid, uid, gid);
+			CG_TRACE3(rule_nomatch, pid, uid, gid);
+			goto finished;
+		}
+
+		/* Otherwise, we did match a rule and it's in trl. */
+		tmp = trl.head;
+	} else {
+		/*
+		 * Find the first matching rule in the cached list. The
+		 * snapshot must be held for as long as its rules are used.
+		 */
+		list = cg_rule_list_get();
+		if (list)
+			tmp = cgroup_find_matching_rule(list, uid, gid,
+					procname);
+		if (!tmp) {
+			cgroup_dbg("No rule found to match PID: %d, UID: %d, "
+				"GID: %d\n", pid, uid, gid);
+			CG_TRACE3(rule_nomatch, pid, uid, gid);
+			ret = 0;
+			goto finished;
 		}
+	}
+	cgroup_dbg("Found matching rule %s for PID: %d, UID: %d, GID: %d\n",
+			tmp->username, pid, uid, gid);
+	CG_TRACE5(rule_match, pid, uid, gid, tmp->ordinal, tmp->destination);
+	matched = tmp;
 
-		newdest[j] = 0;
+	/* If we are here, then we found a matching rule, so execute it. */
+	do {
+		cgroup_dbg("Executing rule %s for PID %d... ", tmp->username,
+								pid);
+		cg_rule_destination(tmp, uid, gid, procname, pid, newdest);
+		if (flags & CGFLAG_DRY_RUN) {
+			cgroup_dbg("dry run, not moving PID %d to %s\n", pid,
+					newdest);
+			tmp = tmp->next;
+			continue;
+		}
+		cached = 0;
 		if (strcmp(newdest, tmp->destination) != 0) {
 			/* destination tag contains templates */
 
 			cgroup_dbg("control group %s is template\n", newdest);
-			ret = cgroup_create_template_group(newdest, tmp, flags);
+			cg_template_group_key(key, sizeof(key), newdest, tmp);
+			cached = cg_template_group_cached(key);
+			if (!cached) {
+				ret = cgroup_create_template_group(newdest,
+						tmp, flags);
+				if (!ret)
+					cg_template_group_add(key);
+			}
 		}
 
 		/* Apply the rule */
-		ret = cgroup_change_cgroup_path(newdest,
-				pid, (const char * const *)tmp->controllers);
+		ret = cgroup_change_cgroup_path_flags(newdest, pid,
+				(const char * const *)tmp->controllers, flags);
+		if (ret == ECGROUPNOTEXIST && cached) {
+			/* the group was removed since it was created */
+			cgroup_dbg("template group %s is gone\n", newdest);
+			cg_template_group_forget(key);
+			if (!cgroup_create_template_group(newdest, tmp, flags))
+				cg_template_group_add(key);
+			ret = cgroup_change_cgroup_path_flags(newdest, pid,
+				(const char * const *)tmp->controllers,
+				flags);
+		}
 		if (ret) {
 			cgroup_warn("Warning: failed to apply the rule. Error was: %d\n",
 					ret);
@@ -3215,8 +5924,10 @@ int cgroup_change_cgroup_flags(uid_t uid, gid_t gid,
 		 */
 		tmp = tmp->next;
 	} while (tmp && (tmp->username[0] == '%'));
+	__sync_fetch_and_add(&matched->matched, 1);
 
 finished:
+	cg_rule_list_put(list);
 	return ret;
 }
 
@@ -3251,19 +5962,39 @@ int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid)
  */
 int cgroup_change_cgroup_path(const char *dest, pid_t pid,
 				const char *const controllers[])
+{
+	return cgroup_change_cgroup_path_flags(dest, pid, controllers, 0);
+}
+
+int cgroup_change_cgroup_path_flags(const char *dest, pid_t pid,
+		const char *const controllers[], int flags)
 {
 	int ret;
-	int nr;
-	struct cgroup cgroup;
+	int nr, i;
+	struct cgroup_controller *thread_controllers[CG_CONTROLLER_MAX];
+	struct cgroup cgroup, threads;
 	DIR *dir;
 	struct dirent *task_dir = NULL;
 	char path[FILENAME_MAX];
+	char *cgroups;
 	pid_t tid;
 
 	if (!cgroup_initialized) {
 		cgroup_warn("Warning: libcgroup is not initialized\n");
 		return ECGROUPNOTINITIALIZED;
 	}
+
+	if (flags & CGFLAG_SKIP_CURRENT) {
+		cgroups = cg_read_proc_cgroups(pid);
+		nr = cgroups && cg_proc_in_destination(cgroups, dest,
+				(char * const *)controllers);
+		free(cgroups);
+		if (nr) {
+			cgroup_dbg("pid %d is already in %s\n", pid, dest);
+			__sync_fetch_and_add(&cg_moves_skipped, 1);
+			return 0;
+		}
+	}
 	memset(&cgroup, 0, sizeof(struct cgroup));
 
 	ret = cg_prepare_cgroup(&cgroup, pid, dest, controllers);
@@ -3277,7 +6008,22 @@ int cgroup_change_cgroup_path(const char *dest, pid_t pid,
 		goto finished;
 	}
 
-	/* Add all threads to cgroup */
+	/*
+	 * Add all threads to cgroup. Writing the pid to cgroup.procs moved
+	 * the whole process in the unified hierarchy, the threads are moved
+	 * only in the other ones.
+	 */
+	threads = cgroup;
+	threads.controller = thread_controllers;
+	threads.controller_size = CG_CONTROLLER_MAX;
+	threads.index = 0;
+	for (i = 0; i < cgroup.index; i++)
+		if (!cg_controller_unified(cgroup.controller[i]->name))
+			threads.controller[threads.index++] =
+				cgroup.controller[i];
+	if (!threads.index)
+		goto finished;
+
 	snprintf(path, FILENAME_MAX, "/proc/%d/task/", pid);
 	dir = opendir(path);
 	if (!dir) {
@@ -3294,7 +6040,7 @@ int cgroup_change_cgroup_path(const char *dest, pid_t pid,
 		if (tid == pid)
 			continue;
 
-		ret = cgroup_attach_task_pid(&cgroup, tid);
+		ret = cgroup_attach_task_pid(&threads, tid);
 		if (ret) {
 			cgroup_warn("Warning: cgroup_attach_task_pid failed: %d\n",
 					ret);
@@ -3309,6 +6055,11 @@ finished:
 	return ret;
 }
 
+unsigned long cgroup_get_skipped_moves(void)
+{
+	return __sync_fetch_and_add(&cg_moves_skipped, 0);
+}
+
 /**
  * Changes the cgroup of all running PIDs based on the rules in the config
  * file. If a rules exists for a PID, then the PID is placed in the correct
@@ -3338,11 +6089,7 @@ int cgroup_change_all_cgroups(void)
 		if (err < 1)
 			continue;
 
-		err = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
-		if (err)
-			continue;
-
-		err = cgroup_get_procname_from_procfs(pid, &procname);
+		err = cgroup_get_proc_identity(pid, &euid, &egid, &procname);
 		if (err)
 			continue;
 
@@ -3358,6 +6105,304 @@ int cgroup_change_all_cgroups(void)
 	return 0;
 }
 
+/* Tasks moved to one destination of a rule by one attach */
+struct cg_change_batch {
+	struct cgroup_rule *rule;
+	char dest[FILENAME_MAX];
+	/* the destination was created from a template */
+	int template;
+	pid_t *pids;
+	size_t count;
+	size_t size;
+	struct cg_change_batch *next;
+};
+
+/* Flush the batches of a worker when it has more of them */
+#define CG_CHANGE_BATCHES_MAX	64
+
+/* Number of pids a worker takes from the shared list at once */
+#define CG_CHANGE_CHUNK		64
+
+struct cg_change_job {
+	struct cgroup_rule_list *list;
+	pid_t *pids;
+	size_t count;
+	/* next pid to take, updated atomically */
+	size_t next;
+	/* serializes creation of the template groups */
+	pthread_mutex_t template_lock;
+};
+
+struct cg_change_worker {
+	struct cg_change_job *job;
+	struct cg_change_batch *batches;
+	int batches_count;
+};
+
+/**
+ * Move the tasks of a batch to its destination.
+ */
+static void cg_change_batch_flush(struct cg_change_job *job,
+		struct cg_change_batch *batch)
+{
+	const char * const *controllers =
+		(const char * const *)batch->rule->controllers;
+	char key[2 * FILENAME_MAX];
+	struct cgroup cgroup;
+	int ret;
+
+	if (!batch->count)
+		return;
+
+	memset(&cgroup, 0, sizeof(cgroup));
+	ret = cg_prepare_cgroup(&cgroup, batch->pids[0], batch->dest,
+			controllers);
+	if (!ret)
+		ret = cgroup_attach_tasks(&cgroup, batch->pids, batch->count,
+				CGFLAG_ATTACH_PROCS, NULL);
+	if (ret == ECGROUPNOTEXIST && batch->template) {
+		/* the group was removed since it was created */
+		cgroup_dbg("template group %s is gone\n", batch->dest);
+		cg_template_group_key(key, sizeof(key), batch->dest,
+				batch->rule);
+		cg_template_group_forget(key);
+		pthread_mutex_lock(&job->template_lock);
+		if (!cgroup_create_template_group(batch->dest, batch->rule,
+					CGFLAG_USECACHE))
+			cg_template_group_add(key);
+		pthread_mutex_unlock(&job->template_lock);
+		ret = cgroup_attach_tasks(&cgroup, batch->pids, batch->count,
+				CGFLAG_ATTACH_PROCS, NULL);
+	}
+	if (ret)
+		cgroup_dbg("moving %zu processes to %s failed: %d\n",
+				batch->count, batch->dest, ret);
+	cgroup_free_controllers(&cgroup);
+	batch->count = 0;
+}
+
+static void cg_change_batches_flush(struct cg_change_worker *worker)
+{
+	struct cg_change_batch *batch, *next;
+
+	for (batch = worker->batches; batch; batch = next) {
+		next = batch->next;
+		cg_change_batch_flush(worker->job, batch);
+		free(batch->pids);
+		free(batch);
+	}
+	worker->batches = NULL;
+	worker->batches_count = 0;
+}
+
+/**
+ * Add a task to the batch of the destination of a rule.
+ *	@return 0 on success, ECGOTHER when out of memory
+ */
+static int cg_change_batch_add(struct cg_change_worker *worker,
+		struct cgroup_rule *rule, const char *dest, int template,
+		pid_t pid)
+{
+	struct cg_change_batch *batch;
+	pid_t *pids;
+
+	for (batch = worker->batches; batch; batch = batch->next) {
+		if (batch->rule == rule && !strcmp(batch->dest, dest))
+			break;
+	}
+
+	if (!batch) {
+		if (worker->batches_count >= CG_CHANGE_BATCHES_MAX)
+			cg_change_batches_flush(worker);
+		batch = calloc(1, sizeof(*batch));
+		if (!batch) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		batch->rule = rule;
+		strcpy(batch->dest, dest);
+		batch->template = template;
+		batch->next = worker->batches;
+		worker->batches = batch;
+		worker->batches_count++;
+	}
+
+	if (batch->count == batch->size) {
+		pids = realloc(batch->pids, (batch->size ? batch->size * 2 :
+					CG_CHANGE_CHUNK) * sizeof(*pids));
+		if (!pids) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		batch->pids = pids;
+		batch->size = batch->size ? batch->size * 2 : CG_CHANGE_CHUNK;
+	}
+	batch->pids[batch->count++] = pid;
+	return 0;
+}
+
+/**
+ * Classify one process like cgroup_change_cgroup_flags() with the cached
+ * rules, but add it to the batches instead of moving it right away. Lines
+ * of the rule, whose destination the process is already in, are skipped.
+ */
+static void cg_change_pid(struct cg_change_worker *worker, pid_t pid)
+{
+	struct cg_change_job *job = worker->job;
+	struct cgroup_rule *tmp, *matched;
+	char newdest[FILENAME_MAX];
+	char key[2 * FILENAME_MAX];
+	char *procname = NULL;
+	char *cgroups = NULL;
+	int template;
+	uid_t euid;
+	gid_t egid;
+
+	if (cgroup_get_proc_identity(pid, &euid, &egid, &procname))
+		return;
+
+	matched = cgroup_find_matching_rule(job->list, euid, egid, procname);
+	if (!matched)
+		goto out;
+
+	cgroups = cg_read_proc_cgroups(pid);
+	if (!cgroups)
+		goto out;
+
+	tmp = matched;
+	do {
+		cg_rule_destination(tmp, euid, egid, procname, pid, newdest);
+		template = strcmp(newdest, tmp->destination) != 0;
+		if (template) {
+			cg_template_group_key(key, sizeof(key), newdest, tmp);
+			pthread_mutex_lock(&job->template_lock);
+			if (!cg_template_group_cached(key) &&
+				!cgroup_create_template_group(newdest, tmp,
+					CGFLAG_USECACHE))
+				cg_template_group_add(key);
+			pthread_mutex_unlock(&job->template_lock);
+		}
+
+		if (cg_proc_in_destination(cgroups, newdest,
+					tmp->controllers))
+			__sync_fetch_and_add(&cg_moves_skipped, 1);
+		else if (cg_change_batch_add(worker, tmp, newdest, template,
+					pid))
+			goto out;
+		tmp = tmp->next;
+	} while (tmp && (tmp->username[0] == '%'));
+	__sync_fetch_and_add(&matched->matched, 1);
+
+out:
+	free(cgroups);
+	free(procname);
+}
+
+static void *cg_change_worker(void *arg)
+{
+	struct cg_change_worker *worker = arg;
+	struct cg_change_job *job = worker->job;
+	size_t i, end;
+
+	for (;;) {
+		i = __sync_fetch_and_add(&job->next, CG_CHANGE_CHUNK);
+		if (i >= job->count)
+			break;
+		end = min(i + CG_CHANGE_CHUNK, job->count);
+		for (; i < end; i++)
+			cg_change_pid(worker, job->pids[i]);
+	}
+	cg_change_batches_flush(worker);
+	return NULL;
+}
+
+int cgroup_change_all_cgroups_parallel(unsigned int threads)
+{
+	struct cg_change_worker *workers = NULL;
+	struct cg_change_job job;
+	struct dirent *pid_dir;
+	pthread_t *tids = NULL;
+	unsigned int started = 0;
+	size_t size = 0;
+	pid_t *pids;
+	DIR *dir;
+	int ret = 0;
+	int pid;
+	unsigned int i;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("Warning: libcgroup is not initialized\n");
+		return -ECGROUPNOTINITIALIZED;
+	}
+
+	memset(&job, 0, sizeof(job));
+	dir = opendir("/proc/");
+	if (!dir)
+		return -ECGOTHER;
+
+	while ((pid_dir = readdir(dir)) != NULL) {
+		if (sscanf(pid_dir->d_name, "%i", &pid) < 1)
+			continue;
+		if (job.count == size) {
+			size = size ? size * 2 : 1024;
+			pids = realloc(job.pids, size * sizeof(*pids));
+			if (!pids) {
+				last_errno = errno;
+				ret = -ECGOTHER;
+				closedir(dir);
+				goto out;
+			}
+			job.pids = pids;
+		}
+		job.pids[job.count++] = pid;
+	}
+	closedir(dir);
+
+	job.list = cg_rule_list_get();
+	if (!job.list || !job.count)
+		goto out;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > (job.count + CG_CHANGE_CHUNK - 1) / CG_CHANGE_CHUNK)
+		threads = (job.count + CG_CHANGE_CHUNK - 1) / CG_CHANGE_CHUNK;
+	if (threads < 1)
+		threads = 1;
+
+	workers = calloc(threads, sizeof(*workers));
+	tids = calloc(threads, sizeof(*tids));
+	if (!workers || !tids) {
+		last_errno = errno;
+		ret = -ECGOTHER;
+		goto out;
+	}
+	pthread_mutex_init(&job.template_lock, NULL);
+	for (i = 0; i < threads; i++)
+		workers[i].job = &job;
+
+	/* the calling thread is one of the workers */
+	while (started < threads - 1) {
+		if (pthread_create(&tids[started], NULL, cg_change_worker,
+					&workers[started + 1]))
+			break;
+		started++;
+	}
+	cgroup_dbg("classifying %zu processes using %u threads\n", job.count,
+			started + 1);
+
+	cg_change_worker(&workers[0]);
+	while (started)
+		pthread_join(tids[--started], NULL);
+	pthread_mutex_destroy(&job.template_lock);
+
+out:
+	cg_rule_list_put(job.list);
+	free(tids);
+	free(workers);
+	free(job.pids);
+	return ret;
+}
+
 /**
  * Print the cached rules table.  This function should be called only after
  * first calling cgroup_parse_config(), but it will work with an empty rule
@@ -3369,18 +6414,21 @@ void cgroup_print_rules_config(FILE *fp)
 	/* Iterator */
 	struct cgroup_rule *itr = NULL;
 
+	/* Snapshot of the cached rules */
+	struct cgroup_rule_list *list;
+
 	/* Loop variable */
 	int i = 0;
 
-	pthread_rwlock_rdlock(&rl_lock);
+	list = cg_rule_list_get();
 
-	if (!(rl.head)) {
+	if (!list || !(list->head)) {
 		fprintf(fp, "The rules table is empty.\n\n");
-		pthread_rwlock_unlock(&rl_lock);
+		cg_rule_list_put(list);
 		return;
 	}
 
-	itr = rl.head;
+	itr = list->head;
 	while (itr) {
 		fprintf(fp, "Rule: %s", itr->username);
 		if (itr->procname)
@@ -3411,12 +6459,242 @@ void cgroup_print_rules_config(FILE *fp)
 		fprintf(fp, "\n");
 		itr = itr->next;
 	}
-	pthread_rwlock_unlock(&rl_lock);
+	cg_rule_list_put(list);
+}
+
+void cgroup_print_rules_stats(FILE *fp)
+{
+	/* Iterator */
+	struct cgroup_rule *itr;
+
+	/* Snapshot of the cached rules */
+	struct cgroup_rule_list *list;
+
+	/* Number of the rule in the list */
+	int i = 0;
+
+	list = cg_rule_list_get();
+	if (!list)
+		return;
+
+	for (itr = list->head; itr; itr = itr->next) {
+		i++;
+		/* Continuation lines count with their rule. */
+		if (itr->username[0] == '%')
+			continue;
+		fprintf(fp, "%d %s%s%s %s %lu\n", i, itr->username,
+				itr->procname ? ":" : "",
+				itr->procname ? itr->procname : "",
+				itr->destination, itr->matched);
+	}
+	cg_rule_list_put(list);
+}
+
+/* Strings of a rules image being written */
+struct cg_rules_image_strings {
+	char *buf;
+	size_t len;
+	size_t size;
+	/* offset of the strings in the image */
+	size_t base;
+};
+
+/**
+ * Add a string to a rules image being written.
+ *	@return The offset of the string in the image, 0 if there is not
+ *	enough memory
+ */
+static u_int32_t cg_rules_image_put_str(struct cg_rules_image_strings *str,
+		const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *buf;
+
+	if (str->len + len > str->size) {
+		str->size = (str->len + len) * 2;
+		buf = realloc(str->buf, str->size);
+		if (!buf)
+			return 0;
+		str->buf = buf;
+	}
+	memcpy(str->buf + str->len, s, len);
+	str->len += len;
+	return str->base + str->len - len;
+}
+
+int cg_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int cgroup_write_rules_image(const char *path)
+{
+	struct cg_rules_image_strings str = { NULL, 0, 0, 0 };
+	struct cg_rules_image_source *sources = NULL;
+	struct cg_rules_image_rule *rules = NULL;
+	struct cg_rules_image_header hdr;
+	struct cgroup_rule_list *list;
+	struct cg_rules_source *src;
+	struct cgroup_rule *itr;
+	char *tmp = NULL;
+	int fd = -1;
+	int ret = ECGOTHER;
+	int i, j;
+
+	if (!path)
+		path = CGRULES_IMAGE_FILE;
+
+	list = cg_rule_list_get();
+	if (!list)
+		return ECGROUPNOTINITIALIZED;
+	if (list->nsources < 0) {
+		last_errno = ENOMEM;
+		goto out;
+	}
+
+	if (!cg_nss_files_only()) {
+		cgroup_dbg("Users are not resolved from files only, removing %s\n",
+				path);
+		ret = 0;
+		if (unlink(path) && errno != ENOENT) {
+			last_errno = errno;
+			ret = ECGOTHER;
+		}
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CG_RULES_IMAGE_MAGIC;
+	hdr.version = CG_RULES_IMAGE_VERSION;
+	hdr.nsources = list->nsources;
+	for (itr = list->head; itr; itr = itr->next)
+		hdr.nrules++;
+
+	sources = calloc(hdr.nsources + 1, sizeof(*sources));
+	rules = calloc(hdr.nrules + 1, sizeof(*rules));
+	if (!sources || !rules)
+		goto oom;
+	str.base = sizeof(hdr) + hdr.nsources * sizeof(*sources) +
+		hdr.nrules * sizeof(*rules);
+
+	for (i = 0; i < list->nsources; i++) {
+		src = &list->sources[i];
+		sources[i].path = cg_rules_image_put_str(&str, src->path);
+		if (!sources[i].path)
+			goto oom;
+		sources[i].missing = src->missing;
+		if (src->missing)
+			continue;
+		sources[i].dev = src->st.st_dev;
+		sources[i].ino = src->st.st_ino;
+		sources[i].size = src->st.st_size;
+		sources[i].mtime_sec = src->st.st_mtim.tv_sec;
+		sources[i].mtime_nsec = src->st.st_mtim.tv_nsec;
+		sources[i].ctime_sec = src->st.st_ctim.tv_sec;
+		sources[i].ctime_nsec = src->st.st_ctim.tv_nsec;
+	}
+
+	for (i = 0, itr = list->head; itr; i++, itr = itr->next) {
+		rules[i].uid = itr->uid;
+		rules[i].gid = itr->gid;
+		rules[i].username = cg_rules_image_put_str(&str,
+				itr->username);
+		rules[i].destination = cg_rules_image_put_str(&str,
+				itr->destination);
+		if (!rules[i].username || !rules[i].destination)
+			goto oom;
+		if (itr->procname) {
+			rules[i].procname = cg_rules_image_put_str(&str,
+					itr->procname);
+			if (!rules[i].procname)
+				goto oom;
+		}
+		for (j = 0; j < MAX_MNT_ELEMENTS && itr->controllers[j]; j++) {
+			rules[i].controllers[j] = cg_rules_image_put_str(&str,
+					itr->controllers[j]);
+			if (!rules[i].controllers[j])
+				goto oom;
+		}
+	}
+
+	if (str.base + str.len > UINT_MAX) {
+		last_errno = EFBIG;
+		goto out;
+	}
+	hdr.size = str.base + str.len;
+
+	/* Write a new file and replace the old one, readers see either. */
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		goto oom;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		last_errno = errno;
+		cgroup_warn("Warning: cannot create %s: %s\n", tmp,
+				strerror(errno));
+		goto out;
+	}
+	if (fchmod(fd, 0644) ||
+		cg_write_all(fd, &hdr, sizeof(hdr)) ||
+		cg_write_all(fd, sources, hdr.nsources * sizeof(*sources)) ||
+		cg_write_all(fd, rules, hdr.nrules * sizeof(*rules)) ||
+		cg_write_all(fd, str.buf, str.len))
+		goto write_err;
+	ret = close(fd);
+	fd = -1;
+	if (ret) {
+		ret = ECGOTHER;
+		goto write_err;
+	}
+	if (rename(tmp, path)) {
+		last_errno = errno;
+		cgroup_warn("Warning: cannot replace %s: %s\n", path,
+				strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+	goto out;
+
+write_err:
+	last_errno = errno;
+	cgroup_warn("Warning: cannot write %s: %s\n", tmp, strerror(errno));
+	if (fd < 0)
+		unlink(tmp);
+	goto out;
+
+oom:
+	last_errno = ENOMEM;
+	cgroup_err("Error: out of memory\n");
+out:
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(str.buf);
+	free(sources);
+	free(rules);
+	cg_rule_list_put(list);
+	return ret;
 }
 
 /**
- * Reloads the rules list, using the given configuration file.  This function
- * is probably NOT thread safe (calls cgroup_parse_rules()).
+ * Reloads the rules list, using the given configuration file.  The new list
+ * is published only when it is parsed successfully.
  *	@return 0 on success, > 0 on failure
  */
 int cgroup_reload_cached_rules(void)
@@ -3453,104 +6731,44 @@ int cgroup_init_rules_cache(void)
 	/* Attempt to read the configuration file and cache the rules. */
 	ret = cgroup_parse_rules(true, CGRULE_INVALID, CGRULE_INVALID, NULL);
 	if (ret) {
-		cgroup_dbg("Could not initialize rule cache, error was: %d\n",
-			ret);
-	}
-
-	return ret;
-}
-
-/**
- * cgroup_get_current_controller_path
- * @pid: pid of the current process for which the path is to be determined
- * @controller: name of the controller for which to determine current path
- * @current_path: a pointer that is filled with the value of the current
- *		path as seen in /proc/<pid>/cgroup
- */
-int cgroup_get_current_controller_path(pid_t pid, const char *controller,
-					char **current_path)
-{
-	char *path = NULL;
-	int ret;
-	FILE *pid_cgroup_fd = NULL;
-
-	if (!controller)
-		return ECGOTHER;
-
-	if (!cgroup_initialized) {
-		cgroup_warn("Warning: libcgroup is not initialized\n");
-		return ECGROUPNOTINITIALIZED;
-	}
-
-	ret = asprintf(&path, "/proc/%d/cgroup", pid);
-	if (ret <= 0) {
-		cgroup_warn(
-				"Warning: cannot allocate memory (/proc/pid/cgroup) ret %d\n",
-				ret);
-		return ret;
-	}
-
-	ret = ECGROUPNOTEXIST;
-	pid_cgroup_fd = fopen(path, "re");
-	if (!pid_cgroup_fd)
-		goto cleanup_path;
-
-	/*
-	 * Why do we grab the cg_mount_table_lock?, the reason is that
-	 * the cgroup of a pid can change via the cgroup_attach_task_pid()
-	 * call. To make sure, we return consitent and safe results,
-	 * we acquire the lock upfront. We can optimize by acquiring
-	 * and releasing the lock in the while loop, but that
-	 * will be more expensive.
-	 */
-	pthread_rwlock_rdlock(&cg_mount_table_lock);
-	while (!feof(pid_cgroup_fd)) {
-		char controllers[FILENAME_MAX];
-		char cgroup_path[FILENAME_MAX];
-		int num;
-		char *savedptr;
-		char *token;
-
-		ret = fscanf(pid_cgroup_fd, "%d:%[^:]:%s\n", &num, controllers,
-				cgroup_path);
-		/*
-		 * Magic numbers like "3" seem to be integrating into
-		 * my daily life, I need some magic to help make them
-		 * disappear :)
-		 */
-		if (ret != 3) {
-			cgroup_warn("Warning: read failed for pid_cgroup_fd ret %d\n",
-					ret);
-			last_errno = errno;
-			ret = ECGOTHER;
-			goto done;
-		}
+		cgroup_dbg("Could not initialize rule cache, error was: %d\n",
+			ret);
+	}
 
-		token = strtok_r(controllers, ",", &savedptr);
-		while (token) {
-			if (strncmp(controller, token, strlen(controller) + 1)
-								== 0) {
-				*current_path = strdup(cgroup_path);
-				if (!*current_path) {
-					last_errno = errno;
-					ret = ECGOTHER;
-					goto done;
-				}
-				ret = 0;
-				goto done;
-			}
-			token = strtok_r(NULL, ",", &savedptr);
-		}
+	return ret;
+}
+
+/**
+ * Resolve members of groups of the cached '@group' rules again, without
+ * parsing the rules files.
+ *	@return 0 on success, > 0 on error
+ */
+int cgroup_refresh_rules_group_cache(void)
+{
+	struct cgroup_rule_list *list;
+	int ret = 0;
+
+	list = cg_rule_list_get();
+	if (list && list->index) {
+		pthread_mutex_lock(&rl_parse_lock);
+		ret = cg_rule_list_refresh_groups(list);
+		pthread_mutex_unlock(&rl_parse_lock);
 	}
+	cg_rule_list_put(list);
 
-done:
-	pthread_rwlock_unlock(&cg_mount_table_lock);
-	fclose(pid_cgroup_fd);
-cleanup_path:
-	free(path);
 	return ret;
 }
 
+/**
+ * Set how long the resolved members of groups of the cached '@group' rules
+ * are valid.
+ *	@param ttl Time to live in seconds, 0 means until the next reload
+ */
+void cgroup_set_rules_group_cache_ttl(unsigned int ttl)
+{
+	rl_group_ttl = ttl;
+}
+
 const char *cgroup_strerror(int code)
 {
 	if (code == ECGOTHER)
@@ -3612,6 +6830,238 @@ static int cg_walk_node(FTS *fts, FTSENT *ent, const int depth,
 	return ret;
 }
 
+/*
+ * Directory-only walker used with CGROUP_WALK_TYPE_DIRS_ONLY. It reads the
+ * directories with getdents64() and relies on d_type to skip the control
+ * files, so that nothing needs to be stat()ed. Every level of the walk keeps
+ * its directory open and children are opened relative to it.
+ */
+#define CG_DIR_WALK_BUFSIZE	16384
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct cg_dir_walk_level {
+	int fd;
+	char *buf;
+	int pos;
+	int len;
+	/* length of the path of this directory in cg_dir_walk.path */
+	size_t path_len;
+	char name[FILENAME_MAX];
+};
+
+struct cg_dir_walk {
+	struct cg_dir_walk_level *levels;
+	int count;
+	int size;
+	char path[FILENAME_MAX];
+	char name[FILENAME_MAX];
+	char parent[FILENAME_MAX];
+};
+
+static int cg_dir_walk_push(struct cg_dir_walk *walk, int fd,
+		const char *name, size_t path_len)
+{
+	struct cg_dir_walk_level *level;
+
+	if (walk->count == walk->size) {
+		int size = walk->size ? walk->size * 2 : 8;
+
+		level = realloc(walk->levels, size * sizeof(*level));
+		if (!level) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		walk->levels = level;
+		walk->size = size;
+	}
+
+	level = &walk->levels[walk->count];
+	level->buf = malloc(CG_DIR_WALK_BUFSIZE);
+	if (!level->buf) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	level->fd = fd;
+	level->pos = 0;
+	level->len = 0;
+	level->path_len = path_len;
+	strncpy(level->name, name, sizeof(level->name) - 1);
+	level->name[sizeof(level->name) - 1] = '\0';
+	walk->count++;
+	return 0;
+}
+
+static void cg_dir_walk_free(struct cg_dir_walk *walk)
+{
+	int i;
+
+	if (!walk)
+		return;
+
+	for (i = 0; i < walk->count; i++) {
+		close(walk->levels[i].fd);
+		free(walk->levels[i].buf);
+	}
+	free(walk->levels);
+	free(walk);
+}
+
+static int cg_dir_walk_start(const char *root, struct cg_dir_walk **result)
+{
+	struct cg_dir_walk *walk;
+	const char *name;
+	int fd, ret;
+
+	if (strlen(root) >= sizeof(walk->path))
+		return ECGINVAL;
+
+	walk = calloc(1, sizeof(*walk));
+	if (!walk) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	strcpy(walk->path, root);
+
+	/* Name the root the way fts does, after its last '/'. */
+	name = strrchr(walk->path, '/');
+	strcpy(walk->name, name ? name + 1 : walk->path);
+
+	fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		last_errno = errno;
+		free(walk);
+		return ECGOTHER;
+	}
+
+	ret = cg_dir_walk_push(walk, fd, walk->name, strlen(walk->path));
+	if (ret) {
+		close(fd);
+		cg_dir_walk_free(walk);
+		return ret;
+	}
+
+	*result = walk;
+	return 0;
+}
+
+static int cg_dir_walk_next(struct cg_dir_walk *walk, int flags,
+		int base_level, struct cgroup_file_info *info)
+{
+	struct cg_dir_walk_level *top;
+	struct linux_dirent64 *d;
+	struct stat st;
+	size_t len, name_len;
+	int depth, fd, ret;
+
+	while (walk->count) {
+		top = &walk->levels[walk->count - 1];
+
+		if (top->pos >= top->len) {
+			ret = syscall(SYS_getdents64, top->fd, top->buf,
+					CG_DIR_WALK_BUFSIZE);
+			if (ret > 0) {
+				top->len = ret;
+				top->pos = 0;
+				continue;
+			}
+
+			/* The directory is done (or unreadable), leave it. */
+			close(top->fd);
+			free(top->buf);
+			walk->count--;
+
+			if (!(flags & CGROUP_WALK_TYPE_POST_DIR))
+				continue;
+
+			walk->path[top->path_len] = '\0';
+			strcpy(walk->name, top->name);
+			strcpy(walk->parent, walk->count ?
+					walk->levels[walk->count - 1].name : "");
+			info->depth = walk->count;
+			goto found;
+		}
+
+		d = (struct linux_dirent64 *)(top->buf + top->pos);
+		top->pos += d->d_reclen;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		if (d->d_type == DT_UNKNOWN) {
+			if (fstatat(top->fd, d->d_name, &st,
+						AT_SYMLINK_NOFOLLOW) ||
+					!S_ISDIR(st.st_mode))
+				continue;
+		} else if (d->d_type != DT_DIR) {
+			continue;
+		}
+
+		depth = walk->count;
+		if (base_level && depth > base_level)
+			continue;
+
+		/* Like fts, do not double the separator of the root path. */
+		len = top->path_len;
+		if (len && walk->path[len - 1] == '/')
+			len--;
+		name_len = strlen(d->d_name);
+		if (len + 1 + name_len >= sizeof(walk->path))
+			continue;
+		walk->path[len++] = '/';
+		memcpy(walk->path + len, d->d_name, name_len + 1);
+
+		if (flags & CGROUP_WALK_TYPE_PRE_DIR) {
+			strcpy(walk->name, d->d_name);
+			strcpy(walk->parent, top->name);
+			info->depth = depth;
+		}
+
+		if (!base_level || depth < base_level) {
+			fd = openat(top->fd, d->d_name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd >= 0) {
+				ret = cg_dir_walk_push(walk, fd, d->d_name,
+						len + name_len);
+				if (ret) {
+					close(fd);
+					return ret;
+				}
+			} else if (!(flags & CGROUP_WALK_TYPE_PRE_DIR)) {
+				/* No post-order visit without the fd. */
+				continue;
+			}
+		} else if (!(flags & CGROUP_WALK_TYPE_PRE_DIR)) {
+			/*
+			 * The directory is not descended into, so it is
+			 * complete right away.
+			 */
+			strcpy(walk->name, d->d_name);
+			strcpy(walk->parent, top->name);
+			info->depth = depth;
+			goto found;
+		}
+
+		if (flags & CGROUP_WALK_TYPE_PRE_DIR)
+			goto found;
+	}
+
+	return ECGEOF;
+
+found:
+	info->path = walk->name;
+	info->parent = walk->parent;
+	info->full_path = walk->path;
+	info->type = CGROUP_FILE_TYPE_DIR;
+	return 0;
+}
+
 int cgroup_walk_tree_next(int depth, void **handle,
 				struct cgroup_file_info *info, int base_level)
 {
@@ -3626,6 +7076,14 @@ int cgroup_walk_tree_next(int depth, void **handle,
 		return ECGINVAL;
 
 	entry = (struct cgroup_tree_handle *) *handle;
+	entry->started = 1;
+
+	if (entry->walk) {
+		if (!base_level && depth)
+			base_level = depth;
+		return cg_dir_walk_next(entry->walk, entry->flags,
+				base_level, info);
+	}
 
 	ent = fts_read(entry->fts);
 	if (!ent)
@@ -3652,6 +7110,8 @@ int cgroup_walk_tree_end(void **handle)
 	entry = (struct cgroup_tree_handle *) *handle;
 
 	fts_close(entry->fts);
+	cg_dir_walk_free(entry->walk);
+	free(entry->root);
 	free(entry);
 	*handle = NULL;
 	return 0;
@@ -3691,59 +7151,402 @@ int cgroup_walk_tree_begin(const char *controller, const char *base_path,
 
 	entry->flags |= CGROUP_WALK_TYPE_PRE_DIR;
 
+	entry->root = strdup(full_path);
+	if (!entry->root) {
+		last_errno = errno;
+		free(entry);
+		*handle = NULL;
+		return ECGOTHER;
+	}
+
 	*base_level = 0;
 	cg_path[0] = full_path;
 	cg_path[1] = NULL;
 
-	entry->fts = fts_open(cg_path, FTS_LOGICAL | FTS_NOCHDIR |
-				FTS_NOSTAT, NULL);
-	if (entry->fts == NULL) {
-		free(entry);
+	entry->fts = fts_open(cg_path, FTS_LOGICAL | FTS_NOCHDIR |
+				FTS_NOSTAT, NULL);
+	if (entry->fts == NULL) {
+		free(entry->root);
+		free(entry);
+		last_errno = errno;
+		*handle = NULL;
+		return ECGOTHER;
+	}
+	ent = fts_read(entry->fts);
+	if (!ent) {
+		cgroup_warn("Warning: fts_read failed\n");
+		fts_close(entry->fts);
+		free(entry->root);
+		free(entry);
+		*handle = NULL;
+		return ECGINVAL;
+	}
+	if (!*base_level && depth)
+		*base_level = ent->fts_level + depth;
+
+	ret = cg_walk_node(entry->fts, ent, *base_level, info, entry->flags);
+	if (ret != 0) {
+		fts_close(entry->fts);
+		free(entry->root);
+		free(entry);
+		*handle = NULL;
+	} else {
+		*handle = entry;
+	}
+	return ret;
+}
+
+int cgroup_walk_tree_set_flags(void **handle, int flags)
+{
+	struct cgroup_tree_handle *entry;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	if ((flags & CGROUP_WALK_TYPE_PRE_DIR) &&
+			(flags & CGROUP_WALK_TYPE_POST_DIR))
+		return ECGINVAL;
+
+	entry = (struct cgroup_tree_handle *) *handle;
+
+	if ((flags & CGROUP_WALK_TYPE_DIRS_ONLY) && !entry->walk) {
+		int ret;
+
+		/* The walker starts from the root, it can't take over. */
+		if (entry->started)
+			return ECGINVAL;
+
+		ret = cg_dir_walk_start(entry->root, &entry->walk);
+		if (ret)
+			return ret;
+	} else if (!(flags & CGROUP_WALK_TYPE_DIRS_ONLY) && entry->walk) {
+		return ECGINVAL;
+	}
+
+	entry->flags = flags;
+
+	*handle = entry;
+	return 0;
+}
+
+/*
+ * Parallel walk. The groups at the split depth are the work items; each
+ * thread owns a slice of them, works through it from the front and, once
+ * it is empty, steals items from the back of the other slices.
+ */
+struct cg_walk_item {
+	char *path;
+	char *name;
+	char *parent;
+	int depth;
+};
+
+struct cg_walk_items {
+	struct cg_walk_item *items;
+	int count;
+	int size;
+};
+
+struct cg_walk_queue {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+};
+
+struct cg_walk_job {
+	struct cg_walk_items *subtrees;
+	struct cg_walk_queue *queues;
+	int queues_count;
+	int flags;
+	cgroup_walk_tree_callback callback;
+	void *userdata;
+	/* first non-zero result, stops the walk */
+	volatile int error;
+	int error_errno;
+	/* cg_namespace_table of the calling thread */
+	char *namespaces[CG_CONTROLLER_MAX];
+};
+
+struct cg_walk_worker {
+	struct cg_walk_job *job;
+	int id;
+};
+
+static int cg_walk_items_add(struct cg_walk_items *list,
+		const struct cgroup_file_info *info)
+{
+	struct cg_walk_item *item;
+
+	if (list->count == list->size) {
+		int size = list->size ? list->size * 2 : 64;
+
+		item = realloc(list->items, size * sizeof(*item));
+		if (!item) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		list->items = item;
+		list->size = size;
+	}
+
+	item = &list->items[list->count];
+	item->path = strdup(info->full_path);
+	item->name = strdup(info->path);
+	item->parent = strdup(info->parent);
+	item->depth = info->depth;
+	if (!item->path || !item->name || !item->parent) {
+		last_errno = errno;
+		free(item->path);
+		free(item->name);
+		free(item->parent);
+		return ECGOTHER;
+	}
+	list->count++;
+	return 0;
+}
+
+static void cg_walk_items_free(struct cg_walk_items *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		free(list->items[i].path);
+		free(list->items[i].name);
+		free(list->items[i].parent);
+	}
+	free(list->items);
+}
+
+static void cg_walk_item_info(const struct cg_walk_item *item,
+		struct cgroup_file_info *info)
+{
+	info->type = CGROUP_FILE_TYPE_DIR;
+	info->path = item->name;
+	info->parent = item->parent;
+	info->full_path = item->path;
+	info->depth = item->depth;
+}
+
+static void cg_walk_job_fail(struct cg_walk_job *job, int error)
+{
+	if (__sync_bool_compare_and_swap(&job->error, 0, error))
+		job->error_errno = last_errno;
+}
+
+/*
+ * Take the next subtree of the thread, or steal one from another thread.
+ */
+static struct cg_walk_item *cg_walk_job_take(struct cg_walk_job *job, int id)
+{
+	struct cg_walk_queue *queue;
+	int i, index = -1;
+
+	for (i = 0; i < job->queues_count && index < 0; i++) {
+		queue = &job->queues[(id + i) % job->queues_count];
+
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail)
+			index = i ? --queue->tail : queue->head++;
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return index < 0 ? NULL : &job->subtrees->items[index];
+}
+
+static int cg_walk_subtree(struct cg_walk_job *job, struct cg_walk_item *item)
+{
+	struct cgroup_file_info info;
+	struct cg_dir_walk *walk;
+	int ret;
+
+	if (job->flags & CGROUP_WALK_TYPE_PRE_DIR) {
+		cg_walk_item_info(item, &info);
+		ret = job->callback(&info, job->userdata);
+		if (ret)
+			return ret;
+	}
+
+	ret = cg_dir_walk_start(item->path, &walk);
+	if (ret) {
+		/* the group was removed meanwhile */
+		if (ret == ECGOTHER && last_errno == ENOENT)
+			return 0;
+		return ret;
+	}
+
+	while (!job->error &&
+			!(ret = cg_dir_walk_next(walk, job->flags, 0, &info))) {
+		if (!info.depth)
+			info.parent = item->parent;
+		info.depth += item->depth;
+		ret = job->callback(&info, job->userdata);
+		if (ret)
+			break;
+	}
+	cg_dir_walk_free(walk);
+
+	return ret == ECGEOF ? 0 : ret;
+}
+
+static void *cg_walk_worker(void *arg)
+{
+	struct cg_walk_worker *worker = arg;
+	struct cg_walk_job *job = worker->job;
+	struct cg_walk_item *item;
+	int ret;
+
+	/* cg_namespace_table is per thread, inherit the caller's one */
+	memcpy(cg_namespace_table, job->namespaces,
+			sizeof(cg_namespace_table));
+
+	while (!job->error && (item = cg_walk_job_take(job, worker->id))) {
+		ret = cg_walk_subtree(job, item);
+		if (ret)
+			cg_walk_job_fail(job, ret);
+	}
+	return NULL;
+}
+
+static void cg_walk_job_run(struct cg_walk_job *job, unsigned int nthreads)
+{
+	struct cg_walk_worker *workers;
+	pthread_t *threads;
+	unsigned int started = 0;
+	int i, count = job->subtrees->count;
+
+	if (nthreads > (unsigned int)count)
+		nthreads = count;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	threads = calloc(nthreads, sizeof(*threads));
+	job->queues = calloc(nthreads, sizeof(*job->queues));
+	if (!workers || !threads || !job->queues) {
 		last_errno = errno;
-		*handle = NULL;
-		return ECGOTHER;
+		cg_walk_job_fail(job, ECGOTHER);
+		goto out;
 	}
-	ent = fts_read(entry->fts);
-	if (!ent) {
-		cgroup_warn("Warning: fts_read failed\n");
-		fts_close(entry->fts);
-		free(entry);
-		*handle = NULL;
-		return ECGINVAL;
+
+	job->queues_count = nthreads;
+	for (i = 0; i < (int)nthreads; i++) {
+		pthread_mutex_init(&job->queues[i].lock, NULL);
+		job->queues[i].head = count * i / nthreads;
+		job->queues[i].tail = count * (i + 1) / nthreads;
+		workers[i].job = job;
+		workers[i].id = i;
 	}
-	if (!*base_level && depth)
-		*base_level = ent->fts_level + depth;
 
-	ret = cg_walk_node(entry->fts, ent, *base_level, info, entry->flags);
-	if (ret != 0) {
-		fts_close(entry->fts);
-		free(entry);
-		*handle = NULL;
-	} else {
-		*handle = entry;
+	/* the calling thread is one of the workers */
+	while (started < nthreads - 1) {
+		if (pthread_create(&threads[started], NULL, cg_walk_worker,
+					&workers[started + 1]))
+			break;
+		started++;
 	}
-	return ret;
+	cgroup_dbg("walking %d subtrees using %u threads\n", count,
+			started + 1);
+
+	cg_walk_worker(&workers[0]);
+	while (started)
+		pthread_join(threads[--started], NULL);
+
+	for (i = 0; i < (int)nthreads; i++)
+		pthread_mutex_destroy(&job->queues[i].lock);
+out:
+	free(job->queues);
+	free(threads);
+	free(workers);
 }
 
-int cgroup_walk_tree_set_flags(void **handle, int flags)
+int cgroup_walk_tree_parallel(const char *controller, const char *base_path,
+		int split_depth, int flags, unsigned int threads,
+		cgroup_walk_tree_callback callback, void *userdata)
 {
-	struct cgroup_tree_handle *entry;
+	struct cg_walk_items subtrees, deferred;
+	struct cgroup_file_info info;
+	struct cg_walk_item root;
+	struct cg_dir_walk *walk;
+	struct cg_walk_job job;
+	char full_path[FILENAME_MAX];
+	int ret, i;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
 
-	if (!handle)
+	if (!callback || split_depth < 1)
 		return ECGINVAL;
 
-	if ((flags & CGROUP_WALK_TYPE_PRE_DIR) &&
-			(flags & CGROUP_WALK_TYPE_POST_DIR))
+	flags &= CGROUP_WALK_TYPE_PRE_DIR | CGROUP_WALK_TYPE_POST_DIR;
+	if (flags != CGROUP_WALK_TYPE_PRE_DIR &&
+			flags != CGROUP_WALK_TYPE_POST_DIR)
 		return ECGINVAL;
 
-	entry = (struct cgroup_tree_handle *) *handle;
-	entry->flags = flags;
+	if (!cg_build_path(base_path, full_path, controller))
+		return ECGOTHER;
 
-	*handle = entry;
-	return 0;
+	ret = cg_dir_walk_start(full_path, &walk);
+	if (ret)
+		return ret;
+
+	memset(&subtrees, 0, sizeof(subtrees));
+	memset(&deferred, 0, sizeof(deferred));
+	memset(&job, 0, sizeof(job));
+	job.subtrees = &subtrees;
+	job.flags = flags;
+	job.callback = callback;
+	job.userdata = userdata;
+	memcpy(job.namespaces, cg_namespace_table, sizeof(job.namespaces));
+
+	if (flags & CGROUP_WALK_TYPE_PRE_DIR) {
+		root.path = full_path;
+		root.name = walk->levels[0].name;
+		root.parent = "";
+		root.depth = 0;
+		cg_walk_item_info(&root, &info);
+		ret = callback(&info, userdata);
+	}
+
+	/*
+	 * Report the groups above the split depth right away in pre-order,
+	 * post-order has to wait for the subtrees to be done.
+	 */
+	while (!ret && !(ret = cg_dir_walk_next(walk, flags, split_depth,
+					&info))) {
+		if (info.depth == split_depth)
+			ret = cg_walk_items_add(&subtrees, &info);
+		else if (flags & CGROUP_WALK_TYPE_PRE_DIR)
+			ret = callback(&info, userdata);
+		else
+			ret = cg_walk_items_add(&deferred, &info);
+	}
+	cg_dir_walk_free(walk);
+	if (ret != ECGEOF)
+		goto out;
+	ret = 0;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (subtrees.count) {
+		cg_walk_job_run(&job, threads);
+		ret = job.error;
+		if (ret)
+			last_errno = job.error_errno;
+	}
+
+	for (i = 0; !ret && i < deferred.count; i++) {
+		cg_walk_item_info(&deferred.items[i], &info);
+		ret = callback(&info, userdata);
+	}
+
+out:
+	cg_walk_items_free(&deferred);
+	cg_walk_items_free(&subtrees);
+	return ret;
 }
 
 /*
@@ -3841,7 +7644,7 @@ int cgroup_read_value_begin(const char *controller, const char *path,
 
 	snprintf(stat_file, sizeof(stat_file), "%s/%s", stat_path,
 		name);
-	fp = fopen(stat_file, "re");
+	fp = cg_fopen(stat_file);
 	if (!fp) {
 		cgroup_warn("Warning: fopen failed\n");
 		last_errno = errno;
@@ -3917,7 +7720,7 @@ int cgroup_read_stats_begin(const char *controller, const char *path,
 	snprintf(stat_file, sizeof(stat_file), "%s/%s.stat", stat_path,
 			controller);
 
-	fp = fopen(stat_file, "re");
+	fp = cg_fopen(stat_file);
 	if (!fp) {
 		cgroup_warn("Warning: fopen failed\n");
 		return ECGINVAL;
@@ -3928,23 +7731,182 @@ int cgroup_read_stats_begin(const char *controller, const char *path,
 	return ret;
 }
 
-int cgroup_get_task_end(void **handle)
+int cgroup_stats_open(const char *controller, const char *path,
+		const char *name, int flags, void **handle)
 {
+	struct cgroup_stats_handle *stats;
+	char stat_path[FILENAME_MAX];
+	int ret;
+
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
 
-	if (!*handle)
+	if (!handle || !controller)
 		return ECGINVAL;
 
-	fclose((FILE *) *handle);
 	*handle = NULL;
 
+	if (!cg_build_path(path, stat_path, controller))
+		return ECGOTHER;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	stats->flags = flags;
+	stats->fd = -1;
+	if (name)
+		ret = snprintf(stats->path, sizeof(stats->path), "%s/%s",
+				stat_path, name);
+	else
+		ret = snprintf(stats->path, sizeof(stats->path), "%s/%s.stat",
+				stat_path, controller);
+	if (ret < 0 || ret >= sizeof(stats->path)) {
+		free(stats);
+		return ECGINVAL;
+	}
+
+	if (flags & CGROUP_STATS_KEEP_OPEN) {
+		stats->fd = cg_open(stats->path, O_RDONLY | O_CLOEXEC);
+		if (stats->fd < 0) {
+			cgroup_warn("Warning: cannot open %s: %s\n",
+					stats->path, strerror(errno));
+			last_errno = errno;
+			free(stats);
+			return ECGOTHER;
+		}
+	}
+
+	*handle = stats;
 	return 0;
 }
 
-int cgroup_get_task_next(void **handle, pid_t *pid)
+/*
+ * Read the whole file with one pread() in the common case, the buffer is
+ * enlarged until the file fits into it.
+ */
+static ssize_t cg_stats_pread(struct cgroup_stats_handle *stats, int fd)
 {
-	int ret;
+	ssize_t ret;
+	char *buf;
+
+	if (!stats->buf) {
+		stats->buf = malloc(4096);
+		if (!stats->buf)
+			return -1;
+		stats->size = 4096;
+	}
+
+	for (;;) {
+		ret = pread(fd, stats->buf, stats->size - 1, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 || (size_t)ret < stats->size - 1)
+			return ret;
+
+		buf = realloc(stats->buf, stats->size * 2);
+		if (!buf)
+			return -1;
+		stats->buf = buf;
+		stats->size *= 2;
+	}
+}
+
+int cgroup_stats_read(void *handle, const struct cgroup_stat_value **values,
+		int *count)
+{
+	struct cgroup_stats_handle *stats = handle;
+	struct cgroup_stat_value *value;
+	char *line, *next, *sep, *end;
+	ssize_t len;
+	int fd, n = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!stats || !values || !count)
+		return ECGINVAL;
+
+	fd = stats->fd;
+	if (fd < 0) {
+		fd = cg_open(stats->path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+	}
+	len = cg_stats_pread(stats, fd);
+	if (len < 0)
+		last_errno = errno;
+	if (fd != stats->fd)
+		close(fd);
+	if (len < 0)
+		return ECGOTHER;
+	stats->buf[len] = '\0';
+
+	for (line = stats->buf; *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			*next++ = '\0';
+
+		sep = strchr(line, ' ');
+		if (!sep || sep == line)
+			continue;
+		*sep++ = '\0';
+
+		if (n == stats->values_size) {
+			int size = stats->values_size ?
+					stats->values_size * 2 : 64;
+
+			value = realloc(stats->values, size * sizeof(*value));
+			if (!value) {
+				last_errno = errno;
+				return ECGOTHER;
+			}
+			stats->values = value;
+			stats->values_size = size;
+		}
+
+		value = &stats->values[n];
+		errno = 0;
+		value->value = strtoull(sep, &end, 10);
+		if (end == sep || *end || errno)
+			continue;
+		value->name = line;
+		n++;
+	}
+
+	*values = stats->values;
+	*count = n;
+	return 0;
+}
+
+int cgroup_stats_close(void **handle)
+{
+	struct cgroup_stats_handle *stats;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	stats = *handle;
+	if (stats) {
+		if (stats->fd >= 0)
+			close(stats->fd);
+		free(stats->buf);
+		free(stats->values);
+		free(stats);
+	}
+	*handle = NULL;
+	return 0;
+}
+
+int cgroup_poll_create(void **handle)
+{
+	struct cgroup_poll_handle *poll;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
@@ -3952,24 +7914,215 @@ int cgroup_get_task_next(void **handle, pid_t *pid)
 	if (!handle)
 		return ECGINVAL;
 
-	ret = fscanf((FILE *) *handle, "%u", pid);
+	poll = calloc(1, sizeof(*poll));
+	if (!poll) {
+		last_errno = errno;
+		*handle = NULL;
+		return ECGOTHER;
+	}
+
+	*handle = poll;
+	return 0;
+}
+
+int cgroup_poll_add(void *handle, const char *path, const char *controller,
+		const char *name, int *index)
+{
+	struct cgroup_poll_handle *poll = handle;
+	char file_path[FILENAME_MAX];
+	int fd;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!poll || !controller || !name || strchr(name, '/'))
+		return ECGINVAL;
+
+	if (!cg_build_path(path, file_path, controller))
+		return ECGOTHER;
+	strncat(file_path, name, sizeof(file_path) - strlen(file_path) - 1);
+
+	if (poll->count == poll->size) {
+		int size = poll->size ? poll->size * 2 : 64;
+		int *fds;
+
+		fds = realloc(poll->fds, size * sizeof(*fds));
+		if (!fds) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		poll->fds = fds;
+		poll->size = size;
+	}
 
-	if (ret != 1) {
-		if (ret == EOF)
-			return ECGEOF;
+	fd = cg_open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		cgroup_warn("Warning: cannot open %s: %s\n", file_path,
+				strerror(errno));
 		last_errno = errno;
 		return ECGOTHER;
 	}
 
+	poll->fds[poll->count] = fd;
+	if (index)
+		*index = poll->count;
+	poll->count++;
+	return 0;
+}
+
+int cgroup_poll_refresh(void *handle, struct cgroup_poll_value *values,
+		int count)
+{
+	struct cgroup_poll_handle *poll = handle;
+	int i, ret = 0, error = 0;
+	ssize_t len;
+	char *nl;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!poll || (count && !values))
+		return ECGINVAL;
+
+	if (count > poll->count)
+		count = poll->count;
+
+	for (i = 0; i < count; i++) {
+		do {
+			len = pread(poll->fds[i], values[i].value,
+					sizeof(values[i].value) - 1, 0);
+		} while (len < 0 && errno == EINTR);
+
+		if (len < 0) {
+			values[i].value[0] = '\0';
+			values[i].error = ECGOTHER;
+			if (!ret) {
+				ret = ECGOTHER;
+				error = errno;
+			}
+			continue;
+		}
+
+		values[i].value[len] = '\0';
+		nl = memchr(values[i].value, '\n', len);
+		if (nl)
+			*nl = '\0';
+		values[i].error = 0;
+	}
+
+	if (ret)
+		last_errno = error;
+	return ret;
+}
+
+int cgroup_poll_destroy(void **handle)
+{
+	struct cgroup_poll_handle *poll;
+	int i;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	poll = *handle;
+	if (poll) {
+		for (i = 0; i < poll->count; i++)
+			close(poll->fds[i]);
+		free(poll->fds);
+		free(poll);
+	}
+	*handle = NULL;
+	return 0;
+}
+
+/*
+ * Reader of tasks and cgroup.procs files. They are read in large blocks and
+ * parsed by hand, which is much faster than fscanf() for big groups.
+ */
+struct cg_pid_reader {
+	int fd;
+	int pos;
+	int len;
+	char buf[16384];
+};
+
+static int cg_pid_reader_next(struct cg_pid_reader *reader, pid_t *pid)
+{
+	pid_t value = 0;
+	int digits = 0;
+	ssize_t ret;
+	char c;
+
+	for (;;) {
+		if (reader->pos == reader->len) {
+			ret = read(reader->fd, reader->buf,
+					sizeof(reader->buf));
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				last_errno = errno;
+				return ECGOTHER;
+			}
+			if (ret == 0)
+				break;
+			reader->pos = 0;
+			reader->len = ret;
+		}
+
+		c = reader->buf[reader->pos++];
+		if (c >= '0' && c <= '9') {
+			value = value * 10 + c - '0';
+			digits++;
+		} else if (digits) {
+			break;
+		}
+	}
+
+	if (!digits)
+		return ECGEOF;
+
+	*pid = value;
+	return 0;
+}
+
+int cgroup_get_task_end(void **handle)
+{
+	struct cg_pid_reader *reader;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!*handle)
+		return ECGINVAL;
+
+	reader = *handle;
+	close(reader->fd);
+	free(reader);
+	*handle = NULL;
+
 	return 0;
 }
 
+int cgroup_get_task_next(void **handle, pid_t *pid)
+{
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle || !*handle)
+		return ECGINVAL;
+
+	return cg_pid_reader_next(*handle, pid);
+}
+
 int cgroup_get_task_begin(const char *cgroup, const char *controller,
 					void **handle, pid_t *pid)
 {
 	int ret = 0;
 	char path[FILENAME_MAX];
 	char *fullpath = NULL;
+	struct cg_pid_reader *reader;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
@@ -3977,20 +8130,31 @@ int cgroup_get_task_begin(const char *cgroup, const char *controller,
 	if (!cg_build_path(cgroup, path, controller))
 		return ECGOTHER;
 
-	ret = asprintf(&fullpath, "%s/tasks", path);
+	ret = asprintf(&fullpath, "%s/%s", path, cg_threads_file(controller));
 
 	if (ret < 0) {
 		last_errno = errno;
 		return ECGOTHER;
 	}
 
-	*handle = (void *) fopen(fullpath, "re");
+	*handle = NULL;
+	reader = malloc(sizeof(*reader));
+	if (!reader) {
+		last_errno = errno;
+		free(fullpath);
+		return ECGOTHER;
+	}
+
+	reader->pos = reader->len = 0;
+	reader->fd = cg_open(fullpath, O_RDONLY | O_CLOEXEC);
 	free(fullpath);
 
-	if (!*handle) {
+	if (reader->fd < 0) {
 		last_errno = errno;
+		free(reader);
 		return ECGOTHER;
 	}
+	*handle = reader;
 	ret = cgroup_get_task_next(handle, pid);
 
 	return ret;
@@ -4063,56 +8227,100 @@ int cgroup_get_controller_begin(void **handle, struct cgroup_mount_point *info)
 		return ECGOTHER;
 	}
 
-	*pos = 0;
+	*pos = 0;
+
+	*handle = pos;
+
+	return cgroup_get_controller_next(handle, info);
+}
+
+/* Size of the buffer for reading files in /proc/<pid> */
+#define CG_PROC_BUF_SIZE	4096
+
+/* Buffer for reading files in /proc/<pid>, reused by each thread */
+static __thread char cg_proc_buf[CG_PROC_BUF_SIZE];
+
+/**
+ * Read a file in the /proc/<pid> directory with a single read() into
+ * cg_proc_buf. A longer file is truncated.
+ * @param dirfd: The open /proc/<pid> directory
+ * @param name: The name of the file
+ * @param len: The number of bytes read, the buffer is terminated by '\0'
+ * @return 0 on success, ECGROUPNOTEXIST if the process does not exist.
+ */
+static int cg_read_proc_file(int dirfd, const char *name, ssize_t *len)
+{
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return ECGROUPNOTEXIST;
 
-	*handle = pos;
+	*len = read(fd, cg_proc_buf, sizeof(cg_proc_buf) - 1);
+	close(fd);
+	if (*len < 0)
+		return ECGROUPNOTEXIST;
 
-	return cgroup_get_controller_next(handle, info);
+	cg_proc_buf[*len] = '\0';
+	return 0;
 }
 
 /**
- * Get process data (euid and egid) from /proc/<pid>/status file.
+ * Get the euid, egid and name of a process from its status file in one
+ * pass.
+ * @param dirfd: The open /proc/<pid> directory
  * @param pid: The process id
- * @param euid: The uid of param pid
- * @param egid: The gid of param pid
+ * @param euid: The uid of param pid, or NULL
+ * @param egid: The gid of param pid, or NULL
+ * @param comm: Buffer for the name of the process, or NULL
+ * @param size: The size of comm
  * @return 0 on success, > 0 on error.
  */
-int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
+static int cg_get_proc_status(int dirfd, pid_t pid, uid_t *euid, gid_t *egid,
+		char *comm, size_t size)
 {
-	FILE *f;
-	char path[FILENAME_MAX];
-	char buf[4092];
 	uid_t ruid, suid, fsuid;
 	gid_t rgid, sgid, fsgid;
-	bool found_euid = false;
-	bool found_egid = false;
+	bool found_euid = !euid;
+	bool found_egid = !egid;
+	bool found_name = !comm;
+	char *line, *end;
+	ssize_t len;
+	int ret;
 
-	sprintf(path, "/proc/%d/status", pid);
-	f = fopen(path, "re");
-	if (!f)
-		return ECGROUPNOTEXIST;
+	ret = cg_read_proc_file(dirfd, "status", &len);
+	if (ret)
+		return ret;
 
-	while (fgets(buf, sizeof(buf), f)) {
-		if (!strncmp(buf, "Uid:", 4)) {
-			if (sscanf((buf + strlen("Uid:") + 1), "%d%d%d%d",
+	for (line = cg_proc_buf; *line; line = end + 1) {
+		end = strchrnul(line, '\n');
+		if (!found_name && !strncmp(line, "Name:", 5)) {
+			line += strlen("Name:") + 1;
+			if ((size_t)(end - line) >= size)
+				break;
+			memcpy(comm, line, end - line);
+			comm[end - line] = '\0';
+			found_name = true;
+		} else if (!found_euid && !strncmp(line, "Uid:", 4)) {
+			if (sscanf((line + strlen("Uid:") + 1), "%d%d%d%d",
 					&ruid, euid, &suid, &fsuid) != 4)
 				break;
 			cgroup_dbg("Scanned proc values are %d %d %d %d\n",
 				ruid, *euid, suid, fsuid);
 			found_euid = true;
-		} else if (!strncmp(buf, "Gid:", 4)) {
-			if (sscanf((buf + strlen("Gid:") + 1), "%d%d%d%d",
+		} else if (!found_egid && !strncmp(line, "Gid:", 4)) {
+			if (sscanf((line + strlen("Gid:") + 1), "%d%d%d%d",
 					&rgid, egid, &sgid, &fsgid) != 4)
 				break;
 			cgroup_dbg("Scanned proc values are %d %d %d %d\n",
 				rgid, *egid, sgid, fsgid);
 			found_egid = true;
 		}
-		if (found_euid && found_egid)
+		if ((found_euid && found_egid && found_name) || !*end)
 			break;
 	}
-	fclose(f);
-	if (!found_euid || !found_egid) {
+
+	if (!found_euid || !found_egid || !found_name) {
 		/*
 		 * This method doesn't match the file format of
 		 * /proc/<pid>/status. The format has been changed
@@ -4125,84 +8333,41 @@ int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
 	return 0;
 }
 
-/**
- * Get process name from /proc/<pid>/status file.
- * @param pid: The process id
- * @param pname_status : The process name
- * @return 0 on success, > 0 on error.
- */
-static int cg_get_procname_from_proc_status(pid_t pid, char **procname_status)
-{
-	int ret = ECGFAIL;
-	int len;
-	FILE *f;
-	char path[FILENAME_MAX];
-	char buf[4092];
-
-	sprintf(path, "/proc/%d/status", pid);
-	f = fopen(path, "re");
-	if (!f)
-		return ECGROUPNOTEXIST;
-
-	while (fgets(buf, sizeof(buf), f)) {
-		if (!strncmp(buf, "Name:", 5)) {
-			len = strlen(buf);
-			if (buf[len - 1] == '\n')
-				buf[len - 1] = '\0';
-			*procname_status = strdup(buf + strlen("Name:") + 1);
-			if (*procname_status == NULL) {
-				last_errno = errno;
-				ret = ECGOTHER;
-				break;
-			}
-			ret = 0;
-			break;
-		}
-	}
-	fclose(f);
-	return ret;
-}
-
 /**
  * Get process name from /proc/<pid>/cmdline file.
  * This function is mainly for getting a script name (shell, perl,
  * etc). A script name is written into the second or later argument
  * of /proc/<pid>/cmdline. This function gets each argument and
  * compares it to a process name taken from /proc/<pid>/status.
- * @param pid: The process id
+ * @param dirfd: The open /proc/<pid> directory
  * @param pname_status : The process name taken from /proc/<pid>/status
  * @param pname_cmdline: The process name taken from /proc/<pid>/cmdline
  * @return 0 on success, > 0 on error.
  */
-static int cg_get_procname_from_proc_cmdline(pid_t pid,
+static int cg_get_procname_from_proc_cmdline(int dirfd,
 			const char *pname_status, char **pname_cmdline)
 {
-	FILE *f;
-	int ret = ECGFAIL;
-	int c = 0;
-	int len = 0;
+	int ret;
+	ssize_t len;
+	char *arg;
 	char path[FILENAME_MAX];
 	char buf_pname[FILENAME_MAX];
 	char buf_cwd[FILENAME_MAX];
 
-	memset(buf_cwd, '\0', sizeof(buf_cwd));
-	sprintf(path, "/proc/%d/cwd", pid);
-	if (readlink(path, buf_cwd, sizeof(buf_cwd)) < 0)
+	len = readlinkat(dirfd, "cwd", buf_cwd, sizeof(buf_cwd) - 1);
+	if (len < 0)
 		return ECGROUPNOTEXIST;
+	buf_cwd[len] = '\0';
 
-	sprintf(path, "/proc/%d/cmdline", pid);
-	f = fopen(path, "re");
-	if (!f)
-		return ECGROUPNOTEXIST;
+	ret = cg_read_proc_file(dirfd, "cmdline", &len);
+	if (ret)
+		return ret;
 
-	while (c != EOF) {
-		c = fgetc(f);
-		if ((c != EOF) && (c != '\0')) {
-			buf_pname[len] = c;
-			len++;
-			continue;
-		}
-		buf_pname[len] = '\0';
+	for (arg = cg_proc_buf; arg < cg_proc_buf + len;
+			arg += strlen(arg) + 1) {
+		/* basename() may modify its argument. */
+		strncpy(buf_pname, arg, sizeof(buf_pname) - 1);
+		buf_pname[sizeof(buf_pname) - 1] = '\0';
 
 		/*
 		 * The taken process name from /proc/<pid>/status is
@@ -4210,87 +8375,68 @@ static int cg_get_procname_from_proc_cmdline(pid_t pid,
 		 * name should be compared by its length.
 		 */
 		if (strncmp(pname_status, basename(buf_pname),
-						TASK_COMM_LEN - 1)) {
-			len = 0;
+						TASK_COMM_LEN - 1))
 			continue;
-		}
-		if (buf_pname[0] == '/') {
-			*pname_cmdline = strdup(buf_pname);
-			if (*pname_cmdline == NULL) {
-				last_errno = errno;
-				ret = ECGOTHER;
-				break;
-			}
-			ret = 0;
-			break;
+
+		if (arg[0] == '/') {
+			*pname_cmdline = strdup(arg);
 		} else {
-			strcat(buf_cwd, "/");
-			strcat(buf_cwd, buf_pname);
-			if (!realpath(buf_cwd, path)) {
+			if (snprintf(buf_pname, sizeof(buf_pname), "%s/%s",
+					buf_cwd, arg) >= (int)sizeof(buf_pname))
+				return ECGFAIL;
+			if (!realpath(buf_pname, path)) {
 				last_errno = errno;
-				ret = ECGOTHER;
-				break;
+				return ECGOTHER;
 			}
 			*pname_cmdline = strdup(path);
-			if (*pname_cmdline == NULL) {
-				last_errno = errno;
-				ret = ECGOTHER;
-				break;
-			}
-			ret = 0;
-			break;
 		}
+		if (*pname_cmdline == NULL) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		return 0;
 	}
-	fclose(f);
-	return ret;
+	return ECGFAIL;
 }
 
 /**
- * Get a process name from /proc file system.
- * This function allocates memory for a process name, writes a process
- * name onto it. So a caller should free the memory when unusing it.
- * @param pid: The process id
+ * Get a process name of an open /proc/<pid> directory.
+ * @param dirfd: The open /proc/<pid> directory
+ * @param pname_status: The process name taken from /proc/<pid>/status
  * @param procname: The process name
  * @return 0 on success, > 0 on error.
  */
-int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
+static int cg_get_procname_from_proc_dir(int dirfd, const char *pname_status,
+		char **procname)
 {
-	int ret;
-	char *pname_status;
-	char *pname_cmdline;
-	char path[FILENAME_MAX];
+	ssize_t len;
 	char buf[FILENAME_MAX];
-
-	ret = cg_get_procname_from_proc_status(pid, &pname_status);
-	if (ret)
-		return ret;
+	char exe[FILENAME_MAX];
 
 	/*
 	 * Get the full patch of process name from /proc/<pid>/exe.
 	 */
-	memset(buf, '\0', sizeof(buf));
-	sprintf(path, "/proc/%d/exe", pid);
-	if (readlink(path, buf, sizeof(buf)) < 0) {
+	len = readlinkat(dirfd, "exe", buf, sizeof(buf) - 1);
+	if (len < 0) {
 		/*
 		 * readlink() fails if a kernel thread, and a process
 		 * name is taken from /proc/<pid>/status.
 		 */
-		*procname = pname_status;
-		return 0;
+		*procname = strdup(pname_status);
+		goto out;
 	}
-	if (!strncmp(pname_status, basename(buf), TASK_COMM_LEN - 1)) {
+	buf[len] = '\0';
+
+	/* basename() may modify its argument. */
+	memcpy(exe, buf, len + 1);
+	if (!strncmp(pname_status, basename(exe), TASK_COMM_LEN - 1)) {
 		/*
 		 * The taken process name from /proc/<pid>/status is
 		 * shortened to 15 characters if it is over. So the
 		 * name should be compared by its length.
 		 */
-		free(pname_status);
 		*procname = strdup(buf);
-		if (*procname == NULL) {
-			last_errno = errno;
-			return ECGOTHER;
-		}
-		return 0;
+		goto out;
 	}
 
 	/*
@@ -4300,21 +8446,16 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	 * Then the full path of a shell script is taken from
 	 * /proc/<pid>/cmdline.
 	 */
-	ret = cg_get_procname_from_proc_cmdline(pid, pname_status,
-						    &pname_cmdline);
-	if (!ret) {
-		*procname = pname_cmdline;
-		free(pname_status);
+	if (!cg_get_procname_from_proc_cmdline(dirfd, pname_status, procname))
 		return 0;
-	}
 
 	/*
 	 * The above strncmp() is not 0 also if executing a symbolic link,
 	 * /proc/pid/exe points to real executable name then.
 	 * Return it as the last resort.
 	 */
-	free(pname_status);
 	*procname = strdup(buf);
+out:
 	if (*procname == NULL) {
 		last_errno = errno;
 		return ECGOTHER;
@@ -4322,6 +8463,222 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	return 0;
 }
 
+/**
+ * Get the identity of a process (euid, egid and process name) from /proc
+ * in a single pass. The /proc/<pid> directory is opened only once and all
+ * the files are read relative to it, so they all describe the same process
+ * even if the PID is reused meanwhile. The status file is read only once.
+ * This function allocates memory for a process name, so a caller should
+ * free the memory when unusing it.
+ * @param pid: The process id
+ * @param euid: The uid of param pid, or NULL
+ * @param egid: The gid of param pid, or NULL
+ * @param procname: The process name, or NULL
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_get_proc_identity(pid_t pid, uid_t *euid, gid_t *egid,
+		char **procname)
+{
+	int dirfd;
+	int ret;
+	char path[FILENAME_MAX];
+	char comm[FILENAME_MAX];
+
+	snprintf(path, sizeof(path), "%s/%d", cg_proc_root, pid);
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return ECGROUPNOTEXIST;
+
+	ret = cg_get_proc_status(dirfd, pid, euid, egid,
+			procname ? comm : NULL, sizeof(comm));
+	if (!ret && procname)
+		ret = cg_get_procname_from_proc_dir(dirfd, comm, procname);
+
+	close(dirfd);
+	return ret;
+}
+
+/**
+ * Get process data (euid and egid) from /proc/<pid>/status file.
+ * @param pid: The process id
+ * @param euid: The uid of param pid
+ * @param egid: The gid of param pid
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
+{
+	return cgroup_get_proc_identity(pid, euid, egid, NULL);
+}
+
+/**
+ * Get a process name from /proc file system.
+ * This function allocates memory for a process name, writes a process
+ * name onto it. So a caller should free the memory when unusing it.
+ * @param pid: The process id
+ * @param procname: The process name
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
+{
+	return cgroup_get_proc_identity(pid, NULL, NULL, procname);
+}
+
+/**
+ * Get the current groups of a task from /proc/<pid>/cgroup, read with a
+ * single read() into cg_proc_buf if it fits there.
+ *	@param paths Array of count items, filled with malloc'ed paths or NULL
+ *	for controllers, which are not there
+ *	@return 0 on success, ECGROUPNOTEXIST if the task does not exist,
+ *	ECGOTHER on error
+ */
+static int cg_get_current_paths(pid_t pid, const char * const controllers[],
+		int count, char *paths[])
+{
+	char path[FILENAME_MAX];
+	char *cgroups = cg_proc_buf;
+	char *alloc = NULL;
+	const char *cur;
+	size_t len;
+	ssize_t read_len;
+	int i;
+
+	for (i = 0; i < count; i++)
+		paths[i] = NULL;
+
+	snprintf(path, sizeof(path), "%s/%d/cgroup", cg_proc_root, pid);
+	if (cg_read_proc_file(AT_FDCWD, path, &read_len))
+		return ECGROUPNOTEXIST;
+	if (read_len >= CG_PROC_BUF_SIZE - 1) {
+		/* Too many or too long paths, read all of it. */
+		alloc = cg_read_proc_cgroups(pid);
+		if (!alloc)
+			return ECGROUPNOTEXIST;
+		cgroups = alloc;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!controllers[i])
+			continue;
+		cur = cg_proc_cgroup_path(cgroups, controllers[i],
+				cg_controller_unified(controllers[i]), &len);
+		if (!cur)
+			continue;
+		paths[i] = malloc(len + 2);
+		if (!paths[i]) {
+			last_errno = errno;
+			while (i--) {
+				free(paths[i]);
+				paths[i] = NULL;
+			}
+			free(alloc);
+			return ECGOTHER;
+		}
+		paths[i][0] = '/';
+		memcpy(paths[i] + 1, cur, len);
+		paths[i][len + 1] = '\0';
+	}
+
+	free(alloc);
+	return 0;
+}
+
+/**
+ * cgroup_get_current_controller_path
+ * @pid: pid of the current process for which the path is to be determined
+ * @controller: name of the controller for which to determine current path
+ * @current_path: a pointer that is filled with the value of the current
+ *		path as seen in /proc/<pid>/cgroup
+ */
+int cgroup_get_current_controller_path(pid_t pid, const char *controller,
+					char **current_path)
+{
+	const char *controllers[] = { controller };
+	int ret;
+
+	if (!controller)
+		return ECGOTHER;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("Warning: libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	ret = cg_get_current_paths(pid, controllers, 1, current_path);
+	if (!ret && !*current_path)
+		ret = ECGROUPNOTEXIST;
+	return ret;
+}
+
+int cgroup_get_current_controller_paths(pid_t pid,
+		const char * const controllers[], char *paths[])
+{
+	int errors[1];
+	int ret;
+
+	ret = cgroup_get_current_controller_paths_pids(&pid, 1, controllers,
+			paths, errors);
+	return ret ? ret : errors[0];
+}
+
+int cgroup_get_current_controller_paths_pids(const pid_t *pids, int count,
+		const char * const controllers[], char *paths[], int *errors)
+{
+	const char *mounted[CG_CURRENT_PATHS_MAX];
+	char (*names)[FILENAME_MAX] = NULL;
+	const char * const *list = controllers;
+	int n = 0;
+	int ret = 0, err;
+	int i;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("Warning: libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+	if (count < 0 || (count && (!pids || !paths)))
+		return ECGINVAL;
+
+	if (controllers) {
+		while (controllers[n])
+			n++;
+	} else {
+		/* Copy the names, the table can change meanwhile. */
+		names = malloc(CG_CURRENT_PATHS_MAX * sizeof(*names));
+		if (!names) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		pthread_rwlock_rdlock(&cg_mount_table_lock);
+		for (n = 0; n < CG_CONTROLLER_MAX && n < CG_CURRENT_PATHS_MAX &&
+				cg_mount_table[n].name[0] != '\0'; n++)
+			strcpy(names[n], cg_mount_table[n].name);
+		pthread_rwlock_unlock(&cg_mount_table_lock);
+		for (i = 0; i < CG_CURRENT_PATHS_MAX; i++)
+			mounted[i] = i < n ? names[i] : NULL;
+		list = mounted;
+		n = CG_CURRENT_PATHS_MAX;
+	}
+
+	for (i = 0; i < count; i++) {
+		err = cg_get_current_paths(pids[i], list, n, paths + i * n);
+		if (errors)
+			errors[i] = err;
+		if (err == ECGOTHER) {
+			/* Out of memory, free what was returned. */
+			while (i--) {
+				for (err = 0; err < n; err++) {
+					free(paths[i * n + err]);
+					paths[i * n + err] = NULL;
+				}
+			}
+			ret = ECGOTHER;
+			break;
+		}
+	}
+
+	free(names);
+	return ret;
+}
+
 int cgroup_register_unchanged_process(pid_t pid, int flags)
 {
 	int sk;
@@ -4479,6 +8836,35 @@ static int pid_compare(const void *a, const void *b)
 	return (*pid1 - *pid2);
 }
 
+/*
+ * Open cgroup.procs or tasks file of a group for a cg_pid_reader.
+ */
+static int cg_open_pids(const char *name, const char *controller, int flags,
+		struct cg_pid_reader *reader)
+{
+	char cgroup_path[FILENAME_MAX];
+
+	if (!cg_build_path(name, cgroup_path, controller))
+		return ECGOTHER;
+	strncat(cgroup_path, "/", FILENAME_MAX - strlen(cgroup_path) - 1);
+	strncat(cgroup_path, (flags & CGROUP_PROCS_TASKS) ?
+			cg_threads_file(controller) : "cgroup.procs",
+			FILENAME_MAX - strlen(cgroup_path) - 1);
+
+	reader->pos = reader->len = 0;
+	reader->fd = cg_open(cgroup_path, O_RDONLY | O_CLOEXEC);
+	if (reader->fd < 0) {
+		last_errno = errno;
+		/*
+		 * This kernel does not have support for cgroup.procs
+		 */
+		if (errno == ENOENT && !(flags & CGROUP_PROCS_TASKS))
+			return ECGROUPUNSUPP;
+		return ECGOTHER;
+	}
+	return 0;
+}
+
 /*
  *pids needs to be completely uninitialized so that we can set it up
  *
@@ -4486,65 +8872,49 @@ static int pid_compare(const void *a, const void *b)
  */
 int cgroup_get_procs(char *name, char *controller, pid_t **pids, int *size)
 {
-	char cgroup_path[FILENAME_MAX];
-	FILE *procs;
-	pid_t *tmp_list;
-	int tot_procs = 16;
+	struct cg_pid_reader reader;
+	pid_t *tmp_list, *orig_list;
+	int tot_procs = 1024;
 	int n = 0;
 	int err;
 
-	cg_build_path(name, cgroup_path, controller);
-	strncat(cgroup_path, "/cgroup.procs", FILENAME_MAX-strlen(cgroup_path));
+	*pids = NULL;
+	*size = 0;
 
-	/*
-	 * This kernel does have support for cgroup.procs
-	 */
-	if (access(cgroup_path, F_OK))
-		return ECGROUPUNSUPP;
+	err = cg_open_pids(name, controller, 0, &reader);
+	if (err)
+		return err;
 
 	/*
 	 * Keep doubling the memory allocated if needed
 	 */
-	tmp_list= malloc(sizeof(pid_t) * tot_procs);
+	tmp_list = malloc(sizeof(pid_t) * tot_procs);
 	if (!tmp_list) {
 		last_errno = errno;
+		close(reader.fd);
 		return ECGOTHER;
 	}
 
-	procs = fopen(cgroup_path, "r");
-	if (!procs) {
-		last_errno = errno;
-		free(tmp_list);
-		*pids = NULL;
-		*size = 0;
-		return ECGOTHER;
-	}
+	while ((err = cg_pid_reader_next(&reader, &tmp_list[n])) == 0) {
+		if (++n < tot_procs)
+			continue;
 
-	while (!feof(procs)) {
-		while (!feof(procs) && n < tot_procs) {
-			pid_t pid;
-			err = fscanf(procs, "%u", &pid);
-			if (err == EOF)
-				break;
-			tmp_list[n] = pid;
-			n++;
-		}
-		if (!feof(procs)) {
-			pid_t *orig_list = tmp_list;
-			tot_procs *= 2;
-			tmp_list = realloc(tmp_list, sizeof(pid_t) * tot_procs);
-			if (!tmp_list) {
-				last_errno = errno;
-				fclose(procs);
-				free(orig_list);
-				*pids = NULL;
-				*size = 0;
-				return ECGOTHER;
-			}
+		orig_list = tmp_list;
+		tot_procs *= 2;
+		tmp_list = realloc(tmp_list, sizeof(pid_t) * tot_procs);
+		if (!tmp_list) {
+			last_errno = errno;
+			free(orig_list);
+			err = ECGOTHER;
+			break;
 		}
 	}
+	close(reader.fd);
 
-	fclose(procs);
+	if (err != ECGEOF) {
+		free(tmp_list);
+		return err;
+	}
 
 	*size = n;
 
@@ -4555,6 +8925,49 @@ int cgroup_get_procs(char *name, char *controller, pid_t **pids, int *size)
 	return 0;
 }
 
+int cgroup_get_procs_buf(const char *name, const char *controller,
+		int flags, pid_t *pids, int *size)
+{
+	struct cg_pid_reader reader;
+	int max, n = 0;
+	pid_t pid;
+	int err;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!size || (*size && !pids) || *size < 0)
+		return ECGINVAL;
+
+	max = *size;
+
+	err = cg_open_pids(name, controller, flags, &reader);
+	if (err)
+		return err;
+
+	while ((err = cg_pid_reader_next(&reader, &pid)) == 0) {
+		if (n < max)
+			pids[n] = pid;
+		n++;
+	}
+	close(reader.fd);
+
+	if (err != ECGEOF)
+		return err;
+
+	*size = n;
+	if (!pids)
+		return 0;
+	if (n > max) {
+		last_errno = ERANGE;
+		return ECGOTHER;
+	}
+
+	if (flags & CGROUP_PROCS_SORT)
+		qsort(pids, n, sizeof(pid_t), &pid_compare);
+
+	return 0;
+}
 
 int cgroup_dictionary_create(struct cgroup_dictionary **dict,
 		int flags)
@@ -22,6 +22,10 @@
  * by Dhaval Giani. All faults will still be Balbir's mistake :)
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
@@ -37,6 +41,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -58,6 +63,12 @@ extern int yyparse(void);
 static struct cgroup default_group;
 static int default_group_set = 0;
 
+/* The file being parsed has a 'default' section */
+static int config_default_defined;
+
+/* Directory of the compiled configuration files, NULL if not used */
+static char *config_cache_dir;
+
 /*
  * The basic global data structures.
  *
@@ -93,6 +104,45 @@ static struct cgroup *template_table;
 static int template_table_index;
 static struct cgroup_string_list *template_files;
 
+/*
+ * Controllers and values of config_cgroup_table and config_template_table
+ * are allocated from one arena per cgroup_parse_config() call. The templates
+ * cache shares them, so it keeps references to the arenas of the parse
+ * sessions the templates come from.
+ */
+static struct cg_arena *config_arena;
+static struct cg_arena **template_arenas;
+static int template_arenas_count;
+
+/*
+ * Source files of the templates cache. A reload takes the templates of the
+ * files which did not change from the old cache instead of parsing them
+ * again.
+ */
+struct cg_template_source {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	/* the templates of the file in template_table */
+	int first;
+	int count;
+	/* arena of the templates, referenced from template_arenas */
+	struct cg_arena *arena;
+};
+static struct cg_template_source *template_sources;
+static int template_sources_count;
+
+/*
+ * Templates by name: template_hash holds the first template of each bucket,
+ * template_hash_next the next one in the same bucket, in the table order.
+ * Without the index, template_table is searched linearly.
+ */
+static int *template_hash;
+static int *template_hash_next;
+static unsigned int template_hash_size;
+
 
 /*
  * Needed for the type while mounting cgroupfs.
@@ -242,6 +292,7 @@ int config_parse_controller_options(char *controller,
 	}
 
 	cgroup_dbg("Adding controller %s\n", controller);
+	config_cgroup->arena = config_arena;
 	cgc = cgroup_add_controller(config_cgroup, controller);
 
 	if (!cgc)
@@ -689,9 +740,29 @@ static int cgroup_config_ajdust_mount_options(struct cg_mount_table_s *mount,
 }
 
 /*
- * Start mounting the mount table.
+ * Check whether the (first) controller of given mount table entry is already
+ * mounted somewhere.
+ */
+static int cgroup_config_is_mounted(struct cg_mount_table_s *mount)
+{
+	char controller[FILENAME_MAX];
+	char *mount_point = NULL;
+	int ret;
+
+	strncpy(controller, mount->name, sizeof(controller) - 1);
+	controller[sizeof(controller) - 1] = '\0';
+	controller[strcspn(controller, ",")] = '\0';
+
+	ret = cgroup_get_subsys_mount_point(controller, &mount_point);
+	free(mount_point);
+	return ret == 0;
+}
+
+/*
+ * Start mounting the mount table. With skip_mounted, hierarchies whose
+ * controllers are already mounted are left untouched.
  */
-static int cgroup_config_mount_fs(void)
+static int cgroup_config_mount_fs(int skip_mounted)
 {
 	int ret;
 	struct stat buff;
@@ -702,6 +773,11 @@ static int cgroup_config_mount_fs(void)
 	for (i = 0; i < config_table_index; i++) {
 		struct cg_mount_table_s *curr =	&(config_mount_table[i]);
 
+		if (skip_mounted && cgroup_config_is_mounted(curr)) {
+			cgroup_dbg("%s is already mounted\n", curr->name);
+			continue;
+		}
+
 		ret = stat(curr->mount.path, &buff);
 
 		if (ret < 0 && errno != ENOENT) {
@@ -754,6 +830,231 @@ out_err:
 	return error;
 }
 
+int _cgroup_config_compare_groups(const void *p1, const void *p2)
+{
+	const struct cgroup *g1 = p1;
+	const struct cgroup *g2 = p2;
+
+	return strcmp(g1->name, g2->name);
+}
+
+static void cgroup_config_sort_groups()
+{
+	qsort(config_cgroup_table, cgroup_table_index, sizeof(struct cgroup),
+			_cgroup_config_compare_groups);
+}
+
+static int cgroup_config_compare_group_name(const void *key, const void *p)
+{
+	const struct cgroup *g = p;
+
+	return strcmp(key, g->name);
+}
+
+/*
+ * Find the nearest ancestor of group i in the sorted config_cgroup_table.
+ * Returns its index or -1 if none of the ancestors is defined in the table.
+ */
+static int cgroup_config_find_parent(int i)
+{
+	char path[FILENAME_MAX];
+	struct cgroup *parent;
+	char *slash;
+
+	strncpy(path, config_cgroup_table[i].name, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+
+	for (;;) {
+		/* strip trailing slashes, then the last path component */
+		slash = path + strlen(path);
+		while (slash > path && *(slash - 1) == '/')
+			slash--;
+		*slash = '\0';
+		slash = strrchr(path, '/');
+		if (!slash)
+			return -1;
+		*slash = '\0';
+		if (!*path)
+			return -1;
+
+		parent = bsearch(path, config_cgroup_table, i,
+				sizeof(struct cgroup),
+				cgroup_config_compare_group_name);
+		if (parent)
+			return parent - config_cgroup_table;
+	}
+}
+
+/*
+ * Number of threads creating the groups, see cgroup_config_set_jobs().
+ */
+static unsigned int config_jobs = 1;
+
+int cgroup_config_set_cache_dir(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir) {
+		copy = strdup(dir);
+		if (!copy) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+	}
+	free(config_cache_dir);
+	config_cache_dir = copy;
+	return 0;
+}
+
+void cgroup_config_set_jobs(unsigned int jobs)
+{
+	config_jobs = jobs ? jobs : 1;
+}
+
+/*
+ * State shared by the threads of cgroup_config_create_groups_parallel().
+ * Groups are split into subtrees of groups whose ancestors are not in the
+ * table. Each subtree is created by one thread, parents first, while
+ * different subtrees are created concurrently.
+ */
+struct cg_create_job {
+	/* index of the first group of each subtree */
+	int *roots;
+	int roots_count;
+	/* index of the next group in the same subtree, -1 for the last one */
+	int *next;
+	/* next subtree to be picked by a thread */
+	int next_root;
+	/* error and errno of each group */
+	int *errors;
+	int *errnos;
+	/* lowest index of a failed group, cgroup_table_index if none */
+	int first_failed;
+	/* cg_namespace_table of the calling thread */
+	char *namespaces[CG_CONTROLLER_MAX];
+};
+
+static void *cgroup_config_create_worker(void *arg)
+{
+	struct cg_create_job *job = arg;
+	int root, first, i;
+
+	/* cg_namespace_table is per thread, inherit the caller's one */
+	memcpy(cg_namespace_table, job->namespaces,
+			sizeof(cg_namespace_table));
+
+	while ((root = __sync_fetch_and_add(&job->next_root, 1))
+			< job->roots_count) {
+		for (i = job->roots[root]; i >= 0; i = job->next[i]) {
+			/* an earlier group failed, its error wins anyway */
+			if (i > job->first_failed)
+				break;
+
+			job->errors[i] = cgroup_create_cgroup(
+					&config_cgroup_table[i], 0);
+			cgroup_dbg("creating group %s, error %d\n",
+					config_cgroup_table[i].name,
+					job->errors[i]);
+			if (!job->errors[i])
+				continue;
+
+			job->errnos[i] = last_errno;
+			do {
+				first = job->first_failed;
+			} while (i < first && !__sync_bool_compare_and_swap(
+					&job->first_failed, first, i));
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int cgroup_config_create_groups_parallel(void)
+{
+	struct cg_create_job job;
+	pthread_t *threads = NULL;
+	int *subtree = NULL, *tail = NULL;
+	unsigned int nthreads, started = 0;
+	int error = 0;
+	int i, parent;
+
+	memset(&job, 0, sizeof(job));
+	job.first_failed = cgroup_table_index;
+	memcpy(job.namespaces, cg_namespace_table, sizeof(job.namespaces));
+
+	job.roots = calloc(cgroup_table_index, sizeof(int));
+	job.next = calloc(cgroup_table_index, sizeof(int));
+	job.errors = calloc(cgroup_table_index, sizeof(int));
+	job.errnos = calloc(cgroup_table_index, sizeof(int));
+	subtree = calloc(cgroup_table_index, sizeof(int));
+	tail = calloc(cgroup_table_index, sizeof(int));
+	if (!job.roots || !job.next || !job.errors || !job.errnos
+			|| !subtree || !tail) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
+
+	/* sorting puts every group after all its ancestors */
+	cgroup_config_sort_groups();
+
+	for (i = 0; i < cgroup_table_index; i++) {
+		job.next[i] = -1;
+
+		if (i > 0 && !strcmp(config_cgroup_table[i].name,
+					config_cgroup_table[i - 1].name))
+			parent = i - 1;
+		else
+			parent = cgroup_config_find_parent(i);
+
+		if (parent < 0) {
+			subtree[i] = job.roots_count;
+			tail[job.roots_count] = i;
+			job.roots[job.roots_count++] = i;
+		} else {
+			subtree[i] = subtree[parent];
+			job.next[tail[subtree[i]]] = i;
+			tail[subtree[i]] = i;
+		}
+	}
+
+	nthreads = config_jobs;
+	if (nthreads > (unsigned int)job.roots_count)
+		nthreads = job.roots_count;
+
+	/* the calling thread is one of the workers */
+	if (nthreads > 1) {
+		threads = calloc(nthreads - 1, sizeof(pthread_t));
+		while (threads && started < nthreads - 1) {
+			if (pthread_create(&threads[started], NULL,
+					cgroup_config_create_worker, &job))
+				break;
+			started++;
+		}
+	}
+	cgroup_dbg("creating %d groups in %d subtrees using %u threads\n",
+			cgroup_table_index, job.roots_count, started + 1);
+
+	cgroup_config_create_worker(&job);
+	while (started)
+		pthread_join(threads[--started], NULL);
+
+	if (job.first_failed < cgroup_table_index) {
+		error = job.errors[job.first_failed];
+		last_errno = job.errnos[job.first_failed];
+	}
+
+out:
+	free(threads);
+	free(tail);
+	free(subtree);
+	free(job.errnos);
+	free(job.errors);
+	free(job.next);
+	free(job.roots);
+	return error;
+}
+
 /*
  * Actually create the groups once the parsing has been finished.
  */
@@ -762,6 +1063,9 @@ static int cgroup_config_create_groups(void)
 	int error = 0;
 	int i;
 
+	if (config_jobs > 1 && cgroup_table_index > 1)
+		return cgroup_config_create_groups_parallel();
+
 	for (i = 0; i < cgroup_table_index; i++) {
 		struct cgroup *cgroup = &config_cgroup_table[i];
 		error = cgroup_create_cgroup(cgroup, 0);
@@ -807,7 +1111,7 @@ static int cgroup_config_unmount_controllers(void)
 		 * We ignore failures and ensure that all mounted
 		 * containers are unmounted
 		 */
-		error = umount(config_mount_table[i].mount.path);
+		error = cg_umount(config_mount_table[i].mount.path);
 		if (error < 0)
 			cgroup_dbg("Unmount failed\n");
 		error = rmdir(config_mount_table[i].mount.path);
@@ -1006,6 +1310,8 @@ static void cgroup_free_config(void)
 		config_template_table = NULL;
 	}
 	config_template_table_index = 0;
+	cg_arena_put(config_arena);
+	config_arena = NULL;
 }
 
 /**
@@ -1036,29 +1342,33 @@ static void cgroup_config_apply_default()
 	}
 }
 
-static int cgroup_parse_config(const char *pathname)
+/**
+ * Prepare empty tables for a new parse session, with room for the given
+ * number of groups and templates.
+ *	@return 0 on success, > 0 on error
+ */
+static int cgroup_config_init_tables(unsigned int groups,
+		unsigned int templates)
 {
-	int ret;
+	/* Forget the previous session, the templates keep their arenas. */
+	cgroup_free_config();
 
-	yyin = fopen(pathname, "re");
+	while (MAX_CGROUPS <= groups && MAX_CGROUPS < INT_MAX / 2)
+		MAX_CGROUPS *= 2;
+	while (MAX_TEMPLATES <= templates && MAX_TEMPLATES < INT_MAX / 2)
+		MAX_TEMPLATES *= 2;
 
-	if (!yyin) {
-		cgroup_err("Error: failed to open file %s\n", pathname);
-		last_errno = errno;
-		return ECGOTHER;
-	}
+	config_arena = cg_arena_create();
+	if (!config_arena)
+		goto err;
 
 	config_cgroup_table = calloc(MAX_CGROUPS, sizeof(struct cgroup));
-	if (!config_cgroup_table) {
-		ret = ECGFAIL;
+	if (!config_cgroup_table)
 		goto err;
-	}
 
 	config_template_table = calloc(MAX_TEMPLATES, sizeof(struct cgroup));
-	if (!config_template_table) {
-		ret = ECGFAIL;
+	if (!config_template_table)
 		goto err;
-	}
 
 	/* Clear all internal variables so this function can be called twice. */
 	init_cgroup_table(config_cgroup_table, MAX_CGROUPS);
@@ -1069,137 +1379,925 @@ static int cgroup_parse_config(const char *pathname)
 	namespace_table_index = 0;
 	cgroup_table_index = 0;
 	config_template_table_index = 0;
+	config_default_defined = 0;
 
 	if (!default_group_set) {
 		/* init the default cgroup */
 		init_cgroup_table(&default_group, 1);
 	}
+	return 0;
 
-	/*
-	 * Parser calls longjmp() on really fatal error (like out-of-memory).
-	 */
-	ret = setjmp(parser_error_env);
-	if (!ret)
-		ret = yyparse();
-	if (ret) {
-		/*
-		 * Either yyparse failed or longjmp() was called.
-		 */
-		cgroup_err("Error: failed to parse file %s\n", pathname);
-		ret = ECGCONFIGPARSEFAIL;
-		goto err;
+err:
+	cgroup_free_config();
+	return ECGFAIL;
+}
+
+/*
+ * The compiled configuration: the parsed tables of one configuration file,
+ * written as a stream of 32 and 64 bit numbers and strings, which are
+ * prefixed by their length including the terminating '\0'. It ends with
+ * the checksum of all the preceding data. The image is valid only while
+ * checksums of the configuration file, /etc/passwd, /etc/group and
+ * /etc/nsswitch.conf, which resolve the user and group names, match the
+ * recorded ones. The resolved ids are recorded, so the image is used only
+ * when users and groups are looked up in the files alone.
+ */
+#define CG_CONFIG_IMAGE_MAGIC	0x43474346
+#define CG_CONFIG_IMAGE_VERSION	2
+
+/* A file the compiled configuration depends on */
+struct cg_config_source {
+	const char *path;
+	/* UINT64_MAX if the file does not exist */
+	u_int64_t size;
+	u_int64_t sum;
+};
+
+#define CG_CONFIG_SOURCES	4
+
+/* A compiled configuration being written */
+struct cg_config_image {
+	char *buf;
+	size_t len;
+	size_t size;
+	int err;
+};
+
+/* A compiled configuration being read */
+struct cg_config_image_reader {
+	const char *pos;
+	const char *end;
+	int err;
+};
+
+/* The FNV-1a hash, used as the checksum */
+static u_int64_t cg_checksum(u_int64_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		sum ^= *p++;
+		sum *= 0x100000001b3ULL;
 	}
+	return sum;
+}
 
-err:
-	if (yyin)
-		fclose(yyin);
-	if (ret) {
-		cgroup_free_config();
+#define CG_CHECKSUM_INIT	0xcbf29ce484222325ULL
+
+/**
+ * Compute the size and checksum of a file.
+ *	@return 0 on success, > 0 on error
+ */
+static int cg_config_source_init(struct cg_config_source *src,
+		const char *path)
+{
+	char buf[65536];
+	ssize_t len;
+	int fd;
+
+	src->path = path;
+	src->size = 0;
+	src->sum = CG_CHECKSUM_INIT;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		src->size = UINT64_MAX;
+		return errno == ENOENT ? 0 : ECGOTHER;
 	}
-	return ret;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		src->sum = cg_checksum(src->sum, buf, len);
+		src->size += len;
+	}
+	close(fd);
+	return len < 0 ? ECGOTHER : 0;
 }
 
-int _cgroup_config_compare_groups(const void *p1, const void *p2)
+static void cg_image_put(struct cg_config_image *img, const void *data,
+		size_t len)
 {
-	const struct cgroup *g1 = p1;
-	const struct cgroup *g2 = p2;
+	char *buf;
+
+	if (img->err)
+		return;
+	if (img->len + len > img->size) {
+		img->size = (img->len + len) * 2;
+		buf = realloc(img->buf, img->size);
+		if (!buf) {
+			img->err = 1;
+			return;
+		}
+		img->buf = buf;
+	}
+	memcpy(img->buf + img->len, data, len);
+	img->len += len;
+}
 
-	return strcmp(g1->name, g2->name);
+static void cg_image_put_u32(struct cg_config_image *img, u_int32_t val)
+{
+	cg_image_put(img, &val, sizeof(val));
 }
 
-static void cgroup_config_sort_groups()
+static void cg_image_put_u64(struct cg_config_image *img, u_int64_t val)
 {
-	qsort(config_cgroup_table, cgroup_table_index, sizeof(struct cgroup),
-			_cgroup_config_compare_groups);
+	cg_image_put(img, &val, sizeof(val));
 }
 
-/*
- * The main function which does all the setup of the data structures
- * and finally creates the cgroups
- */
-int cgroup_config_load_config(const char *pathname)
+static void cg_image_put_str(struct cg_config_image *img, const char *str)
 {
-	int error;
-	int namespace_enabled = 0;
-	int mount_enabled = 0;
-	int ret;
+	u_int32_t len = strlen(str) + 1;
 
-	ret = cgroup_parse_config(pathname);
-	if (ret != 0)
-		return ret;
+	cg_image_put_u32(img, len);
+	cg_image_put(img, str, len);
+}
 
-	namespace_enabled = (config_namespace_table[0].name[0] != '\0');
-	mount_enabled = (config_mount_table[0].name[0] != '\0');
+static const void *cg_image_get(struct cg_config_image_reader *rd,
+		size_t len)
+{
+	const char *data = rd->pos;
 
-	/*
-	 * The configuration should have namespace or mount, not both.
-	 */
-	if (namespace_enabled && mount_enabled) {
-		free(config_cgroup_table);
-		return ECGMOUNTNAMESPACE;
+	if (rd->err || rd->end - rd->pos < len) {
+		rd->err = 1;
+		return NULL;
 	}
+	rd->pos += len;
+	return data;
+}
 
-	error = cgroup_config_mount_fs();
-	if (error)
-		goto err_mnt;
+static u_int32_t cg_image_get_u32(struct cg_config_image_reader *rd)
+{
+	const void *data = cg_image_get(rd, sizeof(u_int32_t));
+	u_int32_t val = 0;
 
-	error = cgroup_init();
-	if (error == ECGROUPNOTMOUNTED && cgroup_table_index == 0
-		&& config_template_table_index == 0) {
-		/*
-		 * The config file seems to be empty.
-		 */
-		error = 0;
-		goto err_mnt;
-	}
-	if (error)
-		goto err_mnt;
+	if (data)
+		memcpy(&val, data, sizeof(val));
+	return val;
+}
 
-	/*
-	 * The very first thing is to sort the namespace table. If we fail
-	 * we unmount everything and get out.
-	 */
+static u_int64_t cg_image_get_u64(struct cg_config_image_reader *rd)
+{
+	const void *data = cg_image_get(rd, sizeof(u_int64_t));
+	u_int64_t val = 0;
 
-	error = config_order_namespace_table();
-	if (error)
-		goto err_mnt;
+	if (data)
+		memcpy(&val, data, sizeof(val));
+	return val;
+}
 
-	error = config_validate_namespaces();
-	if (error)
-		goto err_mnt;
+/**
+ * Read a string of the compiled configuration.
+ *	@return The string, "" if the image is corrupted
+ */
+static const char *cg_image_get_str(struct cg_config_image_reader *rd)
+{
+	u_int32_t len = cg_image_get_u32(rd);
+	const char *str = cg_image_get(rd, len);
 
-	cgroup_config_apply_default();
-	error = cgroup_config_create_groups();
-	cgroup_dbg("creating all cgroups now, error=%d\n", error);
-	if (error)
-		goto err_grp;
+	if (!str || !len || str[len - 1] != '\0') {
+		rd->err = 1;
+		return "";
+	}
+	return str;
+}
 
-	cgroup_free_config();
+static void cg_image_put_perms(struct cg_config_image *img,
+		const struct cgroup *cg)
+{
+	cg_image_put_u32(img, cg->tasks_uid);
+	cg_image_put_u32(img, cg->tasks_gid);
+	cg_image_put_u32(img, cg->task_fperm);
+	cg_image_put_u32(img, cg->control_uid);
+	cg_image_put_u32(img, cg->control_gid);
+	cg_image_put_u32(img, cg->control_fperm);
+	cg_image_put_u32(img, cg->control_dperm);
+}
 
-	return 0;
-err_grp:
-	cgroup_config_destroy_groups();
-err_mnt:
-	cgroup_config_unmount_controllers();
-	cgroup_free_config();
-	return error;
+static void cg_image_get_perms(struct cg_config_image_reader *rd,
+		struct cgroup *cg)
+{
+	cg->tasks_uid = cg_image_get_u32(rd);
+	cg->tasks_gid = cg_image_get_u32(rd);
+	cg->task_fperm = cg_image_get_u32(rd);
+	cg->control_uid = cg_image_get_u32(rd);
+	cg->control_gid = cg_image_get_u32(rd);
+	cg->control_fperm = cg_image_get_u32(rd);
+	cg->control_dperm = cg_image_get_u32(rd);
 }
 
-/* unmounts given mount, but only if it is empty */
-static int cgroup_config_try_unmount(struct cg_mount_table_s *mount_info)
+static void cg_image_put_groups(struct cg_config_image *img,
+		const struct cgroup *table, int count)
 {
-	char *controller, *controller_list;
-	struct cg_mount_point *mount = &(mount_info->mount);
-	void *handle = NULL;
-	int ret, lvl;
-	struct cgroup_file_info info;
-	char *saveptr = NULL;
+	const struct cgroup_controller *cgc;
+	int i, j, k;
 
-	/* parse the first controller name from list of controllers */
-	controller_list = strdup(mount_info->name);
-	if (!controller_list) {
-		last_errno = errno;
-		return ECGOTHER;
+	for (i = 0; i < count; i++) {
+		cg_image_put_str(img, table[i].name);
+		cg_image_put_perms(img, &table[i]);
+		cg_image_put_u32(img, table[i].index);
+		for (j = 0; j < table[i].index; j++) {
+			cgc = table[i].controller[j];
+			cg_image_put_str(img, cgc->name);
+			cg_image_put_u32(img, cgc->index);
+			for (k = 0; k < cgc->index; k++) {
+				cg_image_put_str(img, cgc->values[k]->name);
+				cg_image_put_str(img, cgc->values[k]->value);
+			}
+		}
+	}
+}
+
+/**
+ * Read the groups or templates of the compiled configuration into a table
+ * prepared by cgroup_config_init_tables().
+ *	@return 0 on success, > 0 if the image is corrupted or on error
+ */
+static int cg_image_get_groups(struct cg_config_image_reader *rd,
+		struct cgroup *table, int *index, u_int32_t count)
+{
+	struct cgroup_controller *cgc;
+	u_int32_t ncontrollers, nvalues;
+	const char *name, *value;
+	struct cgroup *cg;
+	u_int32_t i, j, k;
+
+	for (i = 0; i < count && !rd->err; i++) {
+		cg = &table[i];
+		strncpy(cg->name, cg_image_get_str(rd), FILENAME_MAX - 1);
+		cg_image_get_perms(rd, cg);
+		cg->arena = config_arena;
+		*index = i + 1;
+
+		ncontrollers = cg_image_get_u32(rd);
+		for (j = 0; j < ncontrollers && !rd->err; j++) {
+			cgc = cgroup_add_controller(cg, cg_image_get_str(rd));
+			if (!cgc)
+				return ECGFAIL;
+			nvalues = cg_image_get_u32(rd);
+			for (k = 0; k < nvalues && !rd->err; k++) {
+				name = cg_image_get_str(rd);
+				value = cg_image_get_str(rd);
+				if (cgroup_add_value_string(cgc, name, value))
+					return ECGFAIL;
+			}
+		}
+	}
+	return rd->err ? ECGFAIL : 0;
+}
+
+static void cg_image_put_mounts(struct cg_config_image *img,
+		const struct cg_mount_table_s *table, int count)
+{
+	int i;
+
+	cg_image_put_u32(img, count);
+	for (i = 0; i < count; i++) {
+		cg_image_put_str(img, table[i].name);
+		cg_image_put_str(img, table[i].mount.path);
+	}
+}
+
+static int cg_image_get_mounts(struct cg_config_image_reader *rd,
+		struct cg_mount_table_s *table, int *index)
+{
+	u_int32_t count, i;
+
+	count = cg_image_get_u32(rd);
+	if (count > CG_CONTROLLER_MAX)
+		return ECGFAIL;
+	for (i = 0; i < count; i++) {
+		strncpy(table[i].name, cg_image_get_str(rd),
+				FILENAME_MAX - 1);
+		strncpy(table[i].mount.path, cg_image_get_str(rd),
+				FILENAME_MAX - 1);
+		table[i].mount.next = NULL;
+	}
+	*index = count;
+	return rd->err ? ECGFAIL : 0;
+}
+
+/**
+ * Get the path of the compiled configuration of a configuration file.
+ */
+static char *cg_config_image_path(const char *pathname)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%016llx.img", config_cache_dir,
+			(unsigned long long)cg_checksum(CG_CHECKSUM_INIT,
+				pathname, strlen(pathname))) < 0)
+		return NULL;
+	return path;
+}
+
+/**
+ * Write the tables parsed from a configuration file to its compiled
+ * configuration, replacing the previous one atomically.
+ *	@param pathname The configuration file
+ *	@param sources The files the configuration depends on, as they were
+ *	before the parse
+ */
+static void cgroup_config_write_image(const char *pathname,
+		const struct cg_config_source *sources)
+{
+	struct cg_config_image img = { NULL, 0, 0, 0 };
+	char *path, *tmp = NULL;
+	u_int64_t sum;
+	int fd = -1;
+	int i;
+
+	path = cg_config_image_path(pathname);
+	if (!path)
+		return;
+
+	cg_image_put_u32(&img, CG_CONFIG_IMAGE_MAGIC);
+	cg_image_put_u32(&img, CG_CONFIG_IMAGE_VERSION);
+	cg_image_put_str(&img, pathname);
+	cg_image_put_u32(&img, CG_CONFIG_SOURCES);
+	for (i = 0; i < CG_CONFIG_SOURCES; i++) {
+		cg_image_put_str(&img, sources[i].path);
+		cg_image_put_u64(&img, sources[i].size);
+		cg_image_put_u64(&img, sources[i].sum);
+	}
+	cg_image_put_u32(&img, config_default_defined);
+	cg_image_put_perms(&img, &default_group);
+	cg_image_put_u32(&img, cgroup_table_index);
+	cg_image_put_u32(&img, config_template_table_index);
+	cg_image_put_mounts(&img, config_mount_table, config_table_index);
+	cg_image_put_mounts(&img, config_namespace_table,
+			namespace_table_index);
+	cg_image_put_groups(&img, config_cgroup_table, cgroup_table_index);
+	cg_image_put_groups(&img, config_template_table,
+			config_template_table_index);
+	sum = cg_checksum(CG_CHECKSUM_INIT, img.buf, img.len);
+	cg_image_put_u64(&img, sum);
+	if (img.err)
+		goto out;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto err;
+	if (fchmod(fd, 0644) || cg_write_all(fd, img.buf, img.len))
+		goto err;
+	i = close(fd);
+	fd = -1;
+	if (i || rename(tmp, path))
+		goto err;
+	cgroup_dbg("Compiled configuration %s written to %s\n", pathname,
+			path);
+	goto out;
+
+err:
+	cgroup_warn("Warning: cannot write compiled configuration %s: %s\n",
+			path, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	if (tmp)
+		unlink(tmp);
+out:
+	free(tmp);
+	free(img.buf);
+	free(path);
+}
+
+/**
+ * Fill the tables from the compiled configuration of a configuration file,
+ * if it is up to date.
+ *	@param pathname The configuration file
+ *	@param sources The files the configuration depends on, as they are now
+ *	@return 0 on success, > 0 if the configuration must be parsed
+ */
+static int cgroup_config_load_image(const char *pathname,
+		const struct cg_config_source *sources)
+{
+	struct cg_config_image_reader rd;
+	struct cgroup def;
+	u_int32_t has_default, groups, templates;
+	struct stat st;
+	char *path, *buf = NULL;
+	int fd = -1;
+	int ret = ECGFAIL;
+	int i;
+
+	path = cg_config_image_path(pathname);
+	if (!path)
+		return ECGFAIL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	/* Only trust an image nobody else could have written. */
+	if (fstat(fd, &st) || (st.st_uid != 0 && st.st_uid != geteuid()) ||
+			(st.st_mode & 022) ||
+			st.st_size < sizeof(u_int64_t) || st.st_size > INT_MAX)
+		goto out;
+	buf = malloc(st.st_size);
+	if (!buf || read(fd, buf, st.st_size) != st.st_size)
+		goto out;
+
+	rd.pos = buf;
+	rd.end = buf + st.st_size - sizeof(u_int64_t);
+	rd.err = 0;
+	if (memcmp(rd.end, &(u_int64_t){ cg_checksum(CG_CHECKSUM_INIT, buf,
+			rd.end - buf) }, sizeof(u_int64_t)))
+		goto out;
+
+	if (cg_image_get_u32(&rd) != CG_CONFIG_IMAGE_MAGIC ||
+			cg_image_get_u32(&rd) != CG_CONFIG_IMAGE_VERSION ||
+			strcmp(cg_image_get_str(&rd), pathname))
+		goto out;
+	if (cg_image_get_u32(&rd) != CG_CONFIG_SOURCES)
+		goto out;
+	for (i = 0; i < CG_CONFIG_SOURCES; i++) {
+		if (strcmp(cg_image_get_str(&rd), sources[i].path) ||
+			cg_image_get_u64(&rd) != sources[i].size ||
+			cg_image_get_u64(&rd) != sources[i].sum) {
+			cgroup_dbg("Compiled configuration %s is out of "
+					"date\n", path);
+			goto out;
+		}
+	}
+
+	has_default = cg_image_get_u32(&rd);
+	cg_image_get_perms(&rd, &def);
+	groups = cg_image_get_u32(&rd);
+	templates = cg_image_get_u32(&rd);
+	if (rd.err || groups > INT_MAX / 2 || templates > INT_MAX / 2)
+		goto out;
+
+	ret = cgroup_config_init_tables(groups, templates);
+	if (ret)
+		goto out;
+	ret = ECGFAIL;
+	if (cg_image_get_mounts(&rd, config_mount_table, &config_table_index)
+		|| cg_image_get_mounts(&rd, config_namespace_table,
+			&namespace_table_index)
+		|| cg_image_get_groups(&rd, config_cgroup_table,
+			&cgroup_table_index, groups)
+		|| cg_image_get_groups(&rd, config_template_table,
+			&config_template_table_index, templates)
+		|| rd.pos != rd.end)
+		goto free;
+
+	if (has_default) {
+		config_default_defined = 1;
+		init_cgroup_table(&default_group, 1);
+		default_group.tasks_uid = def.tasks_uid;
+		default_group.tasks_gid = def.tasks_gid;
+		default_group.task_fperm = def.task_fperm;
+		default_group.control_uid = def.control_uid;
+		default_group.control_gid = def.control_gid;
+		default_group.control_fperm = def.control_fperm;
+		default_group.control_dperm = def.control_dperm;
+	}
+	cgroup_dbg("Loaded compiled configuration %s of %s\n", path,
+			pathname);
+	ret = 0;
+	goto out;
+
+free:
+	cgroup_free_config();
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	free(path);
+	return ret;
+}
+
+static int cgroup_parse_config_file(const char *pathname)
+{
+	struct cg_config_source sources[CG_CONFIG_SOURCES];
+	int ret;
+
+	/*
+	 * The checksums are taken before parsing, a file changed meanwhile
+	 * only makes the compiled configuration out of date. Ids resolved by
+	 * other NSS services than files could change unnoticed.
+	 */
+	sources[0].path = NULL;
+	if (config_cache_dir && cg_nss_files_only()) {
+		if (cg_config_source_init(&sources[0], pathname) ||
+			cg_config_source_init(&sources[1], "/etc/passwd") ||
+			cg_config_source_init(&sources[2], "/etc/group") ||
+			cg_config_source_init(&sources[3], CG_NSSWITCH_CONF))
+			sources[0].path = NULL;
+		else if (!cgroup_config_load_image(pathname, sources))
+			return 0;
+	}
+
+	yyin = fopen(pathname, "re");
+
+	if (!yyin) {
+		cgroup_err("Error: failed to open file %s\n", pathname);
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	ret = cgroup_config_init_tables(0, 0);
+	if (ret)
+		goto err;
+
+	/*
+	 * Parser calls longjmp() on really fatal error (like out-of-memory).
+	 */
+	ret = setjmp(parser_error_env);
+	if (!ret)
+		ret = yyparse();
+	if (ret) {
+		/*
+		 * Either yyparse failed or longjmp() was called.
+		 */
+		cgroup_err("Error: failed to parse file %s\n", pathname);
+		ret = ECGCONFIGPARSEFAIL;
+		goto err;
+	}
+
+	if (config_cache_dir && sources[0].path)
+		cgroup_config_write_image(pathname, sources);
+
+err:
+	if (yyin)
+		fclose(yyin);
+	if (ret) {
+		cgroup_free_config();
+	}
+	return ret;
+}
+
+static int cgroup_parse_config(const char *pathname)
+{
+	int ret;
+
+	CG_TRACE1(config_parse_begin, pathname);
+	ret = cgroup_parse_config_file(pathname);
+	CG_TRACE3(config_parse_end, pathname, ret, cgroup_table_index);
+	return ret;
+}
+
+/*
+ * The main function which does all the setup of the data structures
+ * and finally creates the cgroups
+ */
+int cgroup_config_load_config(const char *pathname)
+{
+	int error;
+	int namespace_enabled = 0;
+	int mount_enabled = 0;
+	int ret;
+
+	ret = cgroup_parse_config(pathname);
+	if (ret != 0)
+		return ret;
+
+	namespace_enabled = (config_namespace_table[0].name[0] != '\0');
+	mount_enabled = (config_mount_table[0].name[0] != '\0');
+
+	/*
+	 * The configuration should have namespace or mount, not both.
+	 */
+	if (namespace_enabled && mount_enabled) {
+		free(config_cgroup_table);
+		return ECGMOUNTNAMESPACE;
+	}
+
+	CG_TRACE1(config_mount_begin, pathname);
+	error = cgroup_config_mount_fs(0);
+	CG_TRACE2(config_mount_end, pathname, error);
+	if (error)
+		goto err_mnt;
+
+	error = cgroup_init();
+	if (error == ECGROUPNOTMOUNTED && cgroup_table_index == 0
+		&& config_template_table_index == 0) {
+		/*
+		 * The config file seems to be empty.
+		 */
+		error = 0;
+		goto err_mnt;
+	}
+	if (error)
+		goto err_mnt;
+
+	/*
+	 * The very first thing is to sort the namespace table. If we fail
+	 * we unmount everything and get out.
+	 */
+
+	error = config_order_namespace_table();
+	if (error)
+		goto err_mnt;
+
+	error = config_validate_namespaces();
+	if (error)
+		goto err_mnt;
+
+	cgroup_config_apply_default();
+	CG_TRACE2(config_create_begin, pathname, cgroup_table_index);
+	error = cgroup_config_create_groups();
+	CG_TRACE2(config_create_end, pathname, error);
+	cgroup_dbg("creating all cgroups now, error=%d\n", error);
+	if (error)
+		goto err_grp;
+
+	cgroup_free_config();
+
+	return 0;
+err_grp:
+	cgroup_config_destroy_groups();
+err_mnt:
+	cgroup_config_unmount_controllers();
+	cgroup_free_config();
+	return error;
+}
+
+/*
+ * Bring one existing group in line with its configuration. Only the values
+ * which differ from the current ones are written. Groups which do not exist
+ * yet in some of their hierarchies or whose owners or permissions on the
+ * filesystem differ from the configured ones are (re)created by
+ * cgroup_create_cgroup().
+ */
+static int cgroup_config_reload_group(struct cgroup *cgroup)
+{
+	struct cgroup *current = NULL, *view = NULL, *delta = NULL;
+	struct cgroup_controller *cur_cgc, *view_cgc, *delta_cgc;
+	int i, j, k;
+	int error;
+
+	current = cgroup_new_cgroup(cgroup->name);
+	view = cgroup_new_cgroup(cgroup->name);
+	delta = cgroup_new_cgroup(cgroup->name);
+	if (!current || !view || !delta) {
+		error = ECGFAIL;
+		goto out;
+	}
+
+	error = cgroup_get_cgroup(current);
+	if (error == ECGROUPNOTEXIST) {
+		cgroup_dbg("creating group %s\n", cgroup->name);
+		error = cgroup_create_cgroup(cgroup, 0);
+		goto out;
+	}
+	if (error)
+		goto out;
+
+	/*
+	 * Project the current state on the configured one: the values which
+	 * are not listed in the configuration are not compared. The owners
+	 * and permissions are compared with the filesystem below.
+	 */
+	cgroup_set_uid_gid(view, cgroup->tasks_uid, cgroup->tasks_gid,
+		cgroup->control_uid, cgroup->control_gid);
+
+	for (i = 0; i < cgroup->index; i++) {
+		struct cgroup_controller *cgc = cgroup->controller[i];
+
+		cur_cgc = cgroup_get_controller(current, cgc->name);
+		if (!cur_cgc)
+			break;
+		view_cgc = cgroup_add_controller(view, cgc->name);
+		if (!view_cgc) {
+			error = ECGFAIL;
+			goto out;
+		}
+		for (j = 0; j < cgc->index; j++) {
+			for (k = 0; k < cur_cgc->index; k++)
+				if (!strcmp(cgc->values[j]->name,
+						cur_cgc->values[k]->name))
+					break;
+			if (k == cur_cgc->index)
+				continue;
+			error = cgroup_add_value_string(view_cgc,
+					cur_cgc->values[k]->name,
+					cur_cgc->values[k]->value);
+			if (error)
+				goto out;
+		}
+	}
+
+	if (i < cgroup->index || cg_owner_perms_differ(cgroup)) {
+		cgroup_dbg("recreating group %s\n", cgroup->name);
+		error = cgroup_create_cgroup(cgroup, 0);
+		goto out;
+	}
+
+	if (!cgroup_compare_cgroup(cgroup, view)) {
+		cgroup_dbg("group %s is up to date\n", cgroup->name);
+		goto out;
+	}
+
+	for (i = 0; i < cgroup->index; i++) {
+		struct cgroup_controller *cgc = cgroup->controller[i];
+
+		view_cgc = view->controller[i];
+		if (!cgroup_compare_controllers(cgc, view_cgc))
+			continue;
+
+		delta_cgc = cgroup_add_controller(delta, cgc->name);
+		if (!delta_cgc) {
+			error = ECGFAIL;
+			goto out;
+		}
+		for (j = 0; j < cgc->index; j++) {
+			for (k = 0; k < view_cgc->index; k++)
+				if (!strcmp(cgc->values[j]->name,
+						view_cgc->values[k]->name))
+					break;
+			if (k < view_cgc->index && !strcmp(cgc->values[j]->value,
+						view_cgc->values[k]->value))
+				continue;
+
+			cgroup_dbg("changing %s of %s to \"%s\"\n",
+					cgc->values[j]->name, cgroup->name,
+					cgc->values[j]->value);
+			error = cgroup_add_value_string(delta_cgc,
+					cgc->values[j]->name,
+					cgc->values[j]->value);
+			if (error)
+				goto out;
+		}
+	}
+
+	error = cgroup_modify_cgroup(delta);
+out:
+	cgroup_free(&delta);
+	cgroup_free(&view);
+	cgroup_free(&current);
+	return error;
+}
+
+static int cgroup_config_compare_group_ptrs(const void *p1, const void *p2)
+{
+	const struct cgroup * const *g1 = p1;
+	const struct cgroup * const *g2 = p2;
+
+	return strcmp((*g1)->name, (*g2)->name);
+}
+
+/*
+ * Remember names and controllers of all groups of the current configuration,
+ * the returned array is sorted by group name.
+ */
+static struct cgroup **cgroup_config_save_groups(void)
+{
+	struct cgroup **groups;
+	int i, j;
+
+	groups = calloc(cgroup_table_index + 1, sizeof(struct cgroup *));
+	if (!groups) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	for (i = 0; i < cgroup_table_index; i++) {
+		struct cgroup *cgroup = &config_cgroup_table[i];
+
+		groups[i] = cgroup_new_cgroup(cgroup->name);
+		if (!groups[i])
+			goto err;
+		for (j = 0; j < cgroup->index; j++)
+			if (!cgroup_add_controller(groups[i],
+					cgroup->controller[j]->name))
+				goto err;
+	}
+	qsort(groups, cgroup_table_index, sizeof(struct cgroup *),
+			cgroup_config_compare_group_ptrs);
+	return groups;
+err:
+	last_errno = errno;
+	for (i = 0; groups[i]; i++)
+		cgroup_free(&groups[i]);
+	free(groups);
+	return NULL;
+}
+
+int cgroup_config_reload_config(const char *pathname,
+		const char *old_pathname)
+{
+	struct cgroup **old_groups = NULL;
+	int namespace_enabled = 0;
+	int mount_enabled = 0;
+	int error, ret = 0;
+	int i;
+
+	if (old_pathname) {
+		cgroup_dbg("cgroup_config_reload_config: parsing %s\n",
+				old_pathname);
+		ret = cgroup_parse_config(old_pathname);
+		if (ret)
+			return ret;
+		old_groups = cgroup_config_save_groups();
+		if (!old_groups)
+			ret = ECGOTHER;
+		cgroup_free_config();
+		if (ret)
+			return ret;
+	}
+
+	cgroup_dbg("cgroup_config_reload_config: parsing %s\n", pathname);
+	ret = cgroup_parse_config(pathname);
+	if (ret)
+		goto out;
+
+	namespace_enabled = (config_namespace_table[0].name[0] != '\0');
+	mount_enabled = (config_mount_table[0].name[0] != '\0');
+
+	/*
+	 * The configuration should have namespace or mount, not both.
+	 */
+	if (namespace_enabled && mount_enabled) {
+		ret = ECGMOUNTNAMESPACE;
+		goto out;
+	}
+
+	/*
+	 * Nothing is unmounted or destroyed on failure, the hierarchies are
+	 * in use.
+	 */
+	ret = cgroup_config_mount_fs(1);
+	if (ret)
+		goto out;
+
+	ret = cgroup_init();
+	if (ret == ECGROUPNOTMOUNTED && cgroup_table_index == 0
+		&& config_template_table_index == 0 && !old_groups)
+		ret = 0;
+	if (ret)
+		goto out;
+
+	ret = config_order_namespace_table();
+	if (ret)
+		goto out;
+
+	ret = config_validate_namespaces();
+	if (ret)
+		goto out;
+
+	cgroup_config_apply_default();
+
+	/* parents first */
+	cgroup_config_sort_groups();
+	CG_TRACE2(config_reload_begin, pathname, cgroup_table_index);
+	for (i = 0; i < cgroup_table_index; i++) {
+		error = cgroup_config_reload_group(&config_cgroup_table[i]);
+		cgroup_dbg("reloading group %s, error %d\n",
+				config_cgroup_table[i].name, error);
+		if (error && !ret)
+			ret = error;
+	}
+	CG_TRACE2(config_reload_end, pathname, ret);
+
+	if (!old_groups)
+		goto out;
+
+	/*
+	 * Remove the groups which are not configured anymore, subgroups
+	 * first. Groups with tasks are kept, the tasks are never moved.
+	 */
+	for (i = 0; old_groups[i]; i++)
+		;
+	while (--i >= 0) {
+		if (bsearch(old_groups[i]->name, config_cgroup_table,
+				cgroup_table_index, sizeof(struct cgroup),
+				cgroup_config_compare_group_name))
+			continue;
+		cgroup_dbg("removing group %s\n", old_groups[i]->name);
+		error = cgroup_delete_cgroup_ext(old_groups[i],
+				CGFLAG_DELETE_EMPTY_ONLY);
+		if (error == ECGROUPNOTEXIST || error == ECGNONEMPTY)
+			continue;
+		if (error && !ret)
+			ret = error;
+	}
+
+out:
+	if (old_groups) {
+		for (i = 0; old_groups[i]; i++)
+			cgroup_free(&old_groups[i]);
+		free(old_groups);
+	}
+	cgroup_free_config();
+	return ret;
+}
+
+/* unmounts given mount, but only if it is empty */
+static int cgroup_config_try_unmount(struct cg_mount_table_s *mount_info)
+{
+	char *controller, *controller_list;
+	struct cg_mount_point *mount = &(mount_info->mount);
+	void *handle = NULL;
+	int ret, lvl;
+	struct cgroup_file_info info;
+	char *saveptr = NULL;
+
+	/* parse the first controller name from list of controllers */
+	controller_list = strdup(mount_info->name);
+	if (!controller_list) {
+		last_errno = errno;
+		return ECGOTHER;
 	}
 	controller = strtok_r(controller_list, ",", &saveptr);
 	if (!controller) {
@@ -1214,7 +2312,13 @@ static int cgroup_config_try_unmount(struct cg_mount_table_s *mount_info)
 		return 0;
 	if (ret)
 		return ret;
-	/* skip the first found directory, it's '/' */
+	ret = cgroup_walk_tree_set_flags(&handle,
+			CGROUP_WALK_TYPE_PRE_DIR | CGROUP_WALK_TYPE_DIRS_ONLY);
+	if (ret) {
+		cgroup_walk_tree_end(&handle);
+		return ret;
+	}
+	/* find any subdirectory, the root itself is not returned again */
 	ret = cgroup_walk_tree_next(0, &handle, &info, lvl);
 	/* find any other subdirectory */
 	while (ret == 0) {
@@ -1241,7 +2345,7 @@ static int cgroup_config_try_unmount(struct cg_mount_table_s *mount_info)
 		int err;
 		cgroup_dbg("unmounting %s at %s\n", mount_info->name,
 				mount->path);
-		err = umount(mount->path);
+		err = cg_umount(mount->path);
 
 		if (err && !ret) {
 			ret = ECGOTHER;
@@ -1349,7 +2453,7 @@ static int cgroup_config_unload_controller(const struct cgroup_mount_point *moun
 	ret = cgroup_get_subsys_mount_point_begin(mount_info->name, &handle,
 			path);
 	while (ret == 0) {
-		error = umount(path);
+		error = cg_umount(path);
 		if (error) {
 			cgroup_warn("Warning: cannot unmount controller %s on %s: %s\n",
 					mount_info->name, path,
@@ -1454,6 +2558,7 @@ int cgroup_config_define_default(void)
 	 * can be used by following 'group { }'.
 	 */
 	init_cgroup_table(config_cgroup, 1);
+	config_default_defined = 1;
 	return 0;
 }
 
@@ -1477,13 +2582,125 @@ int cgroup_config_set_default(struct cgroup *new_default)
 }
 
 /**
- * Reloads the templates list, using the given configuration file.
- *	@return 0 on success, > 0 on failure
+ * Appending cgroup templates parsed by parser to template_table
+ * @param offset number of templates already in the table
  */
-int cgroup_reload_cached_templates(char *pathname)
+int cgroup_add_cgroup_templates(int offset)
+{
+	struct cg_arena **arenas;
+	struct cgroup *cgroup;
+	int i, j, k;
+
+	arenas = realloc(template_arenas,
+			(template_arenas_count + 1) * sizeof(*arenas));
+	if (!arenas) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	template_arenas = arenas;
+	template_arenas[template_arenas_count++] = cg_arena_get(config_arena);
+
+	/*
+	 * The templates share the controllers and values in the arena, the
+	 * config structures only forget them in cgroup_free_config().
+	 */
+	for (i = 0; i < config_template_table_index; i++) {
+		cgroup = &config_template_table[i];
+		for (j = 0; j < cgroup->index; j++) {
+			/* The template values have not been modified. */
+			for (k = 0; k < cgroup->controller[j]->index; k++)
+				cgroup->controller[j]->values[k]->dirty = false;
+		}
+		template_table[i + offset] = *cgroup;
+	}
+
+	return 0;
+}
+
+static void cgroup_free_template_sources(struct cg_template_source *sources,
+		int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(sources[i].path);
+	free(sources);
+}
+
+/**
+ * (Re)build the index of template_table by template names.
+ */
+static void cgroup_index_templates(void)
+{
+	unsigned int bucket, size = 16;
+	int i;
+
+	free(template_hash);
+	free(template_hash_next);
+	template_hash = NULL;
+	template_hash_next = NULL;
+	template_hash_size = 0;
+
+	if (!template_table_index)
+		return;
+
+	while (size < 2 * (unsigned int)template_table_index)
+		size *= 2;
+
+	template_hash = malloc(size * sizeof(int));
+	template_hash_next = malloc(template_table_index * sizeof(int));
+	if (!template_hash || !template_hash_next) {
+		/* not fatal, the table is searched without the index */
+		free(template_hash);
+		free(template_hash_next);
+		template_hash = NULL;
+		template_hash_next = NULL;
+		return;
+	}
+	template_hash_size = size;
+	memset(template_hash, -1, size * sizeof(int));
+
+	/* going backwards keeps the buckets in the table order */
+	for (i = template_table_index - 1; i >= 0; i--) {
+		bucket = cg_hash_string(template_table[i].name, size);
+		template_hash_next[i] = template_hash[bucket];
+		template_hash[bucket] = i;
+	}
+}
+
+/**
+ * Find the next template with given name after index prev, -1 to start from
+ * the first one.
+ * @return Index of the template in template_table, -1 if there is none.
+ */
+static int cgroup_find_template(const char *name, int prev)
+{
+	int i;
+
+	if (template_hash) {
+		if (prev < 0)
+			i = template_hash[cg_hash_string(name,
+					template_hash_size)];
+		else
+			i = template_hash_next[prev];
+		for (; i >= 0; i = template_hash_next[i])
+			if (!strcmp(template_table[i].name, name))
+				return i;
+		return -1;
+	}
+
+	for (i = prev + 1; i < template_table_index; i++)
+		if (!strcmp(template_table[i].name, name))
+			return i;
+	return -1;
+}
+
+/**
+ * Free the templates cache and the arenas of the templates.
+ */
+static void cgroup_free_templates(void)
 {
 	int i;
-	int ret = 0;
 
 	if (template_table) {
 		/* template structures have to be free */
@@ -1494,6 +2711,31 @@ int cgroup_reload_cached_templates(char *pathname)
 	}
 	template_table_index = 0;
 
+	for (i = 0; i < template_arenas_count; i++)
+		cg_arena_put(template_arenas[i]);
+	free(template_arenas);
+	template_arenas = NULL;
+	template_arenas_count = 0;
+
+	cgroup_free_template_sources(template_sources, template_sources_count);
+	template_sources = NULL;
+	template_sources_count = 0;
+	cgroup_index_templates();
+
+	/* groups created from the old templates may differ */
+	cg_template_groups_flush();
+}
+
+/**
+ * Reloads the templates list, using the given configuration file.
+ *	@return 0 on success, > 0 on failure
+ */
+int cgroup_reload_cached_templates(char *pathname)
+{
+	int ret = 0;
+
+	cgroup_free_templates();
+
 	if ((config_template_table_index != 0) || (config_table_index != 0)) {
 		/* config template structures have to be free as well*/
 		cgroup_free_config();
@@ -1516,26 +2758,8 @@ int cgroup_reload_cached_templates(char *pathname)
 		return  ret;
 	}
 
-	for (i = 0; i < template_table_index; i++) {
-		cgroup_copy_cgroup(&template_table[i],
-			&config_template_table[i]);
-		strcpy((template_table[i]).name,
-			(config_template_table[i]).name);
-		template_table[i].tasks_uid =
-			config_template_table[i].tasks_uid;
-		template_table[i].tasks_gid =
-			config_template_table[i].tasks_gid;
-		template_table[i].task_fperm =
-			config_template_table[i].task_fperm;
-		template_table[i].control_uid =
-			config_template_table[i].control_uid;
-		template_table[i].control_gid =
-			config_template_table[i].control_gid;
-		template_table[i].control_fperm =
-			config_template_table[i].control_fperm;
-		template_table[i].control_dperm =
-			config_template_table[i].control_dperm;
-	}
+	ret = cgroup_add_cgroup_templates(0);
+	cgroup_index_templates();
 
 	return ret;
 }
@@ -1547,16 +2771,8 @@ int cgroup_reload_cached_templates(char *pathname)
 int cgroup_init_templates_cache(char *pathname)
 {
 	int ret = 0;
-	int i;
 
-	if (template_table) {
-		/* template structures have to be free */
-		for (i = 0; i < template_table_index; i++)
-			cgroup_free_controllers(&template_table[i]);
-		free(template_table);
-		template_table = NULL;
-	}
-	template_table_index = 0;
+	cgroup_free_templates();
 
 	if ((config_template_table_index != 0) || (config_table_index != 0)) {
 		/* config structures have to be clean */
@@ -1580,30 +2796,10 @@ int cgroup_init_templates_cache(char *pathname)
 		return ret;
 	}
 
-	for (i = 0; i < template_table_index; i++) {
-		cgroup_copy_cgroup(&template_table[i],
-			&config_template_table[i]);
-		strcpy((template_table[i]).name,
-			(config_template_table[i]).name);
-		template_table[i].tasks_uid =
-			config_template_table[i].tasks_uid;
-		template_table[i].tasks_gid =
-			config_template_table[i].tasks_gid;
-		template_table[i].task_fperm =
-			config_template_table[i].task_fperm;
-		template_table[i].control_uid =
-			config_template_table[i].control_uid;
-		template_table[i].control_gid =
-			config_template_table[i].control_gid;
-		template_table[i].control_fperm =
-			config_template_table[i].control_fperm;
-		template_table[i].control_dperm =
-			config_template_table[i].control_dperm;
-	}
+	ret = cgroup_add_cgroup_templates(0);
+	cgroup_index_templates();
 
 	return ret;
-
-
 }
 
 /**
@@ -1618,37 +2814,25 @@ void cgroup_templates_cache_set_source_files(
 }
 
 /**
- * Appending cgroup templates parsed by parser to template_table
- * @param offset number of templates already in the table
+ * Add count zeroed templates at the end of template table.
+ * @return 0 on success, < 0 on error
  */
-int cgroup_add_cgroup_templates(int offset)
+static int cgroup_grow_template_table(int count)
 {
-	int i, ti, ret;
-
-	for (i = 0; i < config_template_table_index; i++) {
-		ti = i + offset;
-		ret = cgroup_copy_cgroup(&template_table[ti],
-			&config_template_table[i]);
-		if (ret)
-			return ret;
+	struct cgroup *table;
 
-		strcpy((template_table[ti]).name,
-			(config_template_table[i]).name);
-		template_table[ti].tasks_uid =
-			config_template_table[i].tasks_uid;
-		template_table[ti].tasks_gid =
-			config_template_table[i].tasks_gid;
-		template_table[ti].task_fperm =
-			config_template_table[i].task_fperm;
-		template_table[ti].control_uid =
-			config_template_table[i].control_uid;
-		template_table[ti].control_gid =
-			config_template_table[i].control_gid;
-		template_table[ti].control_fperm =
-			config_template_table[i].control_fperm;
-		template_table[ti].control_dperm =
-			config_template_table[i].control_dperm;
+	table = realloc(template_table,
+		(template_table_index + count) * sizeof(struct cgroup));
+	if (table == NULL) {
+		last_errno = errno;
+		return -ECGOTHER;
 	}
+	template_table = table;
+
+	memset(&template_table[template_table_index], 0,
+		count * sizeof(struct cgroup));
+
+	template_table_index += count;
 
 	return 0;
 }
@@ -1660,36 +2844,83 @@ int cgroup_add_cgroup_templates(int offset)
  * @return 0 on success, < 0 on error
  */
 int cgroup_expand_template_table(void)
+{
+	return cgroup_grow_template_table(config_template_table_index);
+}
+
+/**
+ * Load the templates cache from files. Before calling this function,
+ * cgroup_templates_cache_set_source_files has to be called first.
+ * @param file_index index of file which was unable to be parsed
+ * @return 0 on success, > 0 on error
+ */
+static struct cg_template_source *cgroup_find_template_source(
+		struct cg_template_source *sources, int count,
+		const struct cg_template_source *source)
 {
 	int i;
 
-	template_table = realloc(template_table,
-		(template_table_index + config_template_table_index)
-		*sizeof(struct cgroup));
+	for (i = 0; i < count; i++) {
+		if (strcmp(sources[i].path, source->path) ||
+				sources[i].dev != source->dev ||
+				sources[i].ino != source->ino ||
+				sources[i].size != source->size ||
+				sources[i].mtime.tv_sec != source->mtime.tv_sec ||
+				sources[i].mtime.tv_nsec !=
+					source->mtime.tv_nsec)
+			continue;
+		return &sources[i];
+	}
+	return NULL;
+}
 
-	if (template_table == NULL)
-		return -ECGOTHER;
+/**
+ * Take the templates of an unchanged source file from the old cache.
+ */
+static int cgroup_keep_templates(struct cgroup *old_table,
+		const struct cg_template_source *old,
+		struct cg_template_source *source)
+{
+	struct cg_arena **arenas;
+	int ret;
 
-	for (i = 0; i < config_template_table_index; i++)
-		template_table[i + template_table_index].index = 0;
+	source->first = template_table_index;
+	source->count = old->count;
+	source->arena = old->arena;
+	if (!old->count)
+		return 0;
+
+	arenas = realloc(template_arenas,
+			(template_arenas_count + 1) * sizeof(*arenas));
+	if (!arenas) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	template_arenas = arenas;
 
-	template_table_index += config_template_table_index;
+	ret = cgroup_grow_template_table(old->count);
+	if (ret)
+		return -ret;
 
+	template_arenas[template_arenas_count++] = cg_arena_get(old->arena);
+	memcpy(&template_table[source->first], &old_table[old->first],
+			old->count * sizeof(struct cgroup));
 	return 0;
 }
 
-/**
- * Load the templates cache from files. Before calling this function,
- * cgroup_templates_cache_set_source_files has to be called first.
- * @param file_index index of file which was unable to be parsed
- * @return 0 on success, > 0 on error
- */
 int cgroup_load_templates_cache_from_files(int *file_index)
 {
-	int ret;
+	int ret = 0;
 	int i, j;
 	int template_table_last_index;
 	char *pathname;
+	struct stat st;
+	struct cg_template_source *source, *old;
+	struct cg_template_source *old_sources;
+	struct cg_arena **old_arenas;
+	struct cgroup *old_table;
+	int old_sources_count, old_arenas_count;
+	int changed;
 
 	if (!template_files) {
 		/* source files has not been set */
@@ -1706,14 +2937,31 @@ int cgroup_load_templates_cache_from_files(int *file_index)
 				CGCONFIG_CONF_FILE);
 	}
 
-	if (template_table) {
-		/* template structures have to be free */
-		for (i = 0; i < template_table_index; i++)
-			cgroup_free_controllers(&template_table[i]);
-		free(template_table);
-		template_table = NULL;
-	}
+	/*
+	 * Build a new cache, templates of the files which did not change are
+	 * copied from the old one (sharing its arenas), only the other files
+	 * are parsed.
+	 */
+	old_table = template_table;
+	old_arenas = template_arenas;
+	old_arenas_count = template_arenas_count;
+	old_sources = template_sources;
+	old_sources_count = template_sources_count;
+	changed = old_sources_count != template_files->count;
+
+	template_table = NULL;
 	template_table_index = 0;
+	template_arenas = NULL;
+	template_arenas_count = 0;
+	template_sources_count = 0;
+	template_sources = calloc(template_files->count,
+			sizeof(*template_sources));
+	if (!template_sources && template_files->count) {
+		last_errno = errno;
+		*file_index = 0;
+		ret = ECGOTHER;
+		goto out;
+	}
 
 	if ((config_template_table_index != 0) || (config_table_index != 0)) {
 		/* config structures have to be clean before parsing */
@@ -1722,6 +2970,36 @@ int cgroup_load_templates_cache_from_files(int *file_index)
 
 	for (j = 0; j < template_files->count; j++) {
 		pathname = template_files->items[j];
+		*file_index = j;
+
+		source = &template_sources[j];
+		source->path = strdup(pathname);
+		if (!source->path) {
+			last_errno = errno;
+			ret = ECGOTHER;
+			goto out;
+		}
+		template_sources_count++;
+
+		if (!stat(pathname, &st)) {
+			source->dev = st.st_dev;
+			source->ino = st.st_ino;
+			source->size = st.st_size;
+			source->mtime = st.st_mtim;
+
+			old = cgroup_find_template_source(old_sources,
+					old_sources_count, source);
+			if (old) {
+				cgroup_dbg("Templates from %s did not change.\n",
+						pathname);
+				ret = cgroup_keep_templates(old_table, old,
+						source);
+				if (ret)
+					goto out;
+				continue;
+			}
+		}
+		changed = 1;
 
 		cgroup_dbg("Parsing templates from %s.\n", pathname);
 		/* Attempt to read the configuration file
@@ -1730,18 +3008,18 @@ int cgroup_load_templates_cache_from_files(int *file_index)
 		if (ret) {
 			cgroup_dbg("Could not initialize rule cache, ");
 			cgroup_dbg("error was: %d\n", ret);
-			*file_index = j;
-			return ret;
+			goto out;
 		}
 
+		source->first = template_table_index;
 		if (config_template_table_index > 0) {
 			template_table_last_index = template_table_index;
 			ret = cgroup_expand_template_table();
 			if (ret) {
 				cgroup_dbg("Could not expand template table, ");
 				cgroup_dbg("error was: %d\n", -ret);
-				*file_index = j;
-				return -ret;
+				ret = -ret;
+				goto out;
 			}
 
 			/* copy template data to templates cache structures */
@@ -1751,14 +3029,29 @@ int cgroup_load_templates_cache_from_files(int *file_index)
 				template_table_last_index);
 			if (ret) {
 				cgroup_dbg("Unable to copy cgroup\n");
-				*file_index = j;
-				return ret;
+				goto out;
 			}
 			cgroup_dbg("Templates to template table copied\n");
+
+			source->count = config_template_table_index;
+			source->arena = config_arena;
 		}
 	}
 
-	return 0;
+out:
+	cgroup_index_templates();
+
+	for (i = 0; i < old_arenas_count; i++)
+		cg_arena_put(old_arenas[i]);
+	free(old_arenas);
+	free(old_table);
+	cgroup_free_template_sources(old_sources, old_sources_count);
+
+	/* groups created from the old templates may differ */
+	if (changed || ret)
+		cg_template_groups_flush();
+
+	return ret;
 }
 
 /*
@@ -1771,7 +3064,7 @@ int cgroup_config_create_template_group(struct cgroup *cgroup,
 	int ret = 0;
 	int i, j, k;
 	struct cgroup *t_cgroup;
-	char buffer[FILENAME_MAX];
+	struct cgroup t_copy;
 	struct cgroup *aux_cgroup = NULL;
 	struct cgroup_controller *cgc;
 	int found;
@@ -1804,48 +3097,45 @@ int cgroup_config_create_template_group(struct cgroup *cgroup,
 		}
 	}
 
-	for (i = 0; cgroup->controller[i] != NULL; i++) {
+	for (i = 0; i < cgroup->index; i++) {
 		/* for each controller we have to add to cgroup structure
 		 * either template cgroup or empty controller  */
 
 		found = 0;
 		/* look for relevant template - test name x controller pair */
-		for (j = 0; j < template_table_index; j++) {
+		for (j = cgroup_find_template(template_name, -1);
+				j >= 0 && !found;
+				j = cgroup_find_template(template_name, j)) {
 
 			t_cgroup = &template_table[j];
-			if (strcmp(t_cgroup->name, template_name) != 0) {
-				/* template name does not match skip template */
-				continue;
-			}
 
 			/* template name match */
-			for (k = 0; t_cgroup->controller[k] != NULL; k++) {
+			for (k = 0; k < t_cgroup->index; k++) {
 				if (strcmp((cgroup->controller[i])->name,
 					(t_cgroup->controller[k])->name) != 0) {
 					/* controller name does not match */
 					continue;
 				}
 
-				/* name and controller match template found */
-				/* variables substituted in template */
-				strncpy(buffer, t_cgroup->name,
+				/*
+				 * name and controller match template found,
+				 * the template is shared by concurrent
+				 * callers: a copy gets the substituted name
+				 */
+				t_copy = *t_cgroup;
+				strncpy(t_copy.name, cgroup->name,
 					FILENAME_MAX-1);
-				strncpy(t_cgroup->name, cgroup->name,
-					FILENAME_MAX-1);
-
-				ret = cgroup_create_cgroup(t_cgroup, flags);
+				t_copy.name[FILENAME_MAX-1] = '\0';
 
-				strncpy(t_cgroup->name, buffer,
-					FILENAME_MAX-1);
+				ret = cgroup_create_cgroup(&t_copy, flags);
 				if (ret) {
 					cgroup_dbg("creating group %s, error %d\n",
 					cgroup->name, ret);
 					goto end;
 				} else {
 					/* go to new controller */
-					j = template_table_index;
 					found = 1;
-					continue;
+					break;
 				}
 
 			}
@@ -31,6 +31,10 @@
  * TODO Stop using netlink for communication (or at least rewrite that part).
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "libcgroup.h"
 #include "cgrulesengd.h"
 #include "../libcgroup-internal.h"
@@ -52,13 +56,51 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <linux/connector.h>
 #include <linux/cn_proc.h>
+#include <linux/filter.h>
 #include <linux/un.h>
+#include <arpa/inet.h>
+#include <stddef.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Initial number of slots of the PID hashes and the parent info ring */
+#define CGRE_PID_HASH_SIZE	(256)
+
+/* Number of events in the queue of each worker, must be a power of two */
+#define CGRE_QUEUE_SIZE		(4096)
+
+/* Maximum number of classifier workers */
+#define CGRE_MAX_WORKERS	(64)
+
+/* Number of events waiting in one coalescing window, a power of two */
+#define CGRE_COALESCE_SIZE	(1024)
+
+/* Default and maximum number of netlink messages received at once */
+#define CGRE_RECV_BATCH		(16)
+#define CGRE_MAX_RECV_BATCH	(1024)
+
+/* Number of tasks files of destination cgroups kept open */
+#define CGRE_TASKS_FD_CACHE	(64)
+
+/* Number of messages in the log ring, must be a power of two */
+#define CGRE_LOG_RING_SIZE	(1024)
 
-#define NUM_PER_REALLOCATIOM	(100)
+/* Maximum length of one log message, longer messages are truncated */
+#define CGRE_LOG_MSG_SIZE	(512)
+
+/* Number of rate limited message classes, must be a power of two */
+#define CGRE_LOG_CLASSES	(256)
+
+/*
+ * Number of buckets of the classification latency histogram. Bucket i
+ * counts latencies below 2^i microseconds, the last one all longer ones.
+ */
+#define CGRE_LATENCY_BUCKETS	(24)
 
 /* list of config files from CGCONFIG_CONF_FILE and CGCONFIG_CONF_DIR */
 static struct cgroup_string_list template_files;
@@ -72,12 +114,199 @@ int logfacility;
 /* Current log level */
 int loglevel;
 
+/*
+ * A message in the log ring. seq is the position the slot is ready to be
+ * filled at, and the position + 1 once the message is complete.
+ */
+struct cgre_log_msg {
+	unsigned int seq;
+	int level;
+	char text[CGRE_LOG_MSG_SIZE];
+};
+
+/*
+ * Messages waiting for the log thread, NULL when messages are written
+ * directly. Any thread can add a message, only the holder of log_output_lock
+ * writes them out.
+ */
+static struct cgre_log_msg *log_ring;
+
+/* Next position to fill, advanced by the producers */
+static unsigned int log_tail;
+
+/* Next position to write out, advanced by the holder of log_output_lock */
+static unsigned int log_head;
+
+/* Number of messages dropped because the log ring was full */
+static unsigned long log_dropped;
+
+/* Set while the log thread waits for log_ready */
+static int log_sleeping;
+static sem_t log_ready;
+
+/* Serializes writing to the log destinations */
+static pthread_mutex_t log_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A class of log messages, i.e. all messages with the same format, counted
+ * in one second windows.
+ */
+struct cgre_log_class {
+	const char *format;
+	time_t window;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+/* Maximum number of messages of one class per second, 0 = no limit */
+static unsigned int log_rate;
+static struct cgre_log_class log_classes[CGRE_LOG_CLASSES];
+
 /* Owner of the socket, -1 means no change */
 uid_t socket_user = -1;
 
 /* Owner of the socket, -1 means no change */
 gid_t socket_group = -1;
 
+/*
+ * An event waiting until the end of its coalescing window. Later events for
+ * the same PID replace it.
+ */
+struct cgre_pending {
+	struct proc_event ev;
+	__u64 deadline;
+	/* PID of the event, 0 when the event is not in the hash anymore */
+	pid_t pid;
+	/* Next slot in the same hash bucket, -1 at the end */
+	int next;
+};
+
+/*
+ * Events waiting in their coalescing window. All windows have the same
+ * length, so the events expire in the order they were added.
+ */
+struct cgre_coalesce {
+	struct cgre_pending slots[CGRE_COALESCE_SIZE];
+	/* First slot of each hash bucket, -1 if the bucket is empty */
+	int hash[CGRE_COALESCE_SIZE];
+	/* Oldest and next free position in slots */
+	unsigned int head;
+	unsigned int tail;
+};
+
+/*
+ * Queue of events for one classifier worker. The receive thread is the only
+ * producer and the worker the only consumer, so no lock is needed.
+ */
+struct cgre_queue {
+	struct proc_event *events;
+	/* Next slot to fill, written by the receive thread only */
+	unsigned int head;
+	/* Next slot to process, written by the worker only */
+	unsigned int tail;
+	/* Number of events ready in the queue */
+	sem_t ready;
+	pthread_t thread;
+	/* Events of the worker waiting in their coalescing window */
+	struct cgre_coalesce *coalesce;
+	/* Number of events taken from the queue, written by the worker only */
+	unsigned int done;
+};
+
+/* Number of classifier workers, 0 = handle events in the main loop */
+static int num_workers;
+
+/* Event queues, one for each worker */
+static struct cgre_queue *queues;
+
+/* Number of events dropped because a worker queue was full */
+static unsigned long dropped_events;
+
+/* Statistics reported on the daemon socket */
+static struct {
+	/* Events received, by type */
+	unsigned long fork;
+	unsigned long exec;
+	unsigned long uid;
+	unsigned long gid;
+	unsigned long exit;
+	unsigned long other;
+	/* Processes classified, or which could not be moved */
+	unsigned long classified;
+	unsigned long failed;
+	/* Failures to read the identity of a process from /proc */
+	unsigned long proc_errors;
+	/* Time from the event to the end of its classification */
+	unsigned long latency[CGRE_LATENCY_BUCKETS];
+} stats;
+
+/* Size of the netlink socket receive buffer, 0 = system default */
+static int recv_buffer_size;
+
+/* Number of netlink messages to receive by one recvmmsg() */
+static int recv_batch = CGRE_RECV_BATCH;
+
+/* Buffers for the messages received by one recvmmsg() */
+static struct mmsghdr *recv_msgs;
+static struct iovec *recv_iovs;
+static struct sockaddr_nl *recv_addrs;
+static char *recv_buffers;
+
+/* Number of times the kernel dropped messages, the socket buffer was full */
+static unsigned long netlink_overruns;
+
+/* Should unused events be filtered out in the kernel? */
+static int use_filter;
+
+/* Netlink socket with the event filter attached, -1 if there is none */
+static int filter_socket = -1;
+
+/* Whether PROC_EVENT_EXIT events pass the current event filter */
+static int filter_exit;
+
+/* Length of the event coalescing window in nanoseconds, 0 = disabled */
+static __u64 coalesce_window;
+
+/* Events waiting in the coalescing window of the main loop */
+static struct cgre_coalesce *main_coalesce;
+
+/* Number of events folded into other events, i.e. classifications saved */
+static unsigned long coalesced_events;
+
+/* File with the events to replay instead of the kernel ones, or NULL */
+static const char *replay_file;
+
+/* Number of replayed events per second, 0 = as fast as possible */
+static long replay_rate;
+
+/* Move the replayed processes, a replay only matches the rules otherwise */
+static int replay_attach;
+
+/* Flags of the classification, see cgroup_change_cgroup_flags() */
+static int classify_flags = CGFLAG_USECACHE | CGFLAG_SKIP_CURRENT;
+
+/* File all received events are recorded to in the replay format, or NULL */
+static FILE *record_file;
+
+/* Lock for the lists of unchanged processes and parent info */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Workers hold this lock for reading while they handle an event, the main
+ * loop takes it for writing while it reloads the configuration. Writers are
+ * preferred, the workers take it for every event and would keep a reload
+ * waiting forever under a steady load otherwise.
+ */
+static pthread_rwlock_t reload_lock =
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+/* Reloads requested by SIGUSR2 and SIGUSR1, done by the main loop */
+static volatile sig_atomic_t reload_rules;
+static volatile sig_atomic_t reload_templates;
+
+/* The signal handlers wake up the main loop by writing to this pipe */
+static int reload_pipe[2] = { -1, -1 };
+
 /**
  * Prints the usage information for this program and, optionally, an error
  * message.  This function uses vfprintf.
@@ -110,6 +339,30 @@ static void usage(FILE* fd, const char* msg, ...)
 			CGRULE_CGRED_SOCKET_PATH " socket user\n"
 		"    -g <group>   | --socket-group=<group> set "
 			CGRULE_CGRED_SOCKET_PATH " socket group\n"
+		"    -t <sec>     | --group-ttl=<sec>   re-resolve @group "
+			"members after <sec> seconds\n"
+		"    -w <num>     | --workers=<num>     classify events in "
+			"<num> threads\n"
+		"    -r <bytes>   | --rcvbuf=<bytes>    set netlink socket "
+			"receive buffer size\n"
+		"    -b <num>     | --batch=<num>       receive up to <num> "
+			"netlink messages at once\n"
+		"    -F           | --filter            filter unused events "
+			"in the kernel\n"
+		"    -c <msec>    | --coalesce=<msec>   fold events of one "
+			"process within <msec>\n"
+		"    -l <num>     | --log-rate=<num>    log at most <num> "
+			"messages of one kind per second\n"
+		"    -o <path>    | --record=<path>     record the events "
+			"to a file\n"
+		"    -R <path>    | --replay=<path>     handle the events "
+			"from a file and exit\n"
+		"    -e <num>     | --replay-rate=<num> replay <num> "
+			"events per second\n"
+		"    -a           | --replay-attach     move the replayed "
+			"processes\n"
+		"    -P <path>    | --proc-root=<path>  read processes from "
+			"<path> instead of /proc\n"
 		"    -h           | --help              show this help\n\n"
 		);
 	va_end(ap);
@@ -123,15 +376,11 @@ static void usage(FILE* fd, const char* msg, ...)
  *	@param format The format for the message (vprintf style)
  *	@param ap Any args to format (vprintf style)
  */
-void flog_write(int level, const char *format,  va_list ap)
+static void flog_output(int level, const char *format, va_list ap)
 {
 	va_list cap;
 	int copy = 0;
 
-	/* Check the log level */
-	if (level > loglevel)
-		return;
-
 	/* copy the argument list if needed - it can be processed only once */
 	if (logfile && logfacility) {
 		copy = 1;
@@ -158,6 +407,246 @@ void flog_write(int level, const char *format,  va_list ap)
 	}
 }
 
+/**
+ * Like flog_output(), with printf style arguments.
+ */
+static void flog_output_args(int level, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	flog_output(level, format, ap);
+	va_end(ap);
+}
+
+/**
+ * Counts a message in its class.
+ * 	@param format The format of the message
+ * 	@return 1 if the class logged too many messages in this second and the
+ * 	message should be suppressed, 0 otherwise
+ */
+static int cgre_log_limited(const char *format)
+{
+	struct cgre_log_class *c;
+	time_t now, window;
+
+	c = &log_classes[((unsigned long)format >> 3) & (CGRE_LOG_CLASSES - 1)];
+	if (__atomic_load_n(&c->format, __ATOMIC_RELAXED) != format)
+		__atomic_store_n(&c->format, format, __ATOMIC_RELAXED);
+
+	now = time(0);
+	window = __atomic_load_n(&c->window, __ATOMIC_RELAXED);
+	if (window != now && __atomic_compare_exchange_n(&c->window, &window,
+			now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&c->count, 0, __ATOMIC_RELAXED);
+
+	if (__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED) < log_rate)
+		return 0;
+
+	__atomic_fetch_add(&c->suppressed, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/**
+ * Adds a formatted message to the log ring. The message is dropped if the
+ * ring is full.
+ * 	@param level The log level (LOG_EMERG ... LOG_DEBUG)
+ *	@param format The format for the message (vprintf style)
+ *	@param ap Any args to format (vprintf style)
+ */
+static void cgre_log_push(int level, const char *format, va_list ap)
+{
+	struct cgre_log_msg *msg;
+	unsigned int pos, seq;
+
+	pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		msg = &log_ring[pos & (CGRE_LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			/* The slot is free, try to claim it. */
+			if (__atomic_compare_exchange_n(&log_tail, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			/* The slot still holds a message from the last lap. */
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	msg->level = level;
+	vsnprintf(msg->text, sizeof(msg->text), format, ap);
+	__atomic_store_n(&msg->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in cgre_log_thread(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED))
+		sem_post(&log_ready);
+}
+
+/**
+ * Writes out the messages in the log ring, followed by the number of
+ * dropped and suppressed messages. It stops at a message which is not
+ * complete yet, so it is safe to call from a signal handler which
+ * interrupted a producer. The caller must hold log_output_lock.
+ */
+static void cgre_log_drain(void)
+{
+	struct cgre_log_msg *msg;
+	struct cgre_log_class *c;
+	unsigned long dropped;
+	unsigned int suppressed;
+	const char *format;
+	int i, len;
+
+	for (; log_ring; log_head++) {
+		msg = &log_ring[log_head & (CGRE_LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE) !=
+				log_head + 1)
+			break;
+		flog_output_args(msg->level, "%s", msg->text);
+		__atomic_store_n(&msg->seq, log_head + CGRE_LOG_RING_SIZE,
+				__ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		flog_output_args(LOG_WARNING, "Dropped %lu log messages, the "
+				"log buffer was full\n", dropped);
+
+	if (!log_rate)
+		return;
+	for (i = 0; i < CGRE_LOG_CLASSES; i++) {
+		c = &log_classes[i];
+		if (!__atomic_load_n(&c->suppressed, __ATOMIC_RELAXED))
+			continue;
+		suppressed = __atomic_exchange_n(&c->suppressed, 0,
+				__ATOMIC_RELAXED);
+		format = __atomic_load_n(&c->format, __ATOMIC_RELAXED);
+		len = strcspn(format, "\n");
+		flog_output_args(LOG_WARNING, "Suppressed %u log messages "
+				"like: %.*s\n", suppressed, len, format);
+	}
+}
+
+/**
+ * Log thread. It writes out the messages in the log ring, so the threads
+ * handling events never wait for the log file or syslog.
+ * 	@param arg Unused
+ */
+static void *cgre_log_thread(void *arg)
+{
+	struct cgre_log_msg *msg;
+	struct timespec ts;
+
+	for (;;) {
+		pthread_mutex_lock(&log_output_lock);
+		cgre_log_drain();
+		pthread_mutex_unlock(&log_output_lock);
+
+		/*
+		 * Announce the sleep before looking at the ring again, so a
+		 * message added meanwhile either is seen here or posts
+		 * log_ready. Suppressed messages are reported at latest after
+		 * the timeout.
+		 */
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		msg = &log_ring[log_head & (CGRE_LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE) !=
+				log_head + 1) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			sem_timedwait(&log_ready, &ts);
+		}
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/**
+ * Start the log thread. Messages are written directly if it cannot be
+ * started.
+ */
+static void cgre_start_log_thread(void)
+{
+	sigset_t sigset, oldset;
+	pthread_t thread;
+	unsigned int i;
+	int ret;
+
+	log_ring = calloc(CGRE_LOG_RING_SIZE, sizeof(*log_ring));
+	if (!log_ring) {
+		flog(LOG_WARNING, "Failed to allocate the log buffer, "
+				"logging synchronously\n");
+		return;
+	}
+	for (i = 0; i < CGRE_LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	sem_init(&log_ready, 0, 0);
+
+	/* The signal handlers must run in the other threads. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+	ret = pthread_create(&thread, NULL, cgre_log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret) {
+		free(log_ring);
+		log_ring = NULL;
+		sem_destroy(&log_ready);
+		flog(LOG_WARNING, "Failed to start the log thread, error: "
+				"%s, logging synchronously\n", strerror(ret));
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/**
+ * Writes out all messages waiting in the log ring and keeps the log thread
+ * from writing any more until cgre_log_unlock(), so the log destinations can
+ * be used directly or closed.
+ */
+static void cgre_log_lock(void)
+{
+	pthread_mutex_lock(&log_output_lock);
+	cgre_log_drain();
+}
+
+/**
+ * Lets the log thread write out messages again.
+ */
+static void cgre_log_unlock(void)
+{
+	pthread_mutex_unlock(&log_output_lock);
+}
+
+/**
+ * Logs a formatted message (like vprintf()). The message goes to the log
+ * ring when the log thread runs, otherwise it is printed to all log
+ * destinations immediately.
+ * 	@param level The log level (LOG_EMERG ... LOG_DEBUG)
+ *	@param format The format for the message (vprintf style)
+ *	@param ap Any args to format (vprintf style)
+ */
+void flog_write(int level, const char *format,  va_list ap)
+{
+	/* Check the log level */
+	if (level > loglevel)
+		return;
+
+	if (log_rate && cgre_log_limited(format))
+		return;
+
+	if (log_ring)
+		cgre_log_push(level, format, ap);
+	else
+		flog_output(level, format, ap);
+}
+
 /**
  * Prints a formatted message (like printf()) to all log destinations.
  * Flushes the file stream's buffer so that the message is immediately
@@ -199,22 +688,171 @@ void flog_cgroup(void *userdata, int cgroup_level, const char *format,
 	flog_write(level, format, ap);
 }
 
+/* A PID in a PID hash, with a value depending on the hash */
+struct cgre_pid_entry {
+	pid_t pid;
+	int value;
+};
+
+/*
+ * Open addressing hash of PIDs with linear probing. PID 0 marks a free
+ * slot, removed entries are filled by shifting the following ones back.
+ */
+struct cgre_pid_hash {
+	struct cgre_pid_entry *slots;
+	/* Number of slots, a power of two */
+	unsigned int size;
+	unsigned int count;
+};
+
+static unsigned int cgre_pid_slot(const struct cgre_pid_hash *hash,
+		pid_t pid)
+{
+	return ((unsigned int)pid * 2654435761U) & (hash->size - 1);
+}
+
+/**
+ * Find a PID in a PID hash.
+ * 	@param hash The hash
+ * 	@param pid The PID
+ * 	@return The entry of the PID, NULL if the PID is not in the hash
+ */
+static struct cgre_pid_entry *cgre_pid_find(struct cgre_pid_hash *hash,
+		pid_t pid)
+{
+	unsigned int i;
+
+	if (!hash->count)
+		return NULL;
+
+	for (i = cgre_pid_slot(hash, pid); hash->slots[i].pid;
+			i = (i + 1) & (hash->size - 1))
+		if (hash->slots[i].pid == pid)
+			return &hash->slots[i];
+	return NULL;
+}
+
+/**
+ * Add a PID to a PID hash, the hash grows when it is half full.
+ * 	@param hash The hash
+ * 	@param pid The PID
+ * 	@return The entry of the PID, a new one has value 0, NULL if there is
+ * 	not enough memory
+ */
+static struct cgre_pid_entry *cgre_pid_add(struct cgre_pid_hash *hash,
+		pid_t pid)
+{
+	struct cgre_pid_hash grown;
+	struct cgre_pid_entry *entry;
+	unsigned int i;
+
+	entry = cgre_pid_find(hash, pid);
+	if (entry)
+		return entry;
+
+	if ((hash->count + 1) * 2 > hash->size) {
+		grown.size = hash->size ? hash->size * 2 : CGRE_PID_HASH_SIZE;
+		grown.count = hash->count;
+		grown.slots = calloc(grown.size, sizeof(*grown.slots));
+		if (!grown.slots)
+			return NULL;
+		for (i = 0; i < hash->size; i++) {
+			if (!hash->slots[i].pid)
+				continue;
+			entry = &grown.slots[cgre_pid_slot(&grown,
+					hash->slots[i].pid)];
+			while (entry->pid)
+				entry = &grown.slots[(entry - grown.slots + 1) &
+					(grown.size - 1)];
+			*entry = hash->slots[i];
+		}
+		free(hash->slots);
+		*hash = grown;
+	}
+
+	for (i = cgre_pid_slot(hash, pid); hash->slots[i].pid;
+			i = (i + 1) & (hash->size - 1))
+		;
+	hash->slots[i].pid = pid;
+	hash->slots[i].value = 0;
+	hash->count++;
+	return &hash->slots[i];
+}
+
+/**
+ * Remove an entry from a PID hash.
+ * 	@param hash The hash
+ * 	@param entry The entry, as returned by cgre_pid_find()
+ */
+static void cgre_pid_remove(struct cgre_pid_hash *hash,
+		struct cgre_pid_entry *entry)
+{
+	unsigned int i, j, home;
+
+	i = entry - hash->slots;
+	j = i;
+	for (;;) {
+		hash->slots[i].pid = 0;
+		/*
+		 * Move back the next entry, which cannot be found anymore
+		 * past the free slot, i.e. its home slot is not in (i, j].
+		 */
+		do {
+			j = (j + 1) & (hash->size - 1);
+			if (!hash->slots[j].pid) {
+				hash->count--;
+				return;
+			}
+			home = cgre_pid_slot(hash, hash->slots[j].pid);
+		} while (((j - home) & (hash->size - 1)) <
+				((j - i) & (hash->size - 1)));
+		hash->slots[i] = hash->slots[j];
+		i = j;
+	}
+}
+
+/* A process moved by the daemon, with the time it was moved */
 struct parent_info {
 	__u64 timestamp;
 	pid_t pid;
 };
-struct array_parent_info {
-	int index;
-	int num_allocation;
-	struct parent_info **parent_info;
+
+/*
+ * Recently moved processes, in the order they were moved, so the old ones
+ * expire from the head. The hash counts the entries of each PID.
+ */
+struct parent_ring {
+	struct parent_info *info;
+	/* Number of entries, a power of two */
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	struct cgre_pid_hash pids;
 };
-struct array_parent_info array_pi;
+
+/*
+ * One ring for each worker. The forks are routed to the worker of their
+ * parent, so a moved process is kept in the ring of the worker which
+ * handles its forks and only that worker expires it, in the order of its
+ * own events. A shared ring would be expired by the other workers while
+ * the worker of the parent still had older forks to handle.
+ */
+static struct parent_ring parent_rings[CGRE_MAX_WORKERS];
+
+/* The ring of the worker handling the forks of pid */
+static struct parent_ring *cgre_parent_ring(pid_t pid)
+{
+	return &parent_rings[num_workers ? pid % num_workers : 0];
+}
 
 static int cgre_store_parent_info(pid_t pid)
 {
+	struct parent_ring *ring = cgre_parent_ring(pid);
 	__u64 uptime_ns;
 	struct timespec tp;
 	struct parent_info *info;
+	struct cgre_pid_entry *entry;
+	unsigned int i, size;
 
 	if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0) {
 		flog(LOG_WARNING, "Failed to get time\n");
@@ -222,107 +860,169 @@ static int cgre_store_parent_info(pid_t pid)
 	}
 	uptime_ns = ((__u64)tp.tv_sec * 1000 * 1000 * 1000 ) + tp.tv_nsec;
 
-	if (array_pi.index >= array_pi.num_allocation) {
-		int alloc = array_pi.num_allocation + NUM_PER_REALLOCATIOM;
-		void *new_array = realloc(array_pi.parent_info,
-					  sizeof(info) * alloc);
-		if (!new_array) {
+	if (ring->tail - ring->head >= ring->size) {
+		size = ring->size ? ring->size * 2 : CGRE_PID_HASH_SIZE;
+		info = malloc(size * sizeof(*info));
+		if (!info) {
 			flog(LOG_WARNING, "Failed to allocate memory\n");
 			return 1;
 		}
-		array_pi.parent_info = new_array;
-		array_pi.num_allocation = alloc;
+		for (i = 0; i < ring->tail - ring->head; i++)
+			info[i] = ring->info[(ring->head + i) &
+				(ring->size - 1)];
+		free(ring->info);
+		ring->info = info;
+		ring->size = size;
+		ring->tail -= ring->head;
+		ring->head = 0;
 	}
-	info = calloc(1, sizeof(struct parent_info));
-	if (!info) {
+
+	entry = cgre_pid_add(&ring->pids, pid);
+	if (!entry) {
 		flog(LOG_WARNING, "Failed to allocate memory\n");
 		return 1;
 	}
+	entry->value++;
+
+	info = &ring->info[ring->tail & (ring->size - 1)];
 	info->timestamp = uptime_ns;
 	info->pid = pid;
-
-	array_pi.parent_info[array_pi.index] = info;
-	array_pi.index++;
+	ring->tail++;
 
 	return 0;
 }
 
-static void cgre_remove_old_parent_info(__u64 key_timestamp)
+static void cgre_remove_old_parent_info(struct parent_ring *ring,
+		__u64 key_timestamp)
 {
-	int i, j;
+	struct parent_info *info;
+	struct cgre_pid_entry *entry;
 
-	for (i = 0; i < array_pi.index; i++) {
-		if (key_timestamp < array_pi.parent_info[i]->timestamp)
-			continue;
-		free(array_pi.parent_info[i]);
-		for (j = i; j < array_pi.index - 1; j++)
-			array_pi.parent_info[j] = array_pi.parent_info[j + 1];
-		array_pi.index--;
-		i--;
+	while (ring->head != ring->tail) {
+		info = &ring->info[ring->head & (ring->size - 1)];
+		if (key_timestamp < info->timestamp)
+			break;
+		entry = cgre_pid_find(&ring->pids, info->pid);
+		if (entry && !--entry->value)
+			cgre_pid_remove(&ring->pids, entry);
+		ring->head++;
 	}
-	return;
 }
 
 static int cgre_was_parent_changed_when_forking(const struct proc_event *ev)
 {
-	int i;
+	struct parent_ring *ring;
 	pid_t parent_pid;
 	__u64 timestamp_child;
-	__u64 timestamp_parent;
 
 	parent_pid = ev->event_data.fork.parent_pid;
 	timestamp_child = ev->timestamp_ns;
+	ring = cgre_parent_ring(parent_pid);
 
-	cgre_remove_old_parent_info(timestamp_child);
+	/* The remaining entries are all newer than the child. */
+	cgre_remove_old_parent_info(ring, timestamp_child);
 
-	for (i = 0; i < array_pi.index; i++) {
-		if (parent_pid != array_pi.parent_info[i]->pid)
-			continue;
-		timestamp_parent = array_pi.parent_info[i]->timestamp;
-		if (timestamp_child > timestamp_parent)
-			continue;
+	return cgre_pid_find(&ring->pids, parent_pid) != NULL;
+}
+
+/* Sticky processes, with their CGROUP_DAEMON_* flags as the value */
+static struct cgre_pid_hash unchanged;
+
+/*
+ * Offset of the event type in a proc connector message, as seen by a socket
+ * filter.
+ */
+#define CGRE_FILTER_WHAT_OFFSET (NLMSG_LENGTH(0) + \
+	offsetof(struct cn_msg, data) + offsetof(struct proc_event, what))
+
+/**
+ * Attach a classic BPF filter to the netlink socket, which drops proc
+ * connector events the daemon does not need. UID, GID, EXEC and FORK events
+ * are always needed, FORK to track children of sticky processes and of
+ * processes which are just being moved. EXIT events are needed only when
+ * there are sticky processes to forget. The socket filter replaces the
+ * previous one atomically. The caller must hold state_lock.
+ * 	@param sk_nl The netlink socket
+ * 	@param exit Non-zero to let EXIT events pass
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_attach_event_filter(int sk_nl, int exit)
+{
+	struct sock_filter filter[] = {
+		/* Pass all messages, which are not proc connector events. */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+			offsetof(struct nlmsghdr, nlmsg_type)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_DONE), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_LENGTH(0) +
+			offsetof(struct cn_msg, id) + offsetof(struct cb_id, idx)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_IDX_PROC), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_LENGTH(0) +
+			offsetof(struct cn_msg, id) + offsetof(struct cb_id, val)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_VAL_PROC), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+		/* Pass the events we need, drop all others. */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, CGRE_FILTER_WHAT_OFFSET),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_UID), 5, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_GID), 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 3, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_FORK), 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			exit ? htonl(PROC_EVENT_EXIT) : htonl(PROC_EVENT_NONE),
+			1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog fprog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+			sizeof(fprog)) < 0) {
+		flog(LOG_WARNING, "Warning: failed to attach event filter: "
+				"%s\n", strerror(errno));
 		return 1;
 	}
+
+	filter_exit = exit;
+	flog(LOG_DEBUG, "Event filter attached, EXIT events %s\n",
+			exit ? "pass" : "dropped");
 	return 0;
 }
 
-struct unchanged_pid {
-	pid_t pid;
-	int flags;
-} unchanged_pid_t;
+/**
+ * Update the event filter after the list of sticky processes has changed.
+ * The caller must hold state_lock.
+ */
+static void cgre_update_event_filter(void)
+{
+	int exit = unchanged.count > 0;
 
-struct array_unchanged {
-	int index;
-	int num_allocation;
-	struct unchanged_pid *proc;
-};
+	if (filter_socket < 0 || exit == filter_exit)
+		return;
 
-struct array_unchanged array_unch;
+	cgre_attach_event_filter(filter_socket, exit);
+}
 
 static int cgre_store_unchanged_process(pid_t pid, int flags)
 {
-	int i;
+	struct cgre_pid_entry *entry;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
+	entry = cgre_pid_find(&unchanged, pid);
+	if (entry)
 		/* pid is stored already. */
 		return 0;
+
+	entry = cgre_pid_add(&unchanged, pid);
+	if (!entry) {
+		flog(LOG_WARNING, "Failed to allocate memory\n");
+		return 1;
 	}
-	if (array_unch.index >= array_unch.num_allocation) {
-		int alloc = array_unch.num_allocation + NUM_PER_REALLOCATIOM;
-		void *new_array = realloc(array_unch.proc,
-					  sizeof(unchanged_pid_t) * alloc);
-		if (!new_array) {
-			flog(LOG_WARNING, "Failed to allocate memory\n");
-			return 1;
-		}
-		array_unch.proc = new_array;
-		array_unch.num_allocation = alloc;
-	}
-	array_unch.proc[array_unch.index].pid = pid;
-	array_unch.proc[array_unch.index].flags = flags;
-	array_unch.index++;
+	entry->value = flags;
+	cgre_update_event_filter();
 	flog(LOG_DEBUG, "Store the unchanged process (PID: %d, FLAGS: %d)\n",
 			pid, flags);
 	return 0;
@@ -330,47 +1030,55 @@ static int cgre_store_unchanged_process(pid_t pid, int flags)
 
 static void cgre_remove_unchanged_process(pid_t pid)
 {
-	int i, j;
+	struct cgre_pid_entry *entry;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-		for (j = i; j < array_unch.index - 1; j++)
-			memcpy(&array_unch.proc[j],
-				&array_unch.proc[j + 1],
-				sizeof(struct unchanged_pid));
-		array_unch.index--;
-		flog(LOG_DEBUG, "Remove the unchanged process (PID: %d)\n",
-				pid);
-		break;
-	}
-	return;
+	entry = cgre_pid_find(&unchanged, pid);
+	if (!entry)
+		return;
+
+	cgre_pid_remove(&unchanged, entry);
+	flog(LOG_DEBUG, "Remove the unchanged process (PID: %d)\n", pid);
+	cgre_update_event_filter();
 }
 
 static int cgre_is_unchanged_process(pid_t pid)
 {
-	int i;
-
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-		return 1;
-	}
-	return 0;
+	return cgre_pid_find(&unchanged, pid) != NULL;
 }
 
 static int cgre_is_unchanged_child(pid_t pid)
 {
+	struct cgre_pid_entry *entry;
+
+	entry = cgre_pid_find(&unchanged, pid);
+	return entry && (entry->value & CGROUP_DAEMON_UNCHANGE_CHILDREN);
+}
+
+static __u64 cgre_now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((__u64)tp.tv_sec * 1000 * 1000 * 1000) + tp.tv_nsec;
+}
+
+/**
+ * Count the time since the kernel sent an event in the latency histogram.
+ * The kernel stamps the events with the monotonic clock, so the time in the
+ * netlink socket and the worker queues is included.
+ * 	@param ev The classified event
+ */
+static void cgre_count_latency(const struct proc_event *ev)
+{
+	__u64 now = cgre_now_ns(), usec = 0;
 	int i;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-		if (array_unch.proc[i].flags & CGROUP_DAEMON_UNCHANGE_CHILDREN)
-			return 1;
-		break;
-	}
-	return 0;
+	if (now > ev->timestamp_ns)
+		usec = (now - ev->timestamp_ns) / 1000;
+	for (i = 0; i < CGRE_LATENCY_BUCKETS - 1; i++)
+		if (usec < (1ULL << i))
+			break;
+	__sync_fetch_and_add(&stats.latency[i], 1);
 }
 
 /**
@@ -391,6 +1099,7 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 
 	int ret = 0;
 
+	pthread_mutex_lock(&state_lock);
 	switch (type) {
 	case PROC_EVENT_UID:
 	case PROC_EVENT_GID:
@@ -399,7 +1108,7 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		 * cgroup of the process.
 		 */
 		if (cgre_is_unchanged_process(ev->event_data.id.process_pid))
-			return 0;
+			goto unlock;
 		pid = ev->event_data.id.process_pid;
 		break;
 	case PROC_EVENT_FORK:
@@ -407,8 +1116,10 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		cpid = ev->event_data.fork.child_pid;
 		if (cgre_is_unchanged_child(ppid)) {
 			if (cgre_store_unchanged_process(cpid,
-					CGROUP_DAEMON_UNCHANGE_CHILDREN))
-				return 1;
+					CGROUP_DAEMON_UNCHANGE_CHILDREN)) {
+				ret = 1;
+				goto unlock;
+			}
 		}
 
 		/*
@@ -416,37 +1127,35 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		 * this process's cgroup also should be changed.
 		 */
 		if (!cgre_was_parent_changed_when_forking(ev))
-			return 0;
+			goto unlock;
 		pid = ev->event_data.fork.child_pid;
 		break;
 	case PROC_EVENT_EXIT:
 		cgre_remove_unchanged_process(ev->event_data.exit.process_pid);
-		return 0;
+		goto unlock;
 	case PROC_EVENT_EXEC:
 		/*
 		 * If the unchanged process, the daemon should not change the
 		 * cgroup of the process.
 		 */
 		if (cgre_is_unchanged_process(ev->event_data.exec.process_pid))
-			return 0;
+			goto unlock;
 		pid = ev->event_data.exec.process_pid;
 		break;
 	default:
 		break;
 	}
-	ret = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
-	if (ret == ECGROUPNOTEXIST)
-		/* cgroup_get_uid_gid_from_procfs() returns ECGROUPNOTEXIST
-		 * if a process finished and that is not a problem. */
-		return 0;
-	else if (ret)
-		return ret;
+	pthread_mutex_unlock(&state_lock);
 
-	ret = cgroup_get_procname_from_procfs(pid, &procname);
-	if (ret == ECGROUPNOTEXIST)
+	ret = cgroup_get_proc_identity(pid, &euid, &egid, &procname);
+	if (ret == ECGROUPNOTEXIST) {
+		/* cgroup_get_proc_identity() returns ECGROUPNOTEXIST
+		 * if a process finished and that is not a problem. */
 		return 0;
-	else if (ret)
+	} else if (ret) {
+		__sync_fetch_and_add(&stats.proc_errors, 1);
 		return ret;
+	}
 
 	/*
 	 * Now that we have the UID, the GID, and the PID, we can make a call
@@ -476,41 +1185,46 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		break;
 	}
 	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid,
-						 CGFLAG_USECACHE);
+			classify_flags);
+	CG_TRACE4(event_classify, pid, type, ret, ev->timestamp_ns);
 	if ((ret == ECGOTHER) && (errno == ESRCH)) {
 		/* A process finished already and that is not a problem. */
 		ret = 0;
 	} else if (ret) {
+		__sync_fetch_and_add(&stats.failed, 1);
 		flog(LOG_WARNING,
 			"Cgroup change for PID: %d, UID: %d, GID: %d, PROCNAME: %s FAILED! (Error Code: %d)\n",
 			log_pid, log_uid, log_gid, procname, ret);
 	} else {
+		__sync_fetch_and_add(&stats.classified, 1);
+		cgre_count_latency(ev);
 		flog(LOG_INFO,
 			"Cgroup change for PID: %d, UID: %d, GID: %d, PROCNAME: %s OK\n",
 			log_pid, log_uid, log_gid, procname);
+		pthread_mutex_lock(&state_lock);
 		ret = cgre_store_parent_info(pid);
+		pthread_mutex_unlock(&state_lock);
 	}
 	free(procname);
 	return ret;
+
+unlock:
+	pthread_mutex_unlock(&state_lock);
+	return ret;
 }
 
 /**
- * Handle a netlink message.  In the event of PROC_EVENT_UID or PROC_EVENT_GID,
- * we pass the event along to cgre_process_event for further processing.  All
- * other events are ignored.
- * 	@param cn_hdr The netlink message
+ * Handle an event from the kernel.  The events we care about are passed
+ * along to cgre_process_event for further processing.  All other events
+ * are ignored.
+ * 	@param ev The event
  * 	@return 0 on success, > 0 on error
  */
-static int cgre_handle_msg(struct cn_msg *cn_hdr)
+static int cgre_handle_event(const struct proc_event *ev)
 {
-	/* The event to consider */
-	struct proc_event *ev;
-
 	/* Return codes */
 	int ret = 0;
 
-	/* Get the event data.  We only care about two event types. */
-	ev = (struct proc_event*)cn_hdr->data;
 	switch (ev->what) {
 	case PROC_EVENT_UID:
 		flog(LOG_DEBUG,
@@ -546,60 +1260,554 @@ static int cgre_handle_msg(struct cn_msg *cn_hdr)
 		break;
 	}
 
-	return ret;
+	return ret;
+}
+
+static struct cgre_coalesce *cgre_coalesce_create(void)
+{
+	struct cgre_coalesce *co;
+	int i;
+
+	co = calloc(1, sizeof(struct cgre_coalesce));
+	if (!co) {
+		flog(LOG_ERR, "Error: failed to allocate memory\n");
+		return NULL;
+	}
+	for (i = 0; i < CGRE_COALESCE_SIZE; i++)
+		co->hash[i] = -1;
+
+	return co;
+}
+
+/* Remove the event in the slot from the hash, it stays in the FIFO. */
+static void cgre_coalesce_unlink(struct cgre_coalesce *co, int slot)
+{
+	int *itr = &co->hash[co->slots[slot].pid & (CGRE_COALESCE_SIZE - 1)];
+
+	while (*itr != slot)
+		itr = &co->slots[*itr].next;
+	*itr = co->slots[slot].next;
+	co->slots[slot].pid = 0;
+}
+
+/* Handle the oldest waiting event. */
+static void cgre_coalesce_pop(struct cgre_coalesce *co)
+{
+	int slot = co->head & (CGRE_COALESCE_SIZE - 1);
+
+	if (co->slots[slot].pid)
+		cgre_coalesce_unlink(co, slot);
+	co->head++;
+
+	/* The event was cancelled by an EXIT event. */
+	if (co->slots[slot].ev.what == PROC_EVENT_NONE)
+		return;
+
+	cgre_handle_event(&co->slots[slot].ev);
+}
+
+/**
+ * Handle all waiting events, whose coalescing window is over.
+ * 	@param co The waiting events
+ */
+static void cgre_coalesce_expire(struct cgre_coalesce *co)
+{
+	__u64 now = cgre_now_ns();
+
+	while (co->head != co->tail &&
+		co->slots[co->head & (CGRE_COALESCE_SIZE - 1)].deadline <= now)
+		cgre_coalesce_pop(co);
+}
+
+/**
+ * Get the time until the oldest waiting event should be handled.
+ * 	@param co The waiting events
+ * 	@return Time in nanoseconds, 0 if it is due, -1 if there is no event
+ */
+static long long cgre_coalesce_timeout(struct cgre_coalesce *co)
+{
+	__u64 deadline, now;
+
+	if (co->head == co->tail)
+		return -1;
+
+	deadline = co->slots[co->head & (CGRE_COALESCE_SIZE - 1)].deadline;
+	now = cgre_now_ns();
+	return deadline > now ? (long long)(deadline - now) : 0;
+}
+
+/**
+ * Handle an event with coalescing. UID, GID and EXEC events wait until the
+ * end of their window, and any further such events for the same PID just
+ * replace them, so the process is classified only once. An EXIT event
+ * cancels the waiting event of the PID. A FORK event first handles the
+ * waiting event of the parent, so the child forked meanwhile is moved
+ * along with it. Other events are handled right away.
+ * 	@param co The waiting events
+ * 	@param ev The event
+ */
+static void cgre_coalesce_event(struct cgre_coalesce *co,
+		const struct proc_event *ev)
+{
+	struct cgre_pending *pending;
+	struct proc_event parent_ev;
+	int slot;
+	pid_t pid;
+
+	switch (ev->what) {
+	case PROC_EVENT_UID:
+	case PROC_EVENT_GID:
+		pid = ev->event_data.id.process_pid;
+		break;
+	case PROC_EVENT_EXEC:
+		pid = ev->event_data.exec.process_pid;
+		break;
+	case PROC_EVENT_EXIT:
+		pid = ev->event_data.exit.process_pid;
+		break;
+	case PROC_EVENT_FORK:
+		pid = ev->event_data.fork.parent_pid;
+		break;
+	default:
+		cgre_handle_event(ev);
+		return;
+	}
+
+	slot = co->hash[pid & (CGRE_COALESCE_SIZE - 1)];
+	while (slot >= 0 && co->slots[slot].pid != pid)
+		slot = co->slots[slot].next;
+
+	if (ev->what == PROC_EVENT_FORK) {
+		/*
+		 * The parent is classified now, which records it as changed
+		 * after the fork, so the child is classified too.
+		 */
+		if (slot >= 0) {
+			parent_ev = co->slots[slot].ev;
+			co->slots[slot].ev.what = PROC_EVENT_NONE;
+			cgre_coalesce_unlink(co, slot);
+			cgre_handle_event(&parent_ev);
+		}
+		cgre_handle_event(ev);
+		return;
+	}
+
+	if (ev->what == PROC_EVENT_EXIT) {
+		if (slot >= 0) {
+			co->slots[slot].ev.what = PROC_EVENT_NONE;
+			cgre_coalesce_unlink(co, slot);
+			__sync_fetch_and_add(&coalesced_events, 1);
+		}
+		cgre_handle_event(ev);
+		return;
+	}
+
+	/* Fold the event into the waiting one, keep its deadline. */
+	if (slot >= 0) {
+		co->slots[slot].ev = *ev;
+		__sync_fetch_and_add(&coalesced_events, 1);
+		return;
+	}
+
+	/* No space left, the oldest event cannot wait any longer. */
+	if (co->tail - co->head >= CGRE_COALESCE_SIZE)
+		cgre_coalesce_pop(co);
+
+	slot = co->tail & (CGRE_COALESCE_SIZE - 1);
+	pending = &co->slots[slot];
+	pending->ev = *ev;
+	pending->deadline = cgre_now_ns() + coalesce_window;
+	pending->pid = pid;
+	pending->next = co->hash[pid & (CGRE_COALESCE_SIZE - 1)];
+	co->hash[pid & (CGRE_COALESCE_SIZE - 1)] = slot;
+	co->tail++;
+}
+
+/**
+ * Wait for the next event in the queue of a worker, but not longer than
+ * until the oldest coalesced event of the worker is due.
+ * 	@param queue The queue of the worker
+ * 	@return 0 when an event is ready, -1 on timeout or interruption
+ */
+static int cgre_worker_wait(struct cgre_queue *queue)
+{
+	struct timespec ts;
+	long long timeout = -1;
+
+	if (queue->coalesce)
+		timeout = cgre_coalesce_timeout(queue->coalesce);
+	if (timeout < 0)
+		return sem_wait(&queue->ready);
+	if (timeout == 0)
+		return sem_trywait(&queue->ready);
+
+	/* sem_timedwait() measures the time by the real time clock. */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	timeout += ts.tv_nsec;
+	ts.tv_sec += timeout / (1000 * 1000 * 1000);
+	ts.tv_nsec = timeout % (1000 * 1000 * 1000);
+	return sem_timedwait(&queue->ready, &ts);
+}
+
+/**
+ * Classifier worker. It handles events from its queue, in the order they
+ * were received.
+ * 	@param arg The queue of the worker
+ */
+static void *cgre_worker(void *arg)
+{
+	struct cgre_queue *queue = arg;
+	struct proc_event ev;
+	int ready;
+
+	for (;;) {
+		ready = !cgre_worker_wait(queue);
+		if (ready) {
+			ev = queue->events[queue->tail &
+				(CGRE_QUEUE_SIZE - 1)];
+			__atomic_store_n(&queue->tail, queue->tail + 1,
+					__ATOMIC_RELEASE);
+		}
+
+		pthread_rwlock_rdlock(&reload_lock);
+		if (queue->coalesce) {
+			if (ready)
+				cgre_coalesce_event(queue->coalesce, &ev);
+			cgre_coalesce_expire(queue->coalesce);
+		} else if (ready) {
+			cgre_handle_event(&ev);
+		}
+		if (ready)
+			__atomic_store_n(&queue->done, queue->done + 1,
+					__ATOMIC_RELEASE);
+		pthread_rwlock_unlock(&reload_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the process an event is about, for a FORK event the child.
+ * 	@param ev The event
+ * 	@return The PID, 0 for the events the daemon does not handle
+ */
+static pid_t cgre_event_pid(const struct proc_event *ev)
+{
+	switch (ev->what) {
+	case PROC_EVENT_UID:
+	case PROC_EVENT_GID:
+		return ev->event_data.id.process_pid;
+	case PROC_EVENT_FORK:
+		/* The child is the process, which might be changed. */
+		return ev->event_data.fork.child_pid;
+	case PROC_EVENT_EXIT:
+		return ev->event_data.exit.process_pid;
+	case PROC_EVENT_EXEC:
+		return ev->event_data.exec.process_pid;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Pass an event to a worker. All events of one PID go to the same worker,
+ * so they are handled in the order they were received. A FORK event goes
+ * to the worker of the parent, as its handling depends on whether the
+ * parent was classified before. If the queue of the worker is full, the
+ * event is dropped.
+ * 	@param ev The event
+ */
+static void cgre_queue_event(const struct proc_event *ev)
+{
+	static time_t last_warning;
+	struct cgre_queue *queue;
+	unsigned int tail;
+	pid_t pid;
+	time_t now;
+
+	pid = cgre_event_pid(ev);
+	if (!pid)
+		return;
+
+	if (ev->what == PROC_EVENT_FORK)
+		queue = &queues[ev->event_data.fork.parent_pid % num_workers];
+	else
+		queue = &queues[pid % num_workers];
+	tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (queue->head - tail >= CGRE_QUEUE_SIZE) {
+		CG_TRACE2(event_drop, ev->what, pid);
+		dropped_events++;
+		now = time(NULL);
+		if (now != last_warning) {
+			last_warning = now;
+			flog(LOG_WARNING, "Warning: event queue full, %lu "
+					"events dropped so far\n",
+					dropped_events);
+		}
+		return;
+	}
+
+	queue->events[queue->head & (CGRE_QUEUE_SIZE - 1)] = *ev;
+	__atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+	sem_post(&queue->ready);
+}
+
+/**
+ * Write an event to the record file, one line in the replay format:
+ * "fork <parent> <child>", "exec <pid>", "uid <pid> <euid>",
+ * "gid <pid> <egid>" or "exit <pid>". Other events are not recorded.
+ * 	@param ev The event
+ */
+static void cgre_record_event(const struct proc_event *ev)
+{
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		fprintf(record_file, "fork %d %d\n",
+				ev->event_data.fork.parent_pid,
+				ev->event_data.fork.child_pid);
+		break;
+	case PROC_EVENT_EXEC:
+		fprintf(record_file, "exec %d\n",
+				ev->event_data.exec.process_pid);
+		break;
+	case PROC_EVENT_UID:
+		fprintf(record_file, "uid %d %d\n",
+				ev->event_data.id.process_pid,
+				ev->event_data.id.e.euid);
+		break;
+	case PROC_EVENT_GID:
+		fprintf(record_file, "gid %d %d\n",
+				ev->event_data.id.process_pid,
+				ev->event_data.id.e.egid);
+		break;
+	case PROC_EVENT_EXIT:
+		fprintf(record_file, "exit %d\n",
+				ev->event_data.exit.process_pid);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Count an event and either handle it right away, or pass it to a worker
+ * if there are any.
+ * 	@param ev The event
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_dispatch_event(const struct proc_event *ev)
+{
+	CG_TRACE2(event_dispatch, ev->what, cgre_event_pid(ev));
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		__sync_fetch_and_add(&stats.fork, 1);
+		break;
+	case PROC_EVENT_EXEC:
+		__sync_fetch_and_add(&stats.exec, 1);
+		break;
+	case PROC_EVENT_UID:
+		__sync_fetch_and_add(&stats.uid, 1);
+		break;
+	case PROC_EVENT_GID:
+		__sync_fetch_and_add(&stats.gid, 1);
+		break;
+	case PROC_EVENT_EXIT:
+		__sync_fetch_and_add(&stats.exit, 1);
+		break;
+	default:
+		__sync_fetch_and_add(&stats.other, 1);
+		break;
+	}
+
+	if (num_workers) {
+		cgre_queue_event(ev);
+		return 0;
+	}
+
+	if (main_coalesce) {
+		cgre_coalesce_event(main_coalesce, ev);
+		return 0;
+	}
+
+	return cgre_handle_event(ev);
+}
+
+/**
+ * Handle a netlink message.  The event in it is either handled right away,
+ * or passed to a worker if there are any.
+ * 	@param cn_hdr The netlink message
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_handle_msg(struct cn_msg *cn_hdr)
+{
+	/* The event to consider */
+	struct proc_event *ev;
+
+	ev = (struct proc_event *)cn_hdr->data;
+	if (record_file)
+		cgre_record_event(ev);
+
+	return cgre_dispatch_event(ev);
+}
+
+/**
+ * Prepare the netlink socket and the buffers for receiving messages.
+ * 	@param sk_nl The netlink socket
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_setup_netlink_receive(int sk_nl)
+{
+	int i;
+
+	recv_msgs = calloc(recv_batch, sizeof(struct mmsghdr));
+	recv_iovs = calloc(recv_batch, sizeof(struct iovec));
+	recv_addrs = calloc(recv_batch, sizeof(struct sockaddr_nl));
+	recv_buffers = malloc(recv_batch * BUFF_SIZE);
+	if (!recv_msgs || !recv_iovs || !recv_addrs || !recv_buffers) {
+		flog(LOG_ERR, "Error: failed to allocate memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < recv_batch; i++) {
+		recv_iovs[i].iov_base = recv_buffers + i * BUFF_SIZE;
+		recv_iovs[i].iov_len = BUFF_SIZE;
+		recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+		recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		recv_msgs[i].msg_hdr.msg_name = &recv_addrs[i];
+	}
+
+	if (!recv_buffer_size)
+		return 0;
+
+	/*
+	 * SO_RCVBUFFORCE can override the rmem_max limit, but it needs
+	 * CAP_NET_ADMIN. Fall back to SO_RCVBUF if we do not have it.
+	 */
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUFFORCE, &recv_buffer_size,
+			sizeof(recv_buffer_size)) < 0) {
+		flog(LOG_WARNING, "Warning: failed to force netlink receive "
+				"buffer size: %s\n", strerror(errno));
+		if (setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUF,
+				&recv_buffer_size,
+				sizeof(recv_buffer_size)) < 0)
+			flog(LOG_WARNING, "Warning: failed to set netlink "
+					"receive buffer size: %s\n",
+					strerror(errno));
+	}
+	flog(LOG_DEBUG, "Netlink receive buffer size set to %d\n",
+			recv_buffer_size);
+
+	return 0;
 }
 
 static int cgre_receive_netlink_msg(int sk_nl)
 {
-	char buff[BUFF_SIZE];
-	size_t recv_len;
-	struct sockaddr_nl from_nla;
-	socklen_t from_nla_len;
+	struct sockaddr_nl *from_nla;
 	struct nlmsghdr *nlh;
 	struct cn_msg *cn_hdr;
+	int recv_len;
+	int count;
+	int i;
 
-	memset(buff, 0, sizeof(buff));
-	from_nla_len = sizeof(from_nla);
-	recv_len = recvfrom(sk_nl, buff, sizeof(buff), 0,
-		(struct sockaddr *)&from_nla, &from_nla_len);
-	if (recv_len == ENOBUFS) {
-		flog(LOG_ERR, "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
-		return 0;
-	}
-	if (recv_len < 1)
-		return 0;
+	for (i = 0; i < recv_batch; i++)
+		recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
 
-	if (from_nla_len != sizeof(from_nla)) {
-		flog(LOG_ERR, "Bad address size reading netlink socket\n");
+	/* Wait for the first message only, then take what is queued. */
+	count = recvmmsg(sk_nl, recv_msgs, recv_batch, MSG_WAITFORONE, NULL);
+	CG_TRACE1(event_receive, count);
+	if (count < 0) {
+		if (errno == ENOBUFS) {
+			netlink_overruns++;
+			flog(LOG_ERR, "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
+		}
 		return 0;
 	}
-	if (from_nla.nl_groups != CN_IDX_PROC
-	    || from_nla.nl_pid != 0)
-		return 0;
 
-	nlh = (struct nlmsghdr *)buff;
-	while (NLMSG_OK(nlh, recv_len)) {
-		cn_hdr = NLMSG_DATA(nlh);
-		if (nlh->nlmsg_type == NLMSG_NOOP) {
-			nlh = NLMSG_NEXT(nlh, recv_len);
+	for (i = 0; i < count; i++) {
+		from_nla = &recv_addrs[i];
+		recv_len = recv_msgs[i].msg_len;
+		if (recv_len < 1)
+			continue;
+
+		if (recv_msgs[i].msg_hdr.msg_namelen != sizeof(*from_nla)) {
+			flog(LOG_ERR, "Bad address size reading netlink socket\n");
 			continue;
 		}
-		if ((nlh->nlmsg_type == NLMSG_ERROR) ||
-				(nlh->nlmsg_type == NLMSG_OVERRUN))
-			break;
-		if (cgre_handle_msg(cn_hdr) < 0)
-			return 1;
-		if (nlh->nlmsg_type == NLMSG_DONE)
-			break;
-		nlh = NLMSG_NEXT(nlh, recv_len);
+		if (from_nla->nl_groups != CN_IDX_PROC
+		    || from_nla->nl_pid != 0)
+			continue;
+
+		nlh = (struct nlmsghdr *)recv_iovs[i].iov_base;
+		while (NLMSG_OK(nlh, recv_len)) {
+			cn_hdr = NLMSG_DATA(nlh);
+			if (nlh->nlmsg_type == NLMSG_NOOP) {
+				nlh = NLMSG_NEXT(nlh, recv_len);
+				continue;
+			}
+			if ((nlh->nlmsg_type == NLMSG_ERROR) ||
+					(nlh->nlmsg_type == NLMSG_OVERRUN))
+				break;
+			if (cgre_handle_msg(cn_hdr) < 0)
+				return 1;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				break;
+			nlh = NLMSG_NEXT(nlh, recv_len);
+		}
 	}
 	return 0;
 }
 
+/**
+ * Write the daemon statistics to a client of the daemon socket, one
+ * "<name> <value>" pair per line, followed by the number of processes moved
+ * by each rule.
+ * 	@param fd_client The socket of the client
+ */
+static void cgre_send_stats(int fd_client)
+{
+	FILE *fp;
+	int fd, i;
+
+	fd = dup(fd_client);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		flog(LOG_WARNING, "Warning: cannot write to daemon socket: %s\n",
+				strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	fprintf(fp, "events.fork %lu\n", stats.fork);
+	fprintf(fp, "events.exec %lu\n", stats.exec);
+	fprintf(fp, "events.uid %lu\n", stats.uid);
+	fprintf(fp, "events.gid %lu\n", stats.gid);
+	fprintf(fp, "events.exit %lu\n", stats.exit);
+	fprintf(fp, "events.other %lu\n", stats.other);
+	fprintf(fp, "events.dropped %lu\n", dropped_events);
+	fprintf(fp, "events.coalesced %lu\n", coalesced_events);
+	fprintf(fp, "netlink.overruns %lu\n", netlink_overruns);
+	fprintf(fp, "processes.classified %lu\n", stats.classified);
+	fprintf(fp, "processes.failed %lu\n", stats.failed);
+	fprintf(fp, "processes.skipped %lu\n", cgroup_get_skipped_moves());
+	fprintf(fp, "proc.errors %lu\n", stats.proc_errors);
+	for (i = 0; i < CGRE_LATENCY_BUCKETS - 1; i++)
+		fprintf(fp, "latency.us.%llu %lu\n", 1ULL << i,
+				stats.latency[i]);
+	fprintf(fp, "latency.us.inf %lu\n", stats.latency[i]);
+
+	fprintf(fp, "\n");
+	cgroup_print_rules_stats(fp);
+
+	if (fclose(fp))
+		flog(LOG_WARNING, "Warning: cannot write to daemon socket: %s\n",
+				strerror(errno));
+}
+
 static void cgre_receive_unix_domain_msg(int sk_unix)
 {
 	int flags;
 	int fd_client;
+	ssize_t ret;
 	pid_t pid;
 	struct sockaddr_un caddr;
 	socklen_t caddr_len;
@@ -613,9 +1821,15 @@ static void cgre_receive_unix_domain_msg(int sk_unix)
 				strerror(errno));
 		return;
 	}
-	if (read(fd_client, &pid, sizeof(pid)) < 0) {
+	ret = read(fd_client, &pid, sizeof(pid));
+	if (ret != sizeof(pid)) {
+		/* a truncated pid must not be taken for CGRULE_STATS_PID */
 		flog(LOG_WARNING, "Warning: 'read' command error: %s\n",
-				strerror(errno));
+				ret < 0 ? strerror(errno) : "short read");
+		goto close;
+	}
+	if (pid == CGRULE_STATS_PID) {
+		cgre_send_stats(fd_client);
 		goto close;
 	}
 	sprintf(path, "/proc/%d", pid);
@@ -625,17 +1839,22 @@ static void cgre_receive_unix_domain_msg(int sk_unix)
 				pid);
 		goto close;
 	}
-	if (read(fd_client, &flags, sizeof(flags)) < 0) {
+	ret = read(fd_client, &flags, sizeof(flags));
+	if (ret != sizeof(flags)) {
 		flog(LOG_WARNING, "Warning: error reading daemon socket: %s\n",
-				strerror(errno));
+				ret < 0 ? strerror(errno) : "short read");
 		goto close;
 	}
+	pthread_mutex_lock(&state_lock);
 	if (flags == CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS) {
 		cgre_remove_unchanged_process(pid);
 	} else {
-		if (cgre_store_unchanged_process(pid, flags))
+		if (cgre_store_unchanged_process(pid, flags)) {
+			pthread_mutex_unlock(&state_lock);
 			goto close;
+		}
 	}
+	pthread_mutex_unlock(&state_lock);
 	if (write(fd_client, CGRULE_SUCCESS_STORE_PID,
 			sizeof(CGRULE_SUCCESS_STORE_PID)) < 0) {
 		flog(LOG_WARNING,
@@ -648,6 +1867,147 @@ close:
 	return;
 }
 
+/**
+ * Receive thread. It only drains the netlink socket and passes the events
+ * to the workers.
+ * 	@param arg The netlink socket
+ */
+static void *cgre_receiver(void *arg)
+{
+	int sk_nl = (long)arg;
+
+	while (!cgre_receive_netlink_msg(sk_nl))
+		;
+
+	flog(LOG_ERR, "Error: netlink receive thread stopped\n");
+	kill(getpid(), SIGTERM);
+	return NULL;
+}
+
+/**
+ * Compile the cached rules for the tools and PAM, which would parse the
+ * rules files otherwise.
+ */
+static void cgre_write_rules_image(void)
+{
+	int ret;
+
+	ret = cgroup_write_rules_image(NULL);
+	if (ret)
+		flog(LOG_WARNING, "Failed to write the rules image: %s\n",
+				cgroup_strerror(ret));
+}
+
+/**
+ * Reload the configuration requested by the signals. The rules image is
+ * written here too, none of it can be done in a signal handler.
+ */
+static void cgre_reload(void)
+{
+	/* Current time */
+	time_t tm;
+
+	int fileindex;
+
+	if (!reload_rules && !reload_templates)
+		return;
+
+	tm = time(0);
+	if (reload_rules)
+		flog(LOG_INFO, "Reloading rules configuration\n");
+	else
+		flog(LOG_INFO, "Reloading templates configuration.\n");
+	flog(LOG_DEBUG, "Current time: %s\n", ctime(&tm));
+
+	/* Wait for the workers to finish events they are handling. */
+	pthread_rwlock_wrlock(&reload_lock);
+
+	if (reload_rules) {
+		reload_rules = 0;
+
+		/* Ask libcgroup to reload the rules table. */
+		cgroup_reload_cached_rules();
+		cgre_write_rules_image();
+
+		/* Print the results of the new table to our log file. */
+		if (logfile && loglevel >= LOG_INFO) {
+			cgre_log_lock();
+			cgroup_print_rules_config(logfile);
+			fprintf(logfile, "\n");
+			cgre_log_unlock();
+		}
+	}
+	reload_templates = 0;
+
+	/* Ask libcgroup to reload the template rules table. */
+	cgroup_load_templates_cache_from_files(&fileindex);
+
+	pthread_rwlock_unlock(&reload_lock);
+}
+
+/**
+ * Start the classifier workers and the receive thread.
+ * 	@param sk_nl The netlink socket, -1 to start the workers only
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_start_workers(int sk_nl)
+{
+	sigset_t sigset, oldset;
+	pthread_t receiver;
+	int i, ret = 0;
+
+	queues = calloc(num_workers, sizeof(struct cgre_queue));
+	if (!queues) {
+		flog(LOG_ERR, "Error: failed to allocate memory\n");
+		return 1;
+	}
+
+	/* Signals must be handled by the main thread only. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	for (i = 0; i < num_workers; i++) {
+		queues[i].events = calloc(CGRE_QUEUE_SIZE,
+				sizeof(struct proc_event));
+		if (!queues[i].events) {
+			flog(LOG_ERR, "Error: failed to allocate memory\n");
+			ret = 1;
+			goto restore;
+		}
+		sem_init(&queues[i].ready, 0, 0);
+		if (coalesce_window) {
+			queues[i].coalesce = cgre_coalesce_create();
+			if (!queues[i].coalesce) {
+				ret = 1;
+				goto restore;
+			}
+		}
+		ret = pthread_create(&queues[i].thread, NULL, cgre_worker,
+				&queues[i]);
+		if (ret) {
+			flog(LOG_ERR, "Error: failed to start worker: %s\n",
+					strerror(ret));
+			goto restore;
+		}
+	}
+
+	if (sk_nl < 0)
+		goto restore;
+
+	ret = pthread_create(&receiver, NULL, cgre_receiver,
+			(void *)(long)sk_nl);
+	if (ret)
+		flog(LOG_ERR, "Error: failed to start receive thread: %s\n",
+				strerror(ret));
+	else
+		flog(LOG_INFO, "Started %d classifier workers\n",
+				num_workers);
+
+restore:
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return ret;
+}
+
 static int cgre_create_netlink_socket_process_msg(void)
 {
 	int sk_nl = 0, sk_unix = 0, sk_max;
@@ -659,7 +2019,8 @@ static int cgre_create_netlink_socket_process_msg(void)
 	enum proc_cn_mcast_op *mcop_msg;
 	struct sockaddr_un saddr;
 	fd_set fds, readfds;
-	sigset_t sigset;
+	struct timeval tv, *tvp;
+	long long timeout;
 
 	/*
 	 * Create an endpoint for communication. Use the kernel user
@@ -685,6 +2046,16 @@ static int cgre_create_netlink_socket_process_msg(void)
 		goto close_and_exit;
 	}
 
+	if (cgre_setup_netlink_receive(sk_nl))
+		goto close_and_exit;
+
+	if (use_filter) {
+		pthread_mutex_lock(&state_lock);
+		if (!cgre_attach_event_filter(sk_nl, unchanged.count > 0))
+			filter_socket = sk_nl;
+		pthread_mutex_unlock(&state_lock);
+	}
+
 	nl_hdr = (struct nlmsghdr *)buff;
 	cn_hdr = (struct cn_msg *)NLMSG_DATA(nl_hdr);
 	mcop_msg = (enum proc_cn_mcast_op*)&cn_hdr->data[0];
@@ -757,32 +2128,59 @@ static int cgre_create_netlink_socket_process_msg(void)
 	}
 
 	FD_ZERO(&readfds);
-	FD_SET(sk_nl, &readfds);
 	FD_SET(sk_unix, &readfds);
+
+	/* With workers, the netlink socket is drained by its own thread. */
+	if (num_workers) {
+		if (cgre_start_workers(sk_nl))
+			goto close_and_exit;
+	} else {
+		FD_SET(sk_nl, &readfds);
+		if (coalesce_window) {
+			main_coalesce = cgre_coalesce_create();
+			if (!main_coalesce)
+				goto close_and_exit;
+		}
+	}
+	FD_SET(reload_pipe[0], &readfds);
 	if (sk_nl < sk_unix)
 		sk_max = sk_unix;
 	else
 		sk_max = sk_nl;
+	if (sk_max < reload_pipe[0])
+		sk_max = reload_pipe[0];
 
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGUSR2);
 	for(;;) {
-		/*
-		 * For avoiding the deadlock and "Interrupted system call"
-		 * error, restrict the effective range of SIGUSR2 signal.
-		 */
-		sigprocmask(SIG_UNBLOCK, &sigset, NULL);
-		sigprocmask(SIG_BLOCK, &sigset, NULL);
+		/* Wake up when the oldest coalesced event is due. */
+		tvp = NULL;
+		if (main_coalesce) {
+			timeout = cgre_coalesce_timeout(main_coalesce);
+			if (timeout >= 0) {
+				tv.tv_sec = timeout / (1000 * 1000 * 1000);
+				tv.tv_usec = (timeout / 1000) % (1000 * 1000);
+				tvp = &tv;
+			}
+		}
 
 		memcpy(&fds, &readfds, sizeof(fd_set));
-		if (select(sk_max + 1, &fds, NULL, NULL, NULL) < 0) {
+		if (select(sk_max + 1, &fds, NULL, NULL, tvp) < 0) {
+			/* a signal, it wakes the loop up by the pipe */
+			if (errno == EINTR)
+				continue;
 			flog(LOG_ERR, "Selecting error: %s\n", strerror(errno));
 			goto close_and_exit;
 		}
+		if (FD_ISSET(reload_pipe[0], &fds)) {
+			while (read(reload_pipe[0], buff, sizeof(buff)) > 0)
+				;
+			cgre_reload();
+		}
 		if (FD_ISSET(sk_nl, &fds)) {
 			if (cgre_receive_netlink_msg(sk_nl))
 				break;
 		}
+		if (main_coalesce)
+			cgre_coalesce_expire(main_coalesce);
 		if (FD_ISSET(sk_unix, &fds))
 			cgre_receive_unix_domain_msg(sk_unix);
 	}
@@ -795,6 +2193,225 @@ close_and_exit:
 	return rc;
 }
 
+/**
+ * Parse one line of a replayed event stream, in the format written by
+ * cgre_record_event().
+ * 	@param line The line
+ * 	@param ev The event to fill
+ * 	@return 0 on success, 1 if the line is not a valid event
+ */
+static int cgre_parse_event(const char *line, struct proc_event *ev)
+{
+	char type[8];
+	int pid, arg = 0, n;
+
+	memset(ev, 0, sizeof(*ev));
+	n = sscanf(line, "%7s %d %d", type, &pid, &arg);
+	if (n < 2)
+		return 1;
+
+	if (!strcmp(type, "fork") && n == 3) {
+		ev->what = PROC_EVENT_FORK;
+		ev->event_data.fork.parent_pid = pid;
+		ev->event_data.fork.parent_tgid = pid;
+		ev->event_data.fork.child_pid = arg;
+		ev->event_data.fork.child_tgid = arg;
+	} else if (!strcmp(type, "exec")) {
+		ev->what = PROC_EVENT_EXEC;
+		ev->event_data.exec.process_pid = pid;
+		ev->event_data.exec.process_tgid = pid;
+	} else if (!strcmp(type, "uid") && n == 3) {
+		ev->what = PROC_EVENT_UID;
+		ev->event_data.id.process_pid = pid;
+		ev->event_data.id.process_tgid = pid;
+		ev->event_data.id.r.ruid = arg;
+		ev->event_data.id.e.euid = arg;
+	} else if (!strcmp(type, "gid") && n == 3) {
+		ev->what = PROC_EVENT_GID;
+		ev->event_data.id.process_pid = pid;
+		ev->event_data.id.process_tgid = pid;
+		ev->event_data.id.r.rgid = arg;
+		ev->event_data.id.e.egid = arg;
+	} else if (!strcmp(type, "exit")) {
+		ev->what = PROC_EVENT_EXIT;
+		ev->event_data.exit.process_pid = pid;
+		ev->event_data.exit.process_tgid = pid;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Wait until all replayed events are handled, including the ones waiting
+ * in a coalescing window.
+ */
+static void cgre_replay_drain(void)
+{
+	struct timespec ts = { 0, 1000 * 1000 };
+	long long timeout;
+	int i, busy;
+
+	if (!num_workers) {
+		while (main_coalesce &&
+			(timeout = cgre_coalesce_timeout(main_coalesce)) >= 0) {
+			ts.tv_sec = timeout / (1000 * 1000 * 1000);
+			ts.tv_nsec = timeout % (1000 * 1000 * 1000);
+			nanosleep(&ts, NULL);
+			cgre_coalesce_expire(main_coalesce);
+		}
+		return;
+	}
+
+	do {
+		busy = 0;
+		/* The workers touch their queues with the lock held only. */
+		pthread_rwlock_wrlock(&reload_lock);
+		for (i = 0; i < num_workers; i++) {
+			if (__atomic_load_n(&queues[i].done, __ATOMIC_ACQUIRE)
+					!= queues[i].head)
+				busy = 1;
+			else if (queues[i].coalesce && queues[i].coalesce->head
+					!= queues[i].coalesce->tail)
+				busy = 1;
+		}
+		pthread_rwlock_unlock(&reload_lock);
+		if (busy)
+			nanosleep(&ts, NULL);
+	} while (busy);
+}
+
+/**
+ * Get the upper bound of the latency of the given fraction of the
+ * classified processes from the latency histogram.
+ * 	@param fraction The fraction, in percent
+ * 	@return The bound in microseconds, 0 if it is beyond the histogram
+ */
+static unsigned long long cgre_latency_percentile(int fraction)
+{
+	unsigned long total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < CGRE_LATENCY_BUCKETS; i++)
+		total += stats.latency[i];
+	for (i = 0; i < CGRE_LATENCY_BUCKETS - 1; i++) {
+		sum += stats.latency[i];
+		if (sum * 100 >= total * fraction)
+			return 1ULL << i;
+	}
+	return 0;
+}
+
+/**
+ * Print a latency percentile to stdout, as "<name> <bound>" or
+ * "<name> inf".
+ */
+static void cgre_print_percentile(const char *name, int fraction)
+{
+	unsigned long long bound = cgre_latency_percentile(fraction);
+
+	if (bound)
+		printf("%s %llu\n", name, bound);
+	else
+		printf("%s inf\n", name);
+}
+
+/**
+ * Feed the events of replay_file into the classification, instead of the
+ * events from the kernel, at replay_rate events per second. The events are
+ * stamped when they are fed, so the latency histogram shows the time from
+ * feeding an event until its process is classified. The results are
+ * printed to stdout when all the events are handled.
+ * 	@return 0 on success, > 0 on error
+ */
+static int cgre_replay_events(void)
+{
+	struct proc_event ev;
+	struct timespec ts;
+	unsigned long events = 0;
+	__u64 start, next, elapsed;
+	size_t size = 0;
+	char *line = NULL;
+	int line_no = 0;
+	FILE *fp;
+
+	if (!strcmp(replay_file, "-"))
+		fp = stdin;
+	else
+		fp = fopen(replay_file, "re");
+	if (!fp) {
+		flog(LOG_ERR, "Error: cannot open %s: %s\n", replay_file,
+				strerror(errno));
+		return 1;
+	}
+
+	if (num_workers) {
+		if (cgre_start_workers(-1))
+			goto err;
+	} else if (coalesce_window) {
+		main_coalesce = cgre_coalesce_create();
+		if (!main_coalesce)
+			goto err;
+	}
+
+	start = cgre_now_ns();
+	while (getline(&line, &size, fp) > 0) {
+		line_no++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (cgre_parse_event(line, &ev)) {
+			flog(LOG_WARNING, "Warning: %s:%d: invalid event\n",
+					replay_file, line_no);
+			continue;
+		}
+
+		if (replay_rate) {
+			next = start + events * 1000 * 1000 * 1000 /
+				replay_rate;
+			ts.tv_sec = next / (1000 * 1000 * 1000);
+			ts.tv_nsec = next % (1000 * 1000 * 1000);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL) == EINTR)
+				;
+		}
+
+		cgre_reload();
+		ev.timestamp_ns = cgre_now_ns();
+		cgre_dispatch_event(&ev);
+		if (main_coalesce)
+			cgre_coalesce_expire(main_coalesce);
+		events++;
+	}
+	cgre_replay_drain();
+	elapsed = cgre_now_ns() - start;
+
+	printf("replay.events %lu\n", events);
+	printf("replay.seconds %.3f\n", elapsed / 1e9);
+	printf("replay.events_per_sec %.0f\n",
+			elapsed ? events * 1e9 / elapsed : 0);
+	printf("events.dropped %lu\n", dropped_events);
+	printf("events.drop_rate %.4f\n",
+			events ? (double)dropped_events / events : 0);
+	printf("events.coalesced %lu\n", coalesced_events);
+	printf("processes.classified %lu\n", stats.classified);
+	printf("processes.failed %lu\n", stats.failed);
+	printf("processes.skipped %lu\n", cgroup_get_skipped_moves());
+	printf("proc.errors %lu\n", stats.proc_errors);
+	cgre_print_percentile("latency.us.p50", 50);
+	cgre_print_percentile("latency.us.p99", 99);
+	fflush(stdout);
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+
+err:
+	if (fp != stdin)
+		fclose(fp);
+	return 1;
+}
+
 /**
  * Start logging. Opens syslog and/or log file and sets log level.
  * 	@param logp Path of the log file, NULL if no log file was specified
@@ -856,6 +2473,8 @@ static void cgre_start_log(const char *logp, int logf, int logv)
 	flog(LOG_DEBUG, "Current time: %s\n", ctime(&tm));
 	flog(LOG_DEBUG, "Opened log file: %s, log facility: %d,log level: %d\n",
 			logp, logfacility, loglevel);
+
+	cgre_start_log_thread();
 }
 
 
@@ -927,51 +2546,37 @@ int cgre_start_daemon(const char *logp, const int logf,
 	return 0;
 }
 
+/* Wake up the main loop from a signal handler. */
+static void cgre_wake_main_loop(void)
+{
+	int saved_errno = errno;
+
+	if (write(reload_pipe[1], "", 1) < 0) {
+		/* the pipe is full, the main loop wakes up anyway */
+	}
+	errno = saved_errno;
+}
+
 /**
- * Catch the SIGUSR2 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Catch the SIGUSR2 signal and let the main loop reload the rules
+ * configuration.
  * 	@param signum The signal that we caught (always SIGUSR2)
  */
 void cgre_flash_rules(int signum)
 {
-	/* Current time */
-	time_t tm = time(0);
-
-	int fileindex;
-
-	flog(LOG_INFO, "Reloading rules configuration\n");
-	flog(LOG_DEBUG, "Current time: %s\n", ctime(&tm));
-
-	/* Ask libcgroup to reload the rules table. */
-	cgroup_reload_cached_rules();
-
-	/* Print the results of the new table to our log file. */
-	if (logfile && loglevel >= LOG_INFO) {
-		cgroup_print_rules_config(logfile);
-		fprintf(logfile, "\n");
-	}
-
-	/* Ask libcgroup to reload the template rules table. */
-	cgroup_load_templates_cache_from_files(&fileindex);
+	reload_rules = 1;
+	cgre_wake_main_loop();
 }
 
 /**
- * Catch the SIGUSR1 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Catch the SIGUSR1 signal and let the main loop reload the templates
+ * configuration.
  *	@param signum The signal that we caught (always SIGUSR1)
  */
 void cgre_flash_templates(int signum)
 {
-	/* Current time */
-	time_t tm = time(0);
-
-	int fileindex;
-
-	flog(LOG_INFO, "Reloading templates configuration.\n");
-	flog(LOG_DEBUG, "Current time: %s\n", ctime(&tm));
-
-	/* Ask libcgroup to reload the templates table. */
-	cgroup_load_templates_cache_from_files(&fileindex);
+	reload_templates = 1;
+	cgre_wake_main_loop();
 }
 
 /**
@@ -986,6 +2591,19 @@ void cgre_catch_term(int signum)
 
 	flog(LOG_INFO, "Stopped CGroup Rules Engine Daemon at %s\n",
 			ctime(&tm));
+	if (dropped_events)
+		flog(LOG_WARNING, "Dropped %lu events, the worker queues "
+				"were full\n", dropped_events);
+	if (netlink_overruns)
+		flog(LOG_WARNING, "Netlink socket buffer overran %lu times\n",
+				netlink_overruns);
+	if (coalesced_events)
+		flog(LOG_INFO, "Coalesced %lu events\n", coalesced_events);
+	if (record_file)
+		fflush(record_file);
+
+	/* Write out the pending messages, the log thread stays blocked. */
+	cgre_log_lock();
 
 	/* Close the log file, if we opened one */
 	if (logfile && logfile != stdout)
@@ -1058,8 +2676,13 @@ int main(int argc, char *argv[])
 	struct passwd *pw;
 	struct group *gr;
 
+	/* Lifetime of resolved '@group' members */
+	long group_ttl = 0;
+	long window;
+	char *endptr;
+
 	/* Command line arguments */
-	const char *short_options = "hvqf:s::ndQu:g:";
+	const char *short_options = "hvqf:s::ndQu:g:t:w:r:b:Fc:l:o:R:e:aP:";
 	struct option long_options[] = {
 		{"help", no_argument, NULL, 'h'},
 		{"verbose", no_argument, NULL, 'v'},
@@ -1071,6 +2694,18 @@ int main(int argc, char *argv[])
 		{"nolog", no_argument, NULL, 'Q'},
 		{"socket-user", required_argument, NULL, 'u'},
 		{"socket-group", required_argument, NULL, 'g'},
+		{"group-ttl", required_argument, NULL, 't'},
+		{"workers", required_argument, NULL, 'w'},
+		{"rcvbuf", required_argument, NULL, 'r'},
+		{"batch", required_argument, NULL, 'b'},
+		{"filter", no_argument, NULL, 'F'},
+		{"coalesce", required_argument, NULL, 'c'},
+		{"log-rate", required_argument, NULL, 'l'},
+		{"record", required_argument, NULL, 'o'},
+		{"replay", required_argument, NULL, 'R'},
+		{"replay-rate", required_argument, NULL, 'e'},
+		{"replay-attach", no_argument, NULL, 'a'},
+		{"proc-root", required_argument, NULL, 'P'},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -1172,6 +2807,93 @@ int main(int argc, char *argv[])
 			flog(LOG_DEBUG, "Using socket group %s id %d\n",
 					optarg, (int)socket_group);
 			break;
+		case 't': /* --group-ttl */
+			group_ttl = strtol(optarg, &endptr, 10);
+			if (*endptr || group_ttl < 0) {
+				usage(stderr, "Invalid group TTL %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'w': /* --workers */
+			num_workers = strtol(optarg, &endptr, 10);
+			if (*endptr || num_workers < 0 ||
+					num_workers > CGRE_MAX_WORKERS) {
+				usage(stderr, "Invalid number of workers %s",
+						optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'r': /* --rcvbuf */
+			recv_buffer_size = strtol(optarg, &endptr, 10);
+			if (*endptr || recv_buffer_size < 0) {
+				usage(stderr, "Invalid buffer size %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'F': /* --filter */
+			use_filter = 1;
+			break;
+		case 'c': /* --coalesce */
+			window = strtol(optarg, &endptr, 10);
+			if (*endptr || window < 0) {
+				usage(stderr, "Invalid coalescing window %s",
+						optarg);
+				ret = 2;
+				goto finished;
+			}
+			coalesce_window = (__u64)window * 1000 * 1000;
+			break;
+		case 'l': /* --log-rate */
+			window = strtol(optarg, &endptr, 10);
+			if (*endptr || window < 0 || window > UINT_MAX) {
+				usage(stderr, "Invalid log rate %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			log_rate = window;
+			break;
+		case 'o': /* --record */
+			record_file = fopen(optarg, "we");
+			if (!record_file) {
+				usage(stderr, "Cannot open %s: %s", optarg,
+						strerror(errno));
+				ret = 3;
+				goto finished;
+			}
+			break;
+		case 'R': /* --replay */
+			replay_file = optarg;
+			break;
+		case 'e': /* --replay-rate */
+			replay_rate = strtol(optarg, &endptr, 10);
+			if (*endptr || replay_rate < 0) {
+				usage(stderr, "Invalid replay rate %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'a': /* --replay-attach */
+			replay_attach = 1;
+			break;
+		case 'P': /* --proc-root */
+			if (cgroup_set_proc_root(optarg)) {
+				usage(stderr, "Invalid proc root %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'b': /* --batch */
+			recv_batch = strtol(optarg, &endptr, 10);
+			if (*endptr || recv_batch < 1 ||
+					recv_batch > CGRE_MAX_RECV_BATCH) {
+				usage(stderr, "Invalid batch size %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
 		default:
 			usage(stderr, "");
 			ret = 2;
@@ -1206,6 +2928,12 @@ int main(int argc, char *argv[])
 	cgroup_string_list_add_directory(&template_files, CGCONFIG_CONF_DIR,
 		argv[0]);
 
+	cgroup_set_rules_group_cache_ttl(group_ttl);
+	if ((ret = cgroup_set_tasks_fd_cache_size(CGRE_TASKS_FD_CACHE)) != 0) {
+		fprintf(stderr, "Error: cannot allocate tasks file cache: "
+				"%s\n", cgroup_strerror(ret));
+		goto finished;
+	}
 	if ((ret = cgroup_init_rules_cache()) != 0) {
 		fprintf(stderr, "Error: libcgroup failed to initialize rules"
 				"cache from %s. %s\n", CGRULES_CONF_FILE,
@@ -1229,6 +2957,13 @@ int main(int argc, char *argv[])
 		goto finished;
 	}
 
+	/* A replay runs in the foreground and reports to stdout. */
+	if (replay_file) {
+		daemon = 0;
+		if (!replay_attach)
+			classify_flags |= CGFLAG_DRY_RUN;
+	}
+
 	/* Now, start the daemon. */
 	ret = cgre_start_daemon(logp, facility, daemon, verbosity);
 	if (ret < 0) {
@@ -1239,8 +2974,14 @@ int main(int argc, char *argv[])
 
 	/*
 	 * Set up the signal handler to reload the cached rules upon reception
-	 * of a SIGUSR2 signal.
+	 * of a SIGUSR2 signal. The handlers only wake up the main loop.
 	 */
+	if (pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		flog(LOG_ERR, "Failed to create the reload pipe. Error: %s\n",
+				strerror(errno));
+		ret = 1;
+		goto finished;
+	}
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = &cgre_flash_rules;
 	sigemptyset(&sa.sa_mask);
@@ -1278,11 +3019,26 @@ int main(int argc, char *argv[])
 	}
 
 	/* Print the configuration to the log file, or stdout. */
-	if (logfile && loglevel >= LOG_INFO)
+	if (logfile && loglevel >= LOG_INFO) {
+		cgre_log_lock();
 		cgroup_print_rules_config(logfile);
+		cgre_log_unlock();
+	}
+
+	/*
+	 * Replay the events. Running processes are not scanned, the replayed
+	 * pids are only matched against the rules unless --replay-attach is
+	 * given, they can be real processes unrelated to the replayed ones.
+	 */
+	if (replay_file) {
+		ret = cgre_replay_events();
+		goto finished;
+	}
+
+	cgre_write_rules_image();
 
 	/* Scan for running applications with rules */
-	ret = cgroup_change_all_cgroups();
+	ret = cgroup_change_all_cgroups_parallel(0);
 	if (ret)
 		flog(LOG_WARNING, "Failed to initialize running tasks.\n");
 
@@ -1295,6 +3051,9 @@ finished:
 	cgroup_string_list_free(&template_files);
 
 finished_without_temp_files:
+	if (record_file)
+		fclose(record_file);
+	cgre_log_lock();
 	if (logfile && logfile != stdout)
 		fclose(logfile);
 
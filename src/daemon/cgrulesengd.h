@@ -99,15 +99,15 @@ int cgre_start_daemon(const char *logp, const int logf,
 			const unsigned char daemon, const int logv);
 
 /**
- * Catch the SIGUSR2 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Catch the SIGUSR2 signal and let the main loop reload the rules
+ * configuration.
  * 	@param signum The signal that we caught (always SIGUSR2)
  */
 void cgre_flash_rules(int signum);
 
 /**
- * Catch the SIGUSR1 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Catch the SIGUSR1 signal and let the main loop reload the templates
+ * configuration.
  *     @param signum The signal that we caught (always SIGUSR1)
  */
 void cgre_flash_templates(int signum);
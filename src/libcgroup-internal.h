@@ -46,6 +46,12 @@ __BEGIN_DECLS
 
 #define CGRULE_SUCCESS_STORE_PID	"SUCCESS_STORE_PID"
 
+/*
+ * PID sent to the cgrulesengd socket to ask for the daemon statistics
+ * instead of registering a process.
+ */
+#define CGRULE_STATS_PID		((pid_t) 0)
+
 
 #define CGCONFIG_CONF_FILE		"/etc/cgconfig.conf"
 /* Minimum number of file in template file list for cgrulesengd */
@@ -54,8 +60,13 @@ __BEGIN_DECLS
 
 #define CGRULES_CONF_FILE       "/etc/cgrules.conf"
 #define CGRULES_CONF_DIR        "/etc/cgrules.d"
+/* Compiled rules, see cgroup_write_rules_image() */
+#define CGRULES_IMAGE_FILE      "/var/cache/cgrules.img"
 #define CGRULES_MAX_FIELDS_PER_LINE		3
 
+/* Users and groups lookup, see cg_nss_files_only() */
+#define CG_NSSWITCH_CONF	"/etc/nsswitch.conf"
+
 #define CGROUP_BUFFER_LEN (5 * FILENAME_MAX)
 
 /* Maximum length of a key(<user>:<process name>) in the daemon config file */
@@ -65,32 +76,105 @@ __BEGIN_DECLS
 #define CGROUP_RULE_MAXLINE	(FILENAME_MAX + CGROUP_RULE_MAXKEY + \
 	CG_CONTROLLER_MAX + 3)
 
-#define cgroup_err(x...) cgroup_log(CGROUP_LOG_ERROR, x)
-#define cgroup_warn(x...) cgroup_log(CGROUP_LOG_WARNING, x)
-#define cgroup_info(x...) cgroup_log(CGROUP_LOG_INFO, x)
-#define cgroup_dbg(x...) cgroup_log(CGROUP_LOG_DEBUG, x)
+/*
+ * Highest level of the messages passed to the logger. The library reads
+ * it directly, the tools and the daemon by cgroup_get_log_threshold().
+ */
+#ifdef CGROUP_LIBRARY_BUILD
+extern int cgroup_log_threshold __attribute__((visibility("hidden")));
+#define cgroup_log_threshold_now() \
+	__atomic_load_n(&cgroup_log_threshold, __ATOMIC_RELAXED)
+#else
+int cgroup_get_log_threshold(void);
+#define cgroup_log_threshold_now() cgroup_get_log_threshold()
+#endif
+
+/* Would a message of the level reach the logger? */
+#define cgroup_log_enabled(level) ((level) <= cgroup_log_threshold_now())
+
+/* Filtered messages are not even formatted, nor are their arguments. */
+#define cgroup_log_at(level, x...) do {		\
+		if (cgroup_log_enabled(level))		\
+			cgroup_log(level, x);		\
+	} while (0)
+
+#define cgroup_err(x...) cgroup_log_at(CGROUP_LOG_ERROR, x)
+#define cgroup_warn(x...) cgroup_log_at(CGROUP_LOG_WARNING, x)
+#define cgroup_info(x...) cgroup_log_at(CGROUP_LOG_INFO, x)
+#ifdef CGROUP_NO_DEBUG_LOG
+/* Compiled out by configure --disable-debug-log, still type checked. */
+#define cgroup_dbg(x...) do {				\
+		if (0)					\
+			cgroup_log(CGROUP_LOG_DEBUG, x);	\
+	} while (0)
+#else
+#define cgroup_dbg(x...) cgroup_log_at(CGROUP_LOG_DEBUG, x)
+#endif
 
 #define CGROUP_DEFAULT_LOGLEVEL CGROUP_LOG_ERROR
 
+/*
+ * Static tracepoints (USDT) of the "libcgroup" provider for bpftrace, perf
+ * or systemtap, compiled in by configure --enable-usdt. Otherwise they are
+ * empty and their arguments are not evaluated.
+ */
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+#define CG_TRACE1(name, a)		DTRACE_PROBE1(libcgroup, name, a)
+#define CG_TRACE2(name, a, b)		DTRACE_PROBE2(libcgroup, name, a, b)
+#define CG_TRACE3(name, a, b, c)	DTRACE_PROBE3(libcgroup, name, a, b, c)
+#define CG_TRACE4(name, a, b, c, d) \
+	DTRACE_PROBE4(libcgroup, name, a, b, c, d)
+#define CG_TRACE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(libcgroup, name, a, b, c, d, e)
+#else
+#define CG_TRACE1(name, a)		do { } while (0)
+#define CG_TRACE2(name, a, b)		do { } while (0)
+#define CG_TRACE3(name, a, b, c)	do { } while (0)
+#define CG_TRACE4(name, a, b, c, d)	do { } while (0)
+#define CG_TRACE5(name, a, b, c, d, e)	do { } while (0)
+#endif
+
 #define max(x,y) ((y)<(x)?(x):(y))
 #define min(x,y) ((y)>(x)?(x):(y))
 
+/*
+ * Memory region for many small objects, which are all freed at once, see
+ * cg_arena_alloc().
+ */
+struct cg_arena;
+
+/*
+ * Names of controllers and values are interned by cg_intern_string(), so
+ * each distinct name is stored only once. Arrays of values and controllers
+ * grow as needed and are always NULL terminated. When a group has an arena,
+ * its controllers, values and the arrays are allocated from it and
+ * cgroup_free_controllers() only forgets them.
+ */
 struct control_value {
-	char name[FILENAME_MAX];
+	const char *name;
 	char value[CG_VALUE_MAX];
 	bool dirty;
 };
 
 struct cgroup_controller {
-	char name[FILENAME_MAX];
-	struct control_value *values[CG_NV_MAX];
+	const char *name;
+	/* Array of values_size slots, index of them are used */
+	struct control_value **values;
+	int values_size;
 	struct cgroup *cgroup;
+	/* The arena of the cgroup, or NULL */
+	struct cg_arena *arena;
 	int index;
 };
 
 struct cgroup {
 	char name[FILENAME_MAX];
-	struct cgroup_controller *controller[CG_CONTROLLER_MAX];
+	/* Array of controller_size slots, index of them are used */
+	struct cgroup_controller **controller;
+	int controller_size;
+	/* Arena for the controllers, not owned by the cgroup, or NULL */
+	struct cg_arena *arena;
 	int index;
 	uid_t tasks_uid;
 	gid_t tasks_gid;
@@ -114,6 +198,8 @@ struct cg_mount_table_s {
 	 */
 	struct cg_mount_point mount;
 	int index;
+	/** 1 if the controller is in the cgroup v2 unified hierarchy. */
+	int unified;
 };
 
 struct cgroup_rules_data {
@@ -134,19 +220,121 @@ struct cgroup_rule {
 	char destination[FILENAME_MAX];
 	char *controllers[MAX_MNT_ELEMENTS];
 	struct cgroup_rule *next;
+	/* Position of the rule in the list, used by the rule index */
+	int ordinal;
+	/* Next rule in the same rule index bucket */
+	struct cgroup_rule *hash_next;
+	/* Next '@group' rule, in the list order */
+	struct cgroup_rule *group_next;
+	/* Number of processes moved by the rule */
+	unsigned long matched;
+};
+
+/* A resolved member of the group of an '@group' rule */
+struct cgroup_rule_member {
+	uid_t uid;
+	struct cgroup_rule *rule;
+	struct cgroup_rule_member *next;
+};
+
+/*
+ * Resolved members of all '@group' rules of an index, hashed by UID.
+ * Readers hold a reference, refreshing the members replaces the whole
+ * structure.
+ */
+struct cgroup_rule_members {
+	int refcount;
+	/* Number of buckets, same as in the rule index */
+	unsigned int size;
+	struct cgroup_rule_member **hash;
+	struct cgroup_rule_member *members;
+	int len;
+	/* Time when the group members were resolved */
+	time_t resolved;
+};
+
+/**
+ * Lookup index over a cached list of rules. Every rule which does not
+ * start with '%' is put into exactly one hash bucket: user rules by UID,
+ * group rules by GID and wildcard rules with a process name by that name.
+ * Each bucket keeps the list order, so the candidate with the lowest
+ * ordinal is the first match of the linear walk.
+ */
+struct cgroup_rule_index {
+	struct cgroup_rule **uid_hash;
+	struct cgroup_rule **gid_hash;
+	struct cgroup_rule **proc_hash;
+	/* Number of buckets in each table, always a power of two */
+	unsigned int size;
+	/* All '@group' rules, the UID may be a member of the group */
+	struct cgroup_rule *groups;
+	/*
+	 * Members of the groups above. Resolved when the index is built,
+	 * so no NSS lookup is needed to match a rule.
+	 */
+	struct cgroup_rule_members *members;
+	/* First wildcard rule without a process name */
+	struct cgroup_rule *wild;
+	/* First wildcard rule, with or without a process name */
+	struct cgroup_rule *first_wild;
+};
+
+/*
+ * Container for a list of rules. The cached list of rules is an immutable
+ * snapshot, readers hold a reference to it for as long as they use any of
+ * its rules.
+ */
+/* A file the cached rules depend on, with its state when they were parsed */
+struct cg_rules_source {
+	char *path;
+	/* the file did not exist */
+	int missing;
+	struct stat st;
 };
 
-/* Container for a list of rules */
 struct cgroup_rule_list {
 	struct cgroup_rule *head;
 	struct cgroup_rule *tail;
 	int len;
+	/* Lookup index, built only for the cached list of rules */
+	struct cgroup_rule_index *index;
+	int refcount;
+	/* Files the cached rules depend on, -1 if they are not known */
+	struct cg_rules_source *sources;
+	int nsources;
 };
 
 /*The walk_tree handle */
+struct cg_dir_walk;
+
 struct cgroup_tree_handle {
 	FTS *fts;
 	int flags;
+	/* path of the walk root, for the CGROUP_WALK_TYPE_DIRS_ONLY walker */
+	char *root;
+	/* the directory walker, if CGROUP_WALK_TYPE_DIRS_ONLY is set */
+	struct cg_dir_walk *walk;
+	/* cgroup_walk_tree_next() was called already */
+	int started;
+};
+
+struct cgroup_stats_handle {
+	char path[FILENAME_MAX];
+	int flags;
+	/* the stats file, if CGROUP_STATS_KEEP_OPEN is set, -1 otherwise */
+	int fd;
+	/* content of the file, reused by all reads */
+	char *buf;
+	size_t size;
+	struct cgroup_stat_value *values;
+	int values_size;
+};
+
+struct cgroup_poll_handle {
+	/* descriptors of the registered files */
+	int *fds;
+	int count;
+	int size;
 };
 
 /**
@@ -204,10 +392,23 @@ extern jmp_buf parser_error_env;
 char *cg_build_path(const char *name, char *path, const char *type);
 int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid);
 int cgroup_get_procname_from_procfs(pid_t pid, char **procname);
+int cgroup_get_proc_identity(pid_t pid, uid_t *euid, gid_t *egid,
+		char **procname);
 int cg_mkdir_p(const char *path);
+int cg_umount(const char *path);
+int cg_owner_perms_differ(struct cgroup *cgroup);
+int cg_nss_files_only(void);
+int cg_write_all(int fd, const void *buf, size_t len);
 struct cgroup *create_cgroup_from_name_value_pairs(const char *name,
 		struct control_value *name_value, int nv_number);
 void init_cgroup_table(struct cgroup *cgroups, size_t count);
+const char *cg_intern_string(const char *str);
+struct cg_arena *cg_arena_create(void);
+struct cg_arena *cg_arena_get(struct cg_arena *arena);
+void cg_arena_put(struct cg_arena *arena);
+void *cg_arena_alloc(struct cg_arena *arena, size_t size);
+void cg_template_groups_flush(void);
+unsigned int cg_hash_string(const char *str, unsigned int size);
 
 /*
  * Main mounting structures
@@ -24,6 +24,23 @@ static cgroup_logger_callback cgroup_logger;
 static void *cgroup_logger_userdata;
 static int cgroup_loglevel;
 
+/*
+ * Highest level of the messages passed to the logger, 0 if there is no
+ * logger. The logging macros check it before evaluating their arguments.
+ */
+int cgroup_log_threshold;
+
+int cgroup_get_log_threshold(void)
+{
+	return __atomic_load_n(&cgroup_log_threshold, __ATOMIC_RELAXED);
+}
+
+static void cgroup_update_log_threshold(void)
+{
+	__atomic_store_n(&cgroup_log_threshold,
+			cgroup_logger ? cgroup_loglevel : 0, __ATOMIC_RELAXED);
+}
+
 static void cgroup_default_logger(void *userdata, int level, const char *fmt,
 				  va_list ap)
 {
@@ -48,9 +65,9 @@ void cgroup_log(int level, const char *fmt, ...)
 void cgroup_set_logger(cgroup_logger_callback logger, int loglevel,
 		void *userdata)
 {
+	cgroup_logger_userdata = userdata;
 	cgroup_logger = logger;
 	cgroup_set_loglevel(loglevel);
-	cgroup_logger_userdata = userdata;
 }
 
 void cgroup_set_default_logger(int level)
@@ -93,4 +110,5 @@ void cgroup_set_loglevel(int loglevel)
 		else
 			cgroup_loglevel = CGROUP_DEFAULT_LOGLEVEL;
 	}
+	cgroup_update_log_threshold();
 }
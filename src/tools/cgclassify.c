@@ -40,9 +40,14 @@ static void usage(int status, const char *program_name)
 		return;
 	}
 	printf("Usage: %s [[-g] <controllers>:<path>] "\
-		"[--sticky | --cancel-sticky] <list of pids>\n", program_name);
+		"[--sticky | --cancel-sticky] [-f <file> | --stdin] "\
+		"<list of pids>\n", program_name);
 	printf("Move running task(s) to given cgroups\n");
 	printf("  -h, --help			Display this help\n");
+	printf("  -f, --file <file>		Read lines of "\
+		"[<controllers>:<path> ...] <pid> ... from the file\n");
+	printf("  --stdin			Read the lines from "\
+		"the standard input\n");
 	printf("  -g <controllers>:<path>	Control group to be used "\
 		"as target\n");
 	printf("  --cancel-sticky		cgred daemon change pidlist "\
@@ -51,34 +56,121 @@ static void usage(int status, const char *program_name)
 		"pidlist and children tasks\n");
 }
 
+/* tasks to be moved to the same groups */
+struct task_batch {
+	/* the group specifiers as written in the batch file */
+	char *spec;
+	struct cgroup_group_spec **cgroup_list;
+	pid_t *pids;
+	/* the batch file lines of the pids, 0 for the command line ones */
+	int *line_nos;
+	/* name of the batch file in error messages */
+	const char *file;
+	int count;
+	int size;
+};
+
+/* groups set by the lines of the batch file */
+static struct task_batch *batches;
+static int batches_count;
+
 /*
- * Change process group as specified on command line.
+ * Change process group of all the pids of the batch to its groups.
+ * Whole thread groups are moved at once. A pid, which fails to move to one
+ * of the groups, is not moved to the following ones.
  */
-static int change_group_path(pid_t pid, struct cgroup_group_spec *cgroup_list[])
+static int change_group_path(struct task_batch *tasks)
 {
-	int i;
-	int ret = 0;
+	struct cgroup_group_spec **cgroup_list = tasks->cgroup_list;
+	struct cgroup *cgroup;
+	pid_t *todo;
+	int *errors, *line_nos;
+	int i, j, n, count;
+	int ret = 0, err = 0;
+
+	errors = calloc(tasks->count, sizeof(int));
+	todo = malloc(tasks->count * sizeof(pid_t));
+	line_nos = malloc(tasks->count * sizeof(int));
+	if (!errors || !todo || !line_nos) {
+		fprintf(stderr, "Error: out of memory\n");
+		free(errors);
+		free(todo);
+		free(line_nos);
+		return -1;
+	}
+	memcpy(todo, tasks->pids, tasks->count * sizeof(pid_t));
+	memcpy(line_nos, tasks->line_nos, tasks->count * sizeof(int));
+	n = tasks->count;
 
-	for (i = 0; i < CG_HIER_MAX; i++) {
+	for (i = 0; i < CG_HIER_MAX && n; i++) {
 		if (!cgroup_list[i])
 			break;
 
-		ret = cgroup_change_cgroup_path(cgroup_list[i]->path, pid,
-                                                (const char*const*) cgroup_list[i]->controllers);
-		if (ret) {
-			fprintf(stderr, "Error changing group of pid %d: %s\n",
-				pid, cgroup_strerror(ret));
-			return -1;
+		cgroup = cgroup_new_cgroup(cgroup_list[i]->path);
+		if (!cgroup) {
+			fprintf(stderr, "Error: out of memory\n");
+			ret = -1;
+			break;
+		}
+
+		for (j = 0; j < CG_CONTROLLER_MAX; j++) {
+			const char *name = cgroup_list[i]->controllers[j];
+
+			if (!name)
+				break;
+			if (strcmp(name, "*") == 0) {
+				if (cgroup_add_all_controllers(cgroup))
+					err = -1;
+				break;
+			}
+			if (!cgroup_add_controller(cgroup, name)) {
+				err = -1;
+				break;
+			}
+		}
+		if (err) {
+			fprintf(stderr, "Error: cannot add controllers of "
+					"%s\n", cgroup_list[i]->path);
+			cgroup_free(&cgroup);
+			ret = -1;
+			break;
 		}
+
+		cgroup_attach_tasks(cgroup, todo, n, CGFLAG_ATTACH_PROCS,
+				errors);
+		cgroup_free(&cgroup);
+
+		/* the specifiers are applied to the moved pids only */
+		for (j = 0, count = 0; j < n; j++) {
+			if (!errors[j]) {
+				line_nos[count] = line_nos[j];
+				todo[count++] = todo[j];
+				continue;
+			}
+			if (line_nos[j])
+				fprintf(stderr, "%s:%d: error changing group "
+					"of pid %d: %s\n", tasks->file,
+					line_nos[j], todo[j],
+					cgroup_strerror(errors[j]));
+			else
+				fprintf(stderr, "Error changing group of pid "
+					"%d: %s\n", todo[j],
+					cgroup_strerror(errors[j]));
+			ret = -1;
+		}
+		n = count;
 	}
 
-	return 0;
+	free(errors);
+	free(todo);
+	free(line_nos);
+	return ret;
 }
 
 /*
  * Change process group as specified in cgrules.conf.
  */
-static int change_group_based_on_rule(pid_t pid)
+static int change_group_based_on_rule(pid_t pid, int flags)
 {
 	uid_t euid;
 	gid_t egid;
@@ -99,7 +191,7 @@ static int change_group_based_on_rule(pid_t pid)
 	}
 
 	/* Change the cgroup by determining the rules */
-	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid, 0);
+	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid, flags);
 	if (ret) {
 		fprintf(stderr, "Error: change of cgroup failed for"
 		" pid %d: %s\n", pid, cgroup_strerror(ret));
@@ -112,20 +204,197 @@ out:
 	return ret;
 }
 
+/*
+ * Queue a pid to the batch, line_no is its line in the batch file or 0.
+ */
+static int add_task(struct task_batch *batch, pid_t pid, int line_no)
+{
+	int *line_nos;
+	pid_t *pids;
+
+	if (batch->count == batch->size) {
+		pids = realloc(batch->pids,
+			(batch->size * 2 + 16) * sizeof(pid_t));
+		if (pids)
+			batch->pids = pids;
+		line_nos = realloc(batch->line_nos,
+			(batch->size * 2 + 16) * sizeof(int));
+		if (line_nos)
+			batch->line_nos = line_nos;
+		if (!pids || !line_nos) {
+			fprintf(stderr, "Error: out of memory\n");
+			return -1;
+		}
+		batch->size = batch->size * 2 + 16;
+	}
+	batch->line_nos[batch->count] = line_no;
+	batch->pids[batch->count++] = pid;
+	return 0;
+}
+
+/*
+ * Find the batch of the tasks moved to the groups given by the specifiers,
+ * or add a new one.
+ */
+static struct task_batch *get_task_batch(char **specs, int count)
+{
+	struct task_batch *batch = NULL;
+	char *spec = NULL;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		len += strlen(specs[i]) + 1;
+	spec = malloc(len);
+	if (!spec)
+		goto oom;
+	spec[0] = '\0';
+	for (i = 0; i < count; i++) {
+		if (i)
+			strcat(spec, " ");
+		strcat(spec, specs[i]);
+	}
+
+	for (i = 0; i < batches_count; i++) {
+		if (strcmp(batches[i].spec, spec) == 0) {
+			free(spec);
+			return &batches[i];
+		}
+	}
+
+	batch = realloc(batches, (batches_count + 1) * sizeof(*batch));
+	if (!batch)
+		goto oom;
+	batches = batch;
+	batch = &batches[batches_count];
+	memset(batch, 0, sizeof(*batch));
+	batch->cgroup_list = calloc(CG_HIER_MAX,
+			sizeof(struct cgroup_group_spec *));
+	if (!batch->cgroup_list)
+		goto oom;
+	for (i = 0; i < count; i++) {
+		if (parse_cgroup_spec(batch->cgroup_list, specs[i],
+					CG_HIER_MAX)) {
+			fprintf(stderr, "cgroup controller and path "
+					"parsing failed\n");
+			goto err;
+		}
+	}
+	batch->spec = spec;
+	batches_count++;
+	return batch;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+err:
+	if (batch && batch->cgroup_list) {
+		for (i = 0; i < CG_HIER_MAX; i++)
+			if (batch->cgroup_list[i])
+				cgroup_free_group_spec(batch->cgroup_list[i]);
+		free(batch->cgroup_list);
+	}
+	free(spec);
+	return NULL;
+}
+
+/*
+ * Read the tasks to classify from the batch file. The tasks of the lines
+ * without group specifiers are queued to default_batch, or classified
+ * by the rules when it is NULL. The other tasks are queued to the batch
+ * of their groups and moved by the caller.
+ */
+static int read_task_batch(const char *path, const char *program_name,
+		int flag, int rule_flags, struct task_batch *default_batch)
+{
+	struct cgroup_batch batch;
+	struct task_batch *tasks;
+	int exit_code = 0;
+	int specs, i, ret;
+	char *endptr;
+	pid_t pid;
+
+	if (cgroup_batch_open(&batch, path, program_name))
+		return 2;
+
+	while ((ret = cgroup_batch_next(&batch)) > 0) {
+		/* the group specifiers precede the pids */
+		for (specs = 0; specs < batch.count; specs++)
+			if (!strchr(batch.fields[specs], ':'))
+				break;
+		if (specs == batch.count) {
+			fprintf(stderr, "%s:%d: no pid specified\n",
+					batch.name, batch.line_no);
+			exit_code = 2;
+			continue;
+		}
+
+		tasks = default_batch;
+		if (specs) {
+			tasks = get_task_batch(batch.fields, specs);
+			if (!tasks) {
+				fprintf(stderr, "%s:%d: wrong group "
+					"specifier\n", batch.name,
+					batch.line_no);
+				exit_code = 2;
+				continue;
+			}
+		}
+
+		for (i = specs; i < batch.count; i++) {
+			pid = (pid_t) strtol(batch.fields[i], &endptr, 10);
+			if (endptr[0] != '\0') {
+				fprintf(stderr, "%s:%d: %s is not valid "
+					"pid.\n", batch.name, batch.line_no,
+					batch.fields[i]);
+				exit_code = 2;
+				continue;
+			}
+
+			if (flag && cgroup_register_unchanged_process(pid,
+						flag))
+				exit_code = 1;
+
+			if (tasks) {
+				tasks->file = batch.name;
+				if (add_task(tasks, pid, batch.line_no))
+					exit_code = 1;
+				continue;
+			}
+
+			if (change_group_based_on_rule(pid, rule_flags)) {
+				fprintf(stderr, "%s:%d: cannot classify pid "
+					"%d\n", batch.name, batch.line_no,
+					pid);
+				exit_code = 1;
+			}
+		}
+	}
+	if (ret < 0)
+		exit_code = 2;
+
+	cgroup_batch_close(&batch);
+	return exit_code;
+}
+
 static struct option longopts[] = {
 	{"sticky", no_argument, NULL, 's'},
 	{"cancel-sticky", no_argument, NULL, 'u'},
+	{"file", required_argument, NULL, 'f'},
+	{"stdin", no_argument, NULL, 'i'},
 	{"help", no_argument, NULL, 'h'},
 	{0, 0, 0, 0}
 };
 
 int main(int argc, char *argv[])
 {
-	int ret = 0, i, exit_code = 0;
+	int ret = 0, i, j, exit_code = 0;
 	pid_t pid;
+	struct task_batch cmdline_tasks;
 	int cg_specified = 0;
 	int flag = 0;
+	int rule_flags = 0;
 	struct cgroup_group_spec *cgroup_list[CG_HIER_MAX];
+	const char *batch_path = NULL;
 	int c;
 	char *endptr;
 
@@ -136,7 +405,8 @@ int main(int argc, char *argv[])
 	}
 
 	memset(cgroup_list, 0, sizeof(cgroup_list));
-	while ((c = getopt_long(argc, argv, "+g:sh", longopts, NULL)) > 0) {
+	memset(&cmdline_tasks, 0, sizeof(cmdline_tasks));
+	while ((c = getopt_long(argc, argv, "+g:shf:", longopts, NULL)) > 0) {
 		switch (c) {
 		case 'h':
 			usage(0, argv[0]);
@@ -158,6 +428,12 @@ int main(int argc, char *argv[])
 		case 'u':
 			flag |= CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS;
 			break;
+		case 'f':
+			batch_path = optarg;
+			break;
+		case 'i':
+			batch_path = "-";
+			break;
 		default:
 			usage(1, argv[0]);
 			exit(2);
@@ -174,6 +450,14 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
+	/* parse the rules only once when classifying more tasks by them */
+	if (!cg_specified && (batch_path || argc - optind > 1) &&
+			cgroup_init_rules_cache() == 0)
+		rule_flags = CGFLAG_USECACHE;
+
+	cmdline_tasks.cgroup_list = cgroup_list;
+	ret = 0;
+
 	for (i = optind; i < argc; i++) {
 		pid = (pid_t) strtol(argv[i], &endptr, 10);
 		if (endptr[0] != '\0') {
@@ -189,15 +473,47 @@ int main(int argc, char *argv[])
 		if (ret)
 			exit_code = 1;
 
-		if (cg_specified)
-			ret = change_group_path(pid, cgroup_list);
-		else
-			ret = change_group_based_on_rule(pid);
+		if (cg_specified) {
+			/* all the pids are moved at once below */
+			if (add_task(&cmdline_tasks, pid, 0))
+				exit_code = 1;
+			continue;
+		}
+
+		ret = change_group_based_on_rule(pid, rule_flags);
 
 		/* if any group change fails */
 		if (ret)
 			exit_code = 1;
 	}
+
+	if (batch_path) {
+		ret = read_task_batch(batch_path, argv[0], flag, rule_flags,
+				cg_specified ? &cmdline_tasks : NULL);
+		if (ret > exit_code)
+			exit_code = ret;
+	}
+
+	if (cmdline_tasks.count && change_group_path(&cmdline_tasks))
+		exit_code = 1;
+	free(cmdline_tasks.pids);
+	free(cmdline_tasks.line_nos);
+
+	/* move the tasks of each group of the batch file at once */
+	for (i = 0; i < batches_count; i++) {
+		if (batches[i].count && change_group_path(&batches[i]))
+			exit_code = 1;
+		for (j = 0; j < CG_HIER_MAX; j++)
+			if (batches[i].cgroup_list[j])
+				cgroup_free_group_spec(
+						batches[i].cgroup_list[j]);
+		free(batches[i].cgroup_list);
+		free(batches[i].pids);
+		free(batches[i].line_nos);
+		free(batches[i].spec);
+	}
+	free(batches);
+
 	return exit_code;
 
 }
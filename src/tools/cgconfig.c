@@ -43,20 +43,28 @@ static void usage(int status, char *progname)
 		return;
 	}
 	printf("Usage: %s [-h] [-f mode] [-d mode] [-s mode] "\
-		"[-t <tuid>:<tgid>] [-a <agid>:<auid>] [-l FILE] "\
-		"[-L DIR] ...\n", progname);
+		"[-t <tuid>:<tgid>] [-a <agid>:<auid>] [-c DIR] [-j N] "\
+		"[-r [-p FILE]] [-l FILE] [-L DIR] ...\n", progname);
 	printf("Parse and load the specified cgroups configuration file\n");
 	printf("  -a <tuid>:<tgid>		Default owner of groups files "\
 		"and directories\n");
+	printf("  -c, --cache=DIR		Keep compiled configuration "\
+		"files in DIR\n");
 	printf("  -d, --dperm=mode		Default group directory "\
 		"permissions\n");
 	printf("  -f, --fperm=mode		Default group file "\
 		"permissions\n");
 	printf("  -h, --help			Display this help\n");
+	printf("  -j, --jobs=N			Create groups using N "\
+		"threads\n");
 	printf("  -l, --load=FILE		Parse and load the cgroups "\
 		"configuration file\n");
 	printf("  -L, --load-directory=DIR	Parse and load the cgroups "\
 		"configuration files from a directory\n");
+	printf("  -p, --previous=FILE		Remove groups defined in "\
+		"FILE but not in the new configuration (with -r)\n");
+	printf("  -r, --reload			Apply only changes of the "\
+		"configuration to the existing groups\n");
 	printf("  -s, --tperm=mode		Default tasks file "\
 		"permissions\n");
 	printf("  -t <tuid>:<tgid>		Default owner of the tasks "\
@@ -76,6 +84,10 @@ int main(int argc, char *argv[])
 		{"dperm", required_argument, NULL, 'd'},
 		{"fperm", required_argument, NULL, 'f' },
 		{"tperm", required_argument, NULL, 's' },
+		{"jobs", required_argument, NULL, 'j' },
+		{"cache", required_argument, NULL, 'c' },
+		{"reload", no_argument, NULL, 'r' },
+		{"previous", required_argument, NULL, 'p' },
 		{0, 0, 0, 0}
 	};
 	uid_t tuid = NO_UID_GID, auid = NO_UID_GID;
@@ -85,6 +97,10 @@ int main(int argc, char *argv[])
 	mode_t tasks_mode = NO_PERMS;
 	int dirm_change = 0;
 	int filem_change = 0;
+	long jobs;
+	char *endptr;
+	int reload = 0;
+	char *previous = NULL;
 	struct cgroup *default_group = NULL;
 
 	cgroup_set_default_logger(-1);
@@ -98,7 +114,7 @@ int main(int argc, char *argv[])
 	if (error)
 		goto err;
 
-	while ((c = getopt_long(argc, argv, "hl:L:t:a:d:f:s:", options,
+	while ((c = getopt_long(argc, argv, "hl:L:t:a:d:f:s:j:c:rp:", options,
 			NULL)) > 0) {
 		switch (c) {
 		case 'h':
@@ -147,6 +163,31 @@ int main(int argc, char *argv[])
 			if (error)
 				goto err;
 			break;
+		case 'j':
+			jobs = strtol(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || jobs < 1) {
+				fprintf(stderr, "%s: invalid number of jobs "\
+						"'%s'\n", argv[0], optarg);
+				error = -1;
+				goto err;
+			}
+			cgroup_config_set_jobs(jobs);
+			break;
+		case 'c':
+			error = cgroup_config_set_cache_dir(optarg);
+			if (error) {
+				fprintf(stderr, "%s: cannot set the cache "\
+						"directory: %s\n", argv[0],
+						cgroup_strerror(error));
+				goto err;
+			}
+			break;
+		case 'r':
+			reload = 1;
+			break;
+		case 'p':
+			previous = optarg;
+			break;
 		default:
 			usage(1, argv[0]);
 			error = -1;
@@ -160,6 +201,14 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
+	/* groups of the previous file can be matched only to one new file */
+	if (previous && (!reload || cfg_files.count != 1)) {
+		fprintf(stderr, "%s: --previous requires --reload and exactly "\
+				"one configuration file\n", argv[0]);
+		error = -1;
+		goto err;
+	}
+
 	/* set default permissions */
 	default_group = cgroup_new_cgroup("default");
 	if (!default_group) {
@@ -188,7 +237,11 @@ int main(int argc, char *argv[])
 	}
 
 	for (i = 0; i < cfg_files.count; i++) {
-		ret = cgroup_config_load_config(cfg_files.items[i]);
+		if (reload)
+			ret = cgroup_config_reload_config(cfg_files.items[i],
+					previous);
+		else
+			ret = cgroup_config_load_config(cfg_files.items[i]);
 		if (ret) {
 			fprintf(stderr, "%s; error loading %s: %s\n", argv[0],
 					cfg_files.items[i],
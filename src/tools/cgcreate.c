@@ -28,6 +28,16 @@
 
 #include "tools-common.h"
 
+/* owners and permissions of the created groups */
+struct group_attrs {
+	uid_t tuid, auid;
+	gid_t tgid, agid;
+	mode_t dir_mode;
+	mode_t file_mode;
+	mode_t tasks_mode;
+	int perm_change;
+};
+
 /*
  * Display the usage
  */
@@ -41,23 +51,141 @@ static void usage(int status, const char *program_name)
 	}
 	printf("Usage: %s [-h] [-f mode] [-d mode] [-s mode] "\
 		"[-t <tuid>:<tgid>] [-a <agid>:<auid>] "\
-		"-g <controllers>:<path> [-g ...]\n", program_name);
+		"-g <controllers>:<path> [-g ...] "\
+		"[--file <file> | --stdin]\n", program_name);
 	printf("Create control group(s)\n");
 	printf("  -a <tuid>:<tgid>		Owner of the group and all "\
 		"its files\n");
 	printf("  -d, --dperm=mode		Group directory permissions\n");
 	printf("  -f, --fperm=mode		Group file permissions\n");
+	printf("  --file <file>			Read lines of "\
+		"<controllers>:<path> ... from the file\n");
 	printf("  -g <controllers>:<path>	Control group which should be "\
 		"added\n");
 	printf("  -h, --help			Display this help\n");
 	printf("  -s, --tperm=mode		Tasks file permissions\n");
+	printf("  --stdin			Read the lines from "\
+		"the standard input\n");
 	printf("  -t <tuid>:<tgid>		Owner of the tasks file\n");
 }
 
+/*
+ * Create the group given by the specifier.
+ */
+static int create_group(struct cgroup_group_spec *spec,
+		struct group_attrs *attrs, const char *program_name)
+{
+	struct cgroup *cgroup;
+	struct cgroup_controller *cgc;
+	int ret = 0;
+	int j;
+
+	/* create the new cgroup structure */
+	cgroup = cgroup_new_cgroup(spec->path);
+	if (!cgroup) {
+		ret = ECGFAIL;
+		fprintf(stderr, "%s: can't add new cgroup: %s\n",
+			program_name, cgroup_strerror(ret));
+		return ret;
+	}
+
+	/* set uid and gid for the new cgroup based on input options */
+	ret = cgroup_set_uid_gid(cgroup, attrs->tuid, attrs->tgid,
+			attrs->auid, attrs->agid);
+	if (ret)
+		goto err;
+
+	/* add controllers to the new cgroup */
+	j = 0;
+	while (spec->controllers[j]) {
+		if (strcmp(spec->controllers[j], "*") == 0) {
+			/* it is meta character, add all controllers */
+			ret = cgroup_add_all_controllers(cgroup);
+			if (ret != 0) {
+				ret = ECGINVAL;
+				fprintf(stderr, "%s: can't add ",
+					program_name);
+				fprintf(stderr, "all controllers\n");
+				goto err;
+			}
+		} else {
+			cgc = cgroup_add_controller(cgroup,
+				spec->controllers[j]);
+			if (!cgc) {
+				ret = ECGINVAL;
+				fprintf(stderr, "%s: ", program_name);
+				fprintf(stderr, "controller %s",
+					spec->controllers[j]);
+				fprintf(stderr, "can't be add\n");
+				goto err;
+			}
+		}
+		j++;
+	}
+
+	/* all variables set so create cgroup */
+	if (attrs->perm_change)
+		cgroup_set_permissions(cgroup, attrs->dir_mode,
+				attrs->file_mode, attrs->tasks_mode);
+	ret = cgroup_create_cgroup(cgroup, 0);
+	if (ret) {
+		fprintf(stderr, "%s: "
+			"can't create cgroup %s: %s\n",
+			program_name, cgroup->name, cgroup_strerror(ret));
+		goto err;
+	}
+err:
+	cgroup_free(&cgroup);
+	return ret;
+}
+
+/*
+ * Create the groups given by the lines of the batch file, each line
+ * contains one or more group specifiers.
+ */
+static int create_batch_groups(const char *path, struct group_attrs *attrs,
+		const char *program_name)
+{
+	struct cgroup_batch batch;
+	struct cgroup_group_spec *spec[1];
+	int result = 0;
+	int ret, i;
+
+	if (cgroup_batch_open(&batch, path, program_name))
+		return -1;
+
+	while ((ret = cgroup_batch_next(&batch)) > 0) {
+		for (i = 0; i < batch.count; i++) {
+			spec[0] = NULL;
+			if (parse_cgroup_spec(spec, batch.fields[i], 1)) {
+				fprintf(stderr, "%s:%d: "
+					"cgroup controller and path "
+					"parsing failed\n",
+					batch.name, batch.line_no);
+				result = -1;
+				continue;
+			}
+			ret = create_group(spec[0], attrs, program_name);
+			if (ret) {
+				fprintf(stderr, "%s:%d: cannot create %s\n",
+					batch.name, batch.line_no,
+					spec[0]->path);
+				result = ret;
+			}
+			cgroup_free_group_spec(spec[0]);
+		}
+	}
+	if (ret < 0)
+		result = -1;
+
+	cgroup_batch_close(&batch);
+	return result;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = 0;
-	int i, j;
+	int i;
 	int c;
 
 	static struct option long_opts[] = {
@@ -68,6 +196,8 @@ int main(int argc, char *argv[])
 		{"dperm", required_argument, NULL, 'd'},
 		{"fperm", required_argument, NULL, 'f' },
 		{"tperm", required_argument, NULL, 's' },
+		{"file", required_argument, NULL, 'F' },
+		{"stdin", no_argument, NULL, 'I' },
 		{0, 0, 0, 0},
 	};
 
@@ -75,8 +205,8 @@ int main(int argc, char *argv[])
 	gid_t tgid = CGRULE_INVALID, agid = CGRULE_INVALID;
 
 	struct cgroup_group_spec **cgroup_list;
-	struct cgroup *cgroup;
-	struct cgroup_controller *cgc;
+	struct group_attrs attrs;
+	const char *batch_path = NULL;
 
 	/* approximation of max. numbers of groups that will be created */
 	int capacity = argc;
@@ -147,6 +277,12 @@ int main(int argc, char *argv[])
 			if (ret)
 				goto err;
 			break;
+		case 'F':
+			batch_path = optarg;
+			break;
+		case 'I':
+			batch_path = "-";
+			break;
 		default:
 			usage(1, argv[0]);
 			ret = -1;
@@ -172,69 +308,28 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
+	attrs.tuid = tuid;
+	attrs.tgid = tgid;
+	attrs.auid = auid;
+	attrs.agid = agid;
+	attrs.dir_mode = dir_mode;
+	attrs.file_mode = file_mode;
+	attrs.tasks_mode = tasks_mode;
+	attrs.perm_change = dirm_change | filem_change;
+
 	/* for each new cgroup */
 	for (i = 0; i < capacity; i++) {
 		if (!cgroup_list[i])
 			break;
 
-		/* create the new cgroup structure */
-		cgroup = cgroup_new_cgroup(cgroup_list[i]->path);
-		if (!cgroup) {
-			ret = ECGFAIL;
-			fprintf(stderr, "%s: can't add new cgroup: %s\n",
-				argv[0], cgroup_strerror(ret));
-			goto err;
-		}
-
-		/* set uid and gid for the new cgroup based on input options */
-		ret = cgroup_set_uid_gid(cgroup, tuid, tgid, auid, agid);
+		ret = create_group(cgroup_list[i], &attrs, argv[0]);
 		if (ret)
 			goto err;
-
-		/* add controllers to the new cgroup */
-		j = 0;
-		while (cgroup_list[i]->controllers[j]) {
-			if (strcmp(cgroup_list[i]->controllers[j], "*") == 0) {
-				/* it is meta character, add all controllers */
-				ret = cgroup_add_all_controllers(cgroup);
-				if (ret != 0) {
-					ret = ECGINVAL;
-					fprintf(stderr, "%s: can't add ",
-						argv[0]);
-					fprintf(stderr, "all controllers\n");
-					cgroup_free(&cgroup);
-					goto err;
-				}
-			} else {
-				cgc = cgroup_add_controller(cgroup,
-					cgroup_list[i]->controllers[j]);
-				if (!cgc) {
-					ret = ECGINVAL;
-					fprintf(stderr, "%s: ", argv[0]);
-					fprintf(stderr, "controller %s",
-						cgroup_list[i]->controllers[j]);
-					fprintf(stderr, "can't be add\n");
-					cgroup_free(&cgroup);
-					goto err;
-				}
-			}
-			j++;
-		}
-
-		/* all variables set so create cgroup */
-		if (dirm_change | filem_change)
-			cgroup_set_permissions(cgroup, dir_mode, file_mode,
-					tasks_mode);
-		ret = cgroup_create_cgroup(cgroup, 0);
-		if (ret) {
-			fprintf(stderr, "%s: "
-				"can't create cgroup %s: %s\n",
-				argv[0], cgroup->name, cgroup_strerror(ret));
-			cgroup_free(&cgroup);
-			goto err;
-		}
-		cgroup_free(&cgroup);
 	}
+
+	/* create the groups of the batch file after an initialization only */
+	if (batch_path)
+		ret = create_batch_groups(batch_path, &attrs, argv[0]);
 err:
 	if (cgroup_list) {
 		for (i = 0; i < capacity; i++) {
@@ -25,9 +25,14 @@
 
 #include "tools-common.h"
 
+enum {
+	NO_MIGRATION_OPTION = CHAR_MAX + 1,
+};
+
 static struct option const long_options[] =
 {
 	{"recursive", no_argument, NULL, 'r'},
+	{"no-migration", no_argument, NULL, NO_MIGRATION_OPTION},
 	{"help", no_argument, NULL, 'h'},
 	{"group", required_argument, NULL, 'g'},
 	{NULL, 0, NULL, 0}
@@ -48,12 +53,15 @@ static void usage(int status, const char *program_name)
 			program_name);
 		return;
 	}
-	printf("Usage: %s [-h] [-r] [[-g] <controllers>:<path>] ...\n",
+	printf("Usage: %s [-h] [-r] [--no-migration] "\
+		"[[-g] <controllers>:<path>] ...\n",
 		program_name);
 	printf("Remove control group(s)\n");
 	printf("  -g <controllers>:<path>	Control group to be removed "\
 		"(-g is optional)\n");
 	printf("  -h, --help			Display this help\n");
+	printf("  --no-migration			Do not move tasks, "\
+		"the groups are empty\n");
 	printf("  -r, --recursive		Recursively remove "\
 		"all subgroups\n");
 }
@@ -169,7 +177,12 @@ int main(int argc, char *argv[])
 		long_options, NULL)) > 0) {
 		switch (c) {
 		case 'r':
-			flags |= CGFLAG_DELETE_RECURSIVE;
+			/* independent subtrees are removed in parallel */
+			flags |= CGFLAG_DELETE_RECURSIVE |
+				CGFLAG_DELETE_PARALLEL;
+			break;
+		case NO_MIGRATION_OPTION:
+			flags |= CGFLAG_DELETE_NO_MIGRATION;
 			break;
 		case 'g':
 			ret = parse_cgroup_spec(cgroup_list, optarg, argc);
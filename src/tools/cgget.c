@@ -13,7 +13,39 @@
 #define MODE_SHOW_NAMES			2
 #define MODE_SHOW_ALL_CONTROLLERS	4
 
-#define LL_MAX				100
+#define LL_MAX				4096
+
+/* size of the output buffer of stdout */
+#define OUTPUT_BUFFER_SIZE		(1024 * 1024)
+
+/* output formats */
+enum format {
+	FORMAT_PLAIN = 0,	/* human readable, the default */
+	FORMAT_TAB,		/* group, name and value separated by tabs */
+	FORMAT_JSON,		/* a JSON array with an object per group */
+};
+
+static enum format format = FORMAT_PLAIN;
+
+/* number of records printed in the current JSON group */
+static int json_records;
+
+/* names of the records printed in the current JSON group */
+static char **json_names;
+static int json_names_count;
+static int json_names_size;
+
+/* number of groups printed in JSON */
+static int json_groups;
+
+/* value of the variable being printed, reused for all of them */
+struct value_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static struct value_buffer value;
 
 static struct option const long_options[] =
 {
@@ -21,6 +53,7 @@ static struct option const long_options[] =
 	{"help", no_argument, NULL, 'h'},
 	{"all",  no_argument, NULL, 'a'},
 	{"values-only", no_argument, NULL, 'v'},
+	{"format", required_argument, NULL, 'o'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -39,9 +72,10 @@ static void usage(int status, const char *program_name)
 			program_name);
 		return;
 	}
-	printf("Usage: %s [-nv] [-r <name>] [-g <controllers>] "\
-		"[-a] <path> ...\n"\
-		"   or: %s [-nv] [-r <name>] -g <controllers>:<path> ...\n",
+	printf("Usage: %s [-nv] [-o <format>] [-r <name>] "\
+		"[-g <controllers>] [-a] <path> ...\n"\
+		"   or: %s [-nv] [-o <format>] [-r <name>] "\
+		"-g <controllers>:<path> ...\n",
 		program_name, program_name);
 	printf("Print parameter(s) of given group(s).\n");
 	printf("  -a, --all			Print info about all relevant "\
@@ -52,63 +86,288 @@ static void usage(int status, const char *program_name)
 		"should be displayed\n");
 	printf("  -h, --help			Display this help\n");
 	printf("  -n				Do not print headers\n");
+	printf("  -o, --format <format>		Output format: plain "\
+		"(default), tab or json\n");
 	printf("  -r, --variable  <name>	Define parameter to display\n");
 	printf("  -v, --values-only		Print only values, not "\
 		"parameter names\n");
+	printf("A <path> of - reads the paths from the standard input, "\
+		"one per line.\n");
 }
 
-static int display_record(char *name,
-	struct cgroup_controller *group_controller,
-	const char *group_name, const char *program_name, int mode)
+/* append a piece of the value to the value buffer */
+static int value_append(const char *data, size_t len)
+{
+	size_t size;
+	char *new;
+
+	if (value.len + len + 1 > value.size) {
+		size = value.size ? value.size : LL_MAX;
+		while (value.len + len + 1 > size)
+			size *= 2;
+		new = realloc(value.data, size);
+		if (new == NULL)
+			return ECGOTHER;
+		value.data = new;
+		value.size = size;
+	}
+	memcpy(value.data + value.len, data, len);
+	value.len += len;
+	value.data[value.len] = '\0';
+	return 0;
+}
+
+/* read the whole value of the variable to the value buffer */
+static int read_value(const char *controller, const char *group_name,
+	const char *name)
 {
 	int ret = 0;
 	void *handle;
 	char line[LL_MAX];
-	int ind = 0;
 
-	if (mode & MODE_SHOW_NAMES)
-		printf("%s: ", name);
+	value.len = 0;
+	ret = value_append("", 0);
+	if (ret)
+		return ret;
 
 	/* start the reading of the variable value */
-	ret = cgroup_read_value_begin(group_controller->name,
-		group_name, name, &handle, line, LL_MAX);
-
-	if (ret == ECGEOF) {
-		printf("\n");
+	ret = cgroup_read_value_begin(controller, (char *)group_name,
+		(char *)name, &handle, line, LL_MAX);
+	if (ret == ECGEOF)
 		goto read_end;
+	if (ret != 0)
+		return ret;
+
+	/* read iteratively the whole value */
+	do {
+		ret = value_append(line, strlen(line));
+		if (ret)
+			break;
+	} while ((ret = cgroup_read_value_next(&handle, line, LL_MAX)) == 0);
+
+read_end:
+	cgroup_read_value_end(&handle);
+	if (ret == ECGEOF)
+		ret = 0;
+	return ret;
+}
+
+/*
+ * Length of the valid UTF-8 sequence of more than one byte at str, 0 if
+ * there is none.
+ */
+static size_t utf8_sequence_len(const unsigned char *str, size_t len)
+{
+	unsigned char min = 0x80, max = 0xbf;
+	size_t n, i;
+
+	if (str[0] >= 0xc2 && str[0] <= 0xdf)
+		n = 2;
+	else if (str[0] >= 0xe0 && str[0] <= 0xef)
+		n = 3;
+	else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+		n = 4;
+	else
+		return 0;
+
+	/* no overlong forms, surrogates or code points above U+10FFFF */
+	if (str[0] == 0xe0)
+		min = 0xa0;
+	else if (str[0] == 0xed)
+		max = 0x9f;
+	else if (str[0] == 0xf0)
+		min = 0x90;
+	else if (str[0] == 0xf4)
+		max = 0x8f;
+
+	if (n > len || str[1] < min || str[1] > max)
+		return 0;
+	for (i = 2; i < n; i++)
+		if (str[i] < 0x80 || str[i] > 0xbf)
+			return 0;
+	return n;
+}
+
+/*
+ * Print a string escaped for the tab or JSON format. JSON strings must be
+ * valid UTF-8, the bytes which are not are replaced by U+FFFD.
+ */
+static void print_escaped(const char *str, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0; i < len; i++) {
+		switch (str[i]) {
+		case '\\':
+			fputs("\\\\", stdout);
+			break;
+		case '\n':
+			fputs("\\n", stdout);
+			break;
+		case '\t':
+			fputs("\\t", stdout);
+			break;
+		case '"':
+			if (format == FORMAT_JSON) {
+				fputs("\\\"", stdout);
+				break;
+			}
+			/* fall through */
+		default:
+			if (format != FORMAT_JSON ||
+					(unsigned char)str[i] < 0x80) {
+				if (format == FORMAT_JSON &&
+						(unsigned char)str[i] < 0x20)
+					printf("\\u%04x",
+						(unsigned char)str[i]);
+				else
+					putchar(str[i]);
+				break;
+			}
+			n = utf8_sequence_len((const unsigned char *)str + i,
+					len - i);
+			if (n) {
+				fwrite(str + i, 1, n, stdout);
+				i += n - 1;
+			} else {
+				fputs("\\ufffd", stdout);
+			}
+		}
 	}
+}
 
-	if (ret != 0)
-		goto end;
+/* print the beginning of the record of a group */
+static void display_group_begin(const char *group_name, int mode)
+{
+	switch (format) {
+	case FORMAT_PLAIN:
+		/* display the directory if needed */
+		if (mode & MODE_SHOW_HEADERS)
+			printf("%s:\n", group_name);
+		break;
+	case FORMAT_TAB:
+		break;
+	case FORMAT_JSON:
+		fputs(json_groups++ ? ",\n\t{\n\t\t\"group\": \"" :
+				"\t{\n\t\t\"group\": \"", stdout);
+		print_escaped(group_name, strlen(group_name));
+		fputs("\",\n\t\t\"values\": {", stdout);
+		json_records = 0;
+		break;
+	}
+}
 
-	printf("%s", line);
-	if (line[strlen(line)-1] == '\n')
-		/* if value continue on the next row. indent it */
-		ind = 1;
+/* print the end of the record of a group */
+static void display_group_end(int mode)
+{
+	switch (format) {
+	case FORMAT_PLAIN:
+		/* separate each group with empty line. */
+		if (mode & MODE_SHOW_HEADERS)
+			printf("\n");
+		break;
+	case FORMAT_TAB:
+		break;
+	case FORMAT_JSON:
+		fputs(json_records ? "\n\t\t}\n\t}" : "}\n\t}", stdout);
+		while (json_names_count)
+			free(json_names[--json_names_count]);
+		break;
+	}
+}
 
+/*
+ * Tell whether a record of the current JSON group was printed already,
+ * the keys of an object must be unique.
+ */
+static int json_record_seen(const char *name)
+{
+	int i;
 
-	/* read iteratively the whole value  */
-	while ((ret = cgroup_read_value_next(&handle, line, LL_MAX)) == 0) {
-		if (ind == 1)
-			printf("\t");
-		printf("%s", line);
-		ind = 0;
+	for (i = 0; i < json_names_count; i++)
+		if (json_names[i] && !strcmp(json_names[i], name))
+			return 1;
+	return 0;
+}
 
-		/* if value continue on the next row. indent it */
-		if (line[strlen(line)-1] == '\n')
-			ind = 1;
+/* remember the name of a record printed in the current JSON group */
+static void json_record_add(const char *name)
+{
+	char **names;
+
+	if (json_names_count == json_names_size) {
+		names = realloc(json_names,
+			(json_names_size * 2 + 16) * sizeof(char *));
+		if (!names)
+			return;
+		json_names = names;
+		json_names_size = json_names_size * 2 + 16;
 	}
+	json_names[json_names_count++] = strdup(name);
+}
 
-read_end:
-	cgroup_read_value_end(&handle);
-	if (ret == ECGEOF)
-		ret = 0;
+static int display_record(char *name,
+	struct cgroup_controller *group_controller,
+	const char *group_name, const char *program_name, int mode)
+{
+	int ret = 0;
+	size_t len;
+	char *line, *end;
 
-end:
-	if (ret != 0)
+	/* a parameter can be wanted both by its name and its controller */
+	if (format == FORMAT_JSON && json_record_seen(name))
+		return 0;
+
+	ret = read_value(group_controller->name, group_name, name);
+	if (ret != 0) {
 		fprintf(stderr, "variable file read failed %s\n",
 			cgroup_strerror(ret));
-	return ret;
+		return ret;
+	}
+
+	/* the machine readable formats do not keep the last new line */
+	len = value.len;
+	if (format != FORMAT_PLAIN && len && value.data[len - 1] == '\n')
+		len--;
+
+	switch (format) {
+	case FORMAT_PLAIN:
+		if (mode & MODE_SHOW_NAMES)
+			printf("%s: ", name);
+		if (!value.len) {
+			putchar('\n');
+			break;
+		}
+		/* if value continue on the next row, indent it */
+		for (line = value.data; *line; line = end) {
+			end = strchr(line, '\n');
+			end = end ? end + 1 : line + strlen(line);
+			if (line != value.data)
+				putchar('\t');
+			fwrite(line, 1, end - line, stdout);
+		}
+		break;
+	case FORMAT_TAB:
+		print_escaped(group_name, strlen(group_name));
+		putchar('\t');
+		if (mode & MODE_SHOW_NAMES) {
+			print_escaped(name, strlen(name));
+			putchar('\t');
+		}
+		print_escaped(value.data, len);
+		putchar('\n');
+		break;
+	case FORMAT_JSON:
+		fputs(json_records++ ? ",\n\t\t\t\"" : "\n\t\t\t\"",
+				stdout);
+		print_escaped(name, strlen(name));
+		fputs("\": \"", stdout);
+		print_escaped(value.data, len);
+		putchar('"');
+		json_record_add(name);
+		break;
+	}
+	return 0;
 }
 
 
@@ -128,7 +387,8 @@ static int display_name_values(char **names, const char* group_name,
 				group_name);
 		return -1;
 	}
-	ret = cgroup_get_cgroup(group);
+	/* read only the wanted parameters */
+	ret = cgroup_get_cgroup_filtered(group, (const char * const *)names);
 	if (ret != 0) {
 		fprintf(stderr, "%s: cannot read group '%s': %s\n",
 				program_name, group_name, cgroup_strerror(ret));
@@ -198,7 +458,9 @@ static int display_controller_values(char **controllers, const char *group_name,
 		return -1;
 	}
 
-	ret = cgroup_get_cgroup(group);
+	/* read only the hierarchies of the wanted controllers */
+	ret = cgroup_get_cgroup_filtered(group,
+		(const char * const *)controllers);
 	if (ret != 0) {
 		if (!(mode & MODE_SHOW_ALL_CONTROLLERS))
 			fprintf(stderr, "%s: cannot read group '%s': %s\n",
@@ -246,9 +508,7 @@ static int display_values(char **controllers, int max, const char *group_name,
 {
 	int ret, result = 0;
 
-	/* display the directory if needed */
-	if (mode & MODE_SHOW_HEADERS)
-		printf("%s:\n", group_name);
+	display_group_begin(group_name, mode);
 
 	/* display all wanted variables */
 	if (names[0] != NULL) {
@@ -266,30 +526,47 @@ static int display_values(char **controllers, int max, const char *group_name,
 			result = ret;
 	}
 
-	/* separate each group with empty line. */
-	if (mode & MODE_SHOW_HEADERS)
-		printf("\n");
+	display_group_end(mode);
 
 	return result;
 }
 
-int add_record_to_buffer(char **buffer, char *record, int capacity)
+/* display the groups whose paths are read from the standard input */
+static int display_stdin_values(char **controllers, int max, char **names,
+	int mode, const char *program_name)
 {
-	int i;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret = 0;
 
-	/* find first free entry inside the cgroup data array */
-	for (i = 0; i < capacity; i++) {
-		if (!buffer[i])
-			break;
+	while ((len = getline(&line, &size, stdin)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue;
+		ret |= display_values(controllers, max, line, names, mode,
+			program_name);
 	}
+	free(line);
+	return ret;
+}
 
-	if (i < capacity) {
-		buffer[i] = strdup(record);
-		if (buffer[i] == NULL)
-			return 1;
-		return 0;
-	}
-	return 1;
+/*
+ * Add a record to the end of the buffer, count is the number of records
+ * already there.
+ */
+int add_record_to_buffer(char **buffer, int *count, char *record,
+	int capacity)
+{
+	if (*count >= capacity)
+		return 1;
+
+	buffer[*count] = strdup(record);
+	if (buffer[*count] == NULL)
+		return 1;
+	(*count)++;
+	return 0;
 }
 
 
@@ -304,6 +581,8 @@ int main(int argc, char *argv[])
 	struct cgroup_group_spec **cgroup_list; /* list of all groups */
 	char **names;			/* list of wanted variable names */
 	char **controllers;		/* list of wanted controllers*/
+	int names_count = 0;
+	int controllers_count = 0;
 
 	void *handle;
 	struct cgroup_mount_point controller;
@@ -328,7 +607,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* Parse arguments. */
-	while ((c = getopt_long(argc, argv, "r:hnvg:a", long_options, NULL))
+	while ((c = getopt_long(argc, argv, "r:hnvg:ao:", long_options, NULL))
 		> 0) {
 		switch (c) {
 		case 'h':
@@ -349,7 +628,8 @@ int main(int argc, char *argv[])
 
 		case 'r':
 			/* Add name to buffer. */
-			ret = add_record_to_buffer(names, optarg, capacity);
+			ret = add_record_to_buffer(names, &names_count, optarg,
+				capacity);
 			if (ret) {
 				result = ret;
 				goto err;
@@ -364,8 +644,8 @@ int main(int argc, char *argv[])
 					goto err;
 				}
 				group_needed = GR_GROUP;
-				add_record_to_buffer(controllers, optarg,
-					capacity);
+				add_record_to_buffer(controllers,
+					&controllers_count, optarg, capacity);
 			} else {
 				/* -g <group>:<path> */
 				if (group_needed == GR_GROUP) {
@@ -395,6 +675,20 @@ int main(int argc, char *argv[])
 			/* go through cgroups for all possible controllers */
 			mode |=  MODE_SHOW_ALL_CONTROLLERS;
 			break;
+		case 'o':
+			if (strcmp(optarg, "plain") == 0) {
+				format = FORMAT_PLAIN;
+			} else if (strcmp(optarg, "tab") == 0) {
+				format = FORMAT_TAB;
+			} else if (strcmp(optarg, "json") == 0) {
+				format = FORMAT_JSON;
+			} else {
+				fprintf(stderr, "%s: unknown format '%s'\n",
+					argv[0], optarg);
+				result = -1;
+				goto err;
+			}
+			break;
 		default:
 			usage(1, argv[0]);
 			result = -1;
@@ -426,13 +720,18 @@ int main(int argc, char *argv[])
 		ret = cgroup_get_controller_begin(&handle, &controller);
 		/* go through list of controllers, add them to the list */
 		while (ret == 0) {
-			add_record_to_buffer(controllers, controller.name,
-				capacity);
+			add_record_to_buffer(controllers, &controllers_count,
+				controller.name, capacity);
 			ret = cgroup_get_controller_next(&handle, &controller);
 		}
 		cgroup_get_controller_end(&handle);
 	}
 
+	/* print all the output at once, in large blocks */
+	setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	if (format == FORMAT_JSON)
+		fputs("[\n", stdout);
+
 	/* Parse control groups set by -g<c>:<p> pairs */
 	for (i = 0; i < capacity; i++) {
 		if (!cgroup_list[i])
@@ -443,10 +742,19 @@ int main(int argc, char *argv[])
 
 	/* Parse control groups and print them .*/
 	for (i = optind; i < argc; i++) {
-		ret |= display_values(controllers, capacity,
-			argv[i], names, mode, argv[0]);
+		if (strcmp(argv[i], "-") == 0)
+			ret |= display_stdin_values(controllers, capacity,
+				names, mode, argv[0]);
+		else
+			ret |= display_values(controllers, capacity,
+				argv[i], names, mode, argv[0]);
 	}
 
+	if (format == FORMAT_JSON)
+		fputs("\n]\n", stdout);
+	free(json_names);
+	fflush(stdout);
+
 err:
 	for (i = 0; i < capacity; i++) {
 		if (cgroup_list[i])
@@ -458,6 +766,7 @@ err:
 	}
 
 err_free:
+	free(value.data);
 	free(cgroup_list);
 	free(controllers);
 	free(names);
@@ -0,0 +1,118 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <libcgroup.h>
+#include <libcgroup-internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/un.h>
+
+static void usage(int status, const char *program_name)
+{
+	if (status != 0) {
+		fprintf(stderr, "Wrong input parameters,"
+			" try %s -h' for more information.\n",
+			program_name);
+		return;
+	}
+	printf("Usage: %s [-h] [-s SOCKET]\n", program_name);
+	printf("Print the statistics of the cgroup rules engine daemon\n");
+	printf("  -h, --help			Display this help\n");
+	printf("  -s, --socket=SOCKET		Daemon socket, default "
+		CGRULE_CGRED_SOCKET_PATH "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = CGRULE_CGRED_SOCKET_PATH;
+	struct sockaddr_un addr;
+	pid_t pid = CGRULE_STATS_PID;
+	char buf[4096];
+	ssize_t len;
+	int sk;
+	int c;
+
+	struct option longopts[] = {
+		{"socket", required_argument, 0, 's'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "hs:", longopts, NULL)) > 0) {
+		switch (c) {
+		case 'h':
+			usage(0, argv[0]);
+			return 0;
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage(1, argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		usage(1, argv[0]);
+		return 1;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path %s is too long\n", argv[0],
+				path);
+		return 1;
+	}
+
+	sk = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sk < 0) {
+		fprintf(stderr, "%s: cannot create socket: %s\n", argv[0],
+				strerror(errno));
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sk, (struct sockaddr *)&addr,
+			sizeof(addr.sun_family) + strlen(path)) < 0) {
+		fprintf(stderr, "%s: cannot connect to %s: %s\n", argv[0],
+				path, strerror(errno));
+		goto err;
+	}
+
+	if (write(sk, &pid, sizeof(pid)) != sizeof(pid)) {
+		fprintf(stderr, "%s: cannot send the request: %s\n", argv[0],
+				strerror(errno));
+		goto err;
+	}
+
+	while ((len = read(sk, buf, sizeof(buf))) > 0) {
+		if (fwrite(buf, 1, len, stdout) != len) {
+			fprintf(stderr, "%s: cannot write the statistics\n",
+					argv[0]);
+			goto err;
+		}
+	}
+	if (len < 0) {
+		fprintf(stderr, "%s: cannot read the statistics: %s\n",
+				argv[0], strerror(errno));
+		goto err;
+	}
+
+	close(sk);
+	return 0;
+
+err:
+	close(sk);
+	return 1;
+}
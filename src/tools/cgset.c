@@ -13,7 +13,9 @@
 #define FL_COPY		2
 
 enum {
-	COPY_FROM_OPTION = CHAR_MAX + 1
+	COPY_FROM_OPTION = CHAR_MAX + 1,
+	SKIP_EQUAL_OPTION,
+	STDIN_OPTION,
 };
 
 static struct option const long_options[] =
@@ -21,6 +23,9 @@ static struct option const long_options[] =
 	{"rule", required_argument, NULL, 'r'},
 	{"help", no_argument, NULL, 'h'},
 	{"copy-from", required_argument, NULL, COPY_FROM_OPTION},
+	{"skip-equal", no_argument, NULL, SKIP_EQUAL_OPTION},
+	{"file", required_argument, NULL, 'f'},
+	{"stdin", no_argument, NULL, STDIN_OPTION},
 	{NULL, 0, NULL, 0}
 };
 
@@ -65,12 +70,154 @@ static void usage(int status, const char *program_name)
 	}
 	printf("Usage: %s [-r <name=value>] <cgroup_path> ...\n"
 		"   or: %s --copy-from <source_cgroup_path> "\
-		"<cgroup_path> ...\n", program_name, program_name);
+		"<cgroup_path> ...\n"
+		"   or: %s [-r <name=value>] [-f <file> | --stdin] "\
+		"[<cgroup_path> ...]\n",
+		program_name, program_name, program_name);
 	printf("Set the parameters of given cgroup(s)\n");
 	printf("  -r, --variable <name>			Define parameter "\
 		"to set\n");
 	printf("  --copy-from <source_cgroup_path>	Control group whose "\
 		"parameters will be copied\n");
+	printf("  --skip-equal				Do not write "\
+		"parameters which already have the value\n");
+	printf("  -f, --file <file>			Read lines of "\
+		"<cgroup_path> [<name=value> ...] from the file\n");
+	printf("  --stdin				Read the lines "\
+		"from the standard input\n");
+}
+
+/*
+ * Set the values of the source cgroup to the given cgroup.
+ */
+static int set_cgroup_values(const char *path, struct cgroup *src_cgroup,
+	int modify_flags, const char *program_name)
+{
+	struct cgroup *cgroup;
+	int ret;
+
+	/* create new cgroup */
+	cgroup = cgroup_new_cgroup(path);
+	if (!cgroup) {
+		ret = ECGFAIL;
+		fprintf(stderr, "%s: can't add new cgroup: %s\n",
+			program_name, cgroup_strerror(ret));
+		return ret;
+	}
+
+	/* copy the values from the source cgroup to new one */
+	ret = cgroup_copy_cgroup(cgroup, src_cgroup);
+	if (ret != 0) {
+		fprintf(stderr, "%s: cgroup %s error: %s \n",
+			program_name, path, cgroup_strerror(ret));
+		goto err;
+	}
+
+	/* modify cgroup based on values of the new one */
+	ret = cgroup_modify_cgroup_ext(cgroup, modify_flags, NULL);
+	if (ret) {
+		fprintf(stderr, "%s: cgroup modify error: %s \n",
+			program_name, cgroup_strerror(ret));
+		goto err;
+	}
+
+err:
+	cgroup_free(&cgroup);
+	return ret;
+}
+
+/*
+ * Set the values given by the lines of the batch file, the lines without
+ * values use the values of src_cgroup.
+ */
+static int set_batch_values(const char *path, struct cgroup *src_cgroup,
+	int modify_flags, const char *program_name)
+{
+	struct cgroup_batch batch;
+	struct control_value *name_value = NULL;
+	struct cgroup *line_cgroup;
+	int nv_max = 0;
+	int result = 0;
+	int ret, i;
+	char *value;
+
+	if (cgroup_batch_open(&batch, path, program_name))
+		return -1;
+
+	while ((ret = cgroup_batch_next(&batch)) > 0) {
+		if (batch.count == 1) {
+			if (!src_cgroup) {
+				fprintf(stderr, "%s:%d: no name-value pair "
+					"was set\n", batch.name,
+					batch.line_no);
+				result = -1;
+				continue;
+			}
+			ret = set_cgroup_values(batch.fields[0], src_cgroup,
+				modify_flags, program_name);
+			if (ret) {
+				fprintf(stderr, "%s:%d: cannot set %s\n",
+					batch.name, batch.line_no,
+					batch.fields[0]);
+				result = ret;
+			}
+			continue;
+		}
+
+		if (batch.count - 1 > nv_max) {
+			nv_max = batch.count - 1;
+			free(name_value);
+			name_value = malloc(nv_max *
+					sizeof(struct control_value));
+			if (!name_value) {
+				fprintf(stderr, "%s: not enough memory\n",
+					program_name);
+				result = -1;
+				break;
+			}
+		}
+
+		/* the line stays valid, no need to copy the names */
+		for (i = 1; i < batch.count; i++) {
+			value = strchr(batch.fields[i], '=');
+			if (!value || value == batch.fields[i])
+				break;
+			*value++ = '\0';
+			name_value[i - 1].name = batch.fields[i];
+			name_value[i - 1].dirty = false;
+			strncpy(name_value[i - 1].value, value, CG_VALUE_MAX);
+			name_value[i - 1].value[CG_VALUE_MAX - 1] = '\0';
+		}
+		if (i < batch.count) {
+			fprintf(stderr, "%s:%d: wrong name-value pair %s\n",
+				batch.name, batch.line_no, batch.fields[i]);
+			result = -1;
+			continue;
+		}
+
+		line_cgroup = create_cgroup_from_name_value_pairs("tmp",
+			name_value, batch.count - 1);
+		if (!line_cgroup) {
+			fprintf(stderr, "%s:%d: cannot set %s\n",
+				batch.name, batch.line_no, batch.fields[0]);
+			result = -1;
+			continue;
+		}
+		ret = set_cgroup_values(batch.fields[0], line_cgroup,
+			modify_flags & ~CGFLAG_MODIFY_ALL, program_name);
+		if (ret) {
+			fprintf(stderr, "%s:%d: cannot set %s\n",
+				batch.name, batch.line_no, batch.fields[0]);
+			result = ret;
+		}
+		cgroup_free(&line_cgroup);
+	}
+	if (ret < 0)
+		result = -1;
+
+	free(name_value);
+	cgroup_batch_close(&batch);
+	return result;
 }
 
 int main(int argc, char *argv[])
@@ -84,8 +231,9 @@ int main(int argc, char *argv[])
 	int nv_max = 0;
 
 	char src_cg_path[FILENAME_MAX];
-	struct cgroup *src_cgroup;
-	struct cgroup *cgroup;
+	struct cgroup *src_cgroup = NULL;
+	int modify_flags = 0;
+	const char *batch_path = NULL;
 
 	/* no parametr on input */
 	if (argc < 2) {
@@ -96,7 +244,7 @@ int main(int argc, char *argv[])
 
 	/* parse arguments */
 	while ((c = getopt_long (argc, argv,
-		"r:h", long_options, NULL)) != -1) {
+		"r:hf:", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			usage(0, argv[0]);
@@ -139,8 +287,8 @@ int main(int argc, char *argv[])
 				goto err;
 			}
 
-			strncpy(name_value[nv_number].name, buf, FILENAME_MAX);
-			name_value[nv_number].name[FILENAME_MAX-1] = '\0';
+			/* optarg stays valid, no need to copy the name */
+			name_value[nv_number].name = buf;
 
 			buf = strtok(NULL, "=");
 			if (buf == NULL) {
@@ -166,6 +314,15 @@ int main(int argc, char *argv[])
 			strncpy(src_cg_path, optarg, FILENAME_MAX);
 			src_cg_path[FILENAME_MAX-1] = '\0';
 			break;
+		case SKIP_EQUAL_OPTION:
+			modify_flags |= CGFLAG_MODIFY_SKIP_EQUAL;
+			break;
+		case 'f':
+			batch_path = optarg;
+			break;
+		case STDIN_OPTION:
+			batch_path = "-";
+			break;
 		default:
 			usage(1, argv[0]);
 			ret = -1;
@@ -175,13 +332,13 @@ int main(int argc, char *argv[])
 	}
 
 	/* no cgroup name */
-	if (!argv[optind]) {
+	if (!argv[optind] && !batch_path) {
 		fprintf(stderr, "%s: no cgroup specified\n", argv[0]);
 		ret = -1;
 		goto err;
 	}
 
-	if (flags == 0) {
+	if (flags == 0 && !batch_path) {
 		fprintf(stderr, "%s: no name-value pair was set\n", argv[0]);
 		ret = -1;
 		goto err;
@@ -208,42 +365,26 @@ int main(int argc, char *argv[])
 		src_cgroup = copy_name_value_from_cgroup(src_cg_path);
 		if (src_cgroup == NULL)
 			goto err;
+		/* copied values are not dirty, write them all */
+		modify_flags |= CGFLAG_MODIFY_ALL;
 	}
 
 	while (optind < argc) {
-		/* create new cgroup */
-		cgroup = cgroup_new_cgroup(argv[optind]);
-		if (!cgroup) {
-			ret = ECGFAIL;
-			fprintf(stderr, "%s: can't add new cgroup: %s\n",
-				argv[0], cgroup_strerror(ret));
-			goto cgroup_free_err;
-		}
-
-		/* copy the values from the source cgroup to new one */
-		ret = cgroup_copy_cgroup(cgroup, src_cgroup);
-		if (ret != 0) {
-			fprintf(stderr, "%s: cgroup %s error: %s \n",
-				argv[0], src_cg_path, cgroup_strerror(ret));
-			goto cgroup_free_err;
-		}
-
-		/* modify cgroup based on values of the new one */
-		ret = cgroup_modify_cgroup(cgroup);
-		if (ret) {
-			fprintf(stderr, "%s: cgroup modify error: %s \n",
-				argv[0], cgroup_strerror(ret));
+		ret = set_cgroup_values(argv[optind], src_cgroup,
+			modify_flags, argv[0]);
+		if (ret)
 			goto cgroup_free_err;
-		}
-
 		optind++;
-		cgroup_free(&cgroup);
 	}
 
+	/* set the groups of the batch file after an initialization only */
+	if (batch_path)
+		ret = set_batch_values(batch_path, src_cgroup, modify_flags,
+			argv[0]);
+
 cgroup_free_err:
-	if (cgroup)
-		cgroup_free(&cgroup);
-	cgroup_free(&src_cgroup);
+	if (src_cgroup)
+		cgroup_free(&src_cgroup);
 
 err:
 	free(name_value);
@@ -23,6 +23,7 @@
 #include <libcgroup-internal.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 
 enum flag{
     FL_LIST =		1,
@@ -37,19 +38,46 @@ enum flag{
 #define BLACKLIST_CONF		"/etc/cgsnapshot_blacklist.conf"
 #define WHITELIST_CONF		"/etc/cgsnapshot_whitelist.conf"
 
+/* number of buckets of the black and white lists */
+#define LIST_HASH_SIZE		1024
+
 struct black_list_type {
 	char *name;			/* variable name */
-	struct black_list_type *next;	/* pointer to the next record */
+	struct black_list_type *next;	/* next record in the bucket */
+};
+
+/* hashed list of variable names */
+struct name_list {
+	struct black_list_type *hash[LIST_HASH_SIZE];
 };
 
-struct black_list_type *black_list;
-struct black_list_type *white_list;
+struct name_list black_list;
+struct name_list white_list;
 
 typedef char cont_name_t[FILENAME_MAX];
 
+/* controllers of one hierarchy, terminated by an empty name */
+struct hierarchy {
+	cont_name_t *controllers;
+	FILE *out;
+	int ret;
+};
+
+/* hierarchies to display, shared by the threads */
+struct hierarchy_list {
+	struct hierarchy *items;
+	int count;
+	/* next hierarchy to display, updated atomically */
+	int next;
+	const char *program_name;
+};
+
 int flags;
 FILE *of;
 
+/* number of hierarchies displayed at once */
+static long jobs = 1;
+
 /*
  * Display the usage
  */
@@ -61,7 +89,7 @@ static void usage(int status, const char *program_name)
 			program_name);
 		return;
 	}
-	printf("Usage: %s [-h] [-s] [-b FILE] [-w FILE] [-f FILE] "\
+	printf("Usage: %s [-h] [-s] [-b FILE] [-w FILE] [-f FILE] [-j N] "\
 		"[controller] [...]\n", program_name);
 	printf("Generate the configuration file for given controllers\n");
 	printf("  -b, --blacklist=FILE		Set the blacklist"\
@@ -69,6 +97,8 @@ static void usage(int status, const char *program_name)
 	printf("  -f, --file=FILE		Redirect the output"\
 		" to output_file\n");
 	printf("  -h, --help			Display this help\n");
+	printf("  -j, --jobs=N			Read N hierarchies "\
+		"at once\n");
 	printf("  -s, --silent			Ignore all warnings\n");
 	printf("  -t, --strict			Don't show variables "\
 		"which are not on the whitelist\n");
@@ -76,25 +106,52 @@ static void usage(int status, const char *program_name)
 		" configuration file (don't used by default)\n");
 }
 
+static unsigned int list_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char)*name++;
+	return hash % LIST_HASH_SIZE;
+}
+
+/* free list structure */
+void free_list(struct name_list *list)
+{
+	struct black_list_type *now;
+	struct black_list_type *next;
+	int i;
+
+	for (i = 0; i < LIST_HASH_SIZE; i++) {
+		now = list->hash[i];
+		while (now != NULL) {
+			next = now->next;
+			free(now->name);
+			free(now);
+			now = next;
+		}
+		list->hash[i] = NULL;
+	}
+	return;
+}
+
 /* cache values from blacklist file to the list structure */
 
-int load_list(char *filename, struct black_list_type **p_list)
+int load_list(char *filename, struct name_list *list)
 {
 	FILE *fw;
 	int i = 0;
 	int ret;
 	char buf[FILENAME_MAX];
 	char name[FILENAME_MAX];
+	unsigned int hash;
 
-	struct black_list_type *start = NULL;
-	struct black_list_type *end = NULL;
 	struct black_list_type *new;
 
 	fw = fopen(filename, "r");
 	if (fw == NULL) {
 		fprintf(stderr, "ERROR: Failed to open file %s: %s\n",
 			filename, strerror(errno));
-		*p_list = NULL;
 		return 1;
 	}
 
@@ -131,88 +188,54 @@ int load_list(char *filename, struct black_list_type **p_list)
 			free(new);
 			goto err;
 		}
-		new->next = NULL;
 
-		/* update the variables list */
-		if (start == NULL) {
-			start = new;
-			end = new;
-		} else {
-			end->next = new;
-			end = new;
-		}
+		/* add the variable to its bucket */
+		hash = list_hash(name);
+		new->next = list->hash[hash];
+		list->hash[hash] = new;
 	}
 
 	fclose(fw);
-
-	*p_list = start;
 	return 0;
 
 err:
 	fclose(fw);
-	new = start;
-	while (new != NULL) {
-		end = new->next;
-		free(new->name);
-		free(new);
-		new = end;
-	}
-	*p_list = NULL;
+	free_list(list);
 	return ret;
 }
 
-/* free list structure */
-void free_list(struct black_list_type *list)
-{
-	struct black_list_type *now;
-	struct black_list_type *next;
-
-	now = list;
-	while (now != NULL) {
-		next = now->next;
-		free(now->name);
-		free(now);
-		now = next;
-	}
-	return;
-}
-
 /* Test whether the variable is on the list
  * return values are:
  * 1 ... was found
  * 0 ... no record was found
  */
-int is_on_list(char *name, struct black_list_type *list)
+int is_on_list(const char *name, struct name_list *list)
 {
 	struct black_list_type *record;
 
-	record = list;
-	/* go through the list of all values */
-	while (record != NULL) {
-		/* if the variable name is found */
-		if (strcmp(record->name, name) == 0) {
-			/* return its value */
+	/* go through the bucket of the variable */
+	for (record = list->hash[list_hash(name)]; record != NULL;
+			record = record->next) {
+		if (strcmp(record->name, name) == 0)
 			return 1;
-		}
-		record = record->next;
 	}
 
 	/* the variable was not found */
 	return 0;
-
 }
 
 /* Display permissions record for the given group
  * defined by path
  */
-static int display_permissions(const char *path,
+static int display_permissions(FILE *out, const char *path,
 		const char *program_name)
 {
 	int ret;
 	struct stat sba;
 	struct stat sbt;
-	struct passwd *pw;
-	struct group *gr;
+	struct passwd pwd, *pw;
+	struct group grp, *gr;
+	char pw_buf[4096], gr_buf[4096];
 	char tasks_path[FILENAME_MAX];
 
 	/* admin permissions record */
@@ -243,17 +266,19 @@ static int display_permissions(const char *path,
 		   tag is necessery */
 
 		/* print the header */
-		fprintf(of, "\tperm {\n");
+		fprintf(out, "\tperm {\n");
 
 		/* find out the user and group name */
-		pw = getpwuid(sba.st_uid);
+		if (getpwuid_r(sba.st_uid, &pwd, pw_buf, sizeof(pw_buf), &pw))
+			pw = NULL;
 		if (pw == NULL) {
 			fprintf(stderr, "ERROR: can't get %d user name\n",
 				sba.st_uid);
 			return -1;
 		}
 
-		gr = getgrgid(sba.st_gid);
+		if (getgrgid_r(sba.st_gid, &grp, gr_buf, sizeof(gr_buf), &gr))
+			gr = NULL;
 		if (gr == NULL) {
 			fprintf(stderr, "ERROR: can't get %d group name\n",
 				sba.st_gid);
@@ -261,20 +286,22 @@ static int display_permissions(const char *path,
 		}
 
 		/* print the admin record */
-		fprintf(of, "\t\tadmin {\n"\
+		fprintf(out, "\t\tadmin {\n"\
 			"\t\t\tuid = %s;\n"\
 			"\t\t\tgid = %s;\n"\
 			"\t\t}\n", pw->pw_name, gr->gr_name);
 
 		/* find out the user and group name */
-		pw = getpwuid(sbt.st_uid);
+		if (getpwuid_r(sbt.st_uid, &pwd, pw_buf, sizeof(pw_buf), &pw))
+			pw = NULL;
 		if (pw == NULL) {
 			fprintf(stderr, "ERROR: can't get %d user name\n",
 				sbt.st_uid);
 			return -1;
 		}
 
-		gr = getgrgid(sbt.st_gid);
+		if (getgrgid_r(sbt.st_gid, &grp, gr_buf, sizeof(gr_buf), &gr))
+			gr = NULL;
 		if (gr == NULL) {
 			fprintf(stderr, "ERROR: can't get %d group name\n",
 				sbt.st_gid);
@@ -282,12 +309,12 @@ static int display_permissions(const char *path,
 		}
 
 		/* print the task record */
-		fprintf(of, "\t\ttask {\n"\
+		fprintf(out, "\t\ttask {\n"\
 			"\t\t\tuid = %s;\n"\
 			"\t\t\tgid = %s;\n"\
 			"\t\t}\n", pw->pw_name, gr->gr_name);
 
-		fprintf(of, "\t}\n");
+		fprintf(out, "\t}\n");
 	}
 
 	return 0;
@@ -300,8 +327,8 @@ static int display_permissions(const char *path,
  * tail
  */
 
-static int display_cgroup_data(struct cgroup *group,
-		char controller[CG_CONTROLLER_MAX][FILENAME_MAX],
+static int display_cgroup_data(FILE *out, struct cgroup *group,
+		cont_name_t *controller,
 		const char *group_path, int root_path_len, int first,
 		const char *program_name)
 {
@@ -317,10 +344,10 @@ static int display_cgroup_data(struct cgroup *group,
 	struct stat sb;
 
 	/* print the  group definition header */
-	fprintf(of, "group %s {\n", group->name);
+	fprintf(out, "group %s {\n", group->name);
 
 	/* display the permission tags */
-	ret = display_permissions(group_path, program_name);
+	ret = display_permissions(out, group_path, program_name);
 	if (ret)
 		return ret;
 
@@ -339,9 +366,9 @@ static int display_cgroup_data(struct cgroup *group,
 
 		/* print the controller header */
 		if (strncmp(controller[i], "name=", 5) == 0)
-			fprintf(of, "\t\"%s\" {\n", controller[i]);
+			fprintf(out, "\t\"%s\" {\n", controller[i]);
 		else
-			fprintf(of, "\t%s {\n", controller[i]);
+			fprintf(out, "\t%s {\n", controller[i]);
 		i++;
 		nr_var = cgroup_get_value_name_count(group_controller);
 
@@ -380,8 +407,8 @@ static int display_cgroup_data(struct cgroup *group,
 
 			/* find whether the variable is blacklisted or
 			   whitelisted */
-			bl = is_on_list(name, black_list);
-			wl = is_on_list(name, white_list);
+			bl = is_on_list(name, &black_list);
+			wl = is_on_list(name, &white_list);
 
 			/* if it is blacklisted skip it and continue */
 			if (bl)
@@ -412,7 +439,7 @@ static int display_cgroup_data(struct cgroup *group,
 			}
 			if (strcmp("devices.list", name) == 0) {
 				output_name = "devices.allow";
-				fprintf(of,
+				fprintf(out,
 					"\t\tdevices.deny=\"a *:* rwm\";\n");
 			}
 
@@ -427,14 +454,14 @@ static int display_cgroup_data(struct cgroup *group,
 					name);
 				goto err;
 			}
-			fprintf(of, "\t\t%s=\"%s\";\n", output_name, value);
+			fprintf(out, "\t\t%s=\"%s\";\n", output_name, value);
 			free(value);
 		}
-		fprintf(of, "\t}\n");
+		fprintf(out, "\t}\n");
 	}
 
 	/* tail of the record */
-	fprintf(of, "}\n\n");
+	fprintf(out, "}\n\n");
 
 err:
 	return ret;
@@ -442,15 +469,18 @@ err:
 
 /*
  * creates the record about the hierarchie which contains
- * "controller" subsystem
+ * "controller" subsystem, each group is written as soon as it is read
  */
-static int display_controller_data(
-		char controller[CG_CONTROLLER_MAX][FILENAME_MAX],
+static int display_controller_data(FILE *out, cont_name_t *controller,
 		const char *program_name)
 {
 	int ret;
 	void *handle;
 	int first = 1;
+	int i;
+
+	/* read only the controllers of this hierarchy */
+	const char *names[CG_CONTROLLER_MAX + 1];
 
 	struct cgroup_file_info info;
 	int lvl;
@@ -460,6 +490,10 @@ static int display_controller_data(
 
 	struct cgroup *group = NULL;
 
+	for (i = 0; i < CG_CONTROLLER_MAX && controller[i][0] != '\0'; i++)
+		names[i] = controller[i];
+	names[i] = NULL;
+
 	/* start to parse the structure for the first controller -
 	   controller[0] attached to hierarchie */
 	ret = cgroup_walk_tree_begin(controller[0], "/", 0,
@@ -488,15 +522,16 @@ static int display_controller_data(
 				goto err;
 			}
 
-			ret = cgroup_get_cgroup(group);
+			ret = cgroup_get_cgroup_filtered(group, names);
 			if (ret != 0) {
 				printf("cannot read group '%s': %s\n",
 				cgroup_name, cgroup_strerror(ret));
 				goto err;
 			}
 
-			display_cgroup_data(group, controller, info.full_path,
-				prefix_len, first, program_name);
+			display_cgroup_data(out, group, controller,
+				info.full_path, prefix_len, first,
+				program_name);
 			first = 0;
 			cgroup_free(&group);
 		}
@@ -511,7 +546,7 @@ err:
 
 }
 
-static int is_ctlr_on_list(char controllers[CG_CONTROLLER_MAX][FILENAME_MAX],
+static int is_ctlr_on_list(cont_name_t *controllers,
 			cont_name_t wanted_conts[FILENAME_MAX])
 {
 	int i = 0;
@@ -531,6 +566,74 @@ static int is_ctlr_on_list(char controllers[CG_CONTROLLER_MAX][FILENAME_MAX],
 }
 
 
+/* remember a hierarchy to display */
+static int add_hierarchy(struct hierarchy_list *list,
+		char controllers[CG_CONTROLLER_MAX][FILENAME_MAX], int max)
+{
+	struct hierarchy *items;
+	struct hierarchy *item;
+
+	items = realloc(list->items, (list->count + 1) * sizeof(*items));
+	if (items == NULL) {
+		fprintf(stderr, "ERROR: Memory allocation problem (%s)\n",
+			strerror(errno));
+		return ECGOTHER;
+	}
+	list->items = items;
+
+	item = &items[list->count];
+	memset(item, 0, sizeof(*item));
+	item->controllers = calloc(max + 1, sizeof(cont_name_t));
+	if (item->controllers == NULL) {
+		fprintf(stderr, "ERROR: Memory allocation problem (%s)\n",
+			strerror(errno));
+		return ECGOTHER;
+	}
+	memcpy(item->controllers, controllers, max * sizeof(cont_name_t));
+	list->count++;
+	return 0;
+}
+
+/*
+ * Display the hierarchies taken from the list. The first one is streamed
+ * to the output, with more jobs the others are written to temporary files,
+ * which are copied to the output in order when they are done.
+ */
+static void *display_hierarchies(void *arg)
+{
+	struct hierarchy_list *list = arg;
+	struct hierarchy *item;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&list->next, 1)) < list->count) {
+		item = &list->items[i];
+		item->out = (i && jobs > 1) ? tmpfile() : of;
+		if (item->out == NULL) {
+			fprintf(stderr, "ERROR: can't create temporary file "
+				"(%s)\n", strerror(errno));
+			item->ret = ECGOTHER;
+			continue;
+		}
+		item->ret = display_controller_data(item->out,
+			item->controllers, list->program_name);
+	}
+	return NULL;
+}
+
+/* copy the output of a hierarchy from its temporary file */
+static int copy_hierarchy(struct hierarchy *item)
+{
+	char buf[65536];
+	size_t len;
+
+	rewind(item->out);
+	while ((len = fread(buf, 1, sizeof(buf), item->out)) > 0) {
+		if (fwrite(buf, 1, len, of) != len)
+			return ECGOTHER;
+	}
+	return ferror(item->out) ? ECGOTHER : 0;
+}
+
 /* print data about input cont_name controller */
 static int parse_controllers(cont_name_t cont_names[CG_CONTROLLER_MAX],
 	const char *program_name)
@@ -540,9 +643,23 @@ static int parse_controllers(cont_name_t cont_names[CG_CONTROLLER_MAX],
 	char path[FILENAME_MAX];
 	struct cgroup_mount_point controller;
 
-	char controllers[CG_CONTROLLER_MAX][FILENAME_MAX];
+	char (*controllers)[FILENAME_MAX];
 	int max = 0;
 
+	struct hierarchy_list list;
+	pthread_t *threads = NULL;
+	long started = 0;
+	int i, err;
+
+	controllers = calloc(CG_CONTROLLER_MAX, sizeof(cont_name_t));
+	if (controllers == NULL) {
+		fprintf(stderr, "ERROR: Memory allocation problem (%s)\n",
+			strerror(errno));
+		return ECGOTHER;
+	}
+	memset(&list, 0, sizeof(list));
+	list.program_name = program_name;
+
 	path[0] = '\0';
 
 	ret = cgroup_get_controller_begin(&handle, &controller);
@@ -551,7 +668,7 @@ static int parse_controllers(cont_name_t cont_names[CG_CONTROLLER_MAX],
 	while (ret == 0) {
 		if (strcmp(path, controller.path) == 0) {
 			/* if it is still the same mount point */
-			if (max < CG_CONTROLLER_MAX) {
+			if (max < CG_CONTROLLER_MAX - 1) {
 				strncpy(controllers[max],
 					controller.name, FILENAME_MAX);
 				(controllers[max])[FILENAME_MAX-1] = '\0';
@@ -560,12 +677,13 @@ static int parse_controllers(cont_name_t cont_names[CG_CONTROLLER_MAX],
 		} else {
 
 			/* we got new mount point, print it if needed */
+			(controllers[max])[0] = '\0';
 			if ((!(flags & FL_LIST) ||
 				(is_ctlr_on_list(controllers, cont_names)))
 				&& (max != 0)) {
-				(controllers[max])[0] = '\0';
-				ret = display_controller_data(
-					controllers, program_name);
+				ret = add_hierarchy(&list, controllers, max);
+				if (ret)
+					break;
 			}
 
 			strncpy(controllers[0], controller.name, FILENAME_MAX);
@@ -580,18 +698,57 @@ static int parse_controllers(cont_name_t cont_names[CG_CONTROLLER_MAX],
 		ret = cgroup_get_controller_next(&handle, &controller);
 	}
 
-	if ((!(flags & FL_LIST) ||
+	(controllers[max])[0] = '\0';
+	if ((ret == ECGEOF) && (!(flags & FL_LIST) ||
 		(is_ctlr_on_list(controllers, cont_names)))
-		&& (max != 0)) {
-		(controllers[max])[0] = '\0';
-		ret = display_controller_data(
-			controllers, program_name);
-	}
+		&& (max != 0))
+		err = add_hierarchy(&list, controllers, max);
+	else
+		err = 0;
 
 	cgroup_get_controller_end(&handle);
+	free(controllers);
 	if (ret != ECGEOF)
-		return ret;
-	return 0;
+		goto out;
+	ret = err;
+	if (ret)
+		goto out;
+
+	/* the calling thread displays hierarchies too */
+	if (jobs > list.count)
+		jobs = list.count;
+	if (jobs > 1)
+		threads = calloc(jobs - 1, sizeof(*threads));
+	while (threads && started < jobs - 1) {
+		if (pthread_create(&threads[started], NULL,
+				display_hierarchies, &list))
+			break;
+		started++;
+	}
+	display_hierarchies(&list);
+	while (started)
+		pthread_join(threads[--started], NULL);
+	free(threads);
+
+	for (i = 0; i < list.count; i++) {
+		if (list.items[i].ret)
+			ret = list.items[i].ret;
+		if (list.items[i].out == of || list.items[i].out == NULL)
+			continue;
+		if (copy_hierarchy(&list.items[i]) && !ret) {
+			fprintf(stderr, "ERROR: can't write the output\n");
+			ret = ECGOTHER;
+		}
+	}
+
+out:
+	for (i = 0; i < list.count; i++) {
+		if (list.items[i].out && list.items[i].out != of)
+			fclose(list.items[i].out);
+		free(list.items[i].controllers);
+	}
+	free(list.items);
+	return ret;
 }
 
 static int show_mountpoints(const char *controller)
@@ -724,6 +881,7 @@ int main(int argc, char *argv[])
 
 	int i;
 	int c_number = 0;
+	char *endptr;
 	cont_name_t wanted_cont[CG_CONTROLLER_MAX];
 
 	char bl_file[FILENAME_MAX];  /* blacklist file name */
@@ -736,6 +894,7 @@ int main(int argc, char *argv[])
 		{"whitelist", required_argument, NULL, 'w'},
 		{"strict", no_argument, NULL, 't'},
 		{"file", required_argument, NULL, 'f'},
+		{"jobs", required_argument, NULL, 'j'},
 		{0, 0, 0, 0}
 	};
 
@@ -744,7 +903,7 @@ int main(int argc, char *argv[])
 	flags = 0;
 
 	/* parse arguments */
-	while ((c = getopt_long(argc, argv, "hsb:w:tf:", long_opts, NULL))
+	while ((c = getopt_long(argc, argv, "hsb:w:tf:j:", long_opts, NULL))
 		> 0) {
 		switch (c) {
 		case 'h':
@@ -766,6 +925,14 @@ int main(int argc, char *argv[])
 		case 't':
 			flags |= FL_STRICT;
 			break;
+		case 'j':
+			jobs = strtol(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || jobs < 1) {
+				fprintf(stderr, "%s: invalid number of jobs "\
+						"'%s'\n", argv[0], optarg);
+				return -1;
+			}
+			break;
 		case 'f':
 			flags |= FL_OUTPUT;
 			of = fopen(optarg, "w");
@@ -833,8 +1000,8 @@ int main(int argc, char *argv[])
 		ret = err;
 
 finish:
-	free_list(black_list);
-	free_list(white_list);
+	free_list(&black_list);
+	free_list(&white_list);
 
 	if (of != stdout)
 		fclose(of);
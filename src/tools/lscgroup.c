@@ -96,6 +96,14 @@ static int display_controller_data(char *input_path, char *controller, char *nam
 	if (ret != 0)
 		return ret;
 
+	/* only the groups are listed, don't look at the control files */
+	ret = cgroup_walk_tree_set_flags(&handle,
+		CGROUP_WALK_TYPE_PRE_DIR | CGROUP_WALK_TYPE_DIRS_ONLY);
+	if (ret != 0) {
+		cgroup_walk_tree_end(&handle);
+		return ret;
+	}
+
 	strncpy(cgroup_dir_path, info.full_path, FILENAME_MAX);
 	/* remove problematic  '/' characters from cgroup directory path*/
 	trim_filepath(cgroup_dir_path);
@@ -300,3 +300,69 @@ int parse_uid_gid(char *string, uid_t *uid, gid_t *gid,
 	}
 	return 0;
 }
+
+int cgroup_batch_open(struct cgroup_batch *batch, const char *path,
+		const char *program_name)
+{
+	memset(batch, 0, sizeof(*batch));
+	if (strcmp(path, "-") == 0) {
+		batch->file = stdin;
+		batch->name = "stdin";
+		return 0;
+	}
+
+	batch->file = fopen(path, "re");
+	if (!batch->file) {
+		fprintf(stderr, "%s: cannot open %s: %s\n", program_name,
+				path, strerror(errno));
+		return -1;
+	}
+	batch->name = path;
+	return 0;
+}
+
+int cgroup_batch_next(struct cgroup_batch *batch)
+{
+	char **fields;
+	char *field, *saveptr;
+
+	while (getline(&batch->line, &batch->line_size, batch->file) >= 0) {
+		batch->line_no++;
+		batch->count = 0;
+
+		field = strtok_r(batch->line, " \t\n", &saveptr);
+		if (!field || field[0] == '#')
+			continue;
+
+		do {
+			if (batch->count == batch->size) {
+				fields = realloc(batch->fields,
+					(batch->size + 16) * sizeof(char *));
+				if (!fields) {
+					fprintf(stderr, "%s\n",
+							strerror(errno));
+					return -1;
+				}
+				batch->fields = fields;
+				batch->size += 16;
+			}
+			batch->fields[batch->count++] = field;
+		} while ((field = strtok_r(NULL, " \t\n", &saveptr)));
+		return 1;
+	}
+
+	if (ferror(batch->file)) {
+		fprintf(stderr, "%s: %s\n", batch->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void cgroup_batch_close(struct cgroup_batch *batch)
+{
+	if (batch->file && batch->file != stdin)
+		fclose(batch->file);
+	free(batch->line);
+	free(batch->fields);
+	memset(batch, 0, sizeof(*batch));
+}
@@ -22,11 +22,6 @@
 #include <libcgroup.h>
 #include "../libcgroup-internal.h"
 
-#define cgroup_err(x...) cgroup_log(CGROUP_LOG_ERROR, x)
-#define cgroup_warn(x...) cgroup_log(CGROUP_LOG_WARNING, x)
-#define cgroup_info(x...) cgroup_log(CGROUP_LOG_INFO, x)
-#define cgroup_dbg(x...) cgroup_log(CGROUP_LOG_DEBUG, x)
-
 /**
  * Auxiliary specifier of group, used to store parsed command line options.
  */
@@ -122,4 +117,46 @@ int parse_mode(char *string, mode_t *pmode, const char *program_name);
 int parse_uid_gid(char *string, uid_t *uid, gid_t *gid,
 		const char *program_name);
 
+/**
+ * File with one request per line, read by the batch mode of the tools.
+ */
+struct cgroup_batch {
+	FILE *file;
+	/* name of the file used in error messages */
+	const char *name;
+	char *line;
+	size_t line_size;
+	/* number of the line read last */
+	int line_no;
+	/* whitespace separated fields of the line read last */
+	char **fields;
+	int count;
+	int size;
+};
+
+/**
+ * Open a batch file.
+ * @param batch The batch to initialize.
+ * @param path Path to the file, "-" reads the standard input.
+ * @param program_name Argv[0] to show error messages.
+ * @return 0 on success, != 0 on error.
+ */
+int cgroup_batch_open(struct cgroup_batch *batch, const char *path,
+		const char *program_name);
+
+/**
+ * Read the next request from a batch file and split it to the fields.
+ * Empty lines and lines starting with '#' are skipped.
+ * @param batch The batch to read, the fields are stored in batch->fields
+ * and valid until the next call.
+ * @return 1 when a request was read, 0 at the end of the file, -1 on error.
+ */
+int cgroup_batch_next(struct cgroup_batch *batch);
+
+/**
+ * Close a batch file and free its buffers.
+ * @param batch The batch to close.
+ */
+void cgroup_batch_close(struct cgroup_batch *batch);
+
 #endif /* TOOLS_COMMON */
@@ -21,11 +21,198 @@
 #include <libcgroup.h>
 #include <libcgroup-internal.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/* Number of buckets of the interned strings hash, a power of two */
+#define CG_INTERN_HASH_SIZE	256
+
+/* An interned string, see cg_intern_string() */
+struct cg_interned {
+	struct cg_interned *next;
+	char str[];
+};
+
+static struct cg_interned *cg_intern_hash[CG_INTERN_HASH_SIZE];
+static pthread_mutex_t cg_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the single shared copy of a string. The copies are never freed, this
+ * is meant for names of controllers and their values, of which there are
+ * only few distinct ones, repeated in many groups.
+ * @param str The string
+ * @return The shared copy or NULL if out of memory
+ */
+const char *cg_intern_string(const char *str)
+{
+	struct cg_interned *itr;
+	unsigned int hash = 5381;
+	const char *c;
+	size_t len;
+
+	for (c = str; *c; c++)
+		hash = hash * 33 + (unsigned char)*c;
+	hash &= CG_INTERN_HASH_SIZE - 1;
+	len = c - str;
+
+	pthread_mutex_lock(&cg_intern_lock);
+	for (itr = cg_intern_hash[hash]; itr; itr = itr->next) {
+		if (!strcmp(itr->str, str))
+			goto unlock;
+	}
+
+	itr = malloc(sizeof(struct cg_interned) + len + 1);
+	if (!itr)
+		goto unlock;
+	memcpy(itr->str, str, len + 1);
+	itr->next = cg_intern_hash[hash];
+	cg_intern_hash[hash] = itr;
+
+unlock:
+	pthread_mutex_unlock(&cg_intern_lock);
+	return itr ? itr->str : NULL;
+}
+
+/* Size of one arena chunk, bigger objects get a chunk of their own */
+#define CG_ARENA_CHUNK_SIZE	(64 * 1024)
+
+/* Alignment of objects allocated from an arena */
+#define CG_ARENA_ALIGN		(sizeof(long double))
+
+struct cg_arena_chunk {
+	struct cg_arena_chunk *next;
+	size_t used;
+	size_t size;
+	long double data[];
+};
+
+struct cg_arena {
+	struct cg_arena_chunk *chunks;
+	int refcount;
+};
+
+/**
+ * Create an empty arena with one reference.
+ * @return The arena or NULL if out of memory
+ */
+struct cg_arena *cg_arena_create(void)
+{
+	struct cg_arena *arena = calloc(1, sizeof(struct cg_arena));
+
+	if (arena)
+		arena->refcount = 1;
+	return arena;
+}
+
+struct cg_arena *cg_arena_get(struct cg_arena *arena)
+{
+	__sync_fetch_and_add(&arena->refcount, 1);
+	return arena;
+}
+
+/**
+ * Drop a reference to an arena. The last one frees all the memory
+ * allocated from the arena.
+ * @param arena The arena, NULL is ignored
+ */
+void cg_arena_put(struct cg_arena *arena)
+{
+	struct cg_arena_chunk *chunk;
+
+	if (!arena || __sync_sub_and_fetch(&arena->refcount, 1))
+		return;
+
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/**
+ * Allocate zeroed memory from an arena. It cannot be freed separately, it
+ * is freed with the arena.
+ * @param arena The arena
+ * @param size Size of the memory
+ * @return The memory or NULL if out of memory
+ */
+void *cg_arena_alloc(struct cg_arena *arena, size_t size)
+{
+	struct cg_arena_chunk *chunk = arena->chunks;
+	size_t chunk_size;
+	void *ret;
+
+	size = (size + CG_ARENA_ALIGN - 1) & ~(CG_ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = max(size, (size_t)CG_ARENA_CHUNK_SIZE);
+		chunk = calloc(1, sizeof(struct cg_arena_chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->size = chunk_size;
+
+		/* Keep filling the current chunk after a big object. */
+		if (arena->chunks && chunk_size > CG_ARENA_CHUNK_SIZE) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	ret = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+/* Allocate zeroed memory from an arena or from the heap. */
+static void *cg_zalloc(struct cg_arena *arena, size_t size)
+{
+	if (arena)
+		return cg_arena_alloc(arena, size);
+	return calloc(1, size);
+}
+
+/**
+ * Make sure there is space for one more item and the terminating NULL in an
+ * array of pointers.
+ * @param arena The arena of the array, or NULL if it is on the heap
+ * @param array The array, it may be reallocated
+ * @param size Number of slots in the array
+ * @param index Number of used slots
+ * @return 0 on success, -1 if out of memory
+ */
+static int cg_reserve_slot(struct cg_arena *arena, void ***array, int *size,
+		int index)
+{
+	void **slots;
+	int new_size;
+
+	if (index + 1 < *size)
+		return 0;
+
+	new_size = *size ? *size * 2 : 4;
+	if (arena) {
+		/* The old array stays in the arena until it is freed. */
+		slots = cg_arena_alloc(arena, new_size * sizeof(void *));
+		if (slots && *size)
+			memcpy(slots, *array, *size * sizeof(void *));
+	} else {
+		slots = realloc(*array, new_size * sizeof(void *));
+	}
+	if (!slots)
+		return -1;
+
+	memset(slots + *size, 0, (new_size - *size) * sizeof(void *));
+	*array = slots;
+	*size = new_size;
+	return 0;
+}
+
 static void init_cgroup(struct cgroup *cgroup)
 {
 	cgroup->task_fperm = cgroup->control_fperm = cgroup->control_dperm = NO_PERMS;
@@ -72,18 +259,28 @@ struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup,
 	 * Still not sure how to handle the failure here.
 	 */
 	for (i = 0; i < cgroup->index; i++) {
-		if (strncmp(name, cgroup->controller[i]->name,
-				sizeof(cgroup->controller[i]->name)) == 0)
+		if (strcmp(name, cgroup->controller[i]->name) == 0)
 			return NULL;
 	}
 
-	controller = calloc(1, sizeof(struct cgroup_controller));
+	if (cg_reserve_slot(cgroup->arena, (void ***)&cgroup->controller,
+				&cgroup->controller_size, cgroup->index))
+		return NULL;
+
+	controller = cg_zalloc(cgroup->arena,
+			sizeof(struct cgroup_controller));
 
 	if (!controller)
 		return NULL;
 
-	strncpy(controller->name, name, sizeof(controller->name) - 1);
+	controller->name = cg_intern_string(name);
+	if (!controller->name) {
+		if (!cgroup->arena)
+			free(controller);
+		return NULL;
+	}
 	controller->cgroup = cgroup;
+	controller->arena = cgroup->arena;
 	controller->index = 0;
 
 	cgroup->controller[cgroup->index] = controller;
@@ -149,12 +346,22 @@ void cgroup_free_controllers(struct cgroup *cgroup)
 	if (!cgroup)
 		return;
 
+	/* Everything is freed with the arena. */
+	if (cgroup->arena)
+		goto reset;
+
 	for (i = 0; i < cgroup->index; i++) {
 		for (j = 0; j < cgroup->controller[i]->index; j++)
 			free(cgroup->controller[i]->values[j]);
+		free(cgroup->controller[i]->values);
 		cgroup->controller[i]->index = 0;
 		free(cgroup->controller[i]);
 	}
+	free(cgroup->controller);
+reset:
+	cgroup->controller = NULL;
+	cgroup->controller_size = 0;
+	cgroup->arena = NULL;
 	cgroup->index = 0;
 }
 
@@ -182,20 +389,29 @@ int cgroup_add_value_string(struct cgroup_controller *controller,
 	if (!controller)
 		return ECGINVAL;
 
-	if (controller->index >= CG_VALUE_MAX)
+	if (controller->index >= CG_NV_MAX)
 		return ECGMAXVALUESEXCEEDED;
 
-	for (i = 0; i < controller->index && i < CG_VALUE_MAX; i++) {
+	for (i = 0; i < controller->index; i++) {
 		if (!strcmp(controller->values[i]->name, name))
 			return ECGVALUEEXISTS;
 	}
 
-	cntl_value = calloc(1, sizeof(struct control_value));
+	if (cg_reserve_slot(controller->arena, (void ***)&controller->values,
+				&controller->values_size, controller->index))
+		return ECGCONTROLLERCREATEFAILED;
+
+	cntl_value = cg_zalloc(controller->arena, sizeof(struct control_value));
 
 	if (!cntl_value)
 		return ECGCONTROLLERCREATEFAILED;
 
-	strncpy(cntl_value->name, name, sizeof(cntl_value->name));
+	cntl_value->name = cg_intern_string(name);
+	if (!cntl_value->name) {
+		if (!controller->arena)
+			free(cntl_value);
+		return ECGCONTROLLERCREATEFAILED;
+	}
 	strncpy(cntl_value->value, value, sizeof(cntl_value->value));
 	cntl_value->dirty = true;
 	controller->values[controller->index] = cntl_value;
@@ -651,7 +867,7 @@ char *cgroup_get_value_name(struct cgroup_controller *controller, int index)
 		return NULL;
 
 	if (index < controller->index)
-		return (controller->values[index])->name;
+		return (char *)(controller->values[index])->name;
 	else
 		return NULL;
 }
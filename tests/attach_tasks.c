@@ -0,0 +1,100 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Test of cgroup_attach_tasks() with a live and an exited
+ * process. The live one must be moved, the exited one reported as ECGOTHER
+ * with ESRCH. Uses the controller in $ATTACH_CONTROLLER, cpu by default,
+ * and is skipped unless run by root with the controller mounted.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libcgroup.h>
+
+#define GROUP_NAME	"attach_tasks_test"
+#define SKIP		77
+
+int main(void)
+{
+	const char *controller = getenv("ATTACH_CONTROLLER");
+	struct cgroup *cgroup;
+	pid_t pids[2];
+	int errors[2];
+	char *path = NULL, *mount = NULL;
+	int ret, result = 1;
+
+	if (!controller)
+		controller = "cpu";
+	if (geteuid()) {
+		printf("SKIP: must run as root\n");
+		return SKIP;
+	}
+	if (cgroup_init() || cgroup_get_subsys_mount_point(controller,
+				&mount)) {
+		printf("SKIP: %s is not mounted\n", controller);
+		return SKIP;
+	}
+	free(mount);
+
+	cgroup = cgroup_new_cgroup(GROUP_NAME);
+	if (!cgroup || !cgroup_add_controller(cgroup, controller)) {
+		printf("FAIL: cannot allocate the group\n");
+		return 1;
+	}
+	ret = cgroup_create_cgroup(cgroup, 0);
+	if (ret) {
+		printf("FAIL: cannot create the group: %s\n",
+			cgroup_strerror(ret));
+		goto out;
+	}
+
+	/* a process which exited and was reaped, then a live one */
+	pids[0] = fork();
+	if (!pids[0])
+		_exit(0);
+	waitpid(pids[0], NULL, 0);
+	pids[1] = fork();
+	if (!pids[1]) {
+		pause();
+		_exit(0);
+	}
+
+	ret = cgroup_attach_tasks(cgroup, pids, 2, CGFLAG_ATTACH_PROCS,
+			errors);
+	if (ret)
+		printf("FAIL: cgroup_attach_tasks returned %s\n",
+			cgroup_strerror(ret));
+	else if (errors[0] != ECGOTHER || cgroup_get_last_errno() != ESRCH)
+		printf("FAIL: the exited process got %s\n",
+			cgroup_strerror(errors[0]));
+	else if (errors[1])
+		printf("FAIL: the live process got %s\n",
+			cgroup_strerror(errors[1]));
+	else if (cgroup_get_current_controller_path(pids[1], controller,
+				&path) || strcmp(path, "/" GROUP_NAME))
+		printf("FAIL: the live process is in %s\n",
+			path ? path : "unknown group");
+	else
+		result = 0;
+
+	kill(pids[1], SIGKILL);
+	waitpid(pids[1], NULL, 0);
+	free(path);
+out:
+	cgroup_delete_cgroup(cgroup, 1);
+	cgroup_free(&cgroup);
+	if (!result)
+		printf("PASS\n");
+	return result;
+}
@@ -0,0 +1,87 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Helpers of the benchmarks of the library hot paths.
+ */
+
+#include <stdlib.h>
+#include "bench.h"
+
+void bench_samples_add(struct bench_samples *samples, uint64_t ns)
+{
+	uint64_t *new;
+	size_t size;
+
+	if (samples->count == samples->size) {
+		size = samples->size ? samples->size * 2 : 1024;
+		new = realloc(samples->ns, size * sizeof(*new));
+		if (!new) {
+			fprintf(stderr, "bench: out of memory\n");
+			exit(1);
+		}
+		samples->ns = new;
+		samples->size = size;
+	}
+	samples->ns[samples->count++] = ns;
+}
+
+void bench_samples_free(struct bench_samples *samples)
+{
+	free(samples->ns);
+	samples->ns = NULL;
+	samples->count = samples->size = 0;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void bench_report(const char *name, struct bench_samples *samples)
+{
+	uint64_t total = 0;
+	size_t i, n = samples->count;
+
+	if (!n) {
+		printf("%-28s no samples\n", name);
+		return;
+	}
+
+	qsort(samples->ns, n, sizeof(*samples->ns), bench_compare);
+	for (i = 0; i < n; i++)
+		total += samples->ns[i];
+
+	printf("%-28s %8zu ops %12.0f ops/s  mean %9.2f us  "
+		"p50 %9.2f us  p99 %9.2f us  max %9.2f us\n", name, n,
+		total ? n * 1e9 / total : 0.0, total / 1e3 / n,
+		samples->ns[n / 2] / 1e3, samples->ns[n * 99 / 100] / 1e3,
+		samples->ns[n - 1] / 1e3);
+}
+
+void bench_report_total(const char *name, size_t ops, uint64_t ns)
+{
+	printf("%-28s %8zu ops %12.0f ops/s  mean %9.2f us\n", name, ops,
+		ns ? ops * 1e9 / ns : 0.0, ops ? ns / 1e3 / ops : 0.0);
+}
+
+long bench_parse_count(const char *arg, const char *program_name)
+{
+	char *end;
+	long count;
+
+	count = strtol(arg, &end, 10);
+	if (*end || count <= 0) {
+		fprintf(stderr, "%s: wrong number %s\n", program_name, arg);
+		exit(2);
+	}
+	return count;
+}
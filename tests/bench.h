@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Helpers of the benchmarks of the library hot paths, run by
+ * "make bench".
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Durations of the measured operations, in nanoseconds.
+ */
+struct bench_samples {
+	uint64_t *ns;
+	size_t count;
+	size_t size;
+};
+
+/**
+ * Current time of the monotonic clock in nanoseconds.
+ */
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Add the duration of one operation, exits when out of memory.
+ * @param samples The samples to add to.
+ * @param ns The duration in nanoseconds.
+ */
+void bench_samples_add(struct bench_samples *samples, uint64_t ns);
+
+/**
+ * Free the samples.
+ */
+void bench_samples_free(struct bench_samples *samples);
+
+/**
+ * Print one line with the number of operations, their throughput, mean,
+ * median, 99th percentile and maximum duration. The samples are sorted.
+ * @param name Name of the benchmark.
+ * @param samples Durations of the operations.
+ */
+void bench_report(const char *name, struct bench_samples *samples);
+
+/**
+ * Print one line with the number of operations and their throughput, for
+ * operations too short to be timed one by one.
+ * @param name Name of the benchmark.
+ * @param ops Number of operations.
+ * @param ns Total duration of the operations in nanoseconds.
+ */
+void bench_report_total(const char *name, size_t ops, uint64_t ns);
+
+/**
+ * Parse a positive number argument, exits with the usage on error.
+ */
+long bench_parse_count(const char *arg, const char *program_name);
+
+#endif /* __BENCH_H */
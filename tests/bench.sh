@@ -0,0 +1,121 @@
+#!/bin/bash
+# Benchmarks of the library hot paths, run by "make bench".
+#
+# Usage: bench.sh [<top_srcdir>]
+#
+# Must run as root with the controller mounted, the benchmarks create and
+# remove their own groups. The rule matching benchmark runs in a private
+# mount namespace with synthetic rules bind mounted over /etc/cgrules.conf.
+#
+# Environment:
+#   BENCH_CONTROLLER	controller to use, default cpu
+#   BENCH_RULES		numbers of rules of the rule matching, default 10 100 1000
+#   BENCH_GROUPS	groups in the tree benchmark, default 1000
+#   BENCH_EVENTS	events replayed to cgrulesengd, default 100000
+#   BENCH_PIDS		fake processes of the replayed events, default 1000
+#   BENCH_WORKERS	cgrulesengd classifier workers, default 4
+#   CGRULESENGD		the daemon, default ../src/daemon/cgrulesengd
+
+SRCDIR=${1:-..}
+CONTROLLER=${BENCH_CONTROLLER:-cpu}
+RULES=${BENCH_RULES:-10 100 1000}
+GROUPS_COUNT=${BENCH_GROUPS:-1000}
+EVENTS=${BENCH_EVENTS:-100000}
+PIDS=${BENCH_PIDS:-1000}
+WORKERS=${BENCH_WORKERS:-4}
+CGRULESENGD=${CGRULESENGD:-../src/daemon/cgrulesengd}
+RET=0
+
+if [ "$(id -u)" != 0 ]; then
+	echo "bench.sh: the benchmarks must run as root"
+	exit 1
+fi
+
+TMPDIR=`mktemp -d`
+CLEANUP="rm -rf $TMPDIR"
+trap 'eval "$CLEANUP"' EXIT
+
+# the rules are read from a fixed path, bind mounts need an existing
+# mount point
+if [ ! -e /etc/cgrules.conf ]; then
+	touch /etc/cgrules.conf || exit 1
+	CLEANUP="$CLEANUP; rm -f /etc/cgrules.conf"
+fi
+
+function run_bench()
+{
+	if ! "$@"; then
+		echo "Error: $* failed"
+		RET=1
+	fi
+}
+
+# group of this shell in the controller hierarchy
+CURRENT=`awk -F: -v c=$CONTROLLER \
+	'{ n = split($2, a, ","); for (i = 1; i <= n; i++) \
+		if (a[i] == c) print $3 }' /proc/self/cgroup`
+CURRENT=${CURRENT:-/}
+
+# rules which do not match, then one which matches and keeps the process
+# in its group
+for n in $RULES; do
+	RULES_FILE=$TMPDIR/cgrules.conf
+	for ((i = 1; i < n; i++)); do
+		echo "root:bench_nomatch_$i	$CONTROLLER	bench/$i"
+	done > $RULES_FILE
+	echo "*	$CONTROLLER	$CURRENT" >> $RULES_FILE
+	mkdir -p $TMPDIR/cgrules.d
+
+	run_bench unshare -m sh -c "mount --bind $RULES_FILE /etc/cgrules.conf &&
+		{ [ ! -d /etc/cgrules.d ] ||
+			mount --bind $TMPDIR/cgrules.d /etc/cgrules.d; } &&
+		./bench_rules 100000 'rule match ($n rules)'"
+done
+
+# replay of exec and uid events of fake processes, which already are in
+# the group of the matching rule of the last rule set above, so the daemon
+# matches the rules of each event but moves nothing
+if [ -x $CGRULESENGD ]; then
+	for ((i = 0; i < PIDS; i++)); do
+		p=$TMPDIR/proc/$((1000000 + i))
+		mkdir -p $p
+		printf 'Name:\tbench_replay\nUid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\n' \
+			> $p/status
+		printf 'bench_replay\0' > $p/cmdline
+		ln -s /usr/bin/bench_replay $p/exe
+		ln -s / $p/cwd
+		echo "1:$CONTROLLER:$CURRENT" > $p/cgroup
+	done
+	for ((i = 0; i < EVENTS; i++)); do
+		if ((i % 2)); then
+			echo "uid $((1000000 + i / 2 % PIDS)) 0"
+		else
+			echo "exec $((1000000 + i / 2 % PIDS))"
+		fi
+	done > $TMPDIR/events
+
+	for w in 0 $WORKERS; do
+		echo "cgrulesengd replay ($w workers, $n rules)"
+		run_bench unshare -m sh -c "mount --bind $RULES_FILE \
+				/etc/cgrules.conf &&
+			{ [ ! -d /etc/cgrules.d ] ||
+				mount --bind $TMPDIR/cgrules.d /etc/cgrules.d; } &&
+			$CGRULESENGD -Q -w $w -R $TMPDIR/events \
+				-P $TMPDIR/proc"
+	done
+else
+	echo "Skipping the cgrulesengd replay, $CGRULESENGD was not built"
+fi
+
+run_bench ./bench_attach $CONTROLLER
+
+run_bench ./bench_tree $CONTROLLER $GROUPS_COUNT
+
+if bzcat $SRCDIR/samples/large_cgconfig.conf.bz2 > $TMPDIR/large.conf; then
+	run_bench ./bench_config $TMPDIR/large.conf
+else
+	echo "Error: cannot uncompress large_cgconfig.conf.bz2"
+	RET=1
+fi
+
+exit $RET
@@ -0,0 +1,98 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Latency of cgroup_attach_task_pid(). A child process is
+ * moved back and forth between two groups created for the benchmark.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libcgroup.h>
+#include "bench.h"
+
+static struct cgroup *create_group(const char *name, const char *controller)
+{
+	struct cgroup *cgroup;
+	int ret;
+
+	cgroup = cgroup_new_cgroup(name);
+	if (!cgroup || !cgroup_add_controller(cgroup, controller)) {
+		fprintf(stderr, "cannot create group %s\n", name);
+		exit(1);
+	}
+	ret = cgroup_create_cgroup(cgroup, 0);
+	if (ret) {
+		fprintf(stderr, "cannot create group %s: %s\n", name,
+			cgroup_strerror(ret));
+		exit(1);
+	}
+	return cgroup;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_samples samples = { 0 };
+	struct cgroup *groups[2];
+	long i, iterations = 10000;
+	uint64_t start;
+	pid_t child;
+	int ret = 0;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <controller> [<iterations>]\n",
+			argv[0]);
+		exit(2);
+	}
+	if (argc > 2)
+		iterations = bench_parse_count(argv[2], argv[0]);
+
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed: %s\n",
+			cgroup_strerror(ret));
+		exit(1);
+	}
+
+	groups[0] = create_group("bench_attach_a", argv[1]);
+	groups[1] = create_group("bench_attach_b", argv[1]);
+
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!child) {
+		pause();
+		_exit(0);
+	}
+
+	for (i = 0; i < iterations; i++) {
+		start = bench_now();
+		ret = cgroup_attach_task_pid(groups[i & 1], child);
+		bench_samples_add(&samples, bench_now() - start);
+		if (ret) {
+			fprintf(stderr, "cgroup_attach_task_pid failed: %s\n",
+				cgroup_strerror(ret));
+			break;
+		}
+	}
+	if (!ret)
+		bench_report("attach task", &samples);
+
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	for (i = 0; i < 2; i++) {
+		cgroup_delete_cgroup(groups[i], 1);
+		cgroup_free(&groups[i]);
+	}
+	bench_samples_free(&samples);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Parse time of a configuration file, e.g. of the
+ * uncompressed samples/large_cgconfig.conf.bz2. The file is only parsed,
+ * through the templates cache, nothing is mounted or created.
+ */
+
+#include <stdlib.h>
+#include <libcgroup.h>
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	struct bench_samples samples = { 0 };
+	long i, iterations = 20;
+	uint64_t start;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <config file> [<iterations>]\n",
+			argv[0]);
+		exit(2);
+	}
+	if (argc > 2)
+		iterations = bench_parse_count(argv[2], argv[0]);
+
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed: %s\n",
+			cgroup_strerror(ret));
+		exit(1);
+	}
+
+	for (i = 0; i < iterations; i++) {
+		start = bench_now();
+		ret = i ? cgroup_reload_cached_templates(argv[1]) :
+			cgroup_init_templates_cache(argv[1]);
+		bench_samples_add(&samples, bench_now() - start);
+		if (ret) {
+			fprintf(stderr, "cannot parse %s: %s\n", argv[1],
+				cgroup_strerror(ret));
+			exit(1);
+		}
+	}
+	bench_report("config parse", &samples);
+
+	bench_samples_free(&samples);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Throughput of the rule matching of the cached rules, as done
+ * by cgrulesengd for each event. The process classifies itself; the rules
+ * are expected to move it to the group it already is in (see bench.sh),
+ * so with CGFLAG_SKIP_CURRENT nothing is written to the tasks files.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <libcgroup.h>
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	struct bench_samples samples = { 0 };
+	char procname[FILENAME_MAX];
+	const char *name = "rule match";
+	long i, iterations = 100000;
+	uint64_t start;
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+	pid_t pid = getpid();
+	ssize_t len;
+	int ret;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [<iterations> [<name>]]\n",
+			argv[0]);
+		exit(2);
+	}
+	if (argc > 1)
+		iterations = bench_parse_count(argv[1], argv[0]);
+	if (argc > 2)
+		name = argv[2];
+
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed: %s\n",
+			cgroup_strerror(ret));
+		exit(1);
+	}
+
+	start = bench_now();
+	ret = cgroup_init_rules_cache();
+	if (ret) {
+		fprintf(stderr, "cgroup_init_rules_cache failed: %s\n",
+			cgroup_strerror(ret));
+		exit(1);
+	}
+	bench_report_total("rules parse", 1, bench_now() - start);
+
+	/* the daemon matches the rules against the full executable path */
+	len = readlink("/proc/self/exe", procname, sizeof(procname) - 1);
+	if (len < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	procname[len] = '\0';
+
+	for (i = 0; i < iterations; i++) {
+		start = bench_now();
+		ret = cgroup_change_cgroup_flags(uid, gid, procname, pid,
+				CGFLAG_USECACHE | CGFLAG_SKIP_CURRENT);
+		bench_samples_add(&samples, bench_now() - start);
+		if (ret) {
+			fprintf(stderr, "cgroup_change_cgroup_flags failed: "
+				"%s\n", cgroup_strerror(ret));
+			exit(1);
+		}
+	}
+	bench_report(name, &samples);
+
+	if (cgroup_get_skipped_moves() != (unsigned long)iterations)
+		fprintf(stderr, "warning: %lu of %ld matches moved the "
+			"process\n", iterations - cgroup_get_skipped_moves(),
+			iterations);
+
+	bench_samples_free(&samples);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Operations over a large tree of groups: creation with
+ * cgroup_create_cgroup(), reading with cgroup_get_cgroup(), walking with
+ * cgroup_walk_tree_next() and recursive removal. The tree "bench_tree"
+ * has two levels with the given number of groups in total.
+ */
+
+#include <stdlib.h>
+#include <libcgroup.h>
+#include "bench.h"
+
+#define ROOT_NAME	"bench_tree"
+
+static struct cgroup *new_group(const char *name, const char *controller)
+{
+	struct cgroup *cgroup;
+
+	cgroup = cgroup_new_cgroup(name);
+	if (!cgroup || !cgroup_add_controller(cgroup, controller)) {
+		fprintf(stderr, "cannot allocate group %s\n", name);
+		exit(1);
+	}
+	return cgroup;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_samples create = { 0 }, get = { 0 };
+	struct cgroup_file_info info;
+	struct cgroup *cgroup;
+	char name[FILENAME_MAX];
+	long i, groups = 1000, fanout = 1;
+	uint64_t start;
+	size_t walked = 0;
+	void *handle;
+	int ret, err, level;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <controller> [<groups>]\n",
+			argv[0]);
+		exit(2);
+	}
+	if (argc > 2)
+		groups = bench_parse_count(argv[2], argv[0]);
+	while (fanout * fanout < groups)
+		fanout++;
+
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed: %s\n",
+			cgroup_strerror(ret));
+		exit(1);
+	}
+
+	/* the parents first, then their children */
+	for (i = 0; i < groups; i++) {
+		if (i < fanout)
+			snprintf(name, sizeof(name), ROOT_NAME "/%ld", i);
+		else
+			snprintf(name, sizeof(name), ROOT_NAME "/%ld/%ld",
+				i % fanout, i / fanout);
+		cgroup = new_group(name, argv[1]);
+		start = bench_now();
+		ret = cgroup_create_cgroup(cgroup, 0);
+		bench_samples_add(&create, bench_now() - start);
+		cgroup_free(&cgroup);
+		if (ret) {
+			fprintf(stderr, "cannot create group %s: %s\n", name,
+				cgroup_strerror(ret));
+			goto out;
+		}
+	}
+	bench_report("create group", &create);
+
+	for (i = 0; i < groups; i++) {
+		if (i < fanout)
+			snprintf(name, sizeof(name), ROOT_NAME "/%ld", i);
+		else
+			snprintf(name, sizeof(name), ROOT_NAME "/%ld/%ld",
+				i % fanout, i / fanout);
+		cgroup = cgroup_new_cgroup(name);
+		start = bench_now();
+		ret = cgroup_get_cgroup(cgroup);
+		bench_samples_add(&get, bench_now() - start);
+		cgroup_free(&cgroup);
+		if (ret) {
+			fprintf(stderr, "cannot read group %s: %s\n", name,
+				cgroup_strerror(ret));
+			goto out;
+		}
+	}
+	bench_report("get cgroup", &get);
+
+	start = bench_now();
+	ret = cgroup_walk_tree_begin(argv[1], ROOT_NAME, 0, &handle, &info,
+			&level);
+	while (ret == 0) {
+		walked++;
+		ret = cgroup_walk_tree_next(0, &handle, &info, level);
+	}
+	cgroup_walk_tree_end(&handle);
+	bench_report_total("walk tree entry", walked, bench_now() - start);
+
+out:
+	/* the tree is removed even when the benchmark failed */
+	cgroup = new_group(ROOT_NAME, argv[1]);
+	start = bench_now();
+	err = cgroup_delete_cgroup_ext(cgroup, CGFLAG_DELETE_RECURSIVE |
+			CGFLAG_DELETE_PARALLEL);
+	if (err)
+		fprintf(stderr, "cannot remove %s: %s\n", ROOT_NAME,
+			cgroup_strerror(err));
+	else
+		bench_report_total("delete group", groups + 1,
+			bench_now() - start);
+	cgroup_free(&cgroup);
+
+	bench_samples_free(&create);
+	bench_samples_free(&get);
+	return ret == ECGEOF ? 0 : 1;
+}
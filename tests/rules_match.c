@@ -0,0 +1,184 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Test that the rule index finds the same rule as the walk of
+ * the list of rules. A rules file with user, '@group', '*' and process name
+ * rules is parsed and indexed, then every combination of the UIDs, GIDs and
+ * process names below is matched both ways. The matching functions are
+ * static, so the library source is built into the test. Needs no root.
+ */
+
+#include "../src/api.c"
+
+#define MAX_IDS		8
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *procnames[] = {
+	NULL, "sleep", "/bin/sleep", "bash", "/usr/bin/bash", "sh",
+	"/bin/late", "other",
+};
+
+static uid_t uids[MAX_IDS];
+static gid_t gids[MAX_IDS];
+static int nr_uids, nr_gids;
+
+static void add_id(uid_t uid, gid_t gid)
+{
+	int i;
+
+	for (i = 0; i < nr_uids && uids[i] != uid; i++)
+		;
+	if (i == nr_uids && nr_uids < MAX_IDS)
+		uids[nr_uids++] = uid;
+	for (i = 0; i < nr_gids && gids[i] != gid; i++)
+		;
+	if (i == nr_gids && nr_gids < MAX_IDS)
+		gids[nr_gids++] = gid;
+}
+
+/* The walk of cgroup_find_matching_rule() without the index */
+static struct cgroup_rule *find_linear(struct cgroup_rule_list *list,
+		uid_t uid, gid_t gid, const char *procname, const char *base)
+{
+	struct cgroup_rule *rule = list->head;
+
+	while (rule) {
+		rule = cgroup_find_matching_rule_uid_gid(uid, gid, rule);
+		if (!rule || cg_rule_procname_match(rule, procname, base))
+			break;
+		rule = rule->next;
+	}
+
+	return rule;
+}
+
+/* Compare both ways of matching, count the matches of specific rules. */
+static int check(struct cgroup_rule_list *list, uid_t uid, gid_t gid,
+		const char *procname, int *matched)
+{
+	struct cgroup_rule *indexed, *linear;
+	const char *base = NULL;
+
+	if (procname) {
+		base = strrchr(procname, '/');
+		base = base ? base + 1 : procname;
+	}
+
+	indexed = cgroup_find_matching_rule_indexed(list->index,
+			list->index->members, uid, gid, procname, base);
+	linear = find_linear(list, uid, gid, procname, base);
+	if (indexed != linear) {
+		printf("FAIL for uid %d gid %d process %s: index found %s, "
+			"list %s\n", uid, gid, procname ? procname : "(none)",
+			indexed ? indexed->destination : "nothing",
+			linear ? linear->destination : "nothing");
+		return 1;
+	}
+	if (linear && strcmp(linear->destination, "/all"))
+		(*matched)++;
+
+	return 0;
+}
+
+int main()
+{
+	char file[] = "/tmp/rules_match.XXXXXX";
+	struct cgroup_rule_list list = { 0 };
+	struct passwd *pwd;
+	struct group *grp;
+	char *user, *group, *member = NULL;
+	char *self_group;
+	int fail = 0, matched = 0;
+	unsigned int i, j, k;
+	FILE *fp;
+	int fd;
+
+	pwd = getpwuid(geteuid());
+	grp = getgrgid(getegid());
+	if (!pwd || !grp) {
+		printf("SKIP: cannot resolve the current user\n");
+		return 77;
+	}
+	user = strdup(pwd->pw_name);
+	self_group = strdup(grp->gr_name);
+	add_id(pwd->pw_uid, grp->gr_gid);
+	add_id(0, 0);
+	add_id(54321, 54321);
+
+	/* A group with a member, so that the '@group' membership is tested */
+	group = strdup(self_group);
+	setgrent();
+	while ((grp = getgrent())) {
+		if (grp->gr_mem[0] && getpwnam(grp->gr_mem[0])) {
+			free(group);
+			group = strdup(grp->gr_name);
+			member = strdup(grp->gr_mem[0]);
+			add_id(54321, grp->gr_gid);
+			break;
+		}
+	}
+	endgrent();
+	if (member) {
+		pwd = getpwnam(member);
+		add_id(pwd->pw_uid, 54321);
+	}
+
+	fd = mkstemp(file);
+	fp = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!fp) {
+		printf("FAIL: cannot create the rules file\n");
+		return 1;
+	}
+	fprintf(fp, "%s:sleep\tcpu\t/user_sleep\n", user);
+	fprintf(fp, "@%s\tmemory\t/group\n", group);
+	fprintf(fp, "%%\tcpu\t/group\n");
+	fprintf(fp, "*:bash\tcpu\t/all_bash\n");
+	fprintf(fp, "%s\tcpu\t/user\n", user);
+	fprintf(fp, "@%s:sh\tcpu\t/self_sh\n", self_group);
+	fprintf(fp, "root:/bin/sleep\tcpu\t/root_sleep\n");
+	fprintf(fp, "root\tcpu\t/root\n");
+	fprintf(fp, "*\tcpu\t/all\n");
+	fprintf(fp, "*:late\tcpu\t/late\n");
+	fprintf(fp, "%s\tcpu\t/late_user\n", user);
+	fclose(fp);
+
+	pthread_mutex_lock(&rl_parse_lock);
+	if (cgroup_parse_rules_file(file, &list, true, CGRULE_INVALID,
+			CGRULE_INVALID, NULL) || cgroup_build_rule_index(&list)) {
+		pthread_mutex_unlock(&rl_parse_lock);
+		printf("FAIL: cannot parse the rules\n");
+		unlink(file);
+		return 1;
+	}
+	pthread_mutex_unlock(&rl_parse_lock);
+	unlink(file);
+
+	for (i = 0; i < nr_uids; i++)
+		for (j = 0; j < nr_gids; j++)
+			for (k = 0; k < ARRAY_SIZE(procnames); k++)
+				fail |= check(&list, uids[i], gids[j],
+						procnames[k], &matched);
+
+	/* Make sure the rules did not all fall through to the wildcard. */
+	if (!fail && !matched) {
+		printf("FAIL: no rule but the wildcard matched\n");
+		fail = 1;
+	}
+
+	cgroup_free_rule_list(&list);
+	free(user);
+	free(self_group);
+	free(group);
+	free(member);
+
+	if (!fail)
+		printf("PASS\n");
+
+	return fail;
+}
@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2.1 of the GNU Lesser General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Description: Test of a group in the cgroup v2 unified hierarchy: the
+ * current group of a process is read from the "0::" line of
+ * /proc/<pid>/cgroup and cgroup_wait_empty() waits for the process to
+ * exit. Uses the controller in $UNIFIED_CONTROLLER, memory by default, and
+ * is skipped unless run by root with the controller in the unified
+ * hierarchy.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libcgroup.h>
+
+#define GROUP_NAME	"unified_test"
+#define SKIP		77
+
+int main(void)
+{
+	const char *controller = getenv("UNIFIED_CONTROLLER");
+	const char *controllers[2] = { NULL, NULL };
+	char file[FILENAME_MAX];
+	struct cgroup *cgroup;
+	char *path = NULL, *mount = NULL;
+	pid_t pid;
+	int ret, result = 1;
+
+	if (!controller)
+		controller = "memory";
+	controllers[0] = controller;
+	if (geteuid()) {
+		printf("SKIP: must run as root\n");
+		return SKIP;
+	}
+	if (cgroup_init() || cgroup_get_subsys_mount_point(controller,
+				&mount)) {
+		printf("SKIP: %s is not mounted\n", controller);
+		return SKIP;
+	}
+	snprintf(file, sizeof(file), "%s/cgroup.controllers", mount);
+	free(mount);
+	if (access(file, F_OK)) {
+		printf("SKIP: %s is not in the unified hierarchy\n",
+			controller);
+		return SKIP;
+	}
+
+	cgroup = cgroup_new_cgroup(GROUP_NAME);
+	if (!cgroup || !cgroup_add_controller(cgroup, controller)) {
+		printf("FAIL: cannot allocate the group\n");
+		return 1;
+	}
+	ret = cgroup_create_cgroup(cgroup, 0);
+	if (ret && ret != ECGCANTSETVALUE) {
+		printf("FAIL: cannot create the group: %s\n",
+			cgroup_strerror(ret));
+		goto out;
+	}
+
+	pid = fork();
+	if (!pid) {
+		pause();
+		_exit(0);
+	}
+
+	ret = cgroup_change_cgroup_path(GROUP_NAME, pid, controllers);
+	if (ret) {
+		printf("FAIL: cannot move the process: %s\n",
+			cgroup_strerror(ret));
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		goto out;
+	}
+
+	if (cgroup_get_current_controller_path(pid, controller, &path) ||
+			strcmp(path, "/" GROUP_NAME))
+		printf("FAIL: the process is in %s\n",
+			path ? path : "unknown group");
+	else if ((ret = cgroup_wait_empty(cgroup, 100)) != ECGNONEMPTY)
+		printf("FAIL: waiting for the busy group returned %s\n",
+			cgroup_strerror(ret));
+	else
+		result = 0;
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	ret = cgroup_wait_empty(cgroup, 5000);
+	if (!result && ret) {
+		printf("FAIL: waiting for the empty group returned %s\n",
+			cgroup_strerror(ret));
+		result = 1;
+	}
+	free(path);
+out:
+	cgroup_delete_cgroup(cgroup, 1);
+	cgroup_free(&cgroup);
+	if (!result)
+		printf("PASS\n");
+	return result;
+}